@@ -0,0 +1,112 @@
+// Measures the latency of no-op `unixbuild` invocations when many clients hit
+// the same daemon at once, as when several developers and CI jobs share a
+// checkout.
+//
+// Each round starts every client at once and times each one from fork to
+// exit. The first invocation, which does any real build work and starts the
+// daemon, is not measured.
+#include <algorithm>
+#include <cstdlib>
+#include <fcntl.h>
+#include <iostream>
+#include <string>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+
+#include "unixbuild/common.h"
+
+constexpr int DEFAULT_CLIENTS = 64;
+constexpr int DEFAULT_ROUNDS = 10;
+
+double now_ms() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+pid_t start_client(const char* build_path) {
+  pid_t pid = fork();
+  if (pid < 0) {
+    throw unixbuild::ExitException("could not fork", 1);
+  } else if (pid == 0) {
+    // Silence the client so that its output does not get mixed up with the
+    // results.
+    int devnull = open("/dev/null", O_WRONLY);
+    dup2(devnull, STDOUT_FILENO);
+    dup2(devnull, STDERR_FILENO);
+    execl("out/unixbuild", "unixbuild", build_path, NULL);
+    _exit(127);
+  }
+  return pid;
+}
+
+// Runs `clients` clients at once and appends how long each took, in
+// milliseconds, to `samples`.
+void run_round(const char* build_path, int clients,
+               std::vector<double>& samples) {
+  std::unordered_map<pid_t, double> started;
+  for (int i = 0; i < clients; i++) {
+    double start = now_ms();
+    started[start_client(build_path)] = start;
+  }
+
+  bool failed = false;
+  while (!started.empty()) {
+    int status;
+    pid_t pid = waitpid(-1, &status, 0);
+    if (pid < 0) {
+      throw unixbuild::ExitException("waitpid() returned an error status", 1);
+    }
+    samples.push_back(now_ms() - started[pid]);
+    started.erase(pid);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+      failed = true;
+    }
+  }
+  if (failed) {
+    throw unixbuild::ExitException("unixbuild exited with an error", 1);
+  }
+}
+
+double percentile(const std::vector<double>& sorted, double p) {
+  size_t i = static_cast<size_t>(p / 100.0 * (sorted.size() - 1) + 0.5);
+  return sorted[i];
+}
+
+int main(int argc, char* argv[]) {
+  if (argc < 2 || argc > 4) {
+    std::cerr << "usage: " << argv[0] << " <build file> [clients] [rounds]"
+              << std::endl;
+    return 1;
+  }
+  const char* build_path = argv[1];
+  int clients = argc >= 3 ? atoi(argv[2]) : DEFAULT_CLIENTS;
+  int rounds = argc == 4 ? atoi(argv[3]) : DEFAULT_ROUNDS;
+  if (clients <= 0 || rounds <= 0) {
+    std::cerr << "error: clients and rounds must be positive" << std::endl;
+    return 1;
+  }
+
+  try {
+    std::vector<double> warmup;
+    run_round(build_path, 1, warmup);
+
+    std::vector<double> samples;
+    for (int r = 0; r < rounds; r++) {
+      run_round(build_path, clients, samples);
+    }
+
+    std::sort(samples.begin(), samples.end());
+    printf("%d concurrent clients, %d rounds: p50=%.3fms p99=%.3fms "
+           "max=%.3fms\n",
+           clients, rounds, percentile(samples, 50), percentile(samples, 99),
+           samples.back());
+  } catch (unixbuild::ExitException& e) {
+    std::cerr << "error: " << e.message_ << std::endl;
+    return e.returncode_;
+  }
+  return 0;
+}
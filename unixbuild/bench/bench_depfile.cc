@@ -0,0 +1,114 @@
+// Measures how long the daemon takes to load the depfiles of a large build the
+// first time it checks whether anything is stale, and how long it takes to load
+// the same information from a build log instead.
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "unixbuild/build_log.h"
+#include "unixbuild/command.h"
+#include "unixbuild/common.h"
+#include "unixbuild/depfile.h"
+
+constexpr size_t DEFAULT_DEPFILES = 20000;
+// Each generated source includes this many headers, out of a pool shared by
+// every source, which is typical of a C++ code base built with -MMD.
+constexpr size_t HEADERS_PER_SOURCE = 40;
+constexpr size_t HEADER_POOL = 2000;
+constexpr int REPETITIONS = 3;
+
+int main(int argc, char* argv[]) {
+  if (argc > 2) {
+    std::cerr << "usage: " << argv[0] << " [depfiles]" << std::endl;
+    return 1;
+  }
+  size_t count = argc == 2 ? atoi(argv[1]) : DEFAULT_DEPFILES;
+  if (count == 0) {
+    std::cerr << "error: depfiles must be positive" << std::endl;
+    return 1;
+  }
+
+  char dir[] = "/tmp/unixbuild_bench_XXXXXX";
+  if (mkdtemp(dir) == NULL) {
+    std::cerr << "error: could not create temporary directory" << std::endl;
+    return 1;
+  }
+  std::string root(dir);
+
+  try {
+    std::vector<std::string> outputs;
+    std::string log_path = root + "/log";
+    unixbuild::BuildLog log(log_path);
+    size_t total_bytes = 0;
+    for (size_t i = 0; i < count; i++) {
+      std::string output = root + "/obj" + std::to_string(i) + ".o";
+      std::vector<std::string> deps;
+      deps.push_back(root + "/src/file" + std::to_string(i) + ".cc");
+      for (size_t j = 0; j < HEADERS_PER_SOURCE; j++) {
+        size_t header = (i * 7 + j * 13) % HEADER_POOL;
+        deps.push_back(root + "/include/module" + std::to_string(header % 50) +
+                       "/header" + std::to_string(header) + ".h");
+      }
+      unixbuild::write_depfile(unixbuild::depfile_path(output), output, deps);
+      total_bytes += unixbuild::stat_file(
+                         unixbuild::depfile_path(output).c_str())
+                         .size;
+      outputs.push_back(output);
+
+      unixbuild::LogEntry entry;
+      entry.discovered = std::move(deps);
+      log.record(output, std::move(entry));
+    }
+    log.flush();
+
+    double best = -1;
+    size_t edges = 0;
+    size_t paths = 0;
+    for (int r = 0; r < REPETITIONS; r++) {
+      unixbuild::DiscoveredDeps discovered;
+      double start = unixbuild::monotonic_seconds();
+      edges = 0;
+      for (const std::string& output : outputs) {
+        edges += discovered.get(output, root).size();
+      }
+      double elapsed = unixbuild::monotonic_seconds() - start;
+      paths = discovered.paths().size();
+      if (best < 0 || elapsed < best) {
+        best = elapsed;
+      }
+    }
+
+    double best_log = -1;
+    for (int r = 0; r < REPETITIONS; r++) {
+      double start = unixbuild::monotonic_seconds();
+      unixbuild::DiscoveredDeps discovered;
+      unixbuild::BuildLog loaded(log_path);
+      loaded.for_each([&](const std::string& output,
+                          const unixbuild::LogEntry& entry) {
+        discovered.set(output, entry.discovered);
+      });
+      double elapsed = unixbuild::monotonic_seconds() - start;
+      if (best_log < 0 || elapsed < best_log) {
+        best_log = elapsed;
+      }
+    }
+
+    printf("%zu depfiles, %.1f MB, %zu edges, %zu distinct paths\n", count,
+           total_bytes / 1e6, edges, paths);
+    printf("loaded in %.3fs (%.0f depfiles/s)\n", best, count / best);
+    printf("build log, %.1f MB, loaded in %.3fs (%.1fx faster)\n",
+           unixbuild::stat_file(log_path.c_str()).size / 1e6, best_log,
+           best / best_log);
+  } catch (unixbuild::ExitException& e) {
+    std::cerr << "error: " << e.message_ << std::endl;
+    return e.returncode_;
+  }
+
+  std::string cmd = std::string("rm -rf ").append(root);
+  if (system(cmd.c_str()) != 0) {
+    return 1;
+  }
+  return 0;
+}
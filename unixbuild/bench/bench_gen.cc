@@ -0,0 +1,46 @@
+// Writes a synthetic build file and source tree, for benchmarking or for
+// trying things out by hand.
+#include <cstring>
+#include <iostream>
+
+#include "synthetic.h"
+#include "unixbuild/common.h"
+
+void print_usage(const char* program) {
+  std::cerr << "usage: " << program
+            << " <directory> [--rules n] [--fan-in n] [--depth n]\n"
+               "       [--shared ratio] [--seed n] [--build-file-only]"
+            << std::endl;
+}
+
+int main(int argc, char* argv[]) {
+  try {
+    SyntheticOptions options;
+    std::string dir;
+    bool sources = true;
+    for (int i = 1; i < argc;) {
+      if (parse_synthetic_flag(argc, argv, &i, options)) {
+        continue;
+      } else if (strcmp(argv[i], "--build-file-only") == 0) {
+        sources = false;
+      } else if (argv[i][0] != '-' && dir.empty()) {
+        dir = argv[i];
+      } else {
+        print_usage(argv[0]);
+        return 1;
+      }
+      i++;
+    }
+    if (dir.empty()) {
+      print_usage(argv[0]);
+      return 1;
+    }
+
+    unixbuild::create_directories(dir);
+    std::cout << generate_tree(dir, options, sources) << std::endl;
+  } catch (unixbuild::ExitException& e) {
+    std::cerr << "error: " << e.message_ << std::endl;
+    return e.returncode_;
+  }
+  return 0;
+}
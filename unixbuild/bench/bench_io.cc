@@ -0,0 +1,144 @@
+// Compares stat'ing and reading every source file and header of a synthetic
+// tree with io_uring against doing the same with one system call after
+// another, with the files in the page cache and, where we are allowed to drop
+// it, without.
+#include <cstdio>
+#include <cstdlib>
+#include <fcntl.h>
+#include <iostream>
+#include <set>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+#include "synthetic.h"
+#include "unixbuild/batch_io.h"
+#include "unixbuild/command.h"
+#include "unixbuild/common.h"
+#include "unixbuild/graph.h"
+
+constexpr int REPETITIONS = 3;
+
+// Evicts `paths` from the kernel's caches. Dropping every cache, inodes
+// included, needs root; otherwise we can only ask for each file's pages to go.
+// Returns false in that case.
+bool drop_caches(const std::vector<const char*>& paths) {
+  sync();
+  int fd = open("/proc/sys/vm/drop_caches", O_WRONLY | O_CLOEXEC);
+  if (fd >= 0) {
+    bool dropped = write(fd, "3", 1) == 1;
+    close(fd);
+    if (dropped) {
+      return true;
+    }
+  }
+  for (const char* path : paths) {
+    int file = open(path, O_RDONLY | O_CLOEXEC);
+    if (file >= 0) {
+      posix_fadvise(file, 0, 0, POSIX_FADV_DONTNEED);
+      close(file);
+    }
+  }
+  return false;
+}
+
+// Returns the fastest of `REPETITIONS` runs of `f`, dropping the caches
+// before each one if `cold`.
+template <typename F>
+double best_of(const std::vector<const char*>& paths, bool cold, F f) {
+  double best = -1;
+  for (int r = 0; r < REPETITIONS; r++) {
+    if (cold) {
+      drop_caches(paths);
+    }
+    double start = unixbuild::monotonic_seconds();
+    f();
+    double elapsed = unixbuild::monotonic_seconds() - start;
+    if (best < 0 || elapsed < best) {
+      best = elapsed;
+    }
+  }
+  return best;
+}
+
+int main(int argc, char* argv[]) {
+  SyntheticOptions options;
+  options.rules = 20000;
+  options.fan_in = 8;
+  try {
+    for (int i = 1; i < argc;) {
+      if (!parse_synthetic_flag(argc, argv, &i, options)) {
+        std::cerr << "usage: " << argv[0]
+                  << " [--rules N] [--fan-in N] [--depth N] [--shared R]"
+                     " [--seed N]"
+                  << std::endl;
+        return 1;
+      }
+    }
+  } catch (unixbuild::ExitException& e) {
+    std::cerr << "error: " << e.message_ << std::endl;
+    return e.returncode_;
+  }
+
+  char dir[] = "/tmp/unixbuild_bench_XXXXXX";
+  if (mkdtemp(dir) == NULL) {
+    std::cerr << "error: could not create temporary directory" << std::endl;
+    return 1;
+  }
+  std::string root(dir);
+
+  try {
+    std::string path = generate_tree(root, options);
+    unixbuild::BuildGraph graph = unixbuild::load_build_graph(path);
+    std::set<std::string> files;
+    for (size_t node = 0; node < graph.size(); node++) {
+      for (uint32_t dep : graph.deps(node)) {
+        if (!graph.producer(dep).has_value()) {
+          files.insert(root + "/" + std::string(graph.paths().path(dep)));
+        }
+      }
+    }
+    std::vector<const char*> paths;
+    size_t total_bytes = 0;
+    for (const std::string& file : files) {
+      paths.push_back(file.c_str());
+      total_bytes += unixbuild::stat_file(file.c_str()).size;
+    }
+
+    bool can_drop = drop_caches(paths);
+    printf("%zu files, %.1f MB, io_uring %s\n", paths.size(),
+           total_bytes / 1e6,
+           unixbuild::io_uring_available() ? "available" : "not available");
+    if (!can_drop) {
+      printf("not root, so cold runs only drop file contents, not inodes\n");
+    }
+    printf("%-10s %12s %12s %12s %12s\n", "", "stat warm", "stat cold",
+           "read warm", "read cold");
+    for (bool io_uring : {false, true}) {
+      if (io_uring && !unixbuild::io_uring_available()) {
+        continue;
+      }
+      unixbuild::set_io_uring_enabled(io_uring);
+      double times[4];
+      for (int cold = 0; cold < 2; cold++) {
+        times[cold] = best_of(
+            paths, cold, [&]() { unixbuild::stat_files(paths, io_uring); });
+        times[2 + cold] = best_of(paths, cold, [&]() {
+          unixbuild::read_files(paths, 4096);
+        });
+      }
+      printf("%-10s %11.3fs %11.3fs %11.3fs %11.3fs\n",
+             io_uring ? "io_uring" : "syscalls", times[0], times[1], times[2],
+             times[3]);
+    }
+  } catch (unixbuild::ExitException& e) {
+    std::cerr << "error: " << e.message_ << std::endl;
+    return e.returncode_;
+  }
+
+  std::string cmd = std::string("rm -rf ").append(root);
+  if (system(cmd.c_str()) != 0) {
+    return 1;
+  }
+  return 0;
+}
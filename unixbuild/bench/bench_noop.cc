@@ -0,0 +1,122 @@
+// Measures the latency of a no-op `unixbuild` invocation with and without a
+// running daemon.
+//
+// A cold invocation has to fork and exec the daemon, wait for it to start
+// listening, and parse the build file from scratch. A warm invocation should
+// cost one connect and one round trip.
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <string>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+
+#include "unixbuild/common.h"
+#include "unixbuild/protocol.h"
+
+constexpr int DEFAULT_ITERATIONS = 20;
+
+double now_ms() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+// Runs the client once and returns how long it took, in milliseconds.
+double run_client(const char* build_path) {
+  double start = now_ms();
+  pid_t pid = fork();
+  if (pid < 0) {
+    throw unixbuild::ExitException("could not fork", 1);
+  } else if (pid == 0) {
+    // Silence the client so that its output does not get mixed up with the
+    // results.
+    int devnull = open("/dev/null", O_WRONLY);
+    dup2(devnull, STDOUT_FILENO);
+    dup2(devnull, STDERR_FILENO);
+    execl("out/unixbuild", "unixbuild", build_path, NULL);
+    _exit(127);
+  }
+
+  int status;
+  if (waitpid(pid, &status, 0) < 0) {
+    throw unixbuild::ExitException("waitpid() returned an error status", 1);
+  }
+  double elapsed = now_ms() - start;
+
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    throw unixbuild::ExitException("unixbuild exited with an error", 1);
+  }
+  return elapsed;
+}
+
+// Asks the daemon to exit, if one is running, and waits until it has stopped
+// listening.
+void stop_server() {
+  std::string path = unixbuild::socket_path();
+  int fd = unixbuild::connect_to_server(path);
+  if (fd < 0) {
+    return;
+  }
+  unixbuild::send_message(fd, unixbuild::MessageType::SHUTDOWN_REQUEST, "");
+  unixbuild::recv_message(fd);
+  close(fd);
+
+  while ((fd = unixbuild::connect_to_server(path)) >= 0) {
+    close(fd);
+    usleep(1000);
+  }
+}
+
+void report(const char* label, std::vector<double>& samples) {
+  std::sort(samples.begin(), samples.end());
+  double total = 0;
+  for (double x : samples) {
+    total += x;
+  }
+  printf("%-5s n=%zu min=%.3fms median=%.3fms mean=%.3fms max=%.3fms\n", label,
+         samples.size(), samples.front(), samples[samples.size() / 2],
+         total / samples.size(), samples.back());
+}
+
+int main(int argc, char* argv[]) {
+  if (argc < 2 || argc > 3) {
+    std::cerr << "usage: " << argv[0] << " <build file> [iterations]"
+              << std::endl;
+    return 1;
+  }
+  const char* build_path = argv[1];
+  int iterations = argc == 3 ? atoi(argv[2]) : DEFAULT_ITERATIONS;
+  if (iterations <= 0) {
+    std::cerr << "error: iterations must be positive" << std::endl;
+    return 1;
+  }
+
+  try {
+    // Run once up front so that any real build work is done before we start
+    // measuring.
+    run_client(build_path);
+
+    std::vector<double> cold;
+    for (int i = 0; i < iterations; i++) {
+      stop_server();
+      cold.push_back(run_client(build_path));
+    }
+
+    std::vector<double> warm;
+    for (int i = 0; i < iterations; i++) {
+      warm.push_back(run_client(build_path));
+    }
+
+    report("cold", cold);
+    report("warm", warm);
+  } catch (unixbuild::ExitException& e) {
+    std::cerr << "error: " << e.message_ << std::endl;
+    return e.returncode_;
+  }
+  return 0;
+}
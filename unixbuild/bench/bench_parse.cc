@@ -0,0 +1,192 @@
+// Compares the memory-mapped build file parser against the original parser,
+// which read the file into one string per line and copied every token, and
+// shows what SIMD scanning and parsing on several threads each contribute.
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "unixbuild/buildfile.h"
+#include "unixbuild/common.h"
+#include "unixbuild/graph.h"
+
+constexpr size_t DEFAULT_MEGABYTES = 100;
+constexpr int REPETITIONS = 3;
+
+// Writes a synthetic build file of roughly `megabytes` megabytes and returns
+// its path.
+std::string generate_build_file(size_t megabytes) {
+  char path[] = "/tmp/unixbuild_bench_XXXXXX";
+  int fd = mkstemp(path);
+  if (fd < 0) {
+    throw unixbuild::ExitException("could not create temporary file", 1);
+  }
+  FILE* f = fdopen(fd, "w");
+
+  size_t target = megabytes * 1024 * 1024;
+  size_t written = 0;
+  for (size_t i = 0; written < target; i++) {
+    size_t dir = i % 500;
+    int n = fprintf(f,
+                    "obj/dir%zu/file%zu.o: src/dir%zu/file%zu.c "
+                    "include/common.h include/dir%zu/util.h\n",
+                    dir, i, dir, i, dir);
+    written += n;
+  }
+  fclose(f);
+  return path;
+}
+
+// The parser as it was originally written, for comparison.
+unixbuild::BuildFile legacy_parse(const std::string& path) {
+  std::vector<std::string> lines = unixbuild::read_lines(path.c_str());
+  unixbuild::BuildFile build_file;
+
+  for (std::string& line : lines) {
+    unixbuild::trim_whitespace(line);
+    if (line.empty() or line[0] == '#') {
+      continue;
+    }
+
+    unixbuild::Rule rule;
+    auto colon_pos = line.find(':');
+    rule.output = line.substr(0, colon_pos);
+    unixbuild::trim_whitespace(rule.output);
+    unixbuild::split_string(line.substr(colon_pos + 1), rule.deps, ' ');
+    build_file.rules.push_back(rule);
+  }
+  return build_file;
+}
+
+// Estimates the heap memory used by `build_file`.
+size_t build_file_memory(const unixbuild::BuildFile& build_file) {
+  size_t total = build_file.rules.capacity() * sizeof(unixbuild::Rule);
+  auto string_memory = [](const std::string& s) {
+    // Short strings are stored inline, without a heap allocation.
+    return s.capacity() > 15 ? s.capacity() + 1 : 0;
+  };
+  for (const unixbuild::Rule& rule : build_file.rules) {
+    total += string_memory(rule.output);
+    total += rule.deps.capacity() * sizeof(std::string);
+    for (const std::string& dep : rule.deps) {
+      total += string_memory(dep);
+    }
+  }
+  return total;
+}
+
+// Runs `f` several times and returns the fastest time, in seconds.
+template <typename F> double best_of(F f) {
+  double best = -1;
+  for (int i = 0; i < REPETITIONS; i++) {
+    double start = unixbuild::monotonic_seconds();
+    f();
+    double elapsed = unixbuild::monotonic_seconds() - start;
+    if (best < 0 || elapsed < best) {
+      best = elapsed;
+    }
+  }
+  return best;
+}
+
+void report(const char* label, double seconds, size_t megabytes) {
+  printf("%-18s %8.3fs %8.1f MB/s\n", label, seconds, megabytes / seconds);
+}
+
+int main(int argc, char* argv[]) {
+  if (argc > 2) {
+    std::cerr << "usage: " << argv[0] << " [megabytes]" << std::endl;
+    return 1;
+  }
+  size_t megabytes = argc == 2 ? atoi(argv[1]) : DEFAULT_MEGABYTES;
+  if (megabytes == 0) {
+    std::cerr << "error: megabytes must be positive" << std::endl;
+    return 1;
+  }
+
+  try {
+    std::string path = generate_build_file(megabytes);
+    size_t expected = legacy_parse(path).rules.size();
+
+    double legacy = best_of([&]() {
+      size_t n = legacy_parse(path).rules.size();
+      assert(n == expected);
+      (void)n;
+    });
+
+    // Just the views, without copying anything out of the mapping. This is
+    // the floor for what any consumer of `parse_rules` can achieve.
+    auto views_with = [&](unixbuild::ParseOptions options) {
+      return best_of([&]() {
+        unixbuild::MappedFile file(path.c_str());
+        size_t n = 0;
+        unixbuild::parse_rules(
+            file.contents(), [&n](const unixbuild::RuleView&) { n++; },
+            options);
+        assert(n == expected);
+      });
+    };
+    double scalar = views_with({1, unixbuild::SimdLevel::SCALAR});
+    double simd = views_with({1, unixbuild::SimdLevel::AVX2});
+    double views = views_with({});
+
+    double mapped = best_of([&]() {
+      size_t n = unixbuild::parse_build_file(path).rules.size();
+      assert(n == expected);
+      (void)n;
+    });
+
+    double graph = best_of([&]() {
+      size_t n = unixbuild::load_build_graph(path).size();
+      assert(n == expected);
+      (void)n;
+    });
+
+    // What the daemon does instead: an index of the whole file, and then the
+    // graph of just the target being built, here a single object.
+    double indexed = best_of([&]() {
+      size_t n = unixbuild::load_build_file_index(path).size();
+      assert(n == expected);
+      (void)n;
+    });
+    unixbuild::BuildFileIndex index = unixbuild::load_build_file_index(path);
+    double target = best_of([&]() {
+      size_t n = index.subgraph(expected / 2).size();
+      assert(n == 1);
+      (void)n;
+    });
+
+    printf("%zu MB, %zu rules\n", megabytes, expected);
+    report("read_lines", legacy, megabytes);
+    report("views (scalar)", scalar, megabytes);
+    report("views (SIMD)", simd, megabytes);
+    // Files under a megabyte per CPU are parsed on one thread regardless.
+    unsigned cpus = std::thread::hardware_concurrency();
+    char label[64];
+    snprintf(label, sizeof label, "views (%u CPU%s)", cpus,
+             cpus == 1 ? "" : "s");
+    report(label, views, megabytes);
+    report("mmap (BuildFile)", mapped, megabytes);
+    report("mmap (BuildGraph)", graph, megabytes);
+    report("BuildFileIndex", indexed, megabytes);
+    printf("%-18s %8.6fs\n", "one target", target);
+
+    // Interning paths should make the graph much smaller than the BuildFile
+    // that it replaced, since shared headers are stored once.
+    printf("BuildFile size:  %8.1f MB\n",
+           build_file_memory(unixbuild::parse_build_file(path)) / 1e6);
+    printf("BuildGraph size: %8.1f MB\n",
+           unixbuild::load_build_graph(path).memory_usage() / 1e6);
+    printf("Index size:      %8.1f MB\n", index.memory_usage() / 1e6);
+
+    unlink(path.c_str());
+  } catch (unixbuild::ExitException& e) {
+    std::cerr << "error: " << e.message_ << std::endl;
+    return e.returncode_;
+  }
+  return 0;
+}
@@ -0,0 +1,130 @@
+// Measures how the daemon's analysis of a large build, before any job runs,
+// scales with the number of threads in its pool: checking what is stale, from
+// cold caches, hashing every input for the build log, and loading the
+// build file, whose graph's indices are built on the pool.
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "synthetic.h"
+#include "unixbuild/command.h"
+#include "unixbuild/common.h"
+#include "unixbuild/depfile.h"
+#include "unixbuild/graph.h"
+#include "unixbuild/hashing.h"
+#include "unixbuild/staleness.h"
+#include "unixbuild/thread_pool.h"
+
+constexpr int REPETITIONS = 3;
+
+// Returns the fastest of `REPETITIONS` runs of `f`, in seconds.
+template <typename F> double best_of(F f) {
+  double best = -1;
+  for (int r = 0; r < REPETITIONS; r++) {
+    double start = unixbuild::monotonic_seconds();
+    f();
+    double elapsed = unixbuild::monotonic_seconds() - start;
+    if (best < 0 || elapsed < best) {
+      best = elapsed;
+    }
+  }
+  return best;
+}
+
+int main(int argc, char* argv[]) {
+  SyntheticOptions options;
+  options.rules = 20000;
+  options.fan_in = 8;
+  size_t max_threads = 2 * std::max(1u, std::thread::hardware_concurrency());
+  try {
+    for (int i = 1; i < argc;) {
+      if (!parse_synthetic_flag(argc, argv, &i, options)) {
+        std::cerr << "usage: " << argv[0]
+                  << " [--rules N] [--fan-in N] [--depth N] [--shared R]"
+                     " [--seed N]"
+                  << std::endl;
+        return 1;
+      }
+    }
+  } catch (unixbuild::ExitException& e) {
+    std::cerr << "error: " << e.message_ << std::endl;
+    return e.returncode_;
+  }
+
+  char dir[] = "/tmp/unixbuild_bench_XXXXXX";
+  if (mkdtemp(dir) == NULL) {
+    std::cerr << "error: could not create temporary directory" << std::endl;
+    return 1;
+  }
+  std::string root(dir);
+  std::string out = root + "/out";
+
+  try {
+    std::string path = generate_tree(root, options);
+    unixbuild::BuildGraph graph = unixbuild::load_build_graph(path);
+    std::vector<size_t> nodes = graph.closure(*graph.find("bin/app"));
+
+    // Every object has been built, with a depfile listing its headers, so
+    // that checking it means reading the depfile and stat'ing everything.
+    std::vector<std::pair<std::string, unixbuild::FileStamp>> inputs;
+    for (size_t node : nodes) {
+      std::string output = unixbuild::output_file(graph, node, out);
+      unixbuild::create_directories(output.substr(0, output.rfind('/')));
+      unixbuild::write_file_atomically(output, "");
+      std::vector<std::string> deps;
+      for (uint32_t dep : graph.deps(node)) {
+        std::string file = unixbuild::dep_file(graph, dep, out);
+        if (file[0] != '/') {
+          file = root + "/" + file;
+        }
+        inputs.emplace_back(file, unixbuild::FileStamp{});
+        deps.push_back(std::move(file));
+      }
+      if (unixbuild::writes_depfile(graph, node)) {
+        unixbuild::write_depfile(unixbuild::depfile_path(output), output,
+                                 deps);
+      }
+    }
+    for (auto& input : inputs) {
+      input.second = unixbuild::stat_file(input.first.c_str());
+    }
+
+    printf("%zu rules, %zu inputs, %zu CPU%s\n", nodes.size(), inputs.size(),
+           max_threads / 2, max_threads == 2 ? "" : "s");
+    printf("%8s %12s %12s %12s\n", "threads", "find_stale", "hashing",
+           "loading");
+    for (size_t threads = 1; threads <= max_threads; threads *= 2) {
+      unixbuild::ThreadPool pool(threads);
+      double stale = best_of([&]() {
+        unixbuild::StatCache stat_cache;
+        unixbuild::DiscoveredDeps discovered;
+        unixbuild::StalenessChecks checks;
+        checks.discovered = &discovered;
+        checks.pool = &pool;
+        stat_cache.begin_build();
+        unixbuild::find_stale(graph, nodes, root, out, stat_cache, checks);
+      });
+      double hashing = best_of([&]() {
+        unixbuild::ContentHashCache hashes;
+        hashes.prefetch(inputs, pool);
+      });
+      double loading =
+          best_of([&]() { unixbuild::load_build_graph(path, &pool); });
+      printf("%8zu %11.3fs %11.3fs %11.3fs\n", threads, stale, hashing,
+             loading);
+    }
+  } catch (unixbuild::ExitException& e) {
+    std::cerr << "error: " << e.message_ << std::endl;
+    return e.returncode_;
+  }
+
+  std::string cmd = std::string("rm -rf ").append(root);
+  if (system(cmd.c_str()) != 0) {
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,124 @@
+// Measures how long it takes to start a job as the daemon's memory grows,
+// comparing `fork` and `exec` against the `posix_spawn` launcher that the
+// scheduler uses.
+//
+// For each resident set size, a buffer of that size is allocated and touched,
+// and then `/bin/true` is started repeatedly with each method. The time until
+// the call returns in the parent is what the daemon's event loop pays for every
+// job; the time until the child has exited includes the `exec` itself.
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+
+#include "unixbuild/common.h"
+#include "unixbuild/launcher.h"
+
+constexpr int DEFAULT_MAX_MB = 1024;
+constexpr int DEFAULT_SPAWNS = 200;
+
+double now_us() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+// Returns the resident set size of this process, in megabytes.
+double rss_mb() {
+  std::vector<std::string> fields;
+  unixbuild::split_string(unixbuild::read_lines("/proc/self/statm")[0], fields,
+                          ' ');
+  return atol(fields[1].c_str()) * sysconf(_SC_PAGESIZE) / (1024.0 * 1024.0);
+}
+
+pid_t fork_exec(const char* path) {
+  pid_t pid = fork();
+  if (pid < 0) {
+    throw unixbuild::ExitException("could not fork", 1);
+  } else if (pid == 0) {
+    execl(path, path, NULL);
+    _exit(127);
+  }
+  return pid;
+}
+
+void wait_for(pid_t pid) {
+  int status;
+  if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status) ||
+      WEXITSTATUS(status) != 0) {
+    throw unixbuild::ExitException("/bin/true did not exit cleanly", 1);
+  }
+}
+
+struct Timing {
+  // Mean microseconds until the launch call returned, and until the child
+  // had exited.
+  double launch_us = 0.0;
+  double exit_us = 0.0;
+};
+
+template <typename F> Timing time_spawns(int spawns, F spawn) {
+  Timing timing;
+  for (int i = 0; i < spawns; i++) {
+    double start = now_us();
+    pid_t pid = spawn();
+    timing.launch_us += now_us() - start;
+    wait_for(pid);
+    timing.exit_us += now_us() - start;
+  }
+  timing.launch_us /= spawns;
+  timing.exit_us /= spawns;
+  return timing;
+}
+
+int main(int argc, char* argv[]) {
+  if (argc > 3) {
+    std::cerr << "usage: " << argv[0] << " [max MB] [spawns]" << std::endl;
+    return 1;
+  }
+  int max_mb = argc >= 2 ? atoi(argv[1]) : DEFAULT_MAX_MB;
+  int spawns = argc == 3 ? atoi(argv[2]) : DEFAULT_SPAWNS;
+  if (max_mb < 0 || spawns <= 0) {
+    std::cerr << "error: max MB must not be negative and spawns must be "
+                 "positive"
+              << std::endl;
+    return 1;
+  }
+
+  try {
+    unixbuild::Launcher launcher;
+    unixbuild::LaunchOptions options;
+    std::vector<std::string> args = {"/bin/true"};
+
+    std::vector<int> sizes = {0};
+    for (int mb = 64; mb <= max_mb; mb *= 4) {
+      sizes.push_back(mb);
+    }
+
+    printf("%10s  %22s  %22s\n", "", "fork + exec (us)", "posix_spawn (us)");
+    printf("%10s  %10s  %10s  %10s  %10s\n", "RSS (MB)", "launch", "exit",
+           "launch", "exit");
+    for (int mb : sizes) {
+      // Touch every page so that it is resident and has a page table entry
+      // that `fork` has to copy.
+      std::vector<char> ballast(static_cast<size_t>(mb) * 1024 * 1024);
+      memset(ballast.data(), 1, ballast.size());
+
+      Timing forked =
+          time_spawns(spawns, []() { return fork_exec("/bin/true"); });
+      Timing spawned = time_spawns(
+          spawns, [&]() { return launcher.launch(args, options).pid; });
+      printf("%10.0f  %10.1f  %10.1f  %10.1f  %10.1f\n", rss_mb(),
+             forked.launch_us, forked.exit_us, spawned.launch_us,
+             spawned.exit_us);
+    }
+  } catch (unixbuild::ExitException& e) {
+    std::cerr << "error: " << e.message_ << std::endl;
+    return e.returncode_;
+  }
+  return 0;
+}
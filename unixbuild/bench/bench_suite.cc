@@ -0,0 +1,250 @@
+// Runs the standard set of benchmarks on synthetic trees and prints the
+// results as JSON, one object per line, so that they can be collected from
+// each commit and compared to spot regressions.
+//
+// Parsing and graph construction are measured in-process on a large build
+// file. The builds are measured end to end, by running the client against a
+// fresh daemon on a smaller tree that is actually compiled:
+//
+//   full_build         every object built from scratch, with a warm daemon
+//   noop_build         nothing to do
+//   incremental_build  one source file touched, so one object and the link
+//
+// Run from the directory that contains `out/unixbuild`, as `make bench-suite`
+// does.
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <ftw.h>
+#include <iostream>
+#include <string>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+
+#include "synthetic.h"
+#include "unixbuild/buildfile.h"
+#include "unixbuild/common.h"
+#include "unixbuild/graph.h"
+#include "unixbuild/protocol.h"
+
+constexpr size_t DEFAULT_PARSE_RULES = 100000;
+constexpr int DEFAULT_ITERATIONS = 10;
+// Full builds are slow, so they are repeated fewer times.
+constexpr int FULL_BUILD_ITERATIONS = 3;
+
+struct SuiteOptions {
+  SyntheticOptions tree;
+  size_t parse_rules = DEFAULT_PARSE_RULES;
+  int iterations = DEFAULT_ITERATIONS;
+  // Included in every result, e.g. to record the commit.
+  std::string label;
+};
+
+// Prints one result line. `samples` are in seconds.
+void report(const SuiteOptions& options, const char* benchmark, size_t rules,
+            std::vector<double> samples) {
+  std::sort(samples.begin(), samples.end());
+  std::string label;
+  for (char c : options.label) {
+    if (c == '"' || c == '\\') {
+      label.push_back('\\');
+    }
+    label.push_back(c);
+  }
+  printf("{\"label\":\"%s\",\"benchmark\":\"%s\",\"rules\":%zu,"
+         "\"fan_in\":%zu,\"depth\":%zu,\"shared_ratio\":%g,"
+         "\"iterations\":%zu,\"min_ms\":%.3f,\"median_ms\":%.3f,"
+         "\"max_ms\":%.3f}\n",
+         label.c_str(), benchmark, rules, options.tree.fan_in,
+         options.tree.depth, options.tree.shared_ratio, samples.size(),
+         samples.front() * 1e3, samples[samples.size() / 2] * 1e3,
+         samples.back() * 1e3);
+  fflush(stdout);
+}
+
+// Runs `f` `n` times and returns how long each run took, in seconds.
+template <typename F> std::vector<double> time_runs(int n, F f) {
+  std::vector<double> samples;
+  for (int i = 0; i < n; i++) {
+    double start = unixbuild::monotonic_seconds();
+    f(i);
+    samples.push_back(unixbuild::monotonic_seconds() - start);
+  }
+  return samples;
+}
+
+// Runs the client with `args`, and throws if it fails.
+void run_client(const std::vector<std::string>& args) {
+  std::vector<char*> argv = {const_cast<char*>("unixbuild")};
+  for (const std::string& arg : args) {
+    argv.push_back(const_cast<char*>(arg.c_str()));
+  }
+  argv.push_back(NULL);
+
+  pid_t pid = fork();
+  if (pid < 0) {
+    throw unixbuild::ExitException("could not fork", 1);
+  } else if (pid == 0) {
+    int devnull = open("/dev/null", O_WRONLY);
+    dup2(devnull, STDOUT_FILENO);
+    dup2(devnull, STDERR_FILENO);
+    execv("out/unixbuild", argv.data());
+    _exit(127);
+  }
+
+  int status;
+  if (waitpid(pid, &status, 0) < 0) {
+    throw unixbuild::ExitException("waitpid() returned an error status", 1);
+  }
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    throw unixbuild::ExitException("unixbuild exited with an error", 1);
+  }
+}
+
+// Asks the daemon to exit, if one is running, and waits until it has stopped
+// listening.
+void stop_server() {
+  std::string path = unixbuild::socket_path();
+  int fd = unixbuild::connect_to_server(path);
+  if (fd < 0) {
+    return;
+  }
+  unixbuild::send_message(fd, unixbuild::MessageType::SHUTDOWN_REQUEST, "");
+  unixbuild::recv_message(fd);
+  close(fd);
+
+  while ((fd = unixbuild::connect_to_server(path)) >= 0) {
+    close(fd);
+    usleep(1000);
+  }
+}
+
+void remove_tree(const std::string& dir) {
+  nftw(
+      dir.c_str(),
+      [](const char* path, const struct stat*, int, struct FTW*) {
+        remove(path);
+        return 0;
+      },
+      16, FTW_DEPTH | FTW_PHYS);
+}
+
+void bench_parse(const SuiteOptions& options, const std::string& dir) {
+  SyntheticOptions tree = options.tree;
+  tree.rules = options.parse_rules;
+  std::cerr << "generating " << tree.rules << "-rule build file" << std::endl;
+  std::string path = generate_tree(dir, tree, false);
+
+  // The graph has a rule per object, plus the program and main.o.
+  std::vector<double> samples = time_runs(options.iterations, [&](int) {
+    if (unixbuild::parse_build_file(path).rules.size() != tree.rules + 2) {
+      throw unixbuild::ExitException("parsed the wrong number of rules", 1);
+    }
+  });
+  report(options, "parse", tree.rules, samples);
+
+  unixbuild::BuildFile build_file = unixbuild::parse_build_file(path);
+  samples = time_runs(options.iterations, [&](int) {
+    unixbuild::BuildGraph graph(build_file);
+    if (graph.size() != tree.rules + 2) {
+      throw unixbuild::ExitException("built the wrong graph", 1);
+    }
+  });
+  report(options, "graph", tree.rules, samples);
+}
+
+void bench_builds(const SuiteOptions& options, const std::string& dir) {
+  const SyntheticOptions& tree = options.tree;
+  std::cerr << "generating " << tree.rules << "-rule source tree" << std::endl;
+  std::string path = generate_tree(dir, tree);
+
+  // Start a daemon for this build of unixbuild, and let it parse the build
+  // file, so that only the builds themselves are measured.
+  stop_server();
+  run_client({path, "obj/main.o", "--out", dir + "/out"});
+
+  std::cerr << "running full builds" << std::endl;
+  // Each full build goes to a new output directory, so it starts from
+  // scratch without having to delete anything.
+  std::vector<double> samples = time_runs(FULL_BUILD_ITERATIONS, [&](int i) {
+    run_client({path, "--out", dir + "/full" + std::to_string(i)});
+  });
+  report(options, "full_build", tree.rules, samples);
+
+  std::string out = dir + "/full0";
+  samples = time_runs(options.iterations,
+                      [&](int) { run_client({path, "--out", out}); });
+  report(options, "noop_build", tree.rules, samples);
+
+  // Touch sources from the end of the tree, whose objects nothing but the
+  // program depends on, so that each build recompiles one file and relinks.
+  samples = time_runs(options.iterations, [&](int i) {
+    size_t object = tree.rules - 1 - i % tree.rules;
+    std::string source = dir + "/" + synthetic_source(object);
+    if (utimensat(AT_FDCWD, source.c_str(), NULL, 0) < 0) {
+      throw unixbuild::ExitException("could not touch " + source, 1);
+    }
+    run_client({path, "--out", out});
+  });
+  report(options, "incremental_build", tree.rules, samples);
+
+  stop_server();
+}
+
+void print_usage(const char* program) {
+  std::cerr << "usage: " << program
+            << " [--rules n] [--fan-in n] [--depth n] [--shared ratio]\n"
+               "       [--seed n] [--parse-rules n] [--iterations n] "
+               "[--label s]"
+            << std::endl;
+}
+
+int main(int argc, char* argv[]) {
+  SuiteOptions options;
+  try {
+    for (int i = 1; i < argc;) {
+      const char* value = i + 1 < argc ? argv[i + 1] : NULL;
+      if (parse_synthetic_flag(argc, argv, &i, options.tree)) {
+        continue;
+      } else if (strcmp(argv[i], "--parse-rules") == 0 && value != NULL) {
+        options.parse_rules = atol(value);
+      } else if (strcmp(argv[i], "--iterations") == 0 && value != NULL) {
+        options.iterations = atoi(value);
+      } else if (strcmp(argv[i], "--label") == 0 && value != NULL) {
+        options.label = value;
+      } else {
+        print_usage(argv[0]);
+        return 1;
+      }
+      i += 2;
+    }
+    if (options.parse_rules == 0 || options.iterations <= 0) {
+      std::cerr << "error: --parse-rules and --iterations must be positive"
+                << std::endl;
+      return 1;
+    }
+
+    char dir[] = "/tmp/unixbuild_suite_XXXXXX";
+    if (mkdtemp(dir) == NULL) {
+      throw unixbuild::ExitException("could not create temporary directory",
+                                     1);
+    }
+    try {
+      unixbuild::create_directories(std::string(dir) + "/parse");
+      unixbuild::create_directories(std::string(dir) + "/tree");
+      bench_parse(options, std::string(dir) + "/parse");
+      bench_builds(options, std::string(dir) + "/tree");
+    } catch (unixbuild::ExitException& e) {
+      remove_tree(dir);
+      throw;
+    }
+    remove_tree(dir);
+  } catch (unixbuild::ExitException& e) {
+    std::cerr << "error: " << e.message_ << std::endl;
+    return e.returncode_;
+  }
+  return 0;
+}
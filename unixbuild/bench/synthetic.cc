@@ -0,0 +1,162 @@
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <set>
+#include <sys/stat.h>
+
+#include "synthetic.h"
+#include "unixbuild/common.h"
+
+namespace {
+
+// How many objects share a module, which is a directory of sources and
+// private headers.
+constexpr size_t MODULE_SIZE = 50;
+// Each module has at least this many private headers, and the tree has at
+// least this many shared ones, or `fan_in` of each if that is more.
+constexpr size_t MIN_PRIVATE_HEADERS = 8;
+constexpr size_t MIN_SHARED_HEADERS = 16;
+
+std::string module_dir(size_t i) {
+  return "src/m" + std::to_string(i / MODULE_SIZE);
+}
+
+std::string object(size_t i) {
+  return "obj/m" + std::to_string(i / MODULE_SIZE) + "/f" + std::to_string(i) +
+         ".o";
+}
+
+std::string private_header(size_t module, size_t k) {
+  return "src/m" + std::to_string(module) + "/h" + std::to_string(k) + ".h";
+}
+
+std::string shared_header(size_t k) {
+  return "include/shared" + std::to_string(k) + ".h";
+}
+
+std::string basename(const std::string& path) {
+  return path.substr(path.rfind('/') + 1);
+}
+
+void write_file(const std::string& dir, const std::string& path,
+                const std::string& contents) {
+  std::string full = dir + "/" + path;
+  unixbuild::create_directories(full.substr(0, full.rfind('/')));
+  unixbuild::write_file_atomically(full, contents);
+}
+
+size_t parse_size(const char* flag, const char* value) {
+  char* end;
+  unsigned long n = value != NULL ? strtoul(value, &end, 10) : 0;
+  if (value == NULL || *value == '\0' || *end != '\0' || n == 0) {
+    throw unixbuild::ExitException(
+        std::string("expected positive integer argument to ").append(flag), 1);
+  }
+  return n;
+}
+
+} // namespace
+
+bool parse_synthetic_flag(int argc, char* argv[], int* i,
+                          SyntheticOptions& options) {
+  const char* flag = argv[*i];
+  const char* value = *i + 1 < argc ? argv[*i + 1] : NULL;
+  if (strcmp(flag, "--rules") == 0) {
+    options.rules = parse_size(flag, value);
+  } else if (strcmp(flag, "--fan-in") == 0) {
+    options.fan_in = parse_size(flag, value);
+  } else if (strcmp(flag, "--depth") == 0) {
+    options.depth = parse_size(flag, value);
+  } else if (strcmp(flag, "--seed") == 0) {
+    options.seed = parse_size(flag, value);
+  } else if (strcmp(flag, "--shared") == 0) {
+    char* end;
+    double ratio = value != NULL ? strtod(value, &end) : -1;
+    if (value == NULL || *end != '\0' || ratio < 0 || ratio > 1) {
+      throw unixbuild::ExitException(
+          "expected a number from 0 to 1 as argument to --shared", 1);
+    }
+    options.shared_ratio = ratio;
+  } else {
+    return false;
+  }
+  *i += 2;
+  return true;
+}
+
+std::string generate_tree(const std::string& dir,
+                          const SyntheticOptions& options, bool sources) {
+  std::mt19937 rng(options.seed);
+  std::uniform_real_distribution<double> coin(0.0, 1.0);
+  size_t private_headers = std::max(MIN_PRIVATE_HEADERS, options.fan_in);
+  size_t shared_headers = std::max(MIN_SHARED_HEADERS, options.fan_in);
+  size_t depth = std::min(options.depth, options.rules);
+
+  std::string build_file = "bin/app: obj/main.o";
+  for (size_t i = 0; i < options.rules; i++) {
+    build_file.append(" ").append(object(i));
+  }
+  build_file.append("\nobj/main.o: src/main.c\n");
+  if (sources) {
+    write_file(dir, "src/main.c", "int main(void) { return 0; }\n");
+  }
+
+  for (size_t i = 0; i < options.rules; i++) {
+    std::set<std::string> headers;
+    while (headers.size() < options.fan_in) {
+      if (coin(rng) < options.shared_ratio) {
+        headers.insert(shared_header(rng() % shared_headers));
+      } else {
+        headers.insert(
+            private_header(i / MODULE_SIZE, rng() % private_headers));
+      }
+    }
+
+    std::string rule = object(i) + ": " + synthetic_source(i);
+    std::string source;
+    for (const std::string& header : headers) {
+      rule.append(" ").append(header);
+      source.append("#include \"").append(basename(header)).append("\"\n");
+    }
+
+    // Levels are contiguous ranges of objects.
+    size_t level = i * depth / options.rules;
+    if (level > 0) {
+      size_t first = ((level - 1) * options.rules + depth - 1) / depth;
+      size_t last = (level * options.rules + depth - 1) / depth;
+      rule.append(" ").append(object(first + rng() % (last - first)));
+    }
+    build_file.append(rule).append("\n");
+
+    if (sources) {
+      source.append("int f")
+          .append(std::to_string(i))
+          .append("(void) { return ")
+          .append(std::to_string(i))
+          .append("; }\n");
+      write_file(dir, synthetic_source(i), source);
+    }
+  }
+
+  if (sources) {
+    for (size_t k = 0; k < shared_headers; k++) {
+      write_file(dir, shared_header(k),
+                 "int shared" + std::to_string(k) + "(void);\n");
+    }
+    for (size_t m = 0; m * MODULE_SIZE < options.rules; m++) {
+      for (size_t k = 0; k < private_headers; k++) {
+        write_file(dir, private_header(m, k),
+                   "int private" + std::to_string(k) + "(void);\n");
+      }
+    }
+  }
+
+  std::string path = dir + "/BUILD.uxb";
+  unixbuild::write_file_atomically(path, build_file);
+  return path;
+}
+
+std::string synthetic_source(size_t i) {
+  return module_dir(i) + "/f" + std::to_string(i) + ".c";
+}
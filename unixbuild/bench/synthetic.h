@@ -0,0 +1,46 @@
+// Generates synthetic build files, and the source trees that they build, for
+// the benchmarks.
+#ifndef UNIXBUILD_BENCH_SYNTHETIC_H_
+#define UNIXBUILD_BENCH_SYNTHETIC_H_
+
+#include <cstdint>
+#include <string>
+
+struct SyntheticOptions {
+  // The number of object files. Each is compiled from its own source file,
+  // and they are all linked into one program, `bin/app`.
+  size_t rules = 200;
+  // The number of headers that each object file depends on.
+  size_t fan_in = 4;
+  // The objects are split into this many levels, and every object after the
+  // first level also depends on an object from the level before it, as if it
+  // included a header that the earlier one generated. This sets the length of
+  // the longest chain of jobs.
+  size_t depth = 1;
+  // The fraction of each object's headers that come from a small set shared
+  // by the whole tree, like a project's common headers; the rest are private
+  // to its module. Touching a shared header rebuilds much of the tree.
+  double shared_ratio = 0.25;
+  uint32_t seed = 1;
+};
+
+// Parses the flags for `options` (--rules, --fan-in, --depth, --shared, and
+// --seed) starting at `argv[*i]`, advancing `*i` past the ones it consumes.
+// Returns false if `argv[*i]` is not one of them.
+//
+// Throws an `ExitException` if a flag's value is invalid.
+bool parse_synthetic_flag(int argc, char* argv[], int* i,
+                          SyntheticOptions& options);
+
+// Writes a build file, `BUILD.uxb`, and every source file and header that it
+// refers to, into the existing directory `dir`. Returns the build file's path.
+//
+// With `sources` false, only the build file is written, which is enough to
+// benchmark parsing.
+std::string generate_tree(const std::string& dir,
+                          const SyntheticOptions& options, bool sources = true);
+
+// The path, relative to the tree, of the source file of object `i`.
+std::string synthetic_source(size_t i);
+
+#endif
@@ -0,0 +1,108 @@
+#ifndef UNIXBUILD_ACTION_CACHE_H_
+#define UNIXBUILD_ACTION_CACHE_H_
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "unixbuild/hashing.h"
+
+namespace unixbuild {
+
+// A local, content-addressed cache of the files produced by commands.
+//
+// Each entry is keyed by a hash of a command line together with the contents
+// of every input to it, and holds the file that the command produced. Before
+// running a command, the scheduler looks up its key; on a hit, the output is
+// restored from the cache instead of being rebuilt, so the same compilation
+// never has to run twice, even after a clean or in a different output
+// directory: paths under the output directory are hashed relative to it, so
+// that only the command's shape and its inputs' contents decide the key.
+//
+// The key cannot cover headers that the build file does not list, since we
+// only find out about them from the depfile once the command has run. So, as
+// in ccache's direct mode, the entry for a command that wrote a depfile is
+// keyed by a second hash that also covers the discovered headers, and a
+// manifest stored under the first key lists which headers those were.
+//
+// Entries live in `<dir>/<first two hex digits of key>/<rest of key>`. Outputs
+// are restored by hard link where possible, since that costs nothing but a
+// directory entry, and otherwise by reflink or, failing that, by copying.
+//
+// The cache is kept under a size limit by evicting the least recently used
+// entries. An entry's modification time is its last use: restoring it
+// touches it.
+class ActionCache {
+public:
+  // Opens the cache in `dir`, creating it if necessary, and scans it to find
+  // out how large it is.
+  //
+  // Throws an `ExitException` if the directory cannot be created or read.
+  ActionCache(std::string dir, ContentHashCache& hashes);
+
+  // Returns the key of the command `argv`, run in `build_dir`, reading the
+  // files at the absolute paths `inputs`. Paths in either that are under
+  // `output_dir` are keyed relative to it.
+  //
+  // Throws an `ExitException` if an input cannot be read.
+  std::string key(const std::vector<std::string>& argv,
+                  const std::vector<std::string>& inputs,
+                  const std::string& build_dir,
+                  const std::string& output_dir);
+
+  // Replaces the file at `output` with the cached entry for `key`. Returns
+  // false if there is no such entry.
+  //
+  // If the command that produced the entry reported further inputs in a
+  // depfile, then the entry is only used if those files are also unchanged,
+  // and their paths are placed in `discovered`.
+  bool restore(const std::string& key, const std::string& output,
+               std::vector<std::string>& discovered);
+
+  // Adds the file at `output`, just produced by the command with key `key`, to
+  // the cache, and evicts old entries if that takes the cache over its size
+  // limit. `discovered` lists the absolute paths of any inputs that the
+  // command reported in a depfile. Failure to add an entry is not an error,
+  // since the cache is only an optimization.
+  void store(const std::string& key, const std::string& output,
+             const std::vector<std::string>& discovered);
+
+  // Evicts the least recently used entries until the cache takes up no more
+  // than `max_bytes`.
+  void set_max_size(uint64_t max_bytes);
+
+  const std::string& dir() const { return dir_; }
+  size_t hits() const { return hits_; }
+  size_t misses() const { return misses_; }
+  size_t entries() const { return entries_.size(); }
+  uint64_t total_bytes() const { return total_bytes_; }
+
+private:
+  struct Entry {
+    uint64_t size;
+    struct timespec last_use;
+  };
+
+  std::string entry_path(const std::string& key) const;
+  // Returns the key of `key` extended with the contents of `discovered`, or
+  // an empty string if one of them no longer exists.
+  std::string extend_key(const std::string& key,
+                         const std::vector<std::string>& discovered);
+  // Records a new file in the cache.
+  void add_entry(const std::string& key, const std::string& path);
+  void evict();
+
+  std::string dir_;
+  ContentHashCache& hashes_;
+  uint64_t max_bytes_ = UINT64_MAX;
+
+  std::unordered_map<std::string, Entry> entries_;
+  uint64_t total_bytes_ = 0;
+  size_t hits_ = 0;
+  size_t misses_ = 0;
+};
+
+} // namespace unixbuild
+
+#endif
@@ -0,0 +1,77 @@
+#ifndef UNIXBUILD_BATCH_IO_H_
+#define UNIXBUILD_BATCH_IO_H_
+
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "unixbuild/common.h"
+#include "unixbuild/thread_pool.h"
+
+namespace unixbuild {
+
+// Stats and reads files many at a time, for the daemon's analysis, which
+// touches tens of thousands of files before a build can start.
+//
+// Where the kernel supports it, requests are queued on an io_uring (see
+// io_uring(7), and `stat_files` below) and handed to the kernel in batches of
+// `IO_BATCH_SIZE`, so a batch costs a few system calls rather than one or more
+// per file. Otherwise, or if io_uring has been turned off with
+// `set_io_uring_enabled`, the same functions make the usual calls one file at
+// a time. Either way the results are the same.
+//
+// Each thread has its own ring, so these functions may be called from
+// several threads at once.
+
+// The most requests handed to the kernel at once.
+constexpr size_t IO_BATCH_SIZE = 256;
+
+// The outcome of stat'ing a file: `error` is 0 and `stamp` is its stamp, or
+// `error` is the `errno` that `stat` would have set.
+struct StatResult {
+  int error = 0;
+  FileStamp stamp{};
+};
+
+// The outcome of reading a whole file: `error` is 0 and `contents` is what it
+// contains, or `error` is the `errno` that `open` or `read` set.
+struct ReadResult {
+  int error = 0;
+  std::string contents;
+};
+
+// Stats each of `paths`, following symbolic links like `stat`.
+//
+// This only goes through io_uring if `via_io_uring` is set as well. The kernel
+// cannot do a statx without possibly blocking, so it hands every one to a
+// worker thread, and that costs more than the system calls it saves:
+// bench/bench_io.cc finds it slower whether or not the inodes are cached. The
+// option is there so that the benchmark can keep checking.
+std::vector<StatResult> stat_files(const std::vector<const char*>& paths,
+                                   bool via_io_uring = false);
+
+// Reads the whole of each of `paths`. Each read asks for `expected_size`
+// bytes at once, and files larger than that are finished with further reads,
+// so it should be enough for most of them.
+std::vector<ReadResult> read_files(const std::vector<const char*>& paths,
+                                   size_t expected_size = 16 * 1024);
+
+// Splits the indices from 0 to `n` into ranges of at most `IO_BATCH_SIZE`,
+// and calls `f(begin, end)` for each of them on `pool`'s threads, for the
+// callers of the functions above.
+void for_each_batch(ThreadPool& pool, size_t n,
+                    const std::function<void(size_t, size_t)>& f);
+
+// Returns true if the kernel supports everything the io_uring path needs.
+bool io_uring_available();
+
+// Turns the io_uring path on or off for every thread. It is on by default,
+// wherever it is available.
+void set_io_uring_enabled(bool enabled);
+
+// Returns true if calls will go through io_uring.
+bool io_uring_enabled();
+
+} // namespace unixbuild
+
+#endif
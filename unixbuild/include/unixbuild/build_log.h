@@ -0,0 +1,107 @@
+#ifndef UNIXBUILD_BUILD_LOG_H_
+#define UNIXBUILD_BUILD_LOG_H_
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "unixbuild/common.h"
+
+namespace unixbuild {
+
+// What the daemon knew about an output when it last built it.
+struct LogEntry {
+  // The stamp of the output just after it was built. If the output has since
+  // been modified by anything else, the entry no longer describes it.
+  FileStamp output = {};
+  // A hash of the command that built the output, so that a change to the
+  // deduced command line, e.g. because a header was added to the rule, causes
+  // a rebuild even if no file changed.
+  uint64_t command_hash = 0;
+  // The combined hash of the output's inputs, as computed by `hash_inputs`,
+  // if the output was built with `--hash`.
+  bool has_inputs_hash = false;
+  uint64_t inputs_hash = 0;
+  // How long the job that last built the output took, in microseconds, or 0
+  // if it is not known, e.g. because the output was restored from a cache.
+  uint64_t duration_us = 0;
+  // The absolute paths of the dependencies that GCC reported in a depfile.
+  std::vector<std::string> discovered;
+};
+
+// A persistent log of `LogEntry`s for every output in one output directory,
+// so that a freshly started daemon does not have to rediscover what the last
+// one knew, like Ninja's `.ninja_log` and `.ninja_deps` combined.
+//
+// The log is a binary file, written in host byte order since it never leaves
+// the machine, that starts with a 16-byte header (the magic string
+// "UXBLOG\0\0", a 32-bit version, and 32 bits of padding) and continues with a
+// sequence of records:
+//
+//   uint32  size of the rest of the record, in bytes
+//   uint32  length of the output path
+//   uint32  number of discovered dependencies
+//   uint32  flags
+//   uint64  command hash
+//   uint64  inputs hash
+//   uint64  duration of the last job, in microseconds
+//   uint64  output device, inode, mtime seconds, mtime nanoseconds, and size
+//   char[]  output path
+//   then, for each discovered dependency, a uint32 length and the path
+//
+// New entries are appended to the end of the file, so a build that changes a
+// handful of outputs writes a handful of records rather than the whole log.
+// When an output is rebuilt its old record is dead but stays in the file until
+// the log is compacted, which happens once dead records outnumber live ones.
+// Loading the log maps it into memory and walks the records, with later
+// records for an output replacing earlier ones. A truncated record at the end,
+// left by a daemon that died mid-write, is ignored and compacted away.
+class BuildLog {
+public:
+  // Loads the log at `path`, if it exists. A log with a different version is
+  // ignored and replaced the next time the log is written.
+  explicit BuildLog(std::string path);
+
+  // Returns the entry for the output at the absolute path `output`, or null
+  // if there is none.
+  const LogEntry* find(const std::string& output) const;
+
+  // Records `entry` for `output`. It is written to disk by the next `flush`.
+  void record(const std::string& output, LogEntry entry);
+
+  // Appends any records made since the last flush to the log, or compacts it
+  // if it has accumulated too many dead records.
+  //
+  // Throws an `ExitException` if the log cannot be written.
+  void flush();
+
+  // Calls `f(output, entry)` for every live entry.
+  template <typename F> void for_each(F f) const {
+    for (const auto& [output, entry] : entries_) {
+      f(output, entry);
+    }
+  }
+
+  const std::string& path() const { return path_; }
+  size_t size() const { return entries_.size(); }
+  // The number of records in the file, live or dead.
+  size_t records() const { return records_; }
+
+private:
+  void compact();
+
+  std::string path_;
+  std::unordered_map<std::string, LogEntry> entries_;
+  // Outputs recorded since the last flush.
+  std::unordered_set<std::string> pending_;
+  size_t records_ = 0;
+  // Set if the file is missing, has the wrong version, or ends in a partial
+  // record, so that the next flush rewrites it from scratch.
+  bool needs_rewrite_ = false;
+};
+
+} // namespace unixbuild
+
+#endif
@@ -0,0 +1,87 @@
+#ifndef UNIXBUILD_BUILDFILE_H_
+#define UNIXBUILD_BUILDFILE_H_
+
+#include <functional>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "unixbuild/scan.h"
+
+namespace unixbuild {
+
+struct Rule {
+  std::string output;
+  std::vector<std::string> deps;
+};
+
+struct BuildFile {
+  std::vector<Rule> rules;
+};
+
+// A rule whose fields point into the text of the build file rather than owning
+// their own copies.
+struct RuleView {
+  std::string_view output;
+  std::vector<std::string_view> deps;
+};
+
+// How `parse_rules` goes about parsing a build file.
+struct ParseOptions {
+  // How many threads to split the file between. If 0, each CPU gets a thread,
+  // as long as it has at least a megabyte to parse.
+  size_t threads = 0;
+  // The instructions used to find newlines, colons and spaces, which fall back
+  // to the best that this CPU supports.
+  SimdLevel simd = SimdLevel::AVX2;
+};
+
+// Reads and parses the BUILD.uxb file at `path`.
+//
+// Throws a `ParseException` if any line of the file is malformed.
+BuildFile parse_build_file(const std::string& path);
+
+// Called with the directory named by each `subdir` line of a build file.
+using SubdirCallback = std::function<void(std::string_view)>;
+
+// Parses the text of a build file, calling `callback` with each rule in order.
+//
+// A line of the form `subdir <directory>` says that the directory has a build
+// file of its own. If `subdir_callback` is given, it is called with the
+// directory, which points into `contents` too; otherwise such a line is
+// malformed.
+//
+// The views passed to `callback` point into `contents`, and the same `RuleView`
+// is reused for every rule, so the callback must copy anything it wants to
+// keep. This lets a file be parsed without allocating memory per line or per
+// token.
+//
+// A large file is split into runs of whole lines that are parsed on separate
+// threads. `callback` and `subdir_callback` are still only called from the
+// calling thread, with the rules and `subdir` lines in file order.
+//
+// Throws a `ParseException` if any line is malformed, after calling `callback`
+// with every rule before that line.
+void parse_rules(std::string_view contents,
+                 const std::function<void(const RuleView&)>& callback,
+                 const ParseOptions& options = {},
+                 const SubdirCallback& subdir_callback = nullptr);
+
+// Parses a single line of a build file into `rule`. Returns false if the line
+// is blank or a comment. A `subdir` line is not a rule, so it is malformed
+// here.
+//
+// `line` should not include the trailing newline. `lineno` is only used for
+// error messages.
+bool parse_line(std::string_view line, size_t lineno, RuleView& rule);
+
+// Parses a single line of a build file. Returns an empty optional if the line
+// is blank or a comment.
+//
+// `line` is trimmed in-place. `lineno` is only used for error messages.
+std::optional<Rule> parse_line(std::string& line, size_t lineno);
+
+} // namespace unixbuild
+
+#endif
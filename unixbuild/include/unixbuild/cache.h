@@ -0,0 +1,113 @@
+#ifndef UNIXBUILD_CACHE_H_
+#define UNIXBUILD_CACHE_H_
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "unixbuild/common.h"
+#include "unixbuild/graph.h"
+#include "unixbuild/staleness.h"
+
+namespace unixbuild {
+
+// An in-memory cache of parsed build files and their dependency graphs, owned
+// by the daemon.
+//
+// Each build file is kept as a `BuildFileIndex`, and a graph is only built
+// for each target that is asked for, from just the rules that it depends on,
+// so a build of one target never analyzes the rest of the file.
+//
+// Entries are keyed by the canonical path of the build file and are
+// revalidated on every lookup by comparing the file's current `FileStamp`
+// against the one recorded when it was parsed, so a lookup for an unchanged
+// file costs at most one `stat` instead of a full read and parse. The stamp
+// comes from the daemon's `StatCache`, so if the build file's directory is
+// being watched it costs nothing at all.
+//
+// The build files of subdirectories, named by `subdir` lines, are called
+// `BUILD.uxb`, and are cached and revalidated in the same way, each in its
+// own entry. One is only loaded once a target depends on a path in its
+// directory, and editing one only parses that file again, though the graph
+// of every target that used it is rebuilt.
+//
+// Only the `MAX_GRAPHS` most recently used graphs of each file are kept, so
+// that a daemon asked for many different targets does not grow without
+// bound.
+class BuildFileCache {
+public:
+  static constexpr size_t MAX_GRAPHS = 64;
+
+  explicit BuildFileCache(StatCache& stat_cache) : stat_cache_(stat_cache) {}
+
+  // Builds the indices of new graphs on the threads of `pool`, which must
+  // outlive the cache.
+  void set_pool(ThreadPool* pool) { pool_ = pool; }
+
+  // Returns the dependency graph of `target`, or of the first rule if
+  // `target` is empty, in the build file at `path` and those of its
+  // subdirectories, parsing each file only if it is not already cached or
+  // has changed on disk since it was cached. `path` must be canonical, as
+  // returned by `canonicalize_path`.
+  //
+  // The returned graph is an immutable snapshot: when the file changes, the
+  // entry is replaced with a new index rather than updated in place, so
+  // builds that are still using an old graph are unaffected and it is freed
+  // once the last of them is done.
+  //
+  // Throws an `ExitException` if the file has no rules, or none for
+  // `target`.
+  std::shared_ptr<const BuildGraph> get(const std::string& path,
+                                        const std::string& target = "");
+
+  // Lookups of a file that found its index cached, and that had to parse it.
+  size_t hits() const { return hits_; }
+  size_t misses() const { return misses_; }
+  size_t size() const { return entries_.size(); }
+  // The number of targets whose graphs are cached, across every file.
+  size_t graphs() const;
+  // How many times a cached file has been parsed again because it changed.
+  // A rule only changes along with this, so whatever was learned from the
+  // graphs of one generation holds for every graph of the same generation.
+  uint64_t generation() const { return generation_; }
+
+private:
+  struct Graph {
+    std::shared_ptr<const BuildGraph> graph;
+    // When the graph was last returned by `get`, counted in lookups.
+    uint64_t last_use = 0;
+    // The subdirectories whose build files it was built from, and the
+    // indices of those files that were current then.
+    std::vector<std::pair<std::string, std::shared_ptr<const BuildFileIndex>>>
+        subdirs;
+  };
+
+  struct Entry {
+    FileStamp stamp;
+    std::shared_ptr<const BuildFileIndex> index;
+    // Keyed by target, with the first rule under its own name.
+    std::unordered_map<std::string, Graph> graphs;
+  };
+
+  // Returns the entry of the build file at `path`, parsing it if need be.
+  Entry& entry(const std::string& path);
+  // Returns the index of the build file of `subdir`, relative to `dir`,
+  // which ends in a slash.
+  std::shared_ptr<const BuildFileIndex> subdir_index(const std::string& dir,
+                                                     const std::string& subdir);
+
+  StatCache& stat_cache_;
+  ThreadPool* pool_ = nullptr;
+  std::unordered_map<std::string, Entry> entries_;
+  size_t hits_ = 0;
+  size_t misses_ = 0;
+  uint64_t lookups_ = 0;
+  uint64_t generation_ = 0;
+};
+
+} // namespace unixbuild
+
+#endif
@@ -0,0 +1,43 @@
+#ifndef UNIXBUILD_COMMAND_H_
+#define UNIXBUILD_COMMAND_H_
+
+#include <string>
+#include <vector>
+
+#include "unixbuild/graph.h"
+
+namespace unixbuild {
+
+// Returns the path that the output of `node` is written to.
+std::string output_file(const BuildGraph& graph, size_t node,
+                        const std::string& output_dir);
+
+// Returns the path that the dependency with path ID `dep` should be read from:
+// the output directory if it is produced by another rule, or else the path as
+// written in the build file, relative to the build file's directory.
+std::string dep_file(const BuildGraph& graph, uint32_t dep,
+                     const std::string& output_dir);
+
+// Returns the path of the depfile that GCC writes alongside `output`, listing
+// the headers that it read.
+std::string depfile_path(const std::string& output);
+
+// Returns true if the command that builds `node` writes a depfile. GCC can only
+// write a meaningful depfile when it compiles a single source file, since with
+// several it overwrites the depfile for each one.
+bool writes_depfile(const BuildGraph& graph, size_t node);
+
+// Deduces the GCC invocation that builds `node` from the extensions of its
+// output and dependencies, as described in the README. If `writes_depfile` is
+// true, the command also asks GCC for a depfile.
+//
+// The command is meant to be run from the directory containing the build file.
+std::vector<std::string> deduce_command(const BuildGraph& graph, size_t node,
+                                        const std::string& output_dir);
+
+// Joins `argv` with spaces, for display.
+std::string format_command(const std::vector<std::string>& argv);
+
+} // namespace unixbuild
+
+#endif
@@ -1,7 +1,9 @@
 #ifndef UNIXBUILD_COMMON_H_
-#define UNIXBUILD_COMMON_H
+#define UNIXBUILD_COMMON_H_
 
 #include <string>
+#include <string_view>
+#include <sys/stat.h>
 #include <vector>
 
 namespace unixbuild {
@@ -27,15 +29,99 @@ public:
                       2) {}
 };
 
+// Identifies a particular version of a file on disk.
+//
+// Two stamps compare equal only if they refer to the same inode on the same
+// device with the same size and modification time. This is the same heuristic
+// that tools like rsync and git use to decide that a file has not changed
+// without reading its contents.
+struct FileStamp {
+  dev_t dev;
+  ino_t ino;
+  struct timespec mtime;
+  off_t size;
+
+  bool operator==(const FileStamp& other) const;
+  bool operator!=(const FileStamp& other) const { return !(*this == other); }
+};
+
+// Returns the stamp of the file at `path`.
+//
+// Throws an `ExitException` if the file cannot be stat'd.
+FileStamp stat_file(const char* path);
+
+// Returns the canonical absolute form of `path`, with symbolic links and `.`
+// and `..` components resolved.
+//
+// Throws an `ExitException` if the path does not exist.
+std::string canonicalize_path(const char* path);
+
+// Returns `path` without `.` components, repeated slashes, or `..` components
+// that follow a directory name, which they cancel out. Unlike
+// `canonicalize_path`, this only looks at the text, so the path need not
+// exist, and symbolic links are not resolved. Returns "." if nothing is left.
+std::string normalize_path(std::string_view path);
+
+// Creates the directory at `path` along with any missing parents, like
+// `mkdir -p`. New directories are created with permissions `mode`, as
+// modified by the umask.
+//
+// Throws an `ExitException` if a directory cannot be created.
+void create_directories(const std::string& path, mode_t mode = 0777);
+
+// Returns the current time on the monotonic clock, in seconds.
+double monotonic_seconds();
+
+// Returns the directory where the daemon keeps state that should survive it
+// exiting, following the XDG base directory convention: `$XDG_CACHE_HOME`, or
+// else `~/.cache`, with `unixbuild` appended. Returns an empty string if
+// neither variable is set.
+std::string cache_directory();
+
+// Replaces the contents of the file at `path` with `contents`, such that a
+// reader sees either the old contents or the new ones and never a partial
+// write. The file is written next to `path` and renamed over it.
+//
+// Throws an `ExitException` if the file cannot be written.
+void write_file_atomically(const std::string& path,
+                           const std::string& contents);
+
 // Reads the lines of the file into a vector of strings.
 //
 // Each string includes the trailing newline, except the last one may not if the
 // file is missing a final newline.
 std::vector<std::string> read_lines(const char* path);
 
+// A read-only memory mapping of an entire file.
+//
+// Reading a file through a mapping avoids copying its contents out of the page
+// cache, and lets the parser hand out `std::string_view`s that point straight
+// into the file instead of allocating a string for every token.
+class MappedFile {
+public:
+  // Throws an `ExitException` if the file cannot be opened or mapped.
+  explicit MappedFile(const char* path);
+  ~MappedFile();
+
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+
+  // The contents of the file. Only valid for the lifetime of the mapping.
+  std::string_view contents() const {
+    return std::string_view(data_, size_);
+  }
+
+private:
+  char* data_;
+  size_t size_;
+};
+
 // Removes whitespace characters from the beginning and end of `s` in-place.
 void trim_whitespace(std::string& s);
 
+// Returns `s` without whitespace characters at the beginning and end.
+std::string_view trim_whitespace(std::string_view s);
+
 // Splits the string around occurrences of `ch` and places the resulting
 // fragments into the `out` vector.
 //
@@ -43,6 +129,11 @@ void trim_whitespace(std::string& s);
 // instance; this means that an empty string will never be pushed onto `out`.
 void split_string(const std::string& s, std::vector<std::string>& out, char ch);
 
+// Like `split_string` above, but the fragments point into `s` rather than being
+// copied.
+void split_string(std::string_view s, std::vector<std::string_view>& out,
+                  char ch);
+
 } // namespace unixbuild
 
 #endif
@@ -0,0 +1,90 @@
+#ifndef UNIXBUILD_DEPFILE_H_
+#define UNIXBUILD_DEPFILE_H_
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "unixbuild/paths.h"
+#include "unixbuild/thread_pool.h"
+
+namespace unixbuild {
+
+// Calls `on_dep` with each prerequisite listed in `contents`, a depfile in the
+// makefile syntax that GCC writes for -MD and -MMD:
+//
+//   out/main.o: main.c include/util.h include/config.h
+//
+// GCC breaks long lists over several lines with a backslash at the end of each
+// line. These backslash-newlines are treated as whitespace, and GCC's escapes
+// for spaces (`\ `), pound signs (`\#`), and dollar signs (`$$`) are undone.
+// The views passed to `on_dep` are only valid for the duration of the call.
+//
+// Throws an `ExitException` if `contents` has no target.
+void parse_depfile(std::string_view contents,
+                   const std::function<void(std::string_view)>& on_dep);
+
+// Reads the depfile at `path` into a list of absolute paths, resolving
+// relative ones against `build_dir`, the directory that the compiler ran in.
+// Returns an empty list if there is no depfile.
+std::vector<std::string> read_depfile(const std::string& path,
+                                      const std::string& build_dir);
+
+// Writes a depfile to `path` listing `deps` as the prerequisites of `output`,
+// in the same format that GCC uses, for outputs that were restored from a
+// cache rather than compiled.
+//
+// Throws an `ExitException` if the file cannot be written.
+void write_depfile(const std::string& path, const std::string& output,
+                   const std::vector<std::string>& deps);
+
+// The dependencies of outputs that GCC reported in depfiles, but that are not
+// listed in the build file, e.g. headers included by other headers.
+//
+// This supplements the build graph, which only knows what the build file says.
+// The graph itself is shared between builds and never modified, so the
+// discovered edges are kept here, keyed by absolute output path, and consulted
+// alongside it. Like the graph, they intern their paths, so that a header that
+// every source includes is stored once.
+//
+// Depfiles are read lazily, the first time an output is looked up, and the
+// results kept until the output is rebuilt.
+class DiscoveredDeps {
+public:
+  // Returns the IDs, in `paths()`, of the discovered dependencies of
+  // `output`, whose commands were run in `build_dir`.
+  const std::vector<uint32_t>& get(const std::string& output,
+                                   const std::string& build_dir);
+
+  // Reads the depfiles of those of `outputs` that have not been looked up yet
+  // on `pool`'s threads, so that `get` finds them already loaded.
+  void prefetch(const std::vector<std::string>& outputs,
+                const std::string& build_dir, ThreadPool& pool);
+
+  // Replaces the discovered dependencies of `output` with `deps`, which must
+  // be absolute paths.
+  void set(const std::string& output, const std::vector<std::string>& deps);
+
+  // Forgets what we know about `output`, so that its depfile is read again the
+  // next time it is looked up.
+  void invalidate(const std::string& output) { deps_.erase(output); }
+
+  const PathTable& paths() const { return paths_; }
+  // The number of depfiles that have been read, for confirming that they are
+  // only read once.
+  size_t depfiles_read() const { return depfiles_read_; }
+
+private:
+  PathTable paths_;
+  std::unordered_map<std::string, std::vector<uint32_t>> deps_;
+  // Reused for reading each depfile.
+  std::string buffer_;
+  size_t depfiles_read_ = 0;
+};
+
+} // namespace unixbuild
+
+#endif
@@ -0,0 +1,64 @@
+#ifndef UNIXBUILD_EVENT_LOOP_H_
+#define UNIXBUILD_EVENT_LOOP_H_
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <unordered_map>
+
+namespace unixbuild {
+
+// A single-threaded event loop over Linux's epoll interface, which calls back
+// when file descriptors become readable, or writable.
+//
+// The daemon registers everything it waits on with one loop: the listening
+// socket, client connections, the inotify descriptor, and a signalfd for
+// SIGCHLD and the termination signals. Nothing else in the daemon blocks, so
+// while one build is running it can still accept clients and keep up with
+// file system events.
+class EventLoop {
+public:
+  // Throws an `ExitException` if epoll is not available.
+  EventLoop();
+  ~EventLoop();
+
+  EventLoop(const EventLoop&) = delete;
+  EventLoop& operator=(const EventLoop&) = delete;
+
+  // Calls `on_readable` whenever `fd` is readable, or has been closed or hit
+  // an error at the other end, until `remove(fd)` is called. Does not take
+  // ownership of `fd`.
+  //
+  // Throws an `ExitException` if `fd` cannot be added.
+  void add(int fd, std::function<void()> on_readable);
+
+  // Like `add`, but calls `on_writable` whenever `fd` can be written to
+  // without blocking, or has been closed or hit an error at the other end.
+  void add_writable(int fd, std::function<void()> on_writable);
+
+  // Stops watching `fd`. This is safe to call from inside a callback,
+  // including `fd`'s own.
+  void remove(int fd);
+
+  // Waits up to `timeout_ms` milliseconds, or forever if it is negative, for
+  // registered descriptors to become readable, and calls their callbacks.
+  // Returns the number of callbacks that were called, which is zero if the
+  // timeout expired.
+  //
+  // Throws an `ExitException` if `epoll_wait` fails.
+  int run_once(int timeout_ms);
+
+  size_t size() const { return callbacks_.size(); }
+
+private:
+  void watch(int fd, uint32_t events, std::function<void()> callback);
+
+  int fd_;
+  // Shared, so that a callback that removes itself is not destroyed while it
+  // is running.
+  std::unordered_map<int, std::shared_ptr<std::function<void()>>> callbacks_;
+};
+
+} // namespace unixbuild
+
+#endif
@@ -0,0 +1,214 @@
+#ifndef UNIXBUILD_GRAPH_H_
+#define UNIXBUILD_GRAPH_H_
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "unixbuild/buildfile.h"
+#include "unixbuild/paths.h"
+#include "unixbuild/thread_pool.h"
+
+namespace unixbuild {
+
+// A read-only view of a contiguous run of IDs in one of `BuildGraph`'s arrays.
+class IdRange {
+public:
+  IdRange(const uint32_t* begin, const uint32_t* end)
+      : begin_(begin), end_(end) {}
+
+  const uint32_t* begin() const { return begin_; }
+  const uint32_t* end() const { return end_; }
+  size_t size() const { return end_ - begin_; }
+  uint32_t operator[](size_t i) const { return begin_[i]; }
+
+private:
+  const uint32_t* begin_;
+  const uint32_t* end_;
+};
+
+// The dependency graph of a build file.
+//
+// Each rule is a node, identified by its index in the build file. A dependency
+// that names the output of another rule is an edge to that rule; any other
+// dependency is a source file that must already exist.
+//
+// Every path in the build file is interned in a `PathTable` and referred to by
+// ID. A node's dependencies are stored in compressed sparse row form: the
+// dependencies of every node are concatenated into a single array, and a
+// second array records where each node's run begins. This keeps the whole
+// graph in a handful of flat allocations that can be walked sequentially.
+class BuildGraph {
+public:
+  // Throws an `ExitException` if two rules have the same output.
+  explicit BuildGraph(const BuildFile& build_file);
+
+  // Parses the text of a build file straight into a graph, without building
+  // an intermediate `BuildFile`. If `pool` is given, the graph's indices are
+  // built on its threads.
+  //
+  // Throws a `ParseException` if the text is malformed, or an `ExitException`
+  // if two rules have the same output.
+  static BuildGraph parse(std::string_view contents,
+                          ThreadPool* pool = nullptr);
+
+  size_t size() const { return outputs_.size(); }
+  const PathTable& paths() const { return paths_; }
+
+  std::string_view output(size_t node) const {
+    return paths_.path(outputs_[node]);
+  }
+  uint32_t output_id(size_t node) const { return outputs_[node]; }
+
+  // Returns the path IDs of the dependencies of `node`, in the order that they
+  // appear in the build file.
+  IdRange deps(size_t node) const {
+    return IdRange(deps_.data() + dep_offsets_[node],
+                   deps_.data() + dep_offsets_[node + 1]);
+  }
+
+  // Returns the nodes that `node` depends on directly.
+  IdRange rule_deps(size_t node) const {
+    return IdRange(rule_deps_.data() + rule_dep_offsets_[node],
+                   rule_deps_.data() + rule_dep_offsets_[node + 1]);
+  }
+
+  // Returns the node that produces the path with ID `id`, if any.
+  std::optional<size_t> producer(uint32_t id) const {
+    if (producers_[id] == NO_NODE) {
+      return {};
+    }
+    return producers_[id];
+  }
+
+  // Returns the node that produces `output`, if any.
+  std::optional<size_t> find(std::string_view output) const;
+
+  // Returns `target` and every node it depends on directly or indirectly, in
+  // an order in which each node comes after all of its dependencies.
+  //
+  // Throws an `ExitException` if there is a dependency cycle.
+  std::vector<size_t> closure(size_t target) const;
+
+  // The approximate number of bytes of memory that the graph uses.
+  size_t memory_usage() const;
+
+private:
+  friend class BuildFileIndex;
+  static constexpr uint32_t NO_NODE = UINT32_MAX;
+
+  BuildGraph() = default;
+  void add_rule(std::string_view output,
+                const std::vector<std::string_view>& deps);
+  // Resolves edges between rules once every rule has been added.
+  void finish(ThreadPool* pool = nullptr);
+
+  PathTable paths_;
+  std::vector<uint32_t> outputs_;
+  std::vector<uint32_t> dep_offsets_ = {0};
+  std::vector<uint32_t> deps_;
+  std::vector<uint32_t> rule_dep_offsets_;
+  std::vector<uint32_t> rule_deps_;
+  // Indexed by path ID.
+  std::vector<uint32_t> producers_;
+};
+
+// Reads and parses the build file at `path` into a graph.
+BuildGraph load_build_graph(const std::string& path,
+                            ThreadPool* pool = nullptr);
+
+// The rules of a build file, indexed by output, from which the graph of any
+// one target can be built without looking at the rules it does not need.
+//
+// Most of the cost of building a `BuildGraph` is interning every dependency
+// of every rule, though a build only ever looks at the rules that its target
+// depends on. An index interns only the outputs, which it needs in order to
+// find rules, and records where each rule is in the text. `subgraph` then
+// parses just the rules that its target reaches, so building one small tool
+// in a huge build file costs time in proportion to the tool, plus one pass
+// over the text.
+//
+// The whole file is still checked for syntax errors and duplicate outputs
+// up front, with the same errors as `BuildGraph::parse`.
+//
+// The file may name subdirectories with `subdir` lines, each of which has a
+// build file of its own, whose paths are relative to that subdirectory. The
+// rules for every path in a subdirectory are in its build file, which only
+// has to be loaded once a target depends on one of those paths; see
+// `target_graph`.
+class BuildFileIndex {
+public:
+  // Returns the index of the build file of `dir`, a subdirectory named by a
+  // `subdir` line, given relative to the directory of the top-level file.
+  using SubdirLoader = std::function<std::shared_ptr<const BuildFileIndex>(
+      const std::string& dir)>;
+
+  // Throws a `ParseException` if the text is malformed, or an `ExitException`
+  // if two rules have the same output, a subdirectory is not below the
+  // file's directory, or a rule's output is in a subdirectory.
+  explicit BuildFileIndex(std::string contents);
+
+  // The number of rules.
+  size_t size() const { return offsets_.size(); }
+
+  // Returns the output of `rule`, numbered in file order.
+  std::string_view output(size_t rule) const { return outputs_.path(rule); }
+
+  // Returns the rule, numbered in file order, that produces `output`, if any.
+  std::optional<size_t> find(std::string_view output) const {
+    return outputs_.find(output);
+  }
+
+  // Returns the longest of the subdirectories named by `subdir` lines that
+  // `path` is in, if any. Both are relative to the file's directory.
+  std::optional<std::string_view> subdir_of(std::string_view path) const;
+
+  // Returns the graph of `rule` and every rule that it depends on, directly
+  // or indirectly. Their nodes are in the order that the rules appear in the
+  // file, so if the file's first rule is among them, it is node 0.
+  // Subdirectories are ignored.
+  BuildGraph subgraph(size_t rule, ThreadPool* pool = nullptr) const;
+
+  // Like `subgraph`, but of the rule for `target`, or of the first rule if it
+  // is empty, and following dependencies into the build files of
+  // subdirectories, which are loaded with `load_subdir` the first time that a
+  // path in them is needed. Their rules' paths are made relative to this
+  // file's directory, and their nodes come after this file's, in the order
+  // that the files were loaded.
+  //
+  // Throws an `ExitException` if the file has no rules, or none for `target`.
+  BuildGraph target_graph(std::string_view target,
+                          const SubdirLoader& load_subdir,
+                          ThreadPool* pool = nullptr) const;
+
+  // The approximate number of bytes of memory that the index uses.
+  size_t memory_usage() const;
+
+private:
+  // Finds the rules that a target reaches, across build files.
+  class Walker;
+
+  // Parses `rule` again into `view`.
+  void parse_rule(size_t rule, RuleView& view) const;
+
+  // The text is copied, rather than mapped, so that the index is not
+  // corrupted if the file is modified in place while it is in use.
+  std::string contents_;
+  // Rule `i` produces path `i`.
+  PathTable outputs_;
+  // Where each rule's output starts in `contents_`.
+  std::vector<size_t> offsets_;
+  // The directories named by `subdir` lines, normalized.
+  PathTable subdirs_;
+};
+
+// Reads the build file at `path` and indexes its rules.
+BuildFileIndex load_build_file_index(const std::string& path);
+
+} // namespace unixbuild
+
+#endif
@@ -0,0 +1,92 @@
+#ifndef UNIXBUILD_HASHING_H_
+#define UNIXBUILD_HASHING_H_
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "unixbuild/common.h"
+#include "unixbuild/thread_pool.h"
+
+namespace unixbuild {
+
+// Returns a 64-bit hash of `data`, computed with the XXH64 algorithm.
+//
+// XXH64 is not a cryptographic hash, but it is good enough to tell whether a
+// source file has changed, and it is fast enough that hashing is limited by
+// memory bandwidth rather than by computation: the bulk of the input is
+// consumed 32 bytes at a time by four independent accumulators, which the CPU
+// can advance in parallel.
+uint64_t hash_bytes(std::string_view data, uint64_t seed = 0);
+
+// Returns the hash of the contents of the file at `path`.
+//
+// Throws an `ExitException` if the file cannot be read.
+uint64_t hash_file(const char* path);
+
+// A table of file content hashes that persists across daemon restarts.
+//
+// Reading a file to hash it is much more expensive than stat'ing it, so each
+// hash is stored along with the stamp of the file it was computed from, and is
+// reused for as long as the file's inode, size, and modification time do not
+// change. A file that has not changed since it was last hashed is never read
+// again.
+class ContentHashCache {
+public:
+  // Returns the hash of the contents of the file at `path`, whose current
+  // stamp is `stamp`.
+  uint64_t hash(const std::string& path, const FileStamp& stamp);
+
+  // Hashes those of `files`, paths and their current stamps, that `hash`
+  // would have to read, on `pool`'s threads. Files that cannot be read are
+  // left for `hash` to report.
+  void prefetch(const std::vector<std::pair<std::string, FileStamp>>& files,
+                ThreadPool& pool);
+
+  // Replaces the contents of the cache with the entries saved at `path`, if it
+  // exists. Malformed entries are ignored, since the cache can always be
+  // rebuilt by re-reading files.
+  void load(const std::string& path);
+
+  // Writes the cache to `path`, if anything has changed since it was loaded.
+  void save(const std::string& path);
+
+  // The number of files read in order to hash them.
+  size_t files_hashed() const { return files_hashed_; }
+  size_t size() const { return entries_.size(); }
+
+private:
+  struct Key {
+    dev_t dev;
+    ino_t ino;
+
+    bool operator==(const Key& other) const {
+      return dev == other.dev && ino == other.ino;
+    }
+  };
+
+  struct KeyHash {
+    size_t operator()(const Key& key) const {
+      return std::hash<uint64_t>()(key.ino * 31 + key.dev);
+    }
+  };
+
+  struct Entry {
+    FileStamp stamp;
+    uint64_t hash;
+  };
+
+  // Keyed by inode, so that a file that is modified replaces its old entry
+  // rather than adding to it, and the cache stays proportional to the number
+  // of files rather than to the number of versions of them.
+  std::unordered_map<Key, Entry, KeyHash> entries_;
+  bool dirty_ = false;
+  size_t files_hashed_ = 0;
+};
+
+} // namespace unixbuild
+
+#endif
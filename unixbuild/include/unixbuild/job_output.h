@@ -0,0 +1,153 @@
+#ifndef UNIXBUILD_JOB_OUTPUT_H_
+#define UNIXBUILD_JOB_OUTPUT_H_
+
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <string>
+#include <sys/types.h>
+
+#include "unixbuild/event_loop.h"
+
+namespace unixbuild {
+
+// How much of a job's output is kept in memory before the rest goes to a
+// temporary file. Compilers rarely print anything, so this is mostly for the
+// odd job that prints pages of warnings.
+constexpr size_t DEFAULT_OUTPUT_MEMORY_LIMIT = 64 * 1024;
+
+// Collects everything that a job writes to its output pipe while it runs, so
+// that it can be passed on in one piece once the job is done, rather than
+// interleaved with the output of other jobs running at the same time.
+//
+// At most `memory_limit` bytes are kept in memory. Once there is more, it all
+// goes to an anonymous temporary file instead, so that a job that prints
+// megabytes of warnings costs disk space rather than memory.
+class JobOutput {
+public:
+  // Takes ownership of `fd`, the read end of the job's output pipe, and makes
+  // it non-blocking.
+  JobOutput(int fd, size_t memory_limit = DEFAULT_OUTPUT_MEMORY_LIMIT);
+  ~JobOutput();
+
+  JobOutput(const JobOutput&) = delete;
+  JobOutput& operator=(const JobOutput&) = delete;
+
+  // Reads whatever is in the pipe without blocking. Returns false once the
+  // pipe has been closed by every process that could write to it.
+  //
+  // If the output has to be spilled to a file and the file cannot be written,
+  // the rest of the output is read but dropped.
+  bool read_available();
+
+  // Writes `header` followed by the collected output to `out`, as one
+  // contiguous piece as long as no one else is writing to `out`. Errors are
+  // ignored, since a client that has gone away is no reason to fail a build.
+  void write_to(int out, const std::string& header);
+
+  // Copies up to `n` bytes of the collected output, starting `offset` bytes
+  // in, to `buf`. Returns how many were copied, which is 0 at the end.
+  size_t read_at(size_t offset, char* buf, size_t n) const;
+
+  int fd() const { return fd_; }
+  // The number of bytes that have been collected.
+  size_t size() const { return size_; }
+  // True if the output went over the memory limit.
+  bool spilled() const { return spill_fd_ >= 0; }
+  // True if some of the output was dropped because it could not be spilled.
+  bool truncated() const { return truncated_; }
+
+private:
+  int fd_;
+  size_t memory_limit_;
+  std::string buffer_;
+  int spill_fd_ = -1;
+  bool truncated_ = false;
+  size_t size_ = 0;
+};
+
+// Passes text and the output of jobs on to a client's standard output, for
+// the daemon, without blocking its event loop on a client that is slow to
+// read it, or that has been paused, like a pipe into `less`.
+//
+// Whatever cannot be written straight away is queued, and written as the
+// descriptor becomes writable. For that, pipes and terminals are opened afresh
+// with `O_NONBLOCK`, since setting it on the descriptor that the client passed
+// would set it for the client too. Writes to a socket are made non-blocking
+// with `MSG_DONTWAIT` instead. Writes to a regular file do not wait on the
+// client, so they are made as they are.
+//
+// As with `JobOutput`, at most `memory_limit` bytes of the queue are kept in
+// memory, and the rest goes to a temporary file, so a client that has stopped
+// reading costs the daemon disk space rather than memory however many jobs
+// print to it.
+class ClientOutput {
+public:
+  // Does not take ownership of `fd`. `on_drained` is called from the event
+  // loop whenever the queue has been emptied after waiting for the client.
+  ClientOutput(int fd, EventLoop* event_loop, std::function<void()> on_drained,
+               size_t memory_limit = DEFAULT_OUTPUT_MEMORY_LIMIT);
+  ~ClientOutput();
+
+  ClientOutput(const ClientOutput&) = delete;
+  ClientOutput& operator=(const ClientOutput&) = delete;
+
+  // Writes `text`, or queues what cannot be written yet.
+  void write(const std::string& text);
+
+  // Writes `header` followed by everything that `output` collected, in one
+  // piece as far as this queue is concerned.
+  void write(const std::string& header, std::unique_ptr<JobOutput> output);
+
+  // Throws away everything queued, and everything written from now on, for a
+  // client that has stopped reading.
+  void drop();
+
+  // True once everything has been written, or dropped.
+  bool empty() const {
+    return written_ == buffer_.size() && spill_fd_ < 0;
+  }
+  // When the client last took some of the queue, or the queue last started
+  // waiting for it, as from `monotonic_seconds`.
+  double last_progress() const { return last_progress_; }
+
+private:
+  // Adds `n` bytes at `data` to the end of the queue.
+  void append(const char* data, size_t n);
+  // Writes as much as can be written without blocking, and watches for the
+  // descriptor becoming writable if there is more.
+  void flush();
+  // Writes `n` bytes of `data`, returning how many were written, or -1 with
+  // `errno` set.
+  ssize_t write_some(const char* data, size_t n);
+
+  int fd_;
+  // The descriptor that is actually written to, which is `fd_` or a copy of
+  // its own.
+  int write_fd_;
+  bool is_socket_ = false;
+  // Whether `write_fd_` can be watched by the event loop, which regular
+  // files cannot.
+  bool pollable_ = false;
+  EventLoop* event_loop_;
+  std::function<void()> on_drained_;
+  size_t memory_limit_;
+
+  // The queue is `buffer_` from `written_` on, followed by the spill file
+  // from `spill_written_` to `spill_size_`. Once the spill file is in use,
+  // everything goes there until it has all been written.
+  std::string buffer_;
+  size_t written_ = 0;
+  int spill_fd_ = -1;
+  size_t spill_size_ = 0;
+  size_t spill_written_ = 0;
+  // Set when some of the queue could not be spilled and was dropped.
+  bool truncated_ = false;
+  bool dropped_ = false;
+  bool watching_ = false;
+  double last_progress_ = 0.0;
+};
+
+} // namespace unixbuild
+
+#endif
@@ -0,0 +1,63 @@
+#ifndef UNIXBUILD_JOBSERVER_H_
+#define UNIXBUILD_JOBSERVER_H_
+
+#include <cstddef>
+#include <string>
+
+namespace unixbuild {
+
+// A pool of job tokens shared by every build that the daemon runs, so that
+// several clients each asking for -j N do not start more compilers between
+// them than the machine can run.
+//
+// The pool is a GNU make jobserver: a pipe holding one byte per free token.
+// The daemon takes a token before starting each job and puts it back when the
+// job exits. The pipe is inherited by every job, and advertised to them in
+// MAKEFLAGS, so that a job that is itself a jobserver client, such as a
+// recursive make or `gcc -flto=jobserver`, takes further tokens from the same
+// pool for its own sub-jobs rather than adding to the load. As with make, each
+// job runs on the token that was taken for it, and only extra parallelism
+// within it needs more.
+class JobServer {
+public:
+  // Creates a pool of `tokens` tokens.
+  //
+  // Throws an `ExitException` if the pipe cannot be created.
+  explicit JobServer(size_t tokens);
+  ~JobServer();
+
+  JobServer(const JobServer&) = delete;
+  JobServer& operator=(const JobServer&) = delete;
+
+  // Takes a token without blocking. Returns false if there are none free.
+  bool acquire();
+
+  // Returns a token taken by `acquire`.
+  void release();
+
+  // A descriptor that becomes readable when tokens are free, for waiting on
+  // them in an event loop.
+  int fd() const { return nonblocking_fd_; }
+
+  // The value for MAKEFLAGS that points jobs at the pool.
+  std::string makeflags() const;
+
+  size_t capacity() const { return capacity_; }
+  // The number of tokens that the daemon itself holds.
+  size_t held() const { return held_; }
+
+private:
+  // The two ends of the pipe. These are inherited by jobs, so they must stay
+  // blocking: older versions of make do not expect to see EAGAIN.
+  int read_fd_;
+  int write_fd_;
+  // A second, non-blocking, open file description for the read end of the
+  // pipe, which only the daemon uses.
+  int nonblocking_fd_;
+  size_t capacity_;
+  size_t held_ = 0;
+};
+
+} // namespace unixbuild
+
+#endif
@@ -0,0 +1,68 @@
+#ifndef UNIXBUILD_LAUNCHER_H_
+#define UNIXBUILD_LAUNCHER_H_
+
+#include <spawn.h>
+#include <string>
+#include <sys/types.h>
+#include <unistd.h>
+#include <vector>
+
+namespace unixbuild {
+
+struct LaunchOptions {
+  // The directory to run the process in, or empty for the current directory.
+  std::string dir;
+  // The umask that the process runs with.
+  mode_t umask = 022;
+  // Where the process's standard output and standard error go, unless
+  // `capture_output` is set.
+  int stdout_fd = STDOUT_FILENO;
+  int stderr_fd = STDERR_FILENO;
+  // If true, the process's standard output and standard error both go to a new
+  // pipe instead, whose read end is returned to the caller.
+  bool capture_output = false;
+};
+
+struct LaunchedProcess {
+  pid_t pid;
+  // The read end of the output pipe, if `capture_output` was set, or -1. The
+  // caller owns it. It is close-on-exec but blocking.
+  int output_fd = -1;
+};
+
+// Starts processes with `posix_spawn` rather than `fork` and `exec`.
+//
+// `fork` copies the page tables of the calling process, so its cost grows with
+// the daemon's memory, which holds every parsed build file, graph, and cache.
+// `posix_spawn` runs the child in the parent's address space until it calls
+// `exec` (glibc uses `clone` with `CLONE_VM | CLONE_VFORK`), so it costs the
+// same however large the daemon gets. `bench_spawn` measures the difference.
+//
+// The child's signal mask and SIGPIPE disposition, which the daemon changes
+// for itself, are reset in attributes that are prepared once and reused.
+//
+// Not thread-safe: `launch` briefly changes the calling process's umask, since
+// that is the only way to pass one to a spawned process.
+class Launcher {
+public:
+  Launcher();
+  ~Launcher();
+
+  Launcher(const Launcher&) = delete;
+  Launcher& operator=(const Launcher&) = delete;
+
+  // Starts `args[0]`, searched for in PATH, with arguments `args` and the
+  // current environment.
+  //
+  // Throws an `ExitException` if the process cannot be started, including if
+  // the program does not exist.
+  LaunchedProcess launch(const std::vector<std::string>& args,
+                         const LaunchOptions& options);
+
+private:
+  posix_spawnattr_t attr_;
+};
+
+} // namespace unixbuild
+
+#endif
@@ -0,0 +1,65 @@
+#ifndef UNIXBUILD_PATHS_H_
+#define UNIXBUILD_PATHS_H_
+
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace unixbuild {
+
+// Maps each distinct path to a dense 32-bit ID, in the order in which paths are
+// first seen.
+//
+// Every path is stored exactly once, in a single character arena, so a header
+// that a thousand rules depend on costs a few bytes per rule for its ID rather
+// than a heap-allocated string per rule. Comparing two paths is then an
+// integer comparison, and per-path state can be kept in plain arrays indexed by
+// ID instead of in hash tables keyed by string.
+class PathTable {
+public:
+  // Returns the ID of `path`, adding it to the table if it is not already
+  // there.
+  uint32_t intern(std::string_view path);
+
+  // Returns the ID of `path`, if it is in the table.
+  std::optional<uint32_t> find(std::string_view path) const;
+
+  // Returns the path with the given ID. The view is only valid until the next
+  // call to `intern`.
+  std::string_view path(uint32_t id) const {
+    return std::string_view(arena_.data() + offsets_[id],
+                            offsets_[id + 1] - offsets_[id]);
+  }
+
+  size_t size() const { return offsets_.size() - 1; }
+
+  // The approximate number of bytes of memory that the table uses.
+  size_t memory_usage() const;
+
+private:
+  static constexpr uint32_t EMPTY_SLOT = UINT32_MAX;
+
+  // Each slot keeps part of its path's hash next to the ID, so that probing
+  // past a non-matching slot almost never has to look at the arena.
+  struct Slot {
+    uint32_t id;
+    uint32_t hash;
+  };
+
+  size_t find_slot(std::string_view path, size_t hash) const;
+  void grow();
+
+  // The characters of every path, back to back. Path `id` occupies
+  // [offsets_[id], offsets_[id + 1]).
+  std::string arena_;
+  std::vector<uint32_t> offsets_ = {0};
+  // An open-addressing hash table of IDs. It stores IDs rather than string
+  // views so that it stays valid when `arena_` reallocates.
+  std::vector<Slot> slots_;
+};
+
+} // namespace unixbuild
+
+#endif
@@ -0,0 +1,218 @@
+#ifndef UNIXBUILD_PROTOCOL_H_
+#define UNIXBUILD_PROTOCOL_H_
+
+#include <cstdint>
+#include <optional>
+#include <sys/types.h>
+#include <string>
+#include <vector>
+
+#include "unixbuild/common.h"
+
+// The client and the daemon communicate over a Unix-domain stream socket.
+//
+// Every message is a fixed-size header followed by a payload:
+//
+//   uint32  payload length in bytes
+//   uint16  message type
+//   uint16  protocol version
+//
+// Integers are sent in host byte order, since both ends of a Unix-domain socket
+// are by definition on the same machine. Payloads are a sequence of fields,
+// each either a 32-bit integer or a string encoded as a 32-bit length followed
+// by that many bytes. A connection carries exactly one request and one
+// response.
+//
+// A message may also carry open file descriptors, passed as SCM_RIGHTS
+// ancillary data alongside its first byte. The client uses this to hand the
+// daemon its standard output and standard error, so that the commands the
+// daemon runs write to the user's terminal even though the daemon itself has
+// none.
+
+namespace unixbuild {
+
+constexpr uint16_t PROTOCOL_VERSION = 6;
+
+// Payloads larger than this are rejected rather than allocated, so that a
+// corrupted header cannot make the reader try to allocate gigabytes.
+constexpr uint32_t MAX_PAYLOAD_SIZE = 64 * 1024 * 1024;
+
+// The most file descriptors that can be attached to a single message.
+constexpr size_t MAX_MESSAGE_FDS = 4;
+
+enum class MessageType : uint16_t {
+  BUILD_REQUEST = 1,
+  BUILD_RESPONSE = 2,
+  SHUTDOWN_REQUEST = 3,
+  SHUTDOWN_RESPONSE = 4,
+  // The response's payload is the daemon's statistics, as text.
+  STATS_REQUEST = 5,
+  STATS_RESPONSE = 6,
+};
+
+class ProtocolException : public ExitException {
+public:
+  explicit ProtocolException(std::string message)
+      : ExitException(std::string("protocol error: ").append(message), 3) {}
+};
+
+struct Message {
+  MessageType type;
+  std::string payload;
+  // File descriptors passed along with the message. The recipient owns them
+  // and is responsible for closing them.
+  std::vector<int> fds;
+};
+
+// Accumulates the fields of a payload.
+class PayloadWriter {
+public:
+  void write_u32(uint32_t x);
+  void write_string(const std::string& s);
+
+  const std::string& payload() const { return buffer_; }
+
+private:
+  std::string buffer_;
+};
+
+// Reads back the fields written by `PayloadWriter`, in the same order.
+//
+// Throws a `ProtocolException` if the payload is too short.
+class PayloadReader {
+public:
+  explicit PayloadReader(const std::string& payload) : payload_(payload) {}
+
+  uint32_t read_u32();
+  std::string read_string();
+
+private:
+  const std::string& payload_;
+  size_t pos_ = 0;
+};
+
+struct BuildRequest {
+  // These paths are absolute, since the daemon does not share the client's
+  // working directory.
+  std::string build_path;
+  std::string output_path;
+  // Empty means the first target in the build file.
+  std::string target;
+  // The maximum number of commands to run at once.
+  uint32_t jobs;
+  // The client's umask, which the daemon applies to the files it creates on
+  // the client's behalf, since its own umask is 0.
+  uint32_t umask;
+  // Whether to decide what to rebuild by comparing the contents of files
+  // rather than their modification times.
+  bool content_hash = false;
+  // The directory of the action cache, or empty to not use one, and the size
+  // that it is allowed to grow to.
+  std::string cache_dir;
+  uint32_t cache_size_mb = 0;
+  // Where to write a trace of the build, or empty to not record one.
+  std::string trace_path;
+};
+
+struct BuildResponse {
+  uint32_t returncode;
+  std::string message;
+};
+
+std::string encode_build_request(const BuildRequest& request);
+BuildRequest decode_build_request(const std::string& payload);
+std::string encode_build_response(const BuildResponse& response);
+BuildResponse decode_build_response(const std::string& payload);
+
+// Writes a framed message to `fd`, retrying on short writes, and passes the
+// file descriptors in `fds` along with it.
+void send_message(int fd, MessageType type, const std::string& payload,
+                  const std::vector<int>& fds = {});
+
+// Reads one framed message from `fd`, which must be blocking. Returns an
+// empty optional if the peer closed the connection cleanly before sending
+// anything.
+std::optional<Message> recv_message(int fd);
+
+// Reads one framed message in pieces, as they arrive, so that the daemon can
+// wait for the rest of a request in its event loop instead of blocking on it.
+class MessageReader {
+public:
+  MessageReader() = default;
+  // Closes any file descriptors that were received but never taken.
+  ~MessageReader();
+
+  MessageReader(const MessageReader&) = delete;
+  MessageReader& operator=(const MessageReader&) = delete;
+
+  // Reads as much of the message from `fd` as it can without blocking, if
+  // `fd` is non-blocking, or all of it otherwise. Returns true once the
+  // message is complete, or the peer closed the connection before sending
+  // anything, after which `take` returns the result.
+  //
+  // Throws a `ProtocolException` if the message is malformed or the
+  // connection is closed partway through it.
+  bool read_some(int fd);
+
+  // Returns the message that was read, or an empty optional if the peer sent
+  // nothing. The caller becomes responsible for the message's descriptors.
+  std::optional<Message> take();
+
+private:
+  // The header, and then as much of the payload as has arrived.
+  std::string buffer_;
+  // How many bytes `buffer_` has to hold before the message is complete,
+  // which is known once the header has arrived.
+  size_t expected_ = 0;
+  bool closed_ = false;
+  Message message_;
+};
+
+// Returns the directory that holds the daemon's socket:
+// `$XDG_RUNTIME_DIR/unixbuild`, or `/tmp/unixbuild-<uid>` if that variable is
+// not set, creating it if necessary. Other users must not be able to put
+// their own socket where the client will look for ours, so the directory must
+// be a real directory, owned by us, that no one else can write to.
+//
+// Throws an `ExitException` if the directory cannot be created or is not safe
+// to use.
+std::string runtime_directory();
+
+// Returns the path of the daemon's socket. There is one daemon per user.
+std::string socket_path();
+
+// Returns the path of the lock file that the daemon holds for as long as it
+// runs. It is in the runtime directory along with the socket, so that another
+// user cannot create and hold it to stop our daemon from starting.
+std::string lock_path();
+
+// Takes an exclusive lock on the file at `path`, creating it if necessary, and
+// returns a descriptor that holds the lock until it is closed. The kernel drops
+// the lock when its holder exits, however it exits, so a crashed daemon never
+// leaves a stale lock behind.
+//
+// Returns -1 if another process holds the lock, i.e. another daemon is
+// already running. Throws an `ExitException` if the file cannot be opened.
+int acquire_lock(const std::string& path);
+
+// Returns the user ID of the process at the other end of the Unix-domain
+// socket `fd`, or -1 if it cannot be found out.
+uid_t peer_uid(int fd);
+
+// Connects to the daemon listening at `path`. Returns -1 if nothing is
+// listening there.
+//
+// Throws an `ExitException` if the process listening there belongs to
+// another user, so that we never hand it our standard output and error.
+int connect_to_server(const std::string& path);
+
+// Creates a non-blocking socket bound to `path`, which only our own user can
+// connect to, and starts listening on it. Any stale socket file left behind by
+// a daemon that did not shut down cleanly is removed first.
+//
+// Returns -1 if another daemon is already listening at `path`.
+int listen_on(const std::string& path);
+
+} // namespace unixbuild
+
+#endif
@@ -0,0 +1,31 @@
+#ifndef UNIXBUILD_SCAN_H_
+#define UNIXBUILD_SCAN_H_
+
+#include <cstddef>
+#include <cstdint>
+
+namespace unixbuild {
+
+// The number of bytes that a `ScanFunction` looks at in one call.
+constexpr size_t SCAN_BLOCK_SIZE = 64;
+
+// The instruction sets that build files can be scanned with, in order of
+// preference. SSE2 is part of x86-64, so only other architectures fall back
+// to the scalar loop.
+enum class SimdLevel { SCALAR, SSE2, AVX2 };
+
+// Returns a bitmask of which of the `SCAN_BLOCK_SIZE` bytes at `p` are one of
+// the characters that give a build file its structure: a newline, a colon or
+// a space. Bit `i` stands for byte `p[i]`.
+using ScanFunction = uint64_t (*)(const char* p);
+
+// Returns the best level that this CPU supports.
+SimdLevel detect_simd_level();
+
+// Returns the scanner for `level`, or for the best level that this CPU
+// supports if `level` is higher than that.
+ScanFunction scan_function(SimdLevel level);
+
+} // namespace unixbuild
+
+#endif
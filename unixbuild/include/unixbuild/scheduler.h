@@ -0,0 +1,204 @@
+#ifndef UNIXBUILD_SCHEDULER_H_
+#define UNIXBUILD_SCHEDULER_H_
+
+#include <memory>
+#include <queue>
+#include <string>
+#include <sys/types.h>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+
+#include "unixbuild/action_cache.h"
+#include "unixbuild/depfile.h"
+#include "unixbuild/event_loop.h"
+#include "unixbuild/graph.h"
+#include "unixbuild/job_output.h"
+#include "unixbuild/launcher.h"
+#include "unixbuild/trace.h"
+
+namespace unixbuild {
+
+struct BuildOptions {
+  // Commands are run from this directory, which should be the directory that
+  // contains the build file.
+  std::string build_dir;
+  std::string output_dir;
+  // The maximum number of commands to run at once.
+  size_t jobs = 1;
+  // The umask that commands are run with.
+  mode_t umask = 022;
+  // Where commands' standard output and standard error go. Each command is
+  // also echoed to `stdout_fd` before it runs.
+  int stdout_fd = STDOUT_FILENO;
+  int stderr_fd = STDERR_FILENO;
+  // If set, each command's standard output and standard error are instead
+  // collected from a pipe that this event loop watches, and written to
+  // `stdout_fd` together with the command once it has finished, so that the
+  // output of jobs that run at the same time is never interleaved.
+  EventLoop* event_loop = nullptr;
+  // If set, what would be written to `stdout_fd`, i.e. collected output and
+  // notes about outputs restored from the action cache, is passed to this
+  // instead, so that a client that is slow to read it does not block.
+  ClientOutput* client_output = nullptr;
+  // How much of each command's collected output is kept in memory before it
+  // is spilled to a temporary file.
+  size_t output_memory_limit = DEFAULT_OUTPUT_MEMORY_LIMIT;
+  // If set, outputs are restored from this cache instead of being rebuilt
+  // whenever possible, and newly built outputs are added to it.
+  ActionCache* action_cache = nullptr;
+  // If set, updated with the contents of each depfile that a job writes.
+  DiscoveredDeps* discovered = nullptr;
+  // If set, every job, and every output restored from the action cache, is
+  // recorded here, in the lane of the job slot that it used.
+  TraceRecorder* trace = nullptr;
+  // How long each node's job is expected to take, in seconds, indexed by
+  // node, e.g. from how long it took last time. Nodes without an estimate,
+  // which are those past the end or at zero, are assumed to take as long as
+  // the average of those with one.
+  std::vector<double> durations;
+};
+
+struct BuildStats {
+  size_t jobs_run = 0;
+  // Time from the first job starting to the last job finishing.
+  double wall_seconds = 0.0;
+  // The sum of the durations of every job. Divided by `wall_seconds`, this is
+  // the average number of jobs that were running at once.
+  double job_seconds = 0.0;
+  // Outputs restored from the action cache, and outputs that were looked up
+  // in it but had to be built.
+  size_t cache_hits = 0;
+  size_t cache_misses = 0;
+};
+
+// One node on a build's critical path.
+struct CriticalPathStep {
+  size_t node;
+  // How long the node took to build, or to restore from the action cache.
+  double seconds;
+};
+
+// Runs the commands for a set of nodes in a build graph, up to `jobs` at a
+// time, starting each as soon as everything it depends on has finished.
+//
+// When more nodes are ready than there are free job slots, the node with the
+// longest chain of work remaining after it goes first, since that chain sets a
+// lower bound on how long the whole build can take. A chain's length is the
+// sum of its jobs' expected durations, so that e.g. a slow link at the end of
+// a chain is started as early as possible.
+//
+// A scheduler can be driven by `run`, or by an external event loop that calls
+// `start_jobs`, or `can_start` and `start_job`, and `finish_job` itself.
+class Scheduler {
+public:
+  // `nodes` must be in dependency order, as returned by
+  // `BuildGraph::closure`. Dependencies on nodes outside of `nodes` are assumed
+  // to be up to date.
+  Scheduler(const BuildGraph& graph, const std::vector<size_t>& nodes,
+            BuildOptions options);
+  // Stops watching the output of any jobs that are still running. The jobs
+  // themselves are left to finish, and whatever else they print is lost.
+  ~Scheduler();
+
+  // Launches ready jobs until every job slot is full or nothing is ready.
+  void start_jobs();
+
+  // Returns true if a job is ready and there is a free job slot for it.
+  bool can_start() const;
+
+  // Launches the highest-priority ready job, which `can_start` must have
+  // confirmed exists. Returns the pid of the process that was started, or 0
+  // if the job's output was restored from the action cache instead.
+  pid_t start_job();
+
+  // Records that child process `pid` exited with `status`, as returned by
+  // `waitpid`. Returns false if `pid` is not one of this scheduler's jobs.
+  bool finish_job(pid_t pid, int status);
+
+  // Returns true once there is nothing running and nothing more will start.
+  bool finished() const;
+
+  // Runs the build to completion, reaping jobs as SIGCHLD arrives.
+  void run();
+
+  bool failed() const { return !failure_.empty(); }
+  // A description of the first job that failed, if any.
+  const std::string& failure() const { return failure_; }
+  const BuildStats& stats() const { return stats_; }
+  // How long each node's job took, in seconds, indexed by node. Negative for
+  // nodes that did not run a job, or whose job failed.
+  const std::vector<double>& job_durations() const { return job_durations_; }
+  // The chain of nodes that the end of the build waited on, in the order they
+  // were built: the node that finished last, preceded by whichever of its
+  // dependencies finished last, and so on. Making these faster, or splitting
+  // them up, is what would make the build finish sooner.
+  std::vector<CriticalPathStep> critical_path() const;
+  // The number of jobs that are waiting for a free slot, and running.
+  size_t ready_jobs() const { return ready_.size(); }
+  size_t running_jobs() const { return running_.size(); }
+
+private:
+  struct RunningJob {
+    size_t node;
+    double start;
+    // Which of the `jobs` slots the job is using. Only used for tracing.
+    size_t slot;
+    // The job's action cache key, or empty if there is no cache.
+    std::string cache_key;
+    // The echoed command line and what the job has printed so far, if its
+    // output is being collected.
+    std::string command;
+    std::unique_ptr<JobOutput> output;
+  };
+
+  // Orders the ready queue by priority, and then by position in the build file
+  // so that the order is deterministic.
+  struct ReadyOrder {
+    const std::vector<double>* priority;
+    bool operator()(size_t a, size_t b) const {
+      if ((*priority)[a] != (*priority)[b]) {
+        return (*priority)[a] < (*priority)[b];
+      }
+      return a > b;
+    }
+  };
+
+  // Starts the job for `node`, or restores its output from the cache. Returns
+  // the pid of the job's process, or 0 if there is none.
+  pid_t spawn(size_t node);
+  // Makes the dependents of `node`, which was built from `start` until now,
+  // ready if they are not waiting on anything else.
+  void complete(size_t node, double start);
+  // Records a job in the trace, if there is one.
+  void trace_job(size_t node, size_t slot, const char* category, double start,
+                 double end);
+
+  const BuildGraph& graph_;
+  BuildOptions options_;
+  Launcher launcher_;
+
+  // Per-node state, indexed by node. Nodes that are not part of this build
+  // are left at their defaults.
+  std::vector<bool> in_build_;
+  std::vector<size_t> pending_deps_;
+  std::vector<std::vector<size_t>> dependents_;
+  std::vector<double> priority_;
+  // When each node started and finished building, or -1.
+  std::vector<double> started_at_;
+  std::vector<double> finished_at_;
+  std::vector<double> job_durations_;
+
+  std::priority_queue<size_t, std::vector<size_t>, ReadyOrder> ready_;
+  std::unordered_map<pid_t, RunningJob> running_;
+  // Which job slots are in use.
+  std::vector<bool> busy_slots_;
+
+  std::string failure_;
+  BuildStats stats_;
+  double start_time_ = -1.0;
+};
+
+} // namespace unixbuild
+
+#endif
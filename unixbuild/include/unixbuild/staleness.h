@@ -0,0 +1,172 @@
+#ifndef UNIXBUILD_STALENESS_H_
+#define UNIXBUILD_STALENESS_H_
+
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "unixbuild/build_log.h"
+#include "unixbuild/common.h"
+#include "unixbuild/depfile.h"
+#include "unixbuild/graph.h"
+#include "unixbuild/hashing.h"
+#include "unixbuild/thread_pool.h"
+#include "unixbuild/watcher.h"
+
+namespace unixbuild {
+
+// A table of file stamps, owned by the daemon, that guarantees each path is
+// stat'd at most once per build no matter how many rules depend on it.
+//
+// Entries outlive the build that created them, but by default are only trusted
+// within that build: the first lookup of a path in a new build stats it again.
+// If the cache is given a `FileWatcher`, then entries for files in watched
+// directories are trusted until the watcher reports a change, so that a no-op
+// build does not need to stat anything at all.
+class StatCache {
+public:
+  // Keeps entries valid across builds using `watcher`, which must outlive the
+  // cache.
+  void set_watcher(FileWatcher* watcher) { watcher_ = watcher; }
+
+  // Invalidates the entries for any files that the watcher has seen change
+  // since the last call.
+  void process_events();
+
+  // Starts a new build, so that every path will be stat'd afresh the next time
+  // it is looked up.
+  void begin_build() { generation_++; }
+
+  // Returns the stamp of the file at the absolute path `path`, or an empty
+  // optional if it does not exist.
+  std::optional<FileStamp> stamp(const std::string& path);
+
+  // Stats those of `paths` that `stamp` would have to, on `pool`'s threads,
+  // so that `stamp` finds them already in the cache. Paths that cannot be
+  // stat'd are left for `stamp` to report.
+  void prefetch(const std::vector<std::string>& paths, ThreadPool& pool);
+
+  // Forgets what we know about `path`, e.g. because we just rebuilt it.
+  void invalidate(const std::string& path);
+
+  // Forgets everything, e.g. because file change notifications were lost.
+  void invalidate_all() { entries_.clear(); }
+
+  // The number of `stat` calls made, for confirming that paths are not being
+  // stat'd more than once.
+  size_t stat_calls() const { return stat_calls_; }
+  size_t size() const { return entries_.size(); }
+
+private:
+  struct Entry {
+    uint64_t generation;
+    // Whether the file's directory was being watched when it was stat'd, and
+    // the file is not a symlink.
+    bool watched;
+    std::optional<FileStamp> stamp;
+  };
+
+  std::unordered_map<std::string, Entry> entries_;
+  FileWatcher* watcher_ = nullptr;
+  uint64_t generation_ = 0;
+  size_t stat_calls_ = 0;
+};
+
+// Returns the absolute path of the dependency with path ID `dep`, for a build
+// file in `build_dir`, taking into account that outputs of rules live in
+// `output_dir`.
+std::string resolve_dep(const BuildGraph& graph, uint32_t dep,
+                        const std::string& build_dir,
+                        const std::string& output_dir);
+
+// Optional state that refines `find_stale`'s decisions beyond comparing the
+// modification times of the dependencies listed in the build file.
+struct StalenessChecks {
+  // If given, the dependencies that GCC reported in each output's depfile
+  // count as well as those listed in the build file.
+  DiscoveredDeps* discovered = nullptr;
+  // If given, what was recorded about each output when it was last built.
+  BuildLog* log = nullptr;
+  // Outputs, by absolute path, whose commands are known to match the log.
+  // With a log, an output whose command has changed since its entry was
+  // written is stale; deducing every command is not free, though, so the
+  // outputs listed here are not checked.
+  const std::unordered_set<std::string>* commands_checked = nullptr;
+  // If given, along with `log`, then staleness is decided by comparing file
+  // contents rather than modification times.
+  ContentHashCache* hashes = nullptr;
+  // If given, depfiles are read, and files stat'd and hashed, on its threads
+  // before the single-threaded pass that uses them, which then finds them all
+  // in the caches. The results are the same either way.
+  ThreadPool* pool = nullptr;
+};
+
+// Returns a hash of the command that builds `node`.
+uint64_t command_hash(const BuildGraph& graph, size_t node,
+                      const std::string& output_dir);
+
+// Returns a hash of the paths and contents of the dependencies of `node`,
+// including those in `discovered`, if given.
+//
+// Throws an `ExitException` if a dependency is missing.
+uint64_t hash_inputs(const BuildGraph& graph, size_t node,
+                     const std::string& build_dir,
+                     const std::string& output_dir, StatCache& stat_cache,
+                     ContentHashCache& hashes, DiscoveredDeps* discovered);
+
+// Returns the subset of `nodes` that must be rebuilt, in the same order.
+//
+// A node is stale if its output does not exist, if any of its dependencies is
+// newer than its output, or if any node it depends on is stale. `nodes` must
+// be in dependency order, as returned by `BuildGraph::closure`, so that
+// staleness can be propagated in a single pass.
+//
+// If `checks.discovered` is given, the dependencies that GCC reported in each
+// output's depfile count as well. A missing discovered dependency is not an
+// error, since the source may simply no longer include it, but the node is
+// rebuilt to find out.
+//
+// If `checks.log` is given, a node whose output has a valid log entry is stale
+// if its command differs from the logged one.
+//
+// If `checks.hashes` is given, then a node whose output has a valid log entry
+// with an inputs hash is only stale if the hash of its inputs differs from the
+// logged one, so that a file that was touched or checked out again without
+// changing does not cause a rebuild. Nodes without one fall back to comparing
+// modification times.
+//
+// Throws an `ExitException` if a dependency that no rule produces is missing.
+std::vector<size_t> find_stale(const BuildGraph& graph,
+                               const std::vector<size_t>& nodes,
+                               const std::string& build_dir,
+                               const std::string& output_dir,
+                               StatCache& stat_cache,
+                               const StalenessChecks& checks = {});
+
+// Writes log entries for the outputs of `nodes`, which must all be up to date,
+// to `checks.log`, for the next call to `find_stale`. Outputs that already
+// have a valid entry are skipped, unless it lacks an inputs hash and
+// `checks.hashes` is given.
+//
+// `durations`, if given, holds how long each node's job took, in seconds,
+// indexed by node, as returned by `Scheduler::job_durations`. Outputs that
+// were not built by a job keep the duration from their old entry.
+void record_builds(const BuildGraph& graph, const std::vector<size_t>& nodes,
+                   const std::string& build_dir, const std::string& output_dir,
+                   StatCache& stat_cache, const StalenessChecks& checks,
+                   const std::vector<double>& durations = {});
+
+// Returns how long the job for each of `nodes` took the last time it ran,
+// according to `log`, in seconds, indexed by node, for
+// `BuildOptions::durations`. Nodes with no recorded duration are left at 0.
+std::vector<double> logged_durations(const BuildGraph& graph,
+                                     const std::vector<size_t>& nodes,
+                                     const std::string& output_dir,
+                                     const BuildLog& log);
+
+} // namespace unixbuild
+
+#endif
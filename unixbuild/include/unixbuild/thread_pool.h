@@ -0,0 +1,105 @@
+#ifndef UNIXBUILD_THREAD_POOL_H_
+#define UNIXBUILD_THREAD_POOL_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace unixbuild {
+
+// A fixed set of threads for the daemon's CPU- and syscall-bound work, like
+// stat'ing and hashing thousands of files, which the event loop would
+// otherwise do one at a time.
+//
+// Work is shared out by stealing: each thread has its own deque of tasks,
+// pushes the tasks it creates onto the back and takes its next one from there
+// too, and only when its own deque is empty does it take from the front of
+// someone else's. `parallel_for` splits its range in half, again and again,
+// pushing one half each time, so a thief takes the largest piece of work
+// that is left, and threads rarely contend for the same deque.
+//
+// The thread that calls `parallel_for` works on the range too, rather than
+// waiting, so a pool of one thread starts no threads and runs everything on
+// the caller, in order.
+class ThreadPool {
+public:
+  // Starts a pool of `threads` threads, counting the caller, or one per CPU
+  // if `threads` is 0. The threads block every signal, so that they are
+  // delivered to the daemon's `signalfd` instead.
+  explicit ThreadPool(size_t threads = 0);
+  // Waits for the threads to exit. No `parallel_for` may be running.
+  ~ThreadPool();
+
+  ThreadPool(const ThreadPool&) = delete;
+  ThreadPool& operator=(const ThreadPool&) = delete;
+
+  // Calls `f(i)` for every `i` from 0 to `n`, spread across the pool, and
+  // returns once every call has returned. Indices are handed out in runs of
+  // at least `grain`, so that tiny tasks are not swamped by the cost of
+  // scheduling them.
+  //
+  // If any call throws, the rest still run, and then the exception thrown for
+  // the lowest index is rethrown, so that errors do not depend on timing.
+  //
+  // `f` may itself call `parallel_for`.
+  void parallel_for(size_t n, const std::function<void(size_t)>& f,
+                    size_t grain = 1);
+
+  // The number of threads, counting the caller.
+  size_t size() const { return deques_.size(); }
+
+private:
+  using Task = std::function<void()>;
+  struct Job;
+
+  struct Deque {
+    std::mutex mutex;
+    std::deque<Task> tasks;
+  };
+
+  // Calls `job.f` for the indices from `begin` to `end`, first pushing all but
+  // the first `job.grain` of them as smaller ranges for other threads to
+  // steal.
+  void run_range(Job& job, size_t begin, size_t end);
+  // Runs one task, from the back of deque `self` or the front of another.
+  // Returns false if every deque is empty.
+  bool run_one(size_t self);
+  void push(size_t self, Task task);
+  void work(size_t self);
+  // The deque of the calling thread: its own for a pool thread, or the last
+  // one for any other thread.
+  size_t current_deque() const;
+
+  std::vector<std::unique_ptr<Deque>> deques_;
+  std::vector<std::thread> threads_;
+  // Tasks pushed but not yet taken, so that idle threads know when to wake.
+  std::atomic<size_t> queued_{0};
+  std::mutex sleep_mutex_;
+  std::condition_variable wake_;
+  bool stopping_ = false;
+};
+
+// Calls `f(i)` for every `i` from 0 to `n`, on `pool` if there is one and in
+// order on this thread if not.
+inline void for_each_index(ThreadPool* pool, size_t n,
+                           const std::function<void(size_t)>& f,
+                           size_t grain = 1) {
+  if (pool != nullptr) {
+    pool->parallel_for(n, f, grain);
+  } else {
+    for (size_t i = 0; i < n; i++) {
+      f(i);
+    }
+  }
+}
+
+} // namespace unixbuild
+
+#endif
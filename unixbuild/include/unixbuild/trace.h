@@ -0,0 +1,65 @@
+#ifndef UNIXBUILD_TRACE_H_
+#define UNIXBUILD_TRACE_H_
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "unixbuild/graph.h"
+
+namespace unixbuild {
+
+// One span of time in a trace.
+//
+// Every field is a number or a pointer to a string literal, so recording an
+// event never allocates.
+struct TraceEvent {
+  // For a phase of the daemon's work, its name; for a job, null, since jobs
+  // are named after the output of `node` when the trace is written.
+  const char* name = nullptr;
+  // "daemon", "job", "cache", or "failed".
+  const char* category = nullptr;
+  uint32_t node = 0;
+  // The row of the trace that the event is drawn in: 0 for the daemon, and
+  // 1 + the job slot for jobs.
+  uint32_t lane = 0;
+  // As returned by `monotonic_seconds`.
+  double start = 0.0;
+  double end = 0.0;
+};
+
+// Records where the time in one build goes, for viewing in chrome://tracing
+// or Perfetto.
+//
+// Events go into a ring buffer that is allocated up front, so recording is
+// cheap enough to leave on for a whole build. If more than `capacity` events
+// are recorded, the oldest are overwritten.
+class TraceRecorder {
+public:
+  explicit TraceRecorder(size_t capacity);
+
+  void record(const TraceEvent& event);
+
+  // Records a phase of the daemon's work on a build. `name` must be a string
+  // literal.
+  void record_phase(const char* name, double start, double end);
+
+  // Returns the events, oldest first, as a JSON document in the Chrome
+  // trace-event format. Jobs are named after their outputs in `graph`.
+  std::string to_json(const BuildGraph& graph) const;
+
+  // The number of events in the buffer, and the number that were overwritten.
+  size_t size() const { return size_; }
+  size_t dropped() const { return dropped_; }
+
+private:
+  std::vector<TraceEvent> events_;
+  // Where the next event goes.
+  size_t next_ = 0;
+  size_t size_ = 0;
+  size_t dropped_ = 0;
+};
+
+} // namespace unixbuild
+
+#endif
@@ -0,0 +1,63 @@
+#ifndef UNIXBUILD_WATCHER_H_
+#define UNIXBUILD_WATCHER_H_
+
+#include <functional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace unixbuild {
+
+// Watches directories for changes to the files in them, using Linux's inotify
+// interface (see filewatch/filewatch.c in this repository for a minimal
+// example).
+//
+// inotify can watch individual files, but the daemon watches their parent
+// directories instead: one watch then covers every file in the directory, and
+// it also sees files being created, deleted, or replaced by a rename, which a
+// watch on the file itself would not survive.
+class FileWatcher {
+public:
+  // Throws an `ExitException` if inotify is not available.
+  FileWatcher();
+  ~FileWatcher();
+
+  FileWatcher(const FileWatcher&) = delete;
+  FileWatcher& operator=(const FileWatcher&) = delete;
+
+  // The inotify file descriptor, which becomes readable when there are events
+  // to process. It is non-blocking.
+  int fd() const { return fd_; }
+
+  // Starts watching the directory `dir`, if it is not already being watched.
+  // Returns false if it cannot be watched, e.g. because the per-user limit on
+  // inotify watches has been reached.
+  bool watch_directory(const std::string& dir);
+
+  // Returns true if `dir` is being watched.
+  bool is_watched(const std::string& dir) const;
+
+  // Processes every pending event without blocking. `changed` is called with
+  // the path of each file that was modified, created, deleted or renamed.
+  // `lost` is called if the kernel's event queue overflowed or a watched
+  // directory went away, meaning that changes may have been missed.
+  void read_events(const std::function<void(const std::string&)>& changed,
+                   const std::function<void()>& lost);
+
+  size_t watch_count() const { return dirs_.size(); }
+  size_t events_processed() const { return events_processed_; }
+
+private:
+  int fd_;
+  std::unordered_map<std::string, int> wds_;
+  // The same directory may be reached by more than one path, e.g. through a
+  // symbolic link or a `..` component, and inotify gives every path to the
+  // same directory the same watch descriptor, so each one maps to a list of
+  // names.
+  std::unordered_map<int, std::vector<std::string>> dirs_;
+  size_t events_processed_ = 0;
+};
+
+} // namespace unixbuild
+
+#endif
@@ -1,7 +1,10 @@
 #include <cctype>
+#include <climits>
+#include <csignal>
 #include <cstdlib>
 #include <cstring>
 #include <fcntl.h>
+#include <sys/stat.h>
 #include <iostream>
 #include <optional>
 #include <string>
@@ -9,45 +12,89 @@
 #include <vector>
 
 #include "unixbuild/common.h"
+#include "unixbuild/protocol.h"
+
+// The action cache is evicted down to this size unless told otherwise.
+constexpr unsigned long DEFAULT_CACHE_SIZE_MB = 1024;
 
 struct CommandLine {
   std::string build_path;
   std::string target;
   std::string output_path;
+  // 0 means one job per online CPU.
+  unsigned long jobs = 0;
+  bool content_hash = false;
+  // Empty means no action cache.
+  std::string cache_dir;
+  unsigned long cache_size_mb = DEFAULT_CACHE_SIZE_MB;
+  // Empty means no trace.
+  std::string trace_path;
+  // Print the daemon's statistics instead of building anything.
+  bool stats = false;
 };
 
-struct Rule {
-  std::string output;
-  std::vector<std::string> deps;
-};
-
-struct BuildFile {
-  std::vector<Rule> rules;
-};
-
-BuildFile parse_build_file(const std::string& path);
-std::optional<Rule> parse_line(std::string& line, size_t lineno);
-
 CommandLine parse_args(int argc, char* argv[]);
 void print_help(void);
 void print_usage(void);
 
+int print_stats(void);
+int connect_or_spawn_server(void);
+void spawn_server(void);
+std::string make_absolute(const std::string& path);
+
 int main(int argc, char* argv[]) {
   try {
     CommandLine cmdline = parse_args(argc, argv);
-    BuildFile build_file = parse_build_file(cmdline.build_path);
-
-    pid_t pid;
-    if ((pid = fork()) < 0) {
-      throw unixbuild::ExitException(std::string("could not fork"), 1);
-    } else if (pid != 0) {
-      // parent
-      std::cout << "Spawned daemon process with PID " << pid << ". Now exiting."
-                << std::endl;
-    } else {
-      // child
-      execl("out/unixbuild-server", "unixbuild-server", NULL);
+    if (cmdline.stats) {
+      return print_stats();
+    }
+
+    unixbuild::BuildRequest request;
+    request.build_path =
+        unixbuild::canonicalize_path(cmdline.build_path.c_str());
+    request.output_path = make_absolute(cmdline.output_path);
+    request.target = cmdline.target;
+    request.jobs = cmdline.jobs;
+    request.content_hash = cmdline.content_hash;
+    if (!cmdline.cache_dir.empty()) {
+      request.cache_dir = make_absolute(cmdline.cache_dir);
+      request.cache_size_mb = cmdline.cache_size_mb;
+    }
+    if (!cmdline.trace_path.empty()) {
+      request.trace_path = make_absolute(cmdline.trace_path);
+    }
+    if (request.jobs == 0) {
+      long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+      request.jobs = ncpus > 0 ? ncpus : 1;
+    }
+    // There is no way to read the umask without also setting it.
+    mode_t mask = umask(0);
+    umask(mask);
+    request.umask = mask;
+
+    // If the daemon exits while we are talking to it, we want `write` to fail
+    // with EPIPE rather than have SIGPIPE silently kill us.
+    signal(SIGPIPE, SIG_IGN);
+
+    int fd = connect_or_spawn_server();
+    unixbuild::send_message(fd, unixbuild::MessageType::BUILD_REQUEST,
+                            unixbuild::encode_build_request(request),
+                            {STDOUT_FILENO, STDERR_FILENO});
+    std::optional<unixbuild::Message> reply = unixbuild::recv_message(fd);
+    close(fd);
+    if (!reply.has_value() ||
+        reply->type != unixbuild::MessageType::BUILD_RESPONSE) {
+      throw unixbuild::ProtocolException("no response from daemon");
     }
+
+    unixbuild::BuildResponse response =
+        unixbuild::decode_build_response(reply->payload);
+    if (response.returncode != 0) {
+      std::cerr << "error: " << response.message << std::endl;
+    } else if (!response.message.empty()) {
+      std::cout << response.message << std::endl;
+    }
+    return response.returncode;
   } catch (unixbuild::ExitException& e) {
     std::cerr << "error: " << e.message_ << std::endl;
     return e.returncode_;
@@ -55,47 +102,105 @@ int main(int argc, char* argv[]) {
   return 0;
 }
 
-BuildFile parse_build_file(const std::string& path) {
-  std::vector<std::string> lines = unixbuild::read_lines(path.c_str());
-  BuildFile build_file;
+// Asks the running daemon for its statistics and prints them. Unlike a build,
+// this does not start a daemon if none is running, since a new one would have
+// nothing to report.
+int print_stats() {
+  signal(SIGPIPE, SIG_IGN);
+  int fd = unixbuild::connect_to_server(unixbuild::socket_path());
+  if (fd < 0) {
+    std::cerr << "error: no daemon is running" << std::endl;
+    return 1;
+  }
 
-  size_t lineno = 1;
-  for (std::string& line : lines) {
-    std::optional<Rule> optional_rule = parse_line(line, lineno);
-    if (optional_rule.has_value()) {
-      build_file.rules.push_back(optional_rule.value());
-    }
-    lineno++;
+  unixbuild::send_message(fd, unixbuild::MessageType::STATS_REQUEST, "");
+  std::optional<unixbuild::Message> reply = unixbuild::recv_message(fd);
+  close(fd);
+  if (!reply.has_value() ||
+      reply->type != unixbuild::MessageType::STATS_RESPONSE) {
+    throw unixbuild::ProtocolException("no response from daemon");
+  }
+  std::cout << reply->payload;
+  return 0;
+}
+
+// How long to wait for a freshly spawned daemon to start listening.
+constexpr int SPAWN_TIMEOUT_MS = 5000;
+constexpr int SPAWN_POLL_INTERVAL_MS = 5;
+
+int connect_or_spawn_server() {
+  std::string path = unixbuild::socket_path();
+  int fd = unixbuild::connect_to_server(path);
+  if (fd >= 0) {
+    return fd;
   }
 
-  return build_file;
+  spawn_server();
+
+  // The daemon closes every inherited file descriptor as part of becoming a
+  // daemon, so there is no convenient way for it to tell us when it is ready.
+  // Instead we poll the socket until it starts accepting connections.
+  for (int waited = 0; waited < SPAWN_TIMEOUT_MS;
+       waited += SPAWN_POLL_INTERVAL_MS) {
+    usleep(SPAWN_POLL_INTERVAL_MS * 1000);
+    fd = unixbuild::connect_to_server(path);
+    if (fd >= 0) {
+      return fd;
+    }
+  }
+  throw unixbuild::ExitException("timed out waiting for daemon to start", 1);
 }
 
-std::optional<Rule> parse_line(std::string& line, size_t lineno) {
-  Rule rule;
-  unixbuild::trim_whitespace(line);
-  if (line.empty() or line[0] == '#') {
-    return {};
+void spawn_server() {
+  // The server binary is installed next to the client, so look it up relative
+  // to our own executable rather than to the working directory.
+  char exe[PATH_MAX];
+  ssize_t n = readlink("/proc/self/exe", exe, sizeof exe - 1);
+  if (n < 0) {
+    throw unixbuild::ExitException("could not locate unixbuild executable", 1);
   }
+  exe[n] = '\0';
+  std::string server_path(exe);
+  server_path.erase(server_path.rfind('/') + 1);
+  server_path.append("unixbuild-server");
 
-  auto colon_pos = line.find(':');
-  if (colon_pos == std::string::npos) {
-    throw unixbuild::ParseException(lineno, "no colon");
+  pid_t pid;
+  if ((pid = fork()) < 0) {
+    throw unixbuild::ExitException(std::string("could not fork"), 1);
+  } else if (pid == 0) {
+    // child
+    execl(server_path.c_str(), "unixbuild-server", NULL);
+    // `execl` only returns on failure. `_exit` is used instead of `exit` so
+    // that the child does not run the parent's atexit handlers or flush its
+    // copy of the parent's stdio buffers.
+    _exit(127);
   }
 
-  rule.output = line.substr(0, colon_pos);
-  unixbuild::trim_whitespace(rule.output);
-  unixbuild::split_string(line.substr(colon_pos + 1), rule.deps, ' ');
+  std::cerr << "Spawned daemon process with PID " << pid << "." << std::endl;
+}
 
-  if (rule.deps.size() == 0) {
-    throw unixbuild::ParseException(lineno, "no deps");
+std::string make_absolute(const std::string& path) {
+  if (!path.empty() && path[0] == '/') {
+    return path;
   }
 
-  return rule;
+  char cwd[PATH_MAX];
+  if (getcwd(cwd, sizeof cwd) == NULL) {
+    throw unixbuild::ExitException("could not get working directory", 1);
+  }
+  std::string r(cwd);
+  if (!path.empty()) {
+    r.append("/").append(path);
+  }
+  return r;
 }
 
 CommandLine parse_args(int argc, char* argv[]) {
   CommandLine cmdline;
+  const char* cache_dir = getenv("UNIXBUILD_CACHE");
+  if (cache_dir != NULL) {
+    cmdline.cache_dir = cache_dir;
+  }
 
   if (argc < 2) {
     puts("error: too few arguments\n");
@@ -120,6 +225,55 @@ CommandLine parse_args(int argc, char* argv[]) {
       } else {
         cmdline.output_path = arg;
       }
+    } else if (strcmp(arg, "-j") == 0 || strcmp(arg, "--jobs") == 0) {
+      argp++;
+      arg = *argp;
+      char* end;
+      if (arg != NULL) {
+        cmdline.jobs = strtoul(arg, &end, 10);
+      }
+      if (arg == NULL || *arg == '\0' || *end != '\0' || cmdline.jobs == 0) {
+        puts("error: expected positive integer argument to --jobs\n");
+        print_usage();
+        exit(1);
+      }
+    } else if (strcmp(arg, "--cache") == 0) {
+      argp++;
+      arg = *argp;
+      if (arg == NULL || *arg == '-') {
+        puts("error: expected argument to --cache\n");
+        print_usage();
+        exit(1);
+      } else {
+        cmdline.cache_dir = arg;
+      }
+    } else if (strcmp(arg, "--cache-size") == 0) {
+      argp++;
+      arg = *argp;
+      char* end;
+      if (arg != NULL) {
+        cmdline.cache_size_mb = strtoul(arg, &end, 10);
+      }
+      if (arg == NULL || *arg == '\0' || *end != '\0' ||
+          cmdline.cache_size_mb == 0 || cmdline.cache_size_mb > UINT32_MAX) {
+        puts("error: expected positive integer argument to --cache-size\n");
+        print_usage();
+        exit(1);
+      }
+    } else if (strcmp(arg, "--trace") == 0) {
+      argp++;
+      arg = *argp;
+      if (arg == NULL || *arg == '-') {
+        puts("error: expected argument to --trace\n");
+        print_usage();
+        exit(1);
+      } else {
+        cmdline.trace_path = arg;
+      }
+    } else if (strcmp(arg, "--stats") == 0) {
+      cmdline.stats = true;
+    } else if (strcmp(arg, "--hash") == 0) {
+      cmdline.content_hash = true;
     } else if (strcmp(arg, "--") == 0) {
       seen_arg_separator = true;
     } else if (!seen_arg_separator && *arg == '-') {
@@ -147,7 +301,10 @@ CommandLine parse_args(int argc, char* argv[]) {
   return cmdline;
 }
 
-void print_usage() { puts("usage: unixbuild <build file> <target>"); }
+void print_usage() {
+  puts("usage: unixbuild <build file> <target>\n"
+       "       unixbuild --stats");
+}
 
 void print_help() {
   print_usage();
@@ -158,5 +315,18 @@ void print_help() {
       "  <target>            Target to build. Defaults to first target listed\n"
       "                      in the build file.\n"
       "  --out <directory>   Directory in which to place output files.\n"
-      "                      Defaults to current directory.");
+      "                      Defaults to current directory.\n"
+      "  -j, --jobs <n>      Number of commands to run at once. Defaults to\n"
+      "                      the number of CPUs.\n"
+      "  --hash              Rebuild only if the contents of a dependency\n"
+      "                      have changed, not just its timestamp.\n"
+      "  --cache <directory> Restore outputs from, and save them to, the\n"
+      "                      action cache in this directory. Defaults to\n"
+      "                      $UNIXBUILD_CACHE, if set.\n"
+      "  --cache-size <mb>   Maximum size of the action cache. Defaults to\n"
+      "                      1024.\n"
+      "  --trace <file>      Write a trace of where the build's time went to\n"
+      "                      this file, for chrome://tracing or Perfetto.\n"
+      "  --stats             Print the running daemon's statistics, in the\n"
+      "                      Prometheus text format, instead of building.");
 }
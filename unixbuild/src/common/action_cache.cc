@@ -0,0 +1,372 @@
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <dirent.h>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <string_view>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "unixbuild/action_cache.h"
+
+namespace unixbuild {
+
+namespace {
+
+// When the cache goes over its limit, evict down to this fraction of it, so
+// that we are not scanning for victims after every single store.
+constexpr double EVICTION_TARGET = 0.9;
+
+// Stands in for the output directory in keys. It cannot start a path that
+// the build file names, and unlike '\0' it is not a separator.
+constexpr char OUTPUT_DIR_PLACEHOLDER = '\x01';
+
+bool older_than(const struct timespec& a, const struct timespec& b) {
+  return a.tv_sec < b.tv_sec || (a.tv_sec == b.tv_sec && a.tv_nsec < b.tv_nsec);
+}
+
+struct timespec now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return ts;
+}
+
+// Copies the file at `src` to a new file at `dst` with the same permissions,
+// sharing its blocks with a reflink if the file system supports it. Returns
+// false on failure, in which case `dst` does not exist.
+bool copy_file(const std::string& src, const std::string& dst) {
+  int in = open(src.c_str(), O_RDONLY | O_CLOEXEC);
+  if (in < 0) {
+    return false;
+  }
+  struct stat st;
+  if (fstat(in, &st) < 0) {
+    close(in);
+    return false;
+  }
+  int out = open(dst.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC,
+                 st.st_mode & 0777);
+  if (out < 0) {
+    close(in);
+    return false;
+  }
+
+  // FICLONE makes the copy share the source's blocks, on file systems such as
+  // Btrfs and XFS that support it. Everywhere else it fails immediately and we
+  // copy the bytes ourselves.
+  bool ok = ioctl(out, FICLONE, in) == 0;
+  if (!ok) {
+    ok = true;
+    char buffer[64 * 1024];
+    ssize_t n;
+    while ((n = read(in, buffer, sizeof buffer)) > 0) {
+      for (ssize_t written = 0; written < n;) {
+        ssize_t w = write(out, buffer + written, n - written);
+        if (w < 0) {
+          ok = false;
+          break;
+        }
+        written += w;
+      }
+      if (!ok) {
+        break;
+      }
+    }
+    ok = ok && n == 0;
+  }
+
+  close(in);
+  if (close(out) < 0 || !ok) {
+    unlink(dst.c_str());
+    return false;
+  }
+  return true;
+}
+
+// Appends `path` to `buffer`, with a leading `output_dir` replaced by a
+// placeholder, so that an action has the same key in every output directory.
+void append_path(std::string& buffer, std::string_view path,
+                 std::string_view output_dir) {
+  if (!output_dir.empty() &&
+      path.compare(0, output_dir.size(), output_dir) == 0 &&
+      (path.size() == output_dir.size() || path[output_dir.size()] == '/')) {
+    buffer.push_back(OUTPUT_DIR_PLACEHOLDER);
+    path.remove_prefix(output_dir.size());
+  }
+  buffer.append(path).push_back('\0');
+}
+
+void append_input(std::string& buffer, const std::string& path,
+                  std::string_view output_dir, uint64_t hash) {
+  append_path(buffer, path, output_dir);
+  buffer.append(reinterpret_cast<const char*>(&hash), sizeof hash);
+}
+
+// Returns the hex key for the hashed contents of `buffer`.
+std::string format_key(const std::string& buffer) {
+  // Two 64-bit hashes with different seeds, so that an accidental collision,
+  // which would silently produce a wrong build, is out of the question.
+  char key[33];
+  snprintf(key, sizeof key, "%016llx%016llx",
+           (unsigned long long)hash_bytes(buffer, 0),
+           (unsigned long long)hash_bytes(buffer, 1));
+  return key;
+}
+
+// The suffix of the key of the manifest that lists the discovered inputs of
+// an action.
+constexpr const char* MANIFEST_SUFFIX = ".deps";
+
+} // namespace
+
+ActionCache::ActionCache(std::string dir, ContentHashCache& hashes)
+    : dir_(std::move(dir)), hashes_(hashes) {
+  create_directories(dir_, 0700);
+
+  DIR* top = opendir(dir_.c_str());
+  if (top == NULL) {
+    throw ExitException(std::string("could not read directory: ").append(dir_),
+                        2);
+  }
+
+  struct dirent* prefix;
+  while ((prefix = readdir(top)) != NULL) {
+    // Only the two-digit prefix directories, which also rules out `..`.
+    const char* name = prefix->d_name;
+    if (strlen(name) != 2 || !isxdigit((unsigned char)name[0]) ||
+        !isxdigit((unsigned char)name[1])) {
+      continue;
+    }
+
+    std::string subdir = dir_ + "/" + prefix->d_name;
+    DIR* sub = opendir(subdir.c_str());
+    if (sub == NULL) {
+      continue;
+    }
+    struct dirent* rest;
+    while ((rest = readdir(sub)) != NULL) {
+      // Skips `.`, `..`, and temporary files left behind by a daemon that
+      // died in the middle of a store.
+      if (rest->d_name[0] == '.' || strstr(rest->d_name, ".tmp.") != NULL) {
+        continue;
+      }
+
+      struct stat st;
+      std::string path = subdir + "/" + rest->d_name;
+      if (stat(path.c_str(), &st) == 0) {
+        std::string key = std::string(prefix->d_name).append(rest->d_name);
+        entries_[key] = Entry{(uint64_t)st.st_size, st.st_mtim};
+        total_bytes_ += st.st_size;
+      }
+    }
+    closedir(sub);
+  }
+  closedir(top);
+}
+
+std::string ActionCache::key(const std::vector<std::string>& argv,
+                             const std::vector<std::string>& inputs,
+                             const std::string& build_dir,
+                             const std::string& output_dir) {
+  std::string buffer(build_dir);
+  buffer.push_back('\0');
+  for (std::string_view arg : argv) {
+    // Include directories are the only arguments with a path after a flag.
+    if (arg.compare(0, 2, "-I") == 0) {
+      buffer.append("-I");
+      arg.remove_prefix(2);
+    }
+    append_path(buffer, arg, output_dir);
+  }
+  for (const std::string& input : inputs) {
+    append_input(buffer, input, output_dir,
+                 hashes_.hash(input, stat_file(input.c_str())));
+  }
+  return format_key(buffer);
+}
+
+std::string
+ActionCache::extend_key(const std::string& key,
+                        const std::vector<std::string>& discovered) {
+  std::string buffer(key);
+  for (const std::string& path : discovered) {
+    struct stat st;
+    if (stat(path.c_str(), &st) < 0) {
+      return "";
+    }
+    FileStamp stamp{st.st_dev, st.st_ino, st.st_mtim, st.st_size};
+    append_input(buffer, path, "", hashes_.hash(path, stamp));
+  }
+  return format_key(buffer);
+}
+
+std::string ActionCache::entry_path(const std::string& key) const {
+  return std::string(dir_)
+      .append("/")
+      .append(key, 0, 2)
+      .append("/")
+      .append(key, 2, std::string::npos);
+}
+
+bool ActionCache::restore(const std::string& key, const std::string& output,
+                          std::vector<std::string>& discovered) {
+  discovered.clear();
+  std::string entry_key = key;
+  auto manifest = entries_.find(key + MANIFEST_SUFFIX);
+  if (manifest != entries_.end()) {
+    std::string manifest_path = entry_path(manifest->first);
+    try {
+      MappedFile file(manifest_path.c_str());
+      std::vector<std::string_view> lines;
+      split_string(file.contents(), lines, '\n');
+      discovered.assign(lines.begin(), lines.end());
+    } catch (ExitException& e) {
+      total_bytes_ -= manifest->second.size;
+      entries_.erase(manifest);
+      misses_++;
+      return false;
+    }
+    utimensat(AT_FDCWD, manifest_path.c_str(), NULL, 0);
+    manifest->second.last_use = now();
+    entry_key = extend_key(key, discovered);
+  }
+
+  auto it = entries_.find(entry_key);
+  if (it == entries_.end()) {
+    misses_++;
+    return false;
+  }
+
+  std::string path = entry_path(entry_key);
+  if (unlink(output.c_str()) < 0 && errno != ENOENT) {
+    misses_++;
+    return false;
+  }
+  if (link(path.c_str(), output.c_str()) < 0 &&
+      !copy_file(path, output)) {
+    // Most likely someone deleted the entry out from under us.
+    total_bytes_ -= it->second.size;
+    entries_.erase(it);
+    misses_++;
+    return false;
+  }
+
+  // The output has to look newer than its inputs, or it would be considered
+  // stale again on the next build. Touching the entry also marks it as
+  // recently used. When the output is a hard link, this is the same inode.
+  utimensat(AT_FDCWD, path.c_str(), NULL, 0);
+  utimensat(AT_FDCWD, output.c_str(), NULL, 0);
+  it->second.last_use = now();
+  hits_++;
+  return true;
+}
+
+void ActionCache::store(const std::string& key, const std::string& output,
+                        const std::vector<std::string>& discovered) {
+  std::string path = entry_path(key);
+  if (mkdir(path.substr(0, path.rfind('/')).c_str(), 0700) < 0 &&
+      errno != EEXIST) {
+    return;
+  }
+
+  std::string entry_key = key;
+  if (!discovered.empty()) {
+    std::string manifest_key = key + MANIFEST_SUFFIX;
+    std::string contents;
+    for (const std::string& dep : discovered) {
+      contents.append(dep).append("\n");
+    }
+    try {
+      write_file_atomically(entry_path(manifest_key), contents);
+    } catch (ExitException& e) {
+      return;
+    }
+    add_entry(manifest_key, entry_path(manifest_key));
+
+    entry_key = extend_key(key, discovered);
+    if (entry_key.empty()) {
+      return;
+    }
+    path = entry_path(entry_key);
+    if (mkdir(path.substr(0, path.rfind('/')).c_str(), 0700) < 0 &&
+        errno != EEXIST) {
+      return;
+    }
+  }
+
+  if (entries_.count(entry_key) > 0) {
+    return;
+  }
+
+  // A hard link is free, but only works within one file system. Otherwise
+  // copy to a temporary name first, so that a half-written entry can never be
+  // restored.
+  if (link(output.c_str(), path.c_str()) < 0 && errno != EEXIST) {
+    std::string tmp_path = std::string(path, 0, path.rfind('/') + 1)
+                               .append(".tmp.")
+                               .append(entry_key);
+    unlink(tmp_path.c_str());
+    if (!copy_file(output, tmp_path)) {
+      return;
+    }
+    if (rename(tmp_path.c_str(), path.c_str()) < 0) {
+      unlink(tmp_path.c_str());
+      return;
+    }
+  }
+
+  add_entry(entry_key, path);
+  evict();
+}
+
+void ActionCache::add_entry(const std::string& key, const std::string& path) {
+  struct stat st;
+  if (stat(path.c_str(), &st) < 0) {
+    return;
+  }
+
+  auto it = entries_.find(key);
+  if (it != entries_.end()) {
+    total_bytes_ -= it->second.size;
+  }
+  entries_[key] = Entry{(uint64_t)st.st_size, now()};
+  total_bytes_ += st.st_size;
+}
+
+void ActionCache::set_max_size(uint64_t max_bytes) {
+  max_bytes_ = max_bytes;
+  evict();
+}
+
+void ActionCache::evict() {
+  if (total_bytes_ <= max_bytes_) {
+    return;
+  }
+
+  std::vector<std::pair<struct timespec, std::string>> by_age;
+  by_age.reserve(entries_.size());
+  for (const auto& [key, entry] : entries_) {
+    by_age.emplace_back(entry.last_use, key);
+  }
+  std::sort(by_age.begin(), by_age.end(), [](const auto& a, const auto& b) {
+    return older_than(a.first, b.first);
+  });
+
+  uint64_t target = max_bytes_ * EVICTION_TARGET;
+  for (const auto& [last_use, key] : by_age) {
+    if (total_bytes_ <= target) {
+      break;
+    }
+    // Unlinking an entry does not affect outputs that are hard links to it.
+    unlink(entry_path(key).c_str());
+    total_bytes_ -= entries_[key].size;
+    entries_.erase(key);
+  }
+}
+
+} // namespace unixbuild
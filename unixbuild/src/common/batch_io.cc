@@ -0,0 +1,441 @@
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <memory>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
+
+#include "unixbuild/batch_io.h"
+
+namespace unixbuild {
+
+namespace {
+
+// The fewest files worth handing to a thread by themselves.
+constexpr size_t MIN_TASK_SIZE = 32;
+
+std::atomic<bool> use_io_uring{true};
+
+// glibc has no wrappers for the io_uring system calls, and liburing would be
+// the daemon's only dependency, so the ring is driven by hand. This is the
+// same protocol that liburing implements, minus everything we do not use.
+int io_uring_setup(unsigned entries, io_uring_params* params) {
+  return syscall(__NR_io_uring_setup, entries, params);
+}
+
+int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+                   unsigned flags) {
+  return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+                 NULL, 0);
+}
+
+int io_uring_register(int fd, unsigned opcode, void* arg, unsigned nr_args) {
+  return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+// A submission queue with room for `IO_BATCH_SIZE` requests, and the
+// completion queue that the kernel posts their results to. Both are shared
+// with the kernel through memory mappings: we write requests into the
+// submission queue and advance its tail, and read results from the
+// completion queue and advance its head, while the kernel does the opposite.
+class Ring {
+public:
+  // Returns the calling thread's ring, setting it up on first use, or null
+  // if `open` fails.
+  static Ring* get();
+
+  ~Ring();
+
+  // Sets up the ring. Returns false if the kernel cannot give us one that
+  // supports every operation we need.
+  bool open();
+
+  // Queues `n` requests, at most `IO_BATCH_SIZE`, filling in request `i`
+  // with `prepare(sqe, i)`, hands them to the kernel, and waits until they
+  // have all finished, calling `complete(i, res)` with the result of each,
+  // a negated `errno` if it failed.
+  //
+  // Returns false, without calling `complete`, if the kernel would not take
+  // the requests, in which case the caller should fall back to doing them
+  // itself.
+  template <typename P, typename C> bool run(size_t n, P prepare, C complete);
+
+private:
+  int fd_ = -1;
+  void* sq_ring_ = MAP_FAILED;
+  size_t sq_ring_size_ = 0;
+  void* cq_ring_ = MAP_FAILED;
+  size_t cq_ring_size_ = 0;
+  io_uring_sqe* sqes_ = static_cast<io_uring_sqe*>(MAP_FAILED);
+  size_t sqes_size_ = 0;
+
+  unsigned* sq_tail_;
+  unsigned sq_mask_;
+  unsigned* sq_array_;
+  unsigned* cq_head_;
+  unsigned* cq_tail_;
+  unsigned cq_mask_;
+  io_uring_cqe* cqes_;
+};
+
+Ring* Ring::get() {
+  thread_local std::unique_ptr<Ring> ring;
+  thread_local bool tried = false;
+  if (!tried) {
+    tried = true;
+    auto r = std::make_unique<Ring>();
+    if (r->open()) {
+      ring = std::move(r);
+    }
+  }
+  return ring.get();
+}
+
+Ring::~Ring() {
+  if (sqes_ != MAP_FAILED) {
+    munmap(sqes_, sqes_size_);
+  }
+  if (cq_ring_ != MAP_FAILED && cq_ring_ != sq_ring_) {
+    munmap(cq_ring_, cq_ring_size_);
+  }
+  if (sq_ring_ != MAP_FAILED) {
+    munmap(sq_ring_, sq_ring_size_);
+  }
+  if (fd_ >= 0) {
+    close(fd_);
+  }
+}
+
+bool Ring::open() {
+  io_uring_params params;
+  memset(&params, 0, sizeof params);
+  // The ring's file descriptor is always close-on-exec.
+  fd_ = io_uring_setup(IO_BATCH_SIZE, &params);
+  if (fd_ < 0) {
+    return false;
+  }
+
+  // io_uring may be there but too old for some of the operations, or have
+  // had some of them turned off.
+  constexpr unsigned PROBE_OPS = 256;
+  std::vector<char> buffer(sizeof(io_uring_probe) +
+                           PROBE_OPS * sizeof(io_uring_probe_op));
+  auto probe = reinterpret_cast<io_uring_probe*>(buffer.data());
+  if (io_uring_register(fd_, IORING_REGISTER_PROBE, probe, PROBE_OPS) < 0) {
+    return false;
+  }
+  for (unsigned op :
+       {IORING_OP_STATX, IORING_OP_OPENAT, IORING_OP_READ, IORING_OP_CLOSE}) {
+    if (op > probe->last_op ||
+        !(probe->ops[op].flags & IO_URING_OP_SUPPORTED)) {
+      return false;
+    }
+  }
+
+  sq_ring_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  cq_ring_size_ =
+      params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+  bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+  if (single_mmap) {
+    sq_ring_size_ = cq_ring_size_ = std::max(sq_ring_size_, cq_ring_size_);
+  }
+  sq_ring_ = mmap(NULL, sq_ring_size_, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQ_RING);
+  if (sq_ring_ == MAP_FAILED) {
+    return false;
+  }
+  cq_ring_ = single_mmap ? sq_ring_
+                         : mmap(NULL, cq_ring_size_, PROT_READ | PROT_WRITE,
+                                MAP_SHARED | MAP_POPULATE, fd_,
+                                IORING_OFF_CQ_RING);
+  if (cq_ring_ == MAP_FAILED) {
+    return false;
+  }
+  sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+  sqes_ = static_cast<io_uring_sqe*>(mmap(NULL, sqes_size_,
+                                          PROT_READ | PROT_WRITE,
+                                          MAP_SHARED | MAP_POPULATE, fd_,
+                                          IORING_OFF_SQES));
+  if (sqes_ == MAP_FAILED) {
+    return false;
+  }
+
+  char* sq = static_cast<char*>(sq_ring_);
+  sq_tail_ = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+  sq_mask_ = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+  sq_array_ = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+  char* cq = static_cast<char*>(cq_ring_);
+  cq_head_ = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+  cq_tail_ = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+  cq_mask_ = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+  cqes_ = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+  return true;
+}
+
+template <typename P, typename C>
+bool Ring::run(size_t n, P prepare, C complete) {
+  // Only we write the submission queue's tail, so it needs no atomic load,
+  // but the kernel must see the requests before it sees the new tail.
+  unsigned old_tail = *sq_tail_;
+  unsigned tail = old_tail;
+  for (size_t i = 0; i < n; i++, tail++) {
+    unsigned index = tail & sq_mask_;
+    io_uring_sqe& sqe = sqes_[index];
+    memset(&sqe, 0, sizeof sqe);
+    prepare(sqe, i);
+    sqe.user_data = i;
+    sq_array_[index] = index;
+  }
+  __atomic_store_n(sq_tail_, tail, __ATOMIC_RELEASE);
+
+  // The completion queue is twice the size of the submission queue, so it
+  // cannot overflow while we wait for a batch.
+  size_t submitted = 0;
+  size_t completed = 0;
+  while (completed < n) {
+    int r = io_uring_enter(fd_, n - submitted, n - completed,
+                           IORING_ENTER_GETEVENTS);
+    if (r < 0 && errno == EINTR) {
+      continue;
+    } else if (r < 0 && submitted == 0) {
+      // Nothing was taken, so the requests can be withdrawn.
+      __atomic_store_n(sq_tail_, old_tail, __ATOMIC_RELEASE);
+      return false;
+    } else if (r < 0) {
+      // Some requests point at our caller's buffers, so we cannot return
+      // before they finish.
+      throw ExitException("io_uring_enter failed", 2);
+    }
+    submitted += r;
+
+    unsigned head = *cq_head_;
+    unsigned cq_tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+    for (; head != cq_tail; head++, completed++) {
+      const io_uring_cqe& cqe = cqes_[head & cq_mask_];
+      complete(static_cast<size_t>(cqe.user_data), cqe.res);
+    }
+    __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+  }
+  return true;
+}
+
+Ring* ring_for_this_thread() {
+  return use_io_uring.load(std::memory_order_relaxed) ? Ring::get() : nullptr;
+}
+
+void stat_one(const char* path, StatResult& result) {
+  struct stat st;
+  if (stat(path, &st) < 0) {
+    result.error = errno;
+  } else {
+    result.stamp = FileStamp{st.st_dev, st.st_ino, st.st_mtim, st.st_size};
+  }
+}
+
+// Reads from `fd`, starting at offset `contents.size()`, and appends to
+// `contents` until the end of the file, `chunk` bytes at a time. Returns 0,
+// or the `errno` of a failed read.
+int read_rest(int fd, std::string& contents, size_t chunk) {
+  while (true) {
+    size_t old_size = contents.size();
+    contents.resize(old_size + chunk);
+    ssize_t n = pread(fd, &contents[old_size], chunk, old_size);
+    if (n < 0) {
+      contents.resize(old_size);
+      if (errno == EINTR) {
+        continue;
+      }
+      return errno;
+    }
+    contents.resize(old_size + n);
+    if (n == 0) {
+      return 0;
+    }
+  }
+}
+
+void read_one(const char* path, ReadResult& result, size_t chunk) {
+  int fd = ::open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    result.error = errno;
+    return;
+  }
+  result.error = read_rest(fd, result.contents, chunk);
+  close(fd);
+}
+
+} // namespace
+
+std::vector<StatResult> stat_files(const std::vector<const char*>& paths,
+                                   bool via_io_uring) {
+  std::vector<StatResult> results(paths.size());
+  Ring* ring = via_io_uring ? ring_for_this_thread() : nullptr;
+  std::vector<struct statx> buffers(ring != nullptr ? IO_BATCH_SIZE : 0);
+
+  for (size_t begin = 0; begin < paths.size(); begin += IO_BATCH_SIZE) {
+    size_t n = std::min(IO_BATCH_SIZE, paths.size() - begin);
+    bool batched =
+        ring != nullptr &&
+        ring->run(
+            n,
+            [&](io_uring_sqe& sqe, size_t i) {
+              sqe.opcode = IORING_OP_STATX;
+              sqe.fd = AT_FDCWD;
+              sqe.addr = reinterpret_cast<uintptr_t>(paths[begin + i]);
+              sqe.len = STATX_BASIC_STATS;
+              sqe.off = reinterpret_cast<uintptr_t>(&buffers[i]);
+            },
+            [&](size_t i, int res) {
+              StatResult& result = results[begin + i];
+              const struct statx& st = buffers[i];
+              if (res < 0) {
+                result.error = -res;
+              } else {
+                result.stamp.dev = makedev(st.stx_dev_major, st.stx_dev_minor);
+                result.stamp.ino = st.stx_ino;
+                result.stamp.mtime.tv_sec = st.stx_mtime.tv_sec;
+                result.stamp.mtime.tv_nsec = st.stx_mtime.tv_nsec;
+                result.stamp.size = st.stx_size;
+              }
+            });
+    if (!batched) {
+      for (size_t i = begin; i < begin + n; i++) {
+        stat_one(paths[i], results[i]);
+      }
+    }
+  }
+  return results;
+}
+
+std::vector<ReadResult> read_files(const std::vector<const char*>& paths,
+                                   size_t expected_size) {
+  std::vector<ReadResult> results(paths.size());
+  expected_size = std::max<size_t>(expected_size, 1);
+  Ring* ring = ring_for_this_thread();
+  if (ring == nullptr) {
+    for (size_t i = 0; i < paths.size(); i++) {
+      read_one(paths[i], results[i], expected_size);
+    }
+    return results;
+  }
+
+  // Each batch takes three trips into the kernel, one each to open, read and
+  // close every file, however many files there are.
+  std::vector<int> fds(IO_BATCH_SIZE);
+  std::vector<size_t> opened;
+  for (size_t begin = 0; begin < paths.size(); begin += IO_BATCH_SIZE) {
+    size_t n = std::min(IO_BATCH_SIZE, paths.size() - begin);
+    bool batched = ring->run(
+        n,
+        [&](io_uring_sqe& sqe, size_t i) {
+          sqe.opcode = IORING_OP_OPENAT;
+          sqe.fd = AT_FDCWD;
+          sqe.addr = reinterpret_cast<uintptr_t>(paths[begin + i]);
+          sqe.open_flags = O_RDONLY | O_CLOEXEC;
+        },
+        [&](size_t i, int res) {
+          fds[i] = res;
+          if (res < 0) {
+            results[begin + i].error = -res;
+          }
+        });
+    if (!batched) {
+      for (size_t i = begin; i < begin + n; i++) {
+        read_one(paths[i], results[i], expected_size);
+      }
+      continue;
+    }
+
+    opened.clear();
+    for (size_t i = 0; i < n; i++) {
+      if (fds[i] >= 0) {
+        opened.push_back(i);
+        results[begin + i].contents.resize(expected_size);
+      }
+    }
+    std::vector<char> more(n);
+    batched = ring->run(
+        opened.size(),
+        [&](io_uring_sqe& sqe, size_t k) {
+          std::string& contents = results[begin + opened[k]].contents;
+          sqe.opcode = IORING_OP_READ;
+          sqe.fd = fds[opened[k]];
+          sqe.addr = reinterpret_cast<uintptr_t>(&contents[0]);
+          sqe.len = expected_size;
+          sqe.off = 0;
+        },
+        [&](size_t k, int res) {
+          ReadResult& result = results[begin + opened[k]];
+          if (res < 0) {
+            result.error = -res;
+            result.contents.clear();
+          } else {
+            result.contents.resize(res);
+            // Only a full read can have stopped short of the end.
+            more[opened[k]] = static_cast<size_t>(res) == expected_size;
+          }
+        });
+    for (size_t i : opened) {
+      ReadResult& result = results[begin + i];
+      if (!batched) {
+        result.contents.clear();
+        result.error = read_rest(fds[i], result.contents, expected_size);
+      } else if (more[i]) {
+        result.error = read_rest(fds[i], result.contents, expected_size);
+      }
+      if (result.error != 0) {
+        result.contents.clear();
+      }
+    }
+
+    batched = ring->run(
+        opened.size(),
+        [&](io_uring_sqe& sqe, size_t k) {
+          sqe.opcode = IORING_OP_CLOSE;
+          sqe.fd = fds[opened[k]];
+        },
+        [](size_t, int) {});
+    if (!batched) {
+      for (size_t i : opened) {
+        close(fds[i]);
+      }
+    }
+  }
+  return results;
+}
+
+void for_each_batch(ThreadPool& pool, size_t n,
+                    const std::function<void(size_t, size_t)>& f) {
+  // A few batches per thread, so that one that is slow, because its files
+  // are not in the page cache, can be made up for by the others.
+  size_t size = std::clamp<size_t>(n / (4 * pool.size()), MIN_TASK_SIZE,
+                                   IO_BATCH_SIZE);
+  size_t batches = (n + size - 1) / size;
+  pool.parallel_for(batches, [&](size_t i) {
+    f(i * size, std::min(n, (i + 1) * size));
+  });
+}
+
+bool io_uring_available() {
+  // Whether the kernel supports io_uring does not change while we run, so
+  // a ring set up once, and then thrown away, answers for every thread.
+  static const bool available = []() {
+    Ring ring;
+    return ring.open();
+  }();
+  return available;
+}
+
+void set_io_uring_enabled(bool enabled) { use_io_uring = enabled; }
+
+bool io_uring_enabled() {
+  return use_io_uring.load(std::memory_order_relaxed) && io_uring_available();
+}
+
+} // namespace unixbuild
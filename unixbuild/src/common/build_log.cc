@@ -0,0 +1,251 @@
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "unixbuild/build_log.h"
+
+namespace unixbuild {
+
+namespace {
+
+constexpr char LOG_MAGIC[8] = {'U', 'X', 'B', 'L', 'O', 'G', '\0', '\0'};
+constexpr uint32_t LOG_VERSION = 2;
+constexpr size_t HEADER_SIZE = 16;
+// The size of a record's fixed fields after its size field.
+constexpr size_t RECORD_FIXED_SIZE = 3 * 4 + 8 * 8;
+
+constexpr uint32_t FLAG_HAS_INPUTS_HASH = 1;
+
+// Logs smaller than this are never compacted, since rewriting them would save
+// next to nothing.
+constexpr size_t COMPACTION_MIN_RECORDS = 1000;
+
+void put_u32(std::string& out, uint32_t x) {
+  out.append(reinterpret_cast<const char*>(&x), sizeof x);
+}
+
+void put_u64(std::string& out, uint64_t x) {
+  out.append(reinterpret_cast<const char*>(&x), sizeof x);
+}
+
+void append_header(std::string& out) {
+  out.append(LOG_MAGIC, sizeof LOG_MAGIC);
+  put_u32(out, LOG_VERSION);
+  put_u32(out, 0);
+}
+
+void append_record(std::string& out, const std::string& output,
+                   const LogEntry& entry) {
+  size_t start = out.size();
+  put_u32(out, 0);
+  put_u32(out, output.size());
+  put_u32(out, entry.discovered.size());
+  put_u32(out, entry.has_inputs_hash ? FLAG_HAS_INPUTS_HASH : 0);
+  put_u64(out, entry.command_hash);
+  put_u64(out, entry.inputs_hash);
+  put_u64(out, entry.duration_us);
+  put_u64(out, entry.output.dev);
+  put_u64(out, entry.output.ino);
+  put_u64(out, entry.output.mtime.tv_sec);
+  put_u64(out, entry.output.mtime.tv_nsec);
+  put_u64(out, entry.output.size);
+  out.append(output);
+  for (const std::string& dep : entry.discovered) {
+    put_u32(out, dep.size());
+    out.append(dep);
+  }
+
+  // Now that we know how long the record is, fill in its size.
+  uint32_t size = out.size() - start - sizeof(uint32_t);
+  memcpy(&out[start], &size, sizeof size);
+}
+
+// Reads fields out of a record in the mapped log, checking that they are
+// within its bounds.
+class RecordReader {
+public:
+  RecordReader(const char* data, size_t size) : data_(data), size_(size) {}
+
+  bool u32(uint32_t& x) { return read(&x, sizeof x); }
+  bool u64(uint64_t& x) { return read(&x, sizeof x); }
+
+  bool string(uint32_t length, std::string& s) {
+    if (length > size_ - pos_) {
+      return false;
+    }
+    s.assign(data_ + pos_, length);
+    pos_ += length;
+    return true;
+  }
+
+  bool at_end() const { return pos_ == size_; }
+
+private:
+  // The log is only ever read on the machine that wrote it, but a record can
+  // start at any byte offset, so fields are copied out with `memcpy` rather
+  // than read through a possibly misaligned pointer.
+  bool read(void* x, size_t n) {
+    if (n > size_ - pos_) {
+      return false;
+    }
+    memcpy(x, data_ + pos_, n);
+    pos_ += n;
+    return true;
+  }
+
+  const char* data_;
+  size_t size_;
+  size_t pos_ = 0;
+};
+
+bool parse_record(const char* data, size_t size, std::string& output,
+                  LogEntry& entry) {
+  RecordReader reader(data, size);
+  uint32_t output_length, dep_count, flags;
+  uint64_t dev, ino, sec, nsec, file_size;
+  if (!reader.u32(output_length) || !reader.u32(dep_count) ||
+      !reader.u32(flags) || !reader.u64(entry.command_hash) ||
+      !reader.u64(entry.inputs_hash) || !reader.u64(entry.duration_us) ||
+      !reader.u64(dev) || !reader.u64(ino) || !reader.u64(sec) ||
+      !reader.u64(nsec) || !reader.u64(file_size) ||
+      !reader.string(output_length, output)) {
+    return false;
+  }
+  entry.has_inputs_hash = (flags & FLAG_HAS_INPUTS_HASH) != 0;
+  entry.output.dev = dev;
+  entry.output.ino = ino;
+  entry.output.mtime.tv_sec = sec;
+  entry.output.mtime.tv_nsec = nsec;
+  entry.output.size = file_size;
+
+  // Each dependency takes at least four bytes, so a corrupt count cannot make
+  // us reserve more than the record could hold.
+  if (dep_count > size / sizeof(uint32_t)) {
+    return false;
+  }
+  entry.discovered.resize(dep_count);
+  for (std::string& dep : entry.discovered) {
+    uint32_t length;
+    if (!reader.u32(length) || !reader.string(length, dep)) {
+      return false;
+    }
+  }
+  return reader.at_end();
+}
+
+} // namespace
+
+BuildLog::BuildLog(std::string path) : path_(std::move(path)) {
+  if (access(path_.c_str(), F_OK) < 0) {
+    needs_rewrite_ = true;
+    return;
+  }
+
+  MappedFile file(path_.c_str());
+  std::string_view contents = file.contents();
+  uint32_t version;
+  if (contents.size() < HEADER_SIZE ||
+      memcmp(contents.data(), LOG_MAGIC, sizeof LOG_MAGIC) != 0 ||
+      (memcpy(&version, contents.data() + sizeof LOG_MAGIC, sizeof version),
+       version != LOG_VERSION)) {
+    needs_rewrite_ = true;
+    return;
+  }
+
+  size_t pos = HEADER_SIZE;
+  std::string output;
+  while (pos < contents.size()) {
+    uint32_t size;
+    if (contents.size() - pos < sizeof size) {
+      needs_rewrite_ = true;
+      break;
+    }
+    memcpy(&size, contents.data() + pos, sizeof size);
+    pos += sizeof size;
+    if (size < RECORD_FIXED_SIZE || size > contents.size() - pos) {
+      needs_rewrite_ = true;
+      break;
+    }
+
+    LogEntry entry;
+    if (!parse_record(contents.data() + pos, size, output, entry)) {
+      needs_rewrite_ = true;
+      break;
+    }
+    entries_[output] = std::move(entry);
+    records_++;
+    pos += size;
+  }
+}
+
+const LogEntry* BuildLog::find(const std::string& output) const {
+  auto it = entries_.find(output);
+  if (it == entries_.end()) {
+    return nullptr;
+  }
+  return &it->second;
+}
+
+void BuildLog::record(const std::string& output, LogEntry entry) {
+  entries_[output] = std::move(entry);
+  pending_.insert(output);
+}
+
+void BuildLog::flush() {
+  if (needs_rewrite_ || (records_ + pending_.size() > COMPACTION_MIN_RECORDS &&
+                         records_ + pending_.size() > 2 * entries_.size())) {
+    compact();
+    return;
+  }
+  if (pending_.empty()) {
+    return;
+  }
+
+  std::string buffer;
+  for (const std::string& output : pending_) {
+    append_record(buffer, output, entries_[output]);
+  }
+
+  // O_APPEND, and a single `write` for all the new records, so that even if
+  // we die partway through, the file only ever ends in one partial record,
+  // which the next load will discard.
+  int fd = open(path_.c_str(), O_WRONLY | O_APPEND | O_CLOEXEC);
+  if (fd < 0) {
+    throw ExitException(std::string("could not open file: ").append(path_),
+                        2);
+  }
+  size_t written = 0;
+  while (written < buffer.size()) {
+    ssize_t n = write(fd, buffer.data() + written, buffer.size() - written);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    } else if (n < 0) {
+      close(fd);
+      // We cannot tell how much of the last record made it to disk.
+      needs_rewrite_ = true;
+      throw ExitException(std::string("could not write file: ").append(path_),
+                          2);
+    }
+    written += n;
+  }
+  close(fd);
+
+  records_ += pending_.size();
+  pending_.clear();
+}
+
+void BuildLog::compact() {
+  std::string buffer;
+  append_header(buffer);
+  for (const auto& [output, entry] : entries_) {
+    append_record(buffer, output, entry);
+  }
+  write_file_atomically(path_, buffer);
+
+  records_ = entries_.size();
+  pending_.clear();
+  needs_rewrite_ = false;
+}
+
+} // namespace unixbuild
@@ -0,0 +1,406 @@
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <system_error>
+#include <thread>
+
+#include "unixbuild/buildfile.h"
+#include "unixbuild/common.h"
+
+namespace unixbuild {
+
+namespace {
+
+// A file is only split between threads if each would get at least this much
+// of it, since below that, starting a thread costs more than it saves.
+constexpr size_t MIN_CHUNK_SIZE = 1 << 20;
+constexpr size_t MAX_PARSE_THREADS = 16;
+
+Rule to_rule(const RuleView& view) {
+  Rule rule;
+  rule.output = std::string(view.output);
+  rule.deps.reserve(view.deps.size());
+  for (std::string_view dep : view.deps) {
+    rule.deps.emplace_back(dep);
+  }
+  return rule;
+}
+
+// Where the first malformed line of a chunk is, counting from 1 at the start
+// of the chunk, and what is wrong with it.
+struct ChunkError {
+  size_t lineno;
+  const char* message;
+};
+
+// The rules of a chunk that was parsed on another thread.
+struct ParsedChunk {
+  // Each rule's output followed by its dependencies.
+  std::vector<std::string_view> fields;
+  // How many dependencies each rule has.
+  std::vector<uint32_t> dep_counts;
+  // The directories named by its `subdir` lines, each with the number of
+  // rules before it in the chunk, so that they can be passed on in order.
+  std::vector<std::pair<size_t, std::string_view>> subdirs;
+  // The number of newlines in the chunk, if it parsed.
+  size_t lines = 0;
+  std::optional<ChunkError> error;
+};
+
+// Iterates over the newlines, colons and spaces in some text, finding them a
+// block at a time with a `ScanFunction` rather than looking at every byte.
+class StructuralIterator {
+public:
+  StructuralIterator(std::string_view text, ScanFunction scan)
+      : text_(text), scan_(scan) {
+    load();
+  }
+
+  // Returns the position of the next newline, colon or space, or the size of
+  // the text if there are no more.
+  size_t next() {
+    while (bits_ == 0) {
+      block_ += SCAN_BLOCK_SIZE;
+      if (block_ >= text_.size()) {
+        return text_.size();
+      }
+      load();
+    }
+    size_t pos = block_ + __builtin_ctzll(bits_);
+    // Clears the lowest set bit.
+    bits_ &= bits_ - 1;
+    return pos;
+  }
+
+private:
+  void load() {
+    size_t n = text_.size() - block_;
+    if (n >= SCAN_BLOCK_SIZE) {
+      bits_ = scan_(text_.data() + block_);
+    } else {
+      // Reading a whole block here could run off the end of the mapping, so
+      // the last few bytes are copied somewhere safe first. Zeros match
+      // nothing.
+      char padded[SCAN_BLOCK_SIZE] = {};
+      memcpy(padded, text_.data() + block_, n);
+      bits_ = scan_(padded);
+    }
+  }
+
+  std::string_view text_;
+  ScanFunction scan_;
+  size_t block_ = 0;
+  uint64_t bits_ = 0;
+};
+
+bool is_space(char c) { return std::isspace(static_cast<unsigned char>(c)); }
+
+constexpr std::string_view SUBDIR_KEYWORD = "subdir";
+
+// Returns what is wrong with `line`, a line with no colon, which has been
+// trimmed, unless it is a `subdir` line, in which case it sets `dir` to the
+// directory that it names and returns null.
+const char* parse_subdir(std::string_view line, std::string_view& dir) {
+  if (line.substr(0, SUBDIR_KEYWORD.size()) != SUBDIR_KEYWORD) {
+    return "no colon";
+  }
+  if (line.size() == SUBDIR_KEYWORD.size()) {
+    return "no directory";
+  }
+  if (!is_space(line[SUBDIR_KEYWORD.size()])) {
+    return "no colon";
+  }
+  dir = trim_whitespace(line.substr(SUBDIR_KEYWORD.size()));
+  for (char c : dir) {
+    if (is_space(c)) {
+      return "more than one directory";
+    }
+  }
+  return nullptr;
+}
+
+// Parses `chunk`, which must start at the beginning of a line, calling
+// `emit(rule)` for each rule and `(*emit_subdir)(dir)` for each `subdir` line,
+// and setting `lines` to the number of newlines in it. Stops at the first
+// malformed line, which it returns. If `emit_subdir` is null, `subdir` lines
+// are malformed too.
+//
+// This does the same as calling `parse_line` on each line, but it finds the
+// colon and the spaces between dependencies from the structural characters,
+// rather than by looking at every byte of every line again.
+template <typename Emit, typename EmitSubdir>
+std::optional<ChunkError> parse_chunk(std::string_view chunk,
+                                      ScanFunction scan, size_t& lines,
+                                      const Emit& emit,
+                                      const EmitSubdir* emit_subdir) {
+  constexpr size_t NO_COLON = SIZE_MAX;
+  const char* data = chunk.data();
+  StructuralIterator structural(chunk, scan);
+  RuleView rule;
+  size_t line_start = 0;
+  size_t lineno = 1;
+  size_t colon = NO_COLON;
+  // Where the dependency after the last space or the colon starts.
+  size_t dep_start = 0;
+
+  while (line_start < chunk.size()) {
+    size_t pos = structural.next();
+    if (pos < chunk.size() && data[pos] != '\n') {
+      if (colon == NO_COLON) {
+        // Spaces before the colon are part of the output's name, or around it.
+        if (data[pos] == ':') {
+          colon = pos;
+          dep_start = pos + 1;
+        }
+      } else if (data[pos] == ' ') {
+        // Colons after the first are part of a dependency's name.
+        if (pos > dep_start) {
+          rule.deps.emplace_back(data + dep_start, pos - dep_start);
+        }
+        dep_start = pos + 1;
+      }
+      continue;
+    }
+
+    // The end of a line, at a newline or at the end of the chunk.
+    size_t start = line_start;
+    while (start < pos && is_space(data[start])) {
+      start++;
+    }
+    if (start < pos && data[start] != '#' && colon == NO_COLON) {
+      std::string_view dir;
+      const char* error = parse_subdir(
+          trim_whitespace(std::string_view(data + start, pos - start)), dir);
+      if (error != nullptr) {
+        return ChunkError{lineno, error};
+      }
+      if (emit_subdir == nullptr) {
+        return ChunkError{lineno, "unexpected subdir"};
+      }
+      (*emit_subdir)(dir);
+    } else if (start < pos && data[start] != '#') {
+      if (pos > dep_start) {
+        rule.deps.emplace_back(data + dep_start, pos - dep_start);
+      }
+
+      // Whitespace at the end of the line is not part of the last dependency.
+      const char* end = data + pos;
+      while (end > data + start && is_space(end[-1])) {
+        end--;
+      }
+      while (!rule.deps.empty() && rule.deps.back().data() >= end) {
+        rule.deps.pop_back();
+      }
+      if (rule.deps.empty()) {
+        return ChunkError{lineno, "no deps"};
+      }
+      std::string_view& last = rule.deps.back();
+      last = last.substr(0, std::min<size_t>(last.size(), end - last.data()));
+
+      rule.output =
+          trim_whitespace(std::string_view(data + start, colon - start));
+      if (rule.output.empty()) {
+        return ChunkError{lineno, "no output"};
+      }
+      emit(rule);
+    }
+
+    rule.deps.clear();
+    colon = NO_COLON;
+    line_start = pos + 1;
+    if (pos < chunk.size()) {
+      lineno++;
+    }
+  }
+
+  lines = lineno - 1;
+  return {};
+}
+
+// Parses `chunk` into `parsed`, allowing `subdir` lines if `subdirs` is set.
+void parse_chunk_into(std::string_view chunk, ScanFunction scan,
+                      bool subdirs, ParsedChunk& parsed) {
+  auto emit_subdir = [&parsed](std::string_view dir) {
+    parsed.subdirs.emplace_back(parsed.dep_counts.size(), dir);
+  };
+  parsed.error = parse_chunk(
+      chunk, scan, parsed.lines,
+      [&parsed](const RuleView& rule) {
+        parsed.fields.push_back(rule.output);
+        parsed.fields.insert(parsed.fields.end(), rule.deps.begin(),
+                             rule.deps.end());
+        parsed.dep_counts.push_back(rule.deps.size());
+      },
+      subdirs ? &emit_subdir : nullptr);
+}
+
+// Splits `contents` into at most `n` chunks of about the same size, each of
+// which ends just after a newline, apart from the last.
+std::vector<std::string_view> split_chunks(std::string_view contents,
+                                           size_t n) {
+  std::vector<std::string_view> chunks;
+  size_t start = 0;
+  for (size_t i = 1; i < n; i++) {
+    size_t target = std::max(start, contents.size() * i / n);
+    if (target >= contents.size()) {
+      break;
+    }
+    const void* newline =
+        memchr(contents.data() + target, '\n', contents.size() - target);
+    if (newline == nullptr) {
+      break;
+    }
+    size_t end = static_cast<const char*>(newline) - contents.data() + 1;
+    chunks.push_back(contents.substr(start, end - start));
+    start = end;
+  }
+  if (start < contents.size()) {
+    chunks.push_back(contents.substr(start));
+  }
+  return chunks;
+}
+
+} // namespace
+
+BuildFile parse_build_file(const std::string& path) {
+  // The whole file is mapped into memory rather than read line by line; see
+  // `MappedFile` for why.
+  MappedFile file(path.c_str());
+  BuildFile build_file;
+  parse_rules(file.contents(), [&build_file](const RuleView& rule) {
+    build_file.rules.push_back(to_rule(rule));
+  });
+  return build_file;
+}
+
+void parse_rules(std::string_view contents,
+                 const std::function<void(const RuleView&)>& callback,
+                 const ParseOptions& options,
+                 const SubdirCallback& subdir_callback) {
+  const SubdirCallback* emit_subdir =
+      subdir_callback ? &subdir_callback : nullptr;
+  ScanFunction scan = scan_function(options.simd);
+  size_t threads = options.threads;
+  if (threads == 0) {
+    threads = std::min<size_t>({std::thread::hardware_concurrency(),
+                                MAX_PARSE_THREADS,
+                                contents.size() / MIN_CHUNK_SIZE});
+  }
+  std::vector<std::string_view> chunks = split_chunks(contents, threads);
+  if (chunks.size() <= 1) {
+    size_t lines;
+    std::optional<ChunkError> error =
+        parse_chunk(contents, scan, lines, callback, emit_subdir);
+    if (error.has_value()) {
+      throw ParseException(error->lineno, error->message);
+    }
+    return;
+  }
+
+  // Every chunk but the first is parsed on a thread of its own, into a list
+  // of rules to pass to the callback later. The first is parsed on this
+  // thread in the meantime, straight into the callback.
+  std::vector<ParsedChunk> parsed(chunks.size());
+  std::vector<std::thread> workers;
+  std::vector<bool> started(chunks.size());
+  for (size_t i = 1; i < chunks.size(); i++) {
+    try {
+      workers.emplace_back([&chunks, &parsed, scan, emit_subdir, i]() {
+        parse_chunk_into(chunks[i], scan, emit_subdir != nullptr, parsed[i]);
+      });
+      started[i] = true;
+    } catch (std::system_error& e) {
+      // Out of threads, so parse it on this one once the first is done.
+    }
+  }
+  auto join = [&workers]() {
+    for (std::thread& worker : workers) {
+      worker.join();
+    }
+  };
+
+  std::optional<ChunkError> error;
+  try {
+    error =
+        parse_chunk(chunks[0], scan, parsed[0].lines, callback, emit_subdir);
+  } catch (...) {
+    // The workers refer to this frame, so they must finish before it goes.
+    join();
+    throw;
+  }
+  join();
+  if (error.has_value()) {
+    throw ParseException(error->lineno, error->message);
+  }
+
+  // Line numbers within each chunk count from its start, so they are offset
+  // by the lines in the chunks before it.
+  size_t lines_before = parsed[0].lines;
+  RuleView rule;
+  for (size_t i = 1; i < chunks.size(); i++) {
+    ParsedChunk& chunk = parsed[i];
+    if (!started[i]) {
+      parse_chunk_into(chunks[i], scan, emit_subdir != nullptr, chunk);
+    }
+
+    const std::string_view* field = chunk.fields.data();
+    auto subdir = chunk.subdirs.begin();
+    // Passes on the `subdir` lines that come before the rule at `index`.
+    auto emit_subdirs = [&](size_t index) {
+      for (; subdir != chunk.subdirs.end() && subdir->first <= index;
+           ++subdir) {
+        subdir_callback(subdir->second);
+      }
+    };
+    for (size_t j = 0; j < chunk.dep_counts.size(); j++) {
+      emit_subdirs(j);
+      uint32_t deps = chunk.dep_counts[j];
+      rule.output = *field++;
+      rule.deps.assign(field, field + deps);
+      field += deps;
+      callback(rule);
+    }
+    emit_subdirs(chunk.dep_counts.size());
+    if (chunk.error.has_value()) {
+      throw ParseException(lines_before + chunk.error->lineno,
+                           chunk.error->message);
+    }
+    lines_before += chunk.lines;
+  }
+}
+
+bool parse_line(std::string_view line, size_t lineno, RuleView& rule) {
+  line = trim_whitespace(line);
+  if (line.empty() or line[0] == '#') {
+    return false;
+  }
+
+  auto colon_pos = line.find(':');
+  if (colon_pos == std::string_view::npos) {
+    throw ParseException(lineno, "no colon");
+  }
+
+  rule.output = trim_whitespace(line.substr(0, colon_pos));
+  if (rule.output.empty()) {
+    throw ParseException(lineno, "no output");
+  }
+  rule.deps.clear();
+  split_string(line.substr(colon_pos + 1), rule.deps, ' ');
+
+  if (rule.deps.size() == 0) {
+    throw ParseException(lineno, "no deps");
+  }
+
+  return true;
+}
+
+std::optional<Rule> parse_line(std::string& line, size_t lineno) {
+  trim_whitespace(line);
+  RuleView view;
+  if (!parse_line(std::string_view(line), lineno, view)) {
+    return {};
+  }
+  return to_rule(view);
+}
+
+} // namespace unixbuild
@@ -0,0 +1,118 @@
+#include <algorithm>
+
+#include "unixbuild/cache.h"
+
+namespace unixbuild {
+
+namespace {
+
+// The name of the build file in each subdirectory.
+constexpr const char* SUBDIR_BUILD_FILE = "BUILD.uxb";
+
+} // namespace
+
+BuildFileCache::Entry& BuildFileCache::entry(const std::string& path) {
+  // The file is stat'd before it is parsed, not after, so that if it is
+  // modified while we are reading it the recorded stamp will be stale and the
+  // next lookup will parse it again.
+  std::optional<FileStamp> stamp = stat_cache_.stamp(path);
+  if (!stamp.has_value()) {
+    throw ExitException(std::string("could not stat file: ").append(path), 2);
+  }
+
+  auto it = entries_.find(path);
+  if (it != entries_.end() && it->second.stamp == stamp.value()) {
+    hits_++;
+  } else {
+    misses_++;
+    // A file that is loaded for the first time cannot change a rule that
+    // some earlier graph was built from.
+    if (it != entries_.end()) {
+      generation_++;
+    }
+    Entry entry{stamp.value(),
+                std::make_shared<const BuildFileIndex>(
+                    load_build_file_index(path)),
+                {}};
+    it = entries_.insert_or_assign(path, std::move(entry)).first;
+  }
+  return it->second;
+}
+
+std::shared_ptr<const BuildFileIndex>
+BuildFileCache::subdir_index(const std::string& dir,
+                             const std::string& subdir) {
+  std::string path =
+      std::string(dir).append(subdir).append("/").append(SUBDIR_BUILD_FILE);
+  // The stamp is remembered for the rest of the build, so looking it up
+  // again in `entry` costs nothing.
+  if (!stat_cache_.stamp(path).has_value()) {
+    throw ExitException(
+        std::string("no build file in subdir: ").append(subdir), 2);
+  }
+  try {
+    return entry(path).index;
+  } catch (ExitException& e) {
+    // Otherwise a syntax error would not say which file it is in.
+    throw ExitException(path.append(": ").append(e.message_), e.returncode_);
+  }
+}
+
+std::shared_ptr<const BuildGraph>
+BuildFileCache::get(const std::string& path, const std::string& target) {
+  Entry& root = entry(path);
+  std::string dir = path.substr(0, path.rfind('/') + 1);
+  lookups_++;
+  // The first rule is cached under its name, so that asking for it by name
+  // finds the same graph. A file with no rules is left to `target_graph` to
+  // complain about.
+  std::string key = target.empty() && root.index->size() > 0
+                        ? std::string(root.index->output(0))
+                        : target;
+  auto cached = root.graphs.find(key);
+  if (cached != root.graphs.end()) {
+    bool current = true;
+    for (const auto& [subdir, index] : cached->second.subdirs) {
+      if (subdir_index(dir, subdir) != index) {
+        current = false;
+        break;
+      }
+    }
+    if (current) {
+      cached->second.last_use = lookups_;
+      return cached->second.graph;
+    }
+  }
+
+  Graph graph;
+  auto load_subdir = [this, &dir, &graph](const std::string& subdir) {
+    std::shared_ptr<const BuildFileIndex> index = subdir_index(dir, subdir);
+    graph.subdirs.emplace_back(subdir, index);
+    return index;
+  };
+  // Only the entries of subdirectories are added or replaced while the
+  // graph is built, so `root` is still valid afterwards.
+  graph.graph = std::make_shared<const BuildGraph>(
+      root.index->target_graph(key, load_subdir, pool_));
+  graph.last_use = lookups_;
+
+  // Builds that are using an evicted graph keep it alive until they are done.
+  if (root.graphs.size() >= MAX_GRAPHS && root.graphs.count(key) == 0) {
+    root.graphs.erase(std::min_element(
+        root.graphs.begin(), root.graphs.end(),
+        [](const auto& a, const auto& b) {
+          return a.second.last_use < b.second.last_use;
+        }));
+  }
+  return (root.graphs[key] = std::move(graph)).graph;
+}
+
+size_t BuildFileCache::graphs() const {
+  size_t total = 0;
+  for (const auto& [path, entry] : entries_) {
+    total += entry.graphs.size();
+  }
+  return total;
+}
+
+} // namespace unixbuild
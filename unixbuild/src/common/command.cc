@@ -0,0 +1,129 @@
+#include <algorithm>
+#include <cstring>
+
+#include "unixbuild/command.h"
+
+namespace unixbuild {
+
+namespace {
+
+bool ends_with(std::string_view s, const char* suffix) {
+  size_t n = strlen(suffix);
+  return s.size() >= n && s.compare(s.size() - n, n, suffix) == 0;
+}
+
+bool is_cxx_source(std::string_view path) {
+  return ends_with(path, ".cc") || ends_with(path, ".cpp") ||
+         ends_with(path, ".cxx");
+}
+
+bool is_source(std::string_view path) {
+  return ends_with(path, ".c") || is_cxx_source(path);
+}
+
+bool is_header(std::string_view path) {
+  return ends_with(path, ".h") || ends_with(path, ".hh") ||
+         ends_with(path, ".hpp");
+}
+
+bool is_linkable(std::string_view path) {
+  return ends_with(path, ".o") || ends_with(path, ".a") ||
+         ends_with(path, ".so");
+}
+
+std::string dirname(const std::string& path) {
+  size_t slash = path.rfind('/');
+  if (slash == std::string::npos) {
+    return ".";
+  } else if (slash == 0) {
+    return "/";
+  }
+  return path.substr(0, slash);
+}
+
+} // namespace
+
+std::string output_file(const BuildGraph& graph, size_t node,
+                        const std::string& output_dir) {
+  return std::string(output_dir).append("/").append(graph.output(node));
+}
+
+std::string dep_file(const BuildGraph& graph, uint32_t dep,
+                     const std::string& output_dir) {
+  std::string_view path = graph.paths().path(dep);
+  if (graph.producer(dep).has_value()) {
+    return std::string(output_dir).append("/").append(path);
+  }
+  return std::string(path);
+}
+
+std::string depfile_path(const std::string& output) {
+  return std::string(output).append(".d");
+}
+
+bool writes_depfile(const BuildGraph& graph, size_t node) {
+  IdRange deps = graph.deps(node);
+  const PathTable& paths = graph.paths();
+  return std::count_if(deps.begin(), deps.end(), [&paths](uint32_t dep) {
+           return is_source(paths.path(dep));
+         }) == 1;
+}
+
+std::vector<std::string> deduce_command(const BuildGraph& graph, size_t node,
+                                        const std::string& output_dir) {
+  const PathTable& paths = graph.paths();
+  IdRange deps = graph.deps(node);
+  bool object = ends_with(graph.output(node), ".o");
+  bool cxx = std::any_of(deps.begin(), deps.end(), [&paths](uint32_t dep) {
+    return is_cxx_source(paths.path(dep));
+  });
+
+  std::vector<std::string> argv;
+  argv.push_back(cxx ? "g++" : "gcc");
+  if (object) {
+    argv.push_back("-c");
+  }
+  std::string output = output_file(graph, node, output_dir);
+  argv.push_back("-o");
+  argv.push_back(output);
+  if (writes_depfile(graph, node)) {
+    // -MMD rather than -MD leaves out system headers, which make depfiles
+    // several times larger and almost never change.
+    argv.push_back("-MMD");
+    argv.push_back("-MF");
+    argv.push_back(depfile_path(output));
+  }
+
+  std::vector<std::string> include_dirs;
+  for (uint32_t dep : deps) {
+    std::string_view name = paths.path(dep);
+    std::string path = dep_file(graph, dep, output_dir);
+    if (is_source(name) || (!object && is_linkable(name))) {
+      argv.push_back(path);
+    } else if (is_header(name)) {
+      std::string dir = dirname(path);
+      if (std::find(include_dirs.begin(), include_dirs.end(), dir) ==
+          include_dirs.end()) {
+        include_dirs.push_back(dir);
+      }
+    }
+  }
+
+  for (const std::string& dir : include_dirs) {
+    argv.push_back(std::string("-I").append(dir));
+  }
+  return argv;
+}
+
+std::string format_command(const std::vector<std::string>& argv) {
+  std::string r;
+  for (const std::string& arg : argv) {
+    if (!r.empty()) {
+      r.push_back(' ');
+    }
+    r.append(arg);
+  }
+  return r;
+}
+
+} // namespace unixbuild
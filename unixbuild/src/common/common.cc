@@ -1,5 +1,10 @@
 #include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cstdlib>
 #include <fcntl.h>
+#include <sys/mman.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "unixbuild/common.h"
@@ -18,6 +23,39 @@ void trim_whitespace(std::string& s) {
           s.end());
 }
 
+std::string_view trim_whitespace(std::string_view s) {
+  size_t start = 0;
+  while (start < s.size() && std::isspace((unsigned char)s[start])) {
+    start++;
+  }
+
+  size_t end = s.size();
+  while (end > start && std::isspace((unsigned char)s[end - 1])) {
+    end--;
+  }
+  return s.substr(start, end - start);
+}
+
+void split_string(std::string_view s, std::vector<std::string_view>& out,
+                  char ch) {
+  size_t n = s.size();
+  size_t i = 0;
+  while (i < n) {
+    while (i < n && s[i] == ch) {
+      i++;
+    }
+
+    size_t start = i;
+    while (i < n && s[i] != ch) {
+      i++;
+    }
+
+    if (i > start) {
+      out.push_back(s.substr(start, i - start));
+    }
+  }
+}
+
 void split_string(const std::string& s, std::vector<std::string>& out,
                   char ch) {
   size_t outer = 0;
@@ -46,6 +84,169 @@ void split_string(const std::string& s, std::vector<std::string>& out,
   }
 }
 
+bool FileStamp::operator==(const FileStamp& other) const {
+  return dev == other.dev && ino == other.ino && size == other.size &&
+         mtime.tv_sec == other.mtime.tv_sec &&
+         mtime.tv_nsec == other.mtime.tv_nsec;
+}
+
+FileStamp stat_file(const char* path) {
+  struct stat st;
+  if (stat(path, &st) < 0) {
+    throw ExitException(std::string("could not stat file: ").append(path), 2);
+  }
+
+  FileStamp stamp;
+  stamp.dev = st.st_dev;
+  stamp.ino = st.st_ino;
+  stamp.mtime = st.st_mtim;
+  stamp.size = st.st_size;
+  return stamp;
+}
+
+std::string canonicalize_path(const char* path) {
+  // Passing NULL as the second argument asks `realpath` to allocate a buffer
+  // of the right size for us, which we are then responsible for freeing.
+  char* resolved = realpath(path, NULL);
+  if (resolved == NULL) {
+    throw ExitException(std::string("could not resolve path: ").append(path),
+                        2);
+  }
+
+  std::string r(resolved);
+  free(resolved);
+  return r;
+}
+
+std::string normalize_path(std::string_view path) {
+  std::vector<std::string_view> parts;
+  split_string(path, parts, '/');
+  bool absolute = !path.empty() && path[0] == '/';
+  std::vector<std::string_view> kept;
+  for (std::string_view part : parts) {
+    if (part == ".") {
+      continue;
+    }
+    if (part == ".." && !kept.empty() && kept.back() != "..") {
+      kept.pop_back();
+    } else if (part != ".." || !absolute) {
+      // There is nothing above the root, so `/..` is `/`.
+      kept.push_back(part);
+    }
+  }
+
+  std::string normalized = absolute ? "/" : "";
+  for (size_t i = 0; i < kept.size(); i++) {
+    if (i > 0) {
+      normalized.push_back('/');
+    }
+    normalized.append(kept[i]);
+  }
+  return normalized.empty() ? "." : normalized;
+}
+
+void create_directories(const std::string& path, mode_t mode) {
+  // Create each prefix of the path in turn, ignoring the ones that already
+  // exist.
+  for (size_t i = 1; i <= path.size(); i++) {
+    if (i < path.size() && path[i] != '/') {
+      continue;
+    }
+
+    std::string prefix = path.substr(0, i);
+    if (mkdir(prefix.c_str(), mode) < 0 && errno != EEXIST) {
+      throw ExitException(
+          std::string("could not create directory: ").append(prefix), 2);
+    }
+  }
+}
+
+double monotonic_seconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+std::string cache_directory() {
+  const char* xdg = getenv("XDG_CACHE_HOME");
+  if (xdg != NULL && xdg[0] == '/') {
+    return std::string(xdg).append("/unixbuild");
+  }
+  const char* home = getenv("HOME");
+  if (home != NULL && home[0] == '/') {
+    return std::string(home).append("/.cache/unixbuild");
+  }
+  return "";
+}
+
+void write_file_atomically(const std::string& path,
+                           const std::string& contents) {
+  std::string tmp_path = path + ".tmp.XXXXXX";
+  int fd = mkstemp(tmp_path.data());
+  if (fd < 0) {
+    throw ExitException(std::string("could not write file: ").append(path), 2);
+  }
+
+  size_t written = 0;
+  while (written < contents.size()) {
+    ssize_t n = write(fd, contents.data() + written, contents.size() - written);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    } else if (n < 0) {
+      close(fd);
+      unlink(tmp_path.c_str());
+      throw ExitException(std::string("could not write file: ").append(path),
+                          2);
+    }
+    written += n;
+  }
+
+  // `rename` is atomic, so nobody ever sees a half-written file at `path`.
+  if (close(fd) < 0 || rename(tmp_path.c_str(), path.c_str()) < 0) {
+    unlink(tmp_path.c_str());
+    throw ExitException(std::string("could not write file: ").append(path), 2);
+  }
+}
+
+MappedFile::MappedFile(const char* path) : data_(nullptr), size_(0) {
+  int fd = open(path, O_RDONLY);
+  if (fd == -1) {
+    throw ExitException(std::string("could not open file: ").append(path), 2);
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) < 0) {
+    close(fd);
+    throw ExitException(std::string("could not stat file: ").append(path), 2);
+  }
+  size_ = st.st_size;
+
+  // `mmap` rejects a length of zero, and there is nothing to map anyway.
+  if (size_ > 0) {
+    void* p = mmap(NULL, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (p == MAP_FAILED) {
+      close(fd);
+      throw ExitException(std::string("could not map file: ").append(path),
+                          2);
+    }
+    data_ = static_cast<char*>(p);
+
+    // We read the file once from front to back, so ask the kernel to read
+    // ahead aggressively and drop pages behind us.
+    madvise(data_, size_, MADV_SEQUENTIAL);
+  }
+
+  // The mapping keeps its own reference to the file, so the descriptor is no
+  // longer needed.
+  close(fd);
+}
+
+MappedFile::~MappedFile() {
+  if (data_ != nullptr) {
+    munmap(data_, size_);
+  }
+}
+
 constexpr long PAGE_SIZE_DEFAULT = 4096;
 
 std::vector<std::string> read_lines(const char* path) {
@@ -0,0 +1,250 @@
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "unixbuild/batch_io.h"
+#include "unixbuild/command.h"
+#include "unixbuild/common.h"
+#include "unixbuild/depfile.h"
+
+namespace unixbuild {
+
+namespace {
+
+bool is_space(char c) { return c == ' ' || c == '\t' || c == '\r'; }
+
+// Reads the whole file at `path` into `out`. Returns false if it does not
+// exist.
+//
+// Depfiles are small, usually a few hundred bytes, so a couple of `read` calls
+// into a reused buffer are cheaper than setting up and tearing down a memory
+// mapping for each one.
+bool read_file(const std::string& path, std::string& out) {
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    if (errno == ENOENT) {
+      return false;
+    }
+    throw ExitException(std::string("could not open file: ").append(path), 2);
+  }
+
+  out.clear();
+  char buffer[16 * 1024];
+  ssize_t n;
+  while ((n = read(fd, buffer, sizeof buffer)) != 0) {
+    if (n < 0 && errno == EINTR) {
+      continue;
+    } else if (n < 0) {
+      close(fd);
+      throw ExitException(std::string("could not read file: ").append(path),
+                          2);
+    }
+    out.append(buffer, n);
+  }
+  close(fd);
+  return true;
+}
+
+// Returns the dependencies listed in `contents`, made absolute as in
+// `read_depfile`.
+std::vector<std::string> depfile_deps(std::string_view contents,
+                                      const std::string& build_dir) {
+  std::vector<std::string> deps;
+  parse_depfile(contents, [&](std::string_view dep) {
+    if (!dep.empty() && dep[0] == '/') {
+      deps.emplace_back(dep);
+    } else {
+      deps.push_back(std::string(build_dir).append("/").append(dep));
+    }
+  });
+  return deps;
+}
+
+} // namespace
+
+void parse_depfile(std::string_view contents,
+                   const std::function<void(std::string_view)>& on_dep) {
+  // The target ends at the first colon that is followed by whitespace, so
+  // that a colon inside a path does not confuse us.
+  size_t i = 0;
+  size_t n = contents.size();
+  while (i < n && !(contents[i] == ':' &&
+                    (i + 1 == n || is_space(contents[i + 1]) ||
+                     contents[i + 1] == '\n' || contents[i + 1] == '\\'))) {
+    i++;
+  }
+  if (i == n) {
+    throw ExitException("depfile has no target", 2);
+  }
+  i++;
+
+  // Only paths containing escapes are copied into `unescaped`; everything else
+  // is passed to `on_dep` as a view of `contents`.
+  std::string unescaped;
+  while (i < n) {
+    char c = contents[i];
+    if (is_space(c) || c == '\n') {
+      i++;
+      continue;
+    } else if (c == '\\' && i + 1 < n &&
+               (contents[i + 1] == '\n' || contents[i + 1] == '\r')) {
+      i += 2;
+      continue;
+    }
+
+    size_t start = i;
+    bool escaped = false;
+    while (i < n && !is_space(contents[i]) && contents[i] != '\n') {
+      if (contents[i] == '\\' && i + 1 < n) {
+        char next = contents[i + 1];
+        if (next == '\n' || next == '\r') {
+          break;
+        }
+        escaped = escaped || next == ' ' || next == '#' || next == '\\';
+        i += 2;
+      } else {
+        escaped = escaped || contents[i] == '$';
+        i++;
+      }
+    }
+
+    std::string_view token = contents.substr(start, i - start);
+    if (!escaped) {
+      on_dep(token);
+      continue;
+    }
+
+    unescaped.clear();
+    for (size_t j = 0; j < token.size(); j++) {
+      if (token[j] == '\\' && j + 1 < token.size() &&
+          (token[j + 1] == ' ' || token[j + 1] == '#' ||
+           token[j + 1] == '\\')) {
+        j++;
+      } else if (token[j] == '$' && j + 1 < token.size() &&
+                 token[j + 1] == '$') {
+        j++;
+      }
+      unescaped.push_back(token[j]);
+    }
+    on_dep(unescaped);
+  }
+}
+
+std::vector<std::string> read_depfile(const std::string& path,
+                                      const std::string& build_dir) {
+  std::string contents;
+  if (!read_file(path, contents)) {
+    return {};
+  }
+  return depfile_deps(contents, build_dir);
+}
+
+void write_depfile(const std::string& path, const std::string& output,
+                   const std::vector<std::string>& deps) {
+  auto escape = [](std::string& out, const std::string& s) {
+    for (char c : s) {
+      if (c == ' ' || c == '#' || c == '\\') {
+        out.push_back('\\');
+      } else if (c == '$') {
+        out.push_back('$');
+      }
+      out.push_back(c);
+    }
+  };
+
+  std::string contents;
+  escape(contents, output);
+  contents.push_back(':');
+  for (const std::string& dep : deps) {
+    contents.append(" \\\n ");
+    escape(contents, dep);
+  }
+  contents.push_back('\n');
+  write_file_atomically(path, contents);
+}
+
+const std::vector<uint32_t>&
+DiscoveredDeps::get(const std::string& output, const std::string& build_dir) {
+  auto it = deps_.find(output);
+  if (it != deps_.end()) {
+    return it->second;
+  }
+
+  depfiles_read_++;
+  std::vector<uint32_t>& ids = deps_[output];
+  // Paths are interned straight out of the depfile, without building a list
+  // of strings first, since this is done for every output in the build.
+  std::string absolute;
+  try {
+    if (read_file(depfile_path(output), buffer_)) {
+      parse_depfile(buffer_, [&](std::string_view dep) {
+        if (!dep.empty() && dep[0] == '/') {
+          ids.push_back(paths_.intern(dep));
+        } else {
+          absolute.assign(build_dir).append("/").append(dep);
+          ids.push_back(paths_.intern(absolute));
+        }
+      });
+    }
+  } catch (ExitException& e) {
+    // A truncated depfile tells us nothing; the output's listed dependencies
+    // will have to do until it is rebuilt.
+    ids.clear();
+  }
+  return ids;
+}
+
+void DiscoveredDeps::prefetch(const std::vector<std::string>& outputs,
+                              const std::string& build_dir, ThreadPool& pool) {
+  std::vector<const std::string*> missing;
+  for (const std::string& output : outputs) {
+    if (deps_.count(output) == 0) {
+      missing.push_back(&output);
+    }
+  }
+
+  std::vector<std::vector<std::string>> read(missing.size());
+  for_each_batch(pool, missing.size(), [&](size_t begin, size_t end) {
+    std::vector<std::string> paths;
+    for (size_t i = begin; i < end; i++) {
+      paths.push_back(depfile_path(*missing[i]));
+    }
+    std::vector<const char*> batch;
+    for (const std::string& path : paths) {
+      batch.push_back(path.c_str());
+    }
+    std::vector<ReadResult> results = read_files(batch);
+    for (size_t i = begin; i < end; i++) {
+      // A depfile that cannot be read, for whatever reason, or that is
+      // truncated, lists nothing, as in `get`.
+      if (results[i - begin].error != 0) {
+        continue;
+      }
+      try {
+        read[i] = depfile_deps(results[i - begin].contents, build_dir);
+      } catch (ExitException& e) {
+        read[i].clear();
+      }
+    }
+  });
+
+  // The path table is not thread-safe, so the paths are interned afterwards.
+  for (size_t i = 0; i < missing.size(); i++) {
+    if (deps_.count(*missing[i]) == 0) {
+      depfiles_read_++;
+      set(*missing[i], read[i]);
+    }
+  }
+}
+
+void DiscoveredDeps::set(const std::string& output,
+                         const std::vector<std::string>& deps) {
+  std::vector<uint32_t>& ids = deps_[output];
+  ids.clear();
+  for (const std::string& dep : deps) {
+    ids.push_back(paths_.intern(dep));
+  }
+}
+
+} // namespace unixbuild
@@ -0,0 +1,78 @@
+#include <cerrno>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+#include "unixbuild/common.h"
+#include "unixbuild/event_loop.h"
+
+namespace unixbuild {
+
+namespace {
+
+// The most events that one call to `epoll_wait` returns. Any more are returned
+// by the next call.
+constexpr int MAX_EVENTS = 64;
+
+} // namespace
+
+EventLoop::EventLoop() {
+  fd_ = epoll_create1(EPOLL_CLOEXEC);
+  if (fd_ < 0) {
+    throw ExitException("epoll_create1() returned an error status", 1);
+  }
+}
+
+EventLoop::~EventLoop() { close(fd_); }
+
+void EventLoop::add(int fd, std::function<void()> on_readable) {
+  watch(fd, EPOLLIN, std::move(on_readable));
+}
+
+void EventLoop::add_writable(int fd, std::function<void()> on_writable) {
+  watch(fd, EPOLLOUT, std::move(on_writable));
+}
+
+void EventLoop::watch(int fd, uint32_t events,
+                      std::function<void()> callback) {
+  struct epoll_event event = {};
+  event.events = events;
+  event.data.fd = fd;
+  if (epoll_ctl(fd_, EPOLL_CTL_ADD, fd, &event) < 0) {
+    throw ExitException("epoll_ctl() returned an error status", 1);
+  }
+  callbacks_[fd] = std::make_shared<std::function<void()>>(std::move(callback));
+}
+
+void EventLoop::remove(int fd) {
+  if (callbacks_.erase(fd) > 0) {
+    epoll_ctl(fd_, EPOLL_CTL_DEL, fd, NULL);
+  }
+}
+
+int EventLoop::run_once(int timeout_ms) {
+  struct epoll_event events[MAX_EVENTS];
+  int n = epoll_wait(fd_, events, MAX_EVENTS, timeout_ms);
+  if (n < 0) {
+    if (errno == EINTR) {
+      return 0;
+    }
+    throw ExitException("epoll_wait() returned an error status", 1);
+  }
+
+  int called = 0;
+  for (int i = 0; i < n; i++) {
+    // An earlier callback in this batch may have removed this descriptor, or
+    // even closed it and registered a new one with the same number; in the
+    // latter case the new one is simply reported a little early.
+    auto it = callbacks_.find(events[i].data.fd);
+    if (it == callbacks_.end()) {
+      continue;
+    }
+    std::shared_ptr<std::function<void()>> callback = it->second;
+    (*callback)();
+    called++;
+  }
+  return called;
+}
+
+} // namespace unixbuild
@@ -0,0 +1,406 @@
+#include <algorithm>
+#include <unordered_map>
+#include <utility>
+
+#include "unixbuild/common.h"
+#include "unixbuild/graph.h"
+
+namespace unixbuild {
+
+namespace {
+
+// With a thread pool, edges are resolved in blocks of this many nodes at a
+// time.
+constexpr size_t FINISH_BLOCK_SIZE = 4096;
+
+} // namespace
+
+BuildGraph::BuildGraph(const BuildFile& build_file) {
+  std::vector<std::string_view> deps;
+  for (const Rule& rule : build_file.rules) {
+    deps.assign(rule.deps.begin(), rule.deps.end());
+    add_rule(rule.output, deps);
+  }
+  finish();
+}
+
+BuildGraph BuildGraph::parse(std::string_view contents, ThreadPool* pool) {
+  BuildGraph graph;
+  parse_rules(contents, [&graph](const RuleView& rule) {
+    graph.add_rule(rule.output, rule.deps);
+  });
+  graph.finish(pool);
+  return graph;
+}
+
+BuildGraph load_build_graph(const std::string& path, ThreadPool* pool) {
+  MappedFile file(path.c_str());
+  return BuildGraph::parse(file.contents(), pool);
+}
+
+void BuildGraph::add_rule(std::string_view output,
+                          const std::vector<std::string_view>& deps) {
+  outputs_.push_back(paths_.intern(output));
+  for (std::string_view dep : deps) {
+    deps_.push_back(paths_.intern(dep));
+  }
+  dep_offsets_.push_back(deps_.size());
+}
+
+void BuildGraph::finish(ThreadPool* pool) {
+  size_t n = size();
+  producers_.assign(paths_.size(), NO_NODE);
+  for (size_t i = 0; i < n; i++) {
+    uint32_t& producer = producers_[outputs_[i]];
+    if (producer != NO_NODE) {
+      throw ExitException(std::string("more than one rule for output: ")
+                              .append(paths_.path(outputs_[i])),
+                          2);
+    }
+    producer = i;
+  }
+
+  // Edges can only be resolved once every output is known, since a rule may
+  // depend on a rule that appears later in the file.
+  if (pool == nullptr || pool->size() == 1) {
+    rule_dep_offsets_.reserve(n + 1);
+    rule_dep_offsets_.push_back(0);
+    for (size_t i = 0; i < n; i++) {
+      for (uint32_t dep : deps(i)) {
+        if (producers_[dep] != NO_NODE) {
+          rule_deps_.push_back(producers_[dep]);
+        }
+      }
+      rule_dep_offsets_.push_back(rule_deps_.size());
+    }
+  } else {
+    // Each block of nodes counts its edges, and then, once the counts have
+    // been summed into offsets, writes them, independently of the others.
+    size_t blocks = (n + FINISH_BLOCK_SIZE - 1) / FINISH_BLOCK_SIZE;
+    auto for_each_block = [&](const std::function<void(size_t)>& f) {
+      pool->parallel_for(blocks, [&](size_t block) {
+        size_t end = std::min(n, (block + 1) * FINISH_BLOCK_SIZE);
+        for (size_t i = block * FINISH_BLOCK_SIZE; i < end; i++) {
+          f(i);
+        }
+      });
+    };
+
+    rule_dep_offsets_.assign(n + 1, 0);
+    for_each_block([this](size_t i) {
+      for (uint32_t dep : deps(i)) {
+        if (producers_[dep] != NO_NODE) {
+          rule_dep_offsets_[i + 1]++;
+        }
+      }
+    });
+    for (size_t i = 0; i < n; i++) {
+      rule_dep_offsets_[i + 1] += rule_dep_offsets_[i];
+    }
+    rule_deps_.resize(rule_dep_offsets_[n]);
+    for_each_block([this](size_t i) {
+      uint32_t* out = rule_deps_.data() + rule_dep_offsets_[i];
+      for (uint32_t dep : deps(i)) {
+        if (producers_[dep] != NO_NODE) {
+          *out++ = producers_[dep];
+        }
+      }
+    });
+  }
+
+  outputs_.shrink_to_fit();
+  deps_.shrink_to_fit();
+  dep_offsets_.shrink_to_fit();
+  rule_deps_.shrink_to_fit();
+}
+
+std::optional<size_t> BuildGraph::find(std::string_view output) const {
+  std::optional<uint32_t> id = paths_.find(output);
+  if (!id.has_value()) {
+    return {};
+  }
+  return producer(id.value());
+}
+
+std::vector<size_t> BuildGraph::closure(size_t target) const {
+  enum class Mark : uint8_t { UNVISITED, IN_PROGRESS, DONE };
+  std::vector<Mark> marks(size(), Mark::UNVISITED);
+  std::vector<size_t> order;
+
+  // This is a depth-first search that emits nodes in post-order. It uses an
+  // explicit stack of (node, next edge to follow) rather than recursion so that
+  // a long chain of dependencies cannot overflow the call stack.
+  std::vector<std::pair<size_t, size_t>> stack;
+  stack.emplace_back(target, 0);
+  marks[target] = Mark::IN_PROGRESS;
+  while (!stack.empty()) {
+    auto& [node, edge] = stack.back();
+    IdRange edges = rule_deps(node);
+    if (edge == edges.size()) {
+      marks[node] = Mark::DONE;
+      order.push_back(node);
+      stack.pop_back();
+      continue;
+    }
+
+    size_t dep = edges[edge++];
+    if (marks[dep] == Mark::IN_PROGRESS) {
+      throw ExitException(
+          std::string("dependency cycle involving: ").append(output(dep)), 2);
+    } else if (marks[dep] == Mark::UNVISITED) {
+      marks[dep] = Mark::IN_PROGRESS;
+      stack.emplace_back(dep, 0);
+    }
+  }
+
+  return order;
+}
+
+BuildFileIndex::BuildFileIndex(std::string contents)
+    : contents_(std::move(contents)) {
+  // A duplicate is only reported once the whole file has parsed, so that a
+  // syntax error anywhere takes precedence, as it does in `BuildGraph`.
+  std::optional<size_t> duplicate;
+  std::vector<std::string_view> subdirs;
+  parse_rules(
+      contents_,
+      [this, &duplicate](const RuleView& rule) {
+        if (outputs_.intern(rule.output) != offsets_.size() &&
+            !duplicate.has_value()) {
+          duplicate = offsets_.size();
+        }
+        offsets_.push_back(rule.output.data() - contents_.data());
+      },
+      {}, [&subdirs](std::string_view dir) { subdirs.push_back(dir); });
+  if (duplicate.has_value()) {
+    RuleView view;
+    parse_rule(duplicate.value(), view);
+    throw ExitException(
+        std::string("more than one rule for output: ").append(view.output), 2);
+  }
+  offsets_.shrink_to_fit();
+
+  for (std::string_view dir : subdirs) {
+    std::string normalized = normalize_path(dir);
+    if (normalized == "." || normalized[0] == '/' || normalized == ".." ||
+        normalized.compare(0, 3, "../") == 0) {
+      throw ExitException(
+          std::string("subdir is not below the build file: ").append(dir), 2);
+    }
+    subdirs_.intern(normalized);
+  }
+  // Otherwise the rule could never be found, since its output would be
+  // looked for in the subdirectory's build file.
+  for (size_t rule = 0; subdirs_.size() > 0 && rule < size(); rule++) {
+    std::string_view output = outputs_.path(rule);
+    std::optional<std::string_view> subdir = subdir_of(output);
+    if (subdir.has_value()) {
+      throw ExitException(std::string("output ")
+                              .append(output)
+                              .append(" belongs in the build file of ")
+                              .append(subdir.value()),
+                          2);
+    }
+  }
+}
+
+BuildFileIndex load_build_file_index(const std::string& path) {
+  MappedFile file(path.c_str());
+  return BuildFileIndex(std::string(file.contents()));
+}
+
+void BuildFileIndex::parse_rule(size_t rule, RuleView& view) const {
+  // The text from the output to the end of the line parses to the same rule
+  // as the whole line, which has already been checked.
+  std::string_view line = std::string_view(contents_).substr(offsets_[rule]);
+  line = line.substr(0, line.find('\n'));
+  parse_line(line, 0, view);
+}
+
+std::optional<std::string_view>
+BuildFileIndex::subdir_of(std::string_view path) const {
+  if (subdirs_.size() == 0) {
+    return {};
+  }
+  // Each directory that the path is in ends just before one of its slashes,
+  // and the longest ends at the last.
+  size_t slash = path.size();
+  while (slash > 0 && (slash = path.rfind('/', slash - 1)) != path.npos) {
+    std::optional<uint32_t> subdir = subdirs_.find(path.substr(0, slash));
+    if (subdir.has_value()) {
+      return subdirs_.path(subdir.value());
+    }
+  }
+  return {};
+}
+
+class BuildFileIndex::Walker {
+public:
+  // Follows dependencies from `root` into the build files of subdirectories,
+  // loading them with `load_subdir`, unless it is null.
+  Walker(const BuildFileIndex& root, const SubdirLoader* load_subdir)
+      : load_subdir_(load_subdir) {
+    files_.push_back(File{"", &root, std::vector<bool>(root.size()), {}});
+  }
+
+  // Returns the file, by the order in which it was loaded, and the rule in
+  // it, that produce `path`, if any.
+  std::optional<std::pair<size_t, size_t>> locate(std::string_view path) {
+    size_t file = 0;
+    std::optional<std::string_view> subdir;
+    while (load_subdir_ != nullptr &&
+           (subdir = files_[file].index->subdir_of(path)).has_value()) {
+      std::string dir = files_[file].dir;
+      if (!dir.empty()) {
+        dir.push_back('/');
+      }
+      dir.append(subdir.value());
+      path.remove_prefix(subdir->size() + 1);
+      file = open(dir);
+    }
+    std::optional<size_t> rule = files_[file].index->find(path);
+    if (!rule.has_value()) {
+      return {};
+    }
+    return std::make_pair(file, rule.value());
+  }
+
+  // Finds `rule` of `file` and every rule that it depends on.
+  void reach(size_t file, size_t rule) {
+    std::vector<std::pair<size_t, size_t>> stack = {{file, rule}};
+    files_[file].reached[rule] = true;
+    RuleView view;
+    while (!stack.empty()) {
+      auto [next_file, next_rule] = stack.back();
+      stack.pop_back();
+      files_[next_file].rules.push_back(next_rule);
+      parse(next_file, next_rule, view);
+      for (std::string_view dep : view.deps) {
+        std::optional<std::pair<size_t, size_t>> producer = locate(dep);
+        if (producer.has_value() &&
+            !files_[producer->first].reached[producer->second]) {
+          files_[producer->first].reached[producer->second] = true;
+          stack.push_back(producer.value());
+        }
+      }
+    }
+  }
+
+  // Returns the graph of the rules that have been reached.
+  BuildGraph graph(ThreadPool* pool) {
+    BuildGraph graph;
+    RuleView view;
+    for (size_t file = 0; file < files_.size(); file++) {
+      std::vector<size_t>& rules = files_[file].rules;
+      std::sort(rules.begin(), rules.end());
+      for (size_t rule : rules) {
+        parse(file, rule, view);
+        graph.add_rule(view.output, view.deps);
+      }
+    }
+    graph.finish(pool);
+    return graph;
+  }
+
+private:
+  struct File {
+    // Relative to the root's directory, or empty for the root itself.
+    std::string dir;
+    const BuildFileIndex* index;
+    std::vector<bool> reached;
+    std::vector<size_t> rules;
+  };
+
+  // Returns the number of the file of `dir`, loading it if need be.
+  size_t open(const std::string& dir) {
+    auto it = by_dir_.find(dir);
+    if (it != by_dir_.end()) {
+      return it->second;
+    }
+    loaded_.push_back((*load_subdir_)(dir));
+    const BuildFileIndex* index = loaded_.back().get();
+    files_.push_back(File{dir, index, std::vector<bool>(index->size()), {}});
+    return by_dir_[dir] = files_.size() - 1;
+  }
+
+  // Parses `rule` of `file` into `view`, with its relative paths made
+  // relative to the root's directory.
+  void parse(size_t file, size_t rule, RuleView& view) {
+    const File& f = files_[file];
+    f.index->parse_rule(rule, view);
+    if (f.dir.empty()) {
+      return;
+    }
+
+    // Reserving room first means that no string moves, which would leave
+    // views of short strings pointing at their old copies.
+    paths_.clear();
+    paths_.reserve(view.deps.size() + 1);
+    // The parser rejects empty names, so every path has a first character.
+    auto rebase = [this, &f](std::string_view path) {
+      paths_.push_back(path[0] == '/'
+                           ? std::string(path)
+                           : normalize_path(f.dir + "/" + std::string(path)));
+      return std::string_view(paths_.back());
+    };
+    view.output = rebase(view.output);
+    for (std::string_view& dep : view.deps) {
+      dep = rebase(dep);
+    }
+  }
+
+  const SubdirLoader* load_subdir_;
+  // In the order that they were loaded, starting with the root.
+  std::vector<File> files_;
+  std::unordered_map<std::string, size_t> by_dir_;
+  // Keeps the loaded files alive as long as `files_` points to them.
+  std::vector<std::shared_ptr<const BuildFileIndex>> loaded_;
+  // The paths of the last rule parsed from a subdirectory.
+  std::vector<std::string> paths_;
+};
+
+BuildGraph BuildFileIndex::subgraph(size_t rule, ThreadPool* pool) const {
+  Walker walker(*this, nullptr);
+  walker.reach(0, rule);
+  return walker.graph(pool);
+}
+
+BuildGraph BuildFileIndex::target_graph(std::string_view target,
+                                        const SubdirLoader& load_subdir,
+                                        ThreadPool* pool) const {
+  Walker walker(*this, &load_subdir);
+  if (target.empty()) {
+    if (size() == 0) {
+      throw ExitException("build file has no rules", 2);
+    }
+    walker.reach(0, 0);
+    return walker.graph(pool);
+  }
+
+  std::optional<std::pair<size_t, size_t>> rule = walker.locate(target);
+  if (rule.has_value()) {
+    walker.reach(rule->first, rule->second);
+    BuildGraph graph = walker.graph(pool);
+    // A path that is spelled differently from the rule's output, such as
+    // with `./` in it, can still find its subdirectory's rule.
+    if (graph.find(target).has_value()) {
+      return graph;
+    }
+  }
+  throw ExitException(std::string("unknown target: ").append(target), 2);
+}
+
+size_t BuildFileIndex::memory_usage() const {
+  return sizeof *this + contents_.capacity() + outputs_.memory_usage() +
+         offsets_.capacity() * sizeof(size_t) + subdirs_.memory_usage();
+}
+
+size_t BuildGraph::memory_usage() const {
+  return sizeof *this + paths_.memory_usage() +
+         (outputs_.capacity() + dep_offsets_.capacity() + deps_.capacity() +
+          rule_dep_offsets_.capacity() + rule_deps_.capacity() +
+          producers_.capacity()) *
+             sizeof(uint32_t);
+}
+
+} // namespace unixbuild
@@ -0,0 +1,301 @@
+#include <algorithm>
+#include <cerrno>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <unistd.h>
+#include <unordered_set>
+#include <vector>
+
+#include "unixbuild/batch_io.h"
+#include "unixbuild/hashing.h"
+
+namespace unixbuild {
+
+namespace {
+
+constexpr uint64_t PRIME1 = 11400714785074694791ULL;
+constexpr uint64_t PRIME2 = 14029467366897019727ULL;
+constexpr uint64_t PRIME3 = 1609587929392839161ULL;
+constexpr uint64_t PRIME4 = 9650029242287828579ULL;
+constexpr uint64_t PRIME5 = 2870177450012600261ULL;
+
+uint64_t rotl(uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+
+// Unaligned little-endian loads. `memcpy` compiles to a single instruction on
+// x86, where unaligned loads are allowed.
+uint64_t read64(const char* p) {
+  uint64_t x;
+  memcpy(&x, p, sizeof x);
+  return x;
+}
+
+uint32_t read32(const char* p) {
+  uint32_t x;
+  memcpy(&x, p, sizeof x);
+  return x;
+}
+
+uint64_t mix_round(uint64_t acc, uint64_t input) {
+  acc += input * PRIME2;
+  acc = rotl(acc, 31);
+  return acc * PRIME1;
+}
+
+uint64_t merge_round(uint64_t acc, uint64_t value) {
+  acc ^= mix_round(0, value);
+  return acc * PRIME1 + PRIME4;
+}
+
+// Files up to this size are read into memory to be hashed by `prefetch`,
+// rather than mapped.
+constexpr off_t MAX_BATCH_READ_SIZE = 64 * 1024;
+
+// The version of the on-disk format below. Files with any other version are
+// ignored.
+constexpr const char* HASH_CACHE_HEADER = "unixbuild hashes 1";
+
+void append_stamp(std::string& out, const FileStamp& stamp) {
+  char buffer[128];
+  snprintf(buffer, sizeof buffer, "%" PRIu64 " %" PRIu64 " %" PRId64
+           " %ld %" PRId64,
+           (uint64_t)stamp.dev, (uint64_t)stamp.ino,
+           (int64_t)stamp.mtime.tv_sec, stamp.mtime.tv_nsec,
+           (int64_t)stamp.size);
+  out.append(buffer);
+}
+
+void append_hash(std::string& out, uint64_t hash) {
+  char buffer[32];
+  snprintf(buffer, sizeof buffer, " %016" PRIx64, hash);
+  out.append(buffer);
+}
+
+// Parses an unsigned integer in `base`. Returns false if `field` is not
+// entirely made of digits.
+bool parse_u64(std::string_view field, int base, uint64_t& out) {
+  std::string s(field);
+  char* end;
+  errno = 0;
+  out = strtoull(s.c_str(), &end, base);
+  return !s.empty() && *end == '\0' && errno == 0;
+}
+
+// Parses a stamp written by `append_stamp` followed by a hash from the first
+// six of `fields`.
+bool parse_stamp_and_hash(const std::vector<std::string_view>& fields,
+                          FileStamp& stamp, uint64_t& hash) {
+  uint64_t values[5];
+  for (size_t i = 0; i < 5; i++) {
+    if (!parse_u64(fields[i], 10, values[i])) {
+      return false;
+    }
+  }
+  stamp.dev = values[0];
+  stamp.ino = values[1];
+  stamp.mtime.tv_sec = values[2];
+  stamp.mtime.tv_nsec = values[3];
+  stamp.size = values[4];
+  return parse_u64(fields[5], 16, hash);
+}
+
+// Calls `f` with the space-separated fields of every line of the file at
+// `path` after the header line, if the file exists and its header is `header`.
+template <typename F>
+void read_state_file(const std::string& path, const char* header, F f) {
+  if (access(path.c_str(), F_OK) < 0) {
+    return;
+  }
+
+  MappedFile file(path.c_str());
+  std::vector<std::string_view> lines;
+  split_string(file.contents(), lines, '\n');
+  if (lines.empty() || lines[0] != header) {
+    return;
+  }
+
+  std::vector<std::string_view> fields;
+  for (size_t i = 1; i < lines.size(); i++) {
+    fields.clear();
+    split_string(lines[i], fields, ' ');
+    f(fields);
+  }
+}
+
+} // namespace
+
+uint64_t hash_bytes(std::string_view data, uint64_t seed) {
+  const char* p = data.data();
+  const char* end = p + data.size();
+  uint64_t h;
+
+  if (data.size() >= 32) {
+    uint64_t v1 = seed + PRIME1 + PRIME2;
+    uint64_t v2 = seed + PRIME2;
+    uint64_t v3 = seed;
+    uint64_t v4 = seed - PRIME1;
+    // The four lanes do not depend on each other, so each iteration's four
+    // multiplications can be in flight at once.
+    const char* limit = end - 32;
+    do {
+      v1 = mix_round(v1, read64(p));
+      v2 = mix_round(v2, read64(p + 8));
+      v3 = mix_round(v3, read64(p + 16));
+      v4 = mix_round(v4, read64(p + 24));
+      p += 32;
+    } while (p <= limit);
+
+    h = rotl(v1, 1) + rotl(v2, 7) + rotl(v3, 12) + rotl(v4, 18);
+    h = merge_round(h, v1);
+    h = merge_round(h, v2);
+    h = merge_round(h, v3);
+    h = merge_round(h, v4);
+  } else {
+    h = seed + PRIME5;
+  }
+
+  h += data.size();
+
+  while (p + 8 <= end) {
+    h ^= mix_round(0, read64(p));
+    h = rotl(h, 27) * PRIME1 + PRIME4;
+    p += 8;
+  }
+  if (p + 4 <= end) {
+    h ^= (uint64_t)read32(p) * PRIME1;
+    h = rotl(h, 23) * PRIME2 + PRIME3;
+    p += 4;
+  }
+  while (p < end) {
+    h ^= (uint64_t)(unsigned char)*p * PRIME5;
+    h = rotl(h, 11) * PRIME1;
+    p++;
+  }
+
+  h ^= h >> 33;
+  h *= PRIME2;
+  h ^= h >> 29;
+  h *= PRIME3;
+  h ^= h >> 32;
+  return h;
+}
+
+uint64_t hash_file(const char* path) {
+  MappedFile file(path);
+  return hash_bytes(file.contents());
+}
+
+uint64_t ContentHashCache::hash(const std::string& path,
+                                const FileStamp& stamp) {
+  Key key{stamp.dev, stamp.ino};
+  auto it = entries_.find(key);
+  if (it != entries_.end() && it->second.stamp == stamp) {
+    return it->second.hash;
+  }
+
+  files_hashed_++;
+  uint64_t hash = hash_file(path.c_str());
+  entries_[key] = Entry{stamp, hash};
+  dirty_ = true;
+  return hash;
+}
+
+void ContentHashCache::prefetch(
+    const std::vector<std::pair<std::string, FileStamp>>& files,
+    ThreadPool& pool) {
+  std::vector<const std::pair<std::string, FileStamp>*> missing;
+  std::unordered_set<Key, KeyHash> seen;
+  for (const auto& file : files) {
+    Key key{file.second.dev, file.second.ino};
+    auto it = entries_.find(key);
+    if ((it == entries_.end() || !(it->second.stamp == file.second)) &&
+        seen.insert(key).second) {
+      missing.push_back(&file);
+    }
+  }
+
+  // Small files, which most sources and headers are, are read in batches;
+  // larger ones are mapped, one at a time, as in `hash`.
+  std::vector<size_t> small;
+  std::vector<size_t> large;
+  for (size_t i = 0; i < missing.size(); i++) {
+    if (missing[i]->second.size <= MAX_BATCH_READ_SIZE) {
+      small.push_back(i);
+    } else {
+      large.push_back(i);
+    }
+  }
+
+  // Files that cannot be read are left for `hash` to try again, and report.
+  std::vector<uint64_t> hashes(missing.size());
+  std::vector<char> hashed(missing.size());
+  for_each_batch(pool, small.size(), [&](size_t begin, size_t end) {
+    std::vector<const char*> batch;
+    size_t expected_size = 0;
+    for (size_t k = begin; k < end; k++) {
+      const auto& file = *missing[small[k]];
+      batch.push_back(file.first.c_str());
+      // One more byte than the file should have, so that a single read
+      // reaches the end.
+      expected_size =
+          std::max(expected_size, static_cast<size_t>(file.second.size) + 1);
+    }
+    std::vector<ReadResult> results = read_files(batch, expected_size);
+    for (size_t k = begin; k < end; k++) {
+      if (results[k - begin].error == 0) {
+        hashes[small[k]] = hash_bytes(results[k - begin].contents);
+        hashed[small[k]] = true;
+      }
+    }
+  });
+  pool.parallel_for(large.size(), [&](size_t k) {
+    try {
+      hashes[large[k]] = hash_file(missing[large[k]]->first.c_str());
+      hashed[large[k]] = true;
+    } catch (ExitException& e) {
+      // As above.
+    }
+  });
+
+  for (size_t i = 0; i < missing.size(); i++) {
+    if (hashed[i]) {
+      const FileStamp& stamp = missing[i]->second;
+      files_hashed_++;
+      entries_[Key{stamp.dev, stamp.ino}] = Entry{stamp, hashes[i]};
+      dirty_ = true;
+    }
+  }
+}
+
+void ContentHashCache::load(const std::string& path) {
+  entries_.clear();
+  dirty_ = false;
+  read_state_file(path, HASH_CACHE_HEADER,
+                  [this](const std::vector<std::string_view>& fields) {
+                    Entry entry;
+                    if (fields.size() == 6 &&
+                        parse_stamp_and_hash(fields, entry.stamp,
+                                             entry.hash)) {
+                      entries_[Key{entry.stamp.dev, entry.stamp.ino}] = entry;
+                    }
+                  });
+}
+
+void ContentHashCache::save(const std::string& path) {
+  if (!dirty_) {
+    return;
+  }
+
+  std::string contents(HASH_CACHE_HEADER);
+  contents.append("\n");
+  for (const auto& [key, entry] : entries_) {
+    append_stamp(contents, entry.stamp);
+    append_hash(contents, entry.hash);
+    contents.append("\n");
+  }
+  write_file_atomically(path, contents);
+  dirty_ = false;
+}
+
+} // namespace unixbuild
@@ -0,0 +1,56 @@
+#include <algorithm>
+#include <cmath>
+
+#include "unixbuild/histogram.h"
+
+namespace unixbuild {
+
+void Histogram::record(uint64_t value) {
+  counts_[bucket_of(value)]++;
+  count_++;
+  sum_ += value;
+  min_ = std::min(min_, value);
+  max_ = std::max(max_, value);
+}
+
+uint64_t Histogram::percentile(double p) const {
+  if (count_ == 0) {
+    return 0;
+  }
+
+  // The rank of the value we want, counting from 1.
+  uint64_t rank = static_cast<uint64_t>(std::ceil(p / 100.0 * count_));
+  rank = std::clamp<uint64_t>(rank, 1, count_);
+  uint64_t seen = 0;
+  for (int bucket = 0; bucket < BUCKETS; bucket++) {
+    seen += counts_[bucket];
+    if (seen >= rank) {
+      return std::min(bucket_top(bucket), max_);
+    }
+  }
+  return max_;
+}
+
+int Histogram::bucket_of(uint64_t value) {
+  if (value < 2 * SUB_BUCKETS) {
+    return static_cast<int>(value);
+  }
+  // The position of the highest set bit, and the bits just below it, pick the
+  // bucket.
+  int exponent = 63 - __builtin_clzll(value);
+  int shift = exponent - SUB_BUCKET_BITS;
+  int sub_bucket = static_cast<int>(value >> shift) - SUB_BUCKETS;
+  return (shift + 1) * SUB_BUCKETS + sub_bucket;
+}
+
+uint64_t Histogram::bucket_top(int bucket) {
+  if (bucket < 2 * SUB_BUCKETS) {
+    return bucket;
+  }
+  int shift = bucket / SUB_BUCKETS - 1;
+  uint64_t sub_bucket = bucket % SUB_BUCKETS + SUB_BUCKETS;
+  // For the very last bucket this wraps around to exactly UINT64_MAX.
+  return ((sub_bucket + 1) << shift) - 1;
+}
+
+} // namespace unixbuild
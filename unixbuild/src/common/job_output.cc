@@ -0,0 +1,373 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "unixbuild/common.h"
+#include "unixbuild/job_output.h"
+
+namespace unixbuild {
+
+namespace {
+
+// The most that is read from the pipe, or copied out of the spill file, at a
+// time.
+constexpr size_t CHUNK_SIZE = 16 * 1024;
+
+// Follows the output of a job that printed more than could be kept.
+constexpr const char* TRUNCATED_MESSAGE =
+    "unixbuild: output truncated; could not write temporary file\n";
+
+// Returns false if the data could not all be written.
+bool write_fully(int fd, const char* buf, size_t n) {
+  while (n > 0) {
+    ssize_t nwritten = write(fd, buf, n);
+    if (nwritten < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    buf += nwritten;
+    n -= nwritten;
+  }
+  return true;
+}
+
+// Opens a temporary file that has no name, and so disappears when it is
+// closed.
+int open_spill_file() {
+  const char* tmpdir = getenv("TMPDIR");
+  std::string dir = tmpdir != NULL && tmpdir[0] == '/' ? tmpdir : "/tmp";
+  int fd = open(dir.c_str(), O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+  if (fd >= 0 || errno != EOPNOTSUPP) {
+    return fd;
+  }
+
+  // Not every file system supports `O_TMPFILE`.
+  std::string path = dir + "/unixbuild-output-XXXXXX";
+  fd = mkostemp(path.data(), O_CLOEXEC);
+  if (fd >= 0) {
+    unlink(path.c_str());
+  }
+  return fd;
+}
+
+} // namespace
+
+JobOutput::JobOutput(int fd, size_t memory_limit)
+    : fd_(fd), memory_limit_(memory_limit) {
+  fcntl(fd_, F_SETFL, fcntl(fd_, F_GETFL) | O_NONBLOCK);
+}
+
+JobOutput::~JobOutput() {
+  close(fd_);
+  if (spill_fd_ >= 0) {
+    close(spill_fd_);
+  }
+}
+
+bool JobOutput::read_available() {
+  char chunk[CHUNK_SIZE];
+  while (true) {
+    ssize_t n = read(fd_, chunk, sizeof chunk);
+    if (n == 0) {
+      return false;
+    } else if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return errno == EAGAIN || errno == EWOULDBLOCK;
+    }
+
+    size_ += n;
+    if (spill_fd_ < 0 && buffer_.size() + n <= memory_limit_) {
+      buffer_.append(chunk, n);
+      continue;
+    }
+
+    if (spill_fd_ < 0 && !truncated_) {
+      spill_fd_ = open_spill_file();
+      if (spill_fd_ >= 0 &&
+          write_fully(spill_fd_, buffer_.data(), buffer_.size())) {
+        // `clear` would keep the memory.
+        std::string().swap(buffer_);
+      } else if (spill_fd_ >= 0) {
+        close(spill_fd_);
+        spill_fd_ = -1;
+      }
+    }
+    if (spill_fd_ < 0 || !write_fully(spill_fd_, chunk, n)) {
+      // Keep what fits in memory and drop the rest, but keep reading, or the
+      // job would block once the pipe was full.
+      truncated_ = true;
+    }
+  }
+}
+
+void JobOutput::write_to(int out, const std::string& header) {
+  std::string trailer;
+  if (truncated_) {
+    trailer = TRUNCATED_MESSAGE;
+  }
+
+  if (spill_fd_ < 0) {
+    // One `write` for everything, so that nothing can come in between even if
+    // someone else is writing to `out` after all.
+    std::string all = header + buffer_ + trailer;
+    write_fully(out, all.data(), all.size());
+    return;
+  }
+
+  if (!write_fully(out, header.data(), header.size())) {
+    return;
+  }
+  char chunk[CHUNK_SIZE];
+  size_t offset = 0;
+  size_t n;
+  while ((n = read_at(offset, chunk, sizeof chunk)) > 0) {
+    if (!write_fully(out, chunk, n)) {
+      return;
+    }
+    offset += n;
+  }
+  write_fully(out, trailer.data(), trailer.size());
+}
+
+size_t JobOutput::read_at(size_t offset, char* buf, size_t n) const {
+  if (spill_fd_ < 0) {
+    if (offset >= buffer_.size()) {
+      return 0;
+    }
+    n = std::min(n, buffer_.size() - offset);
+    memcpy(buf, buffer_.data() + offset, n);
+    return n;
+  }
+  while (true) {
+    ssize_t nread = pread(spill_fd_, buf, n, offset);
+    if (nread < 0 && errno == EINTR) {
+      continue;
+    }
+    // A spill file that cannot be read is treated as ending early.
+    return nread < 0 ? 0 : nread;
+  }
+}
+
+ClientOutput::ClientOutput(int fd, EventLoop* event_loop,
+                           std::function<void()> on_drained,
+                           size_t memory_limit)
+    : fd_(fd), write_fd_(fd), event_loop_(event_loop),
+      on_drained_(std::move(on_drained)), memory_limit_(memory_limit) {
+  struct stat st;
+  if (fstat(fd, &st) < 0) {
+    return;
+  }
+  if (S_ISSOCK(st.st_mode)) {
+    is_socket_ = true;
+    pollable_ = true;
+  } else if (S_ISFIFO(st.st_mode) || S_ISCHR(st.st_mode)) {
+    // `O_NOCTTY`, or a terminal could become the daemon's controlling
+    // terminal. If this fails, e.g. because the pipe has no reader any more,
+    // writes go to `fd` as they are, and fail or block there.
+    std::string path = "/proc/self/fd/" + std::to_string(fd);
+    int copy = open(path.c_str(), O_WRONLY | O_NONBLOCK | O_NOCTTY | O_CLOEXEC);
+    if (copy >= 0) {
+      write_fd_ = copy;
+      pollable_ = true;
+    }
+  }
+}
+
+ClientOutput::~ClientOutput() {
+  drop();
+  if (write_fd_ != fd_) {
+    close(write_fd_);
+  }
+}
+
+void ClientOutput::write(const std::string& text) {
+  append(text.data(), text.size());
+  if (!watching_) {
+    flush();
+  }
+}
+
+void ClientOutput::write(const std::string& header,
+                         std::unique_ptr<JobOutput> output) {
+  std::string trailer = output->truncated() ? TRUNCATED_MESSAGE : "";
+  if (!output->spilled()) {
+    // It is all in memory anyway, so it goes in one `write` if it can.
+    std::string all = header;
+    all.resize(header.size() + output->size());
+    all.resize(header.size() +
+               output->read_at(0, &all[header.size()], output->size()));
+    write(all.append(trailer));
+    return;
+  }
+
+  append(header.data(), header.size());
+  char chunk[CHUNK_SIZE];
+  size_t offset = 0;
+  size_t n;
+  while ((n = output->read_at(offset, chunk, sizeof chunk)) > 0) {
+    append(chunk, n);
+    offset += n;
+  }
+  write(trailer);
+}
+
+void ClientOutput::drop() {
+  if (watching_) {
+    event_loop_->remove(write_fd_);
+    watching_ = false;
+  }
+  if (spill_fd_ >= 0) {
+    close(spill_fd_);
+    spill_fd_ = -1;
+  }
+  // `clear` would keep the memory.
+  std::string().swap(buffer_);
+  written_ = 0;
+  dropped_ = true;
+}
+
+void ClientOutput::append(const char* data, size_t n) {
+  if (dropped_ || n == 0) {
+    return;
+  }
+  if (empty()) {
+    // Most clients keep up, and then nothing needs to be queued at all.
+    ssize_t nwritten;
+    while ((nwritten = write_some(data, n)) < 0 && errno == EINTR) {
+    }
+    if (nwritten > 0) {
+      data += nwritten;
+      n -= nwritten;
+    } else if (nwritten < 0 &&
+               !((errno == EAGAIN || errno == EWOULDBLOCK) && pollable_)) {
+      // The client has gone away, but that is no reason not to finish the
+      // build.
+      drop();
+      return;
+    }
+    if (n == 0) {
+      return;
+    }
+    last_progress_ = monotonic_seconds();
+    buffer_.clear();
+    written_ = 0;
+    truncated_ = false;
+  }
+
+  if (spill_fd_ < 0 && buffer_.size() - written_ + n <= memory_limit_) {
+    buffer_.append(data, n);
+    return;
+  }
+  if (spill_fd_ < 0 && !truncated_) {
+    spill_fd_ = open_spill_file();
+    spill_size_ = 0;
+    spill_written_ = 0;
+  }
+  while (spill_fd_ >= 0 && n > 0) {
+    ssize_t nwritten = pwrite(spill_fd_, data, n, spill_size_);
+    if (nwritten < 0 && errno == EINTR) {
+      continue;
+    } else if (nwritten < 0) {
+      break;
+    }
+    data += nwritten;
+    n -= nwritten;
+    spill_size_ += nwritten;
+  }
+  if (n > 0 && !truncated_) {
+    // The rest is dropped, but the client is told. The note goes in memory,
+    // past the limit, since there is nowhere else for it, so if the spill
+    // file failed partway it comes before what did get spilled.
+    truncated_ = true;
+    buffer_.append(TRUNCATED_MESSAGE);
+  }
+}
+
+void ClientOutput::flush() {
+  char chunk[CHUNK_SIZE];
+  while (!empty()) {
+    const char* data;
+    size_t n;
+    if (written_ < buffer_.size()) {
+      data = buffer_.data() + written_;
+      n = buffer_.size() - written_;
+    } else {
+      ssize_t nread =
+          pread(spill_fd_, chunk,
+                std::min(sizeof chunk, spill_size_ - spill_written_),
+                spill_written_);
+      if (nread < 0 && errno == EINTR) {
+        continue;
+      } else if (nread <= 0) {
+        // A spill file that cannot be read is treated as ending early.
+        close(spill_fd_);
+        spill_fd_ = -1;
+        continue;
+      }
+      data = chunk;
+      n = nread;
+    }
+
+    ssize_t nwritten = write_some(data, n);
+    if (nwritten > 0) {
+      last_progress_ = monotonic_seconds();
+      if (written_ < buffer_.size()) {
+        written_ += nwritten;
+      } else {
+        spill_written_ += nwritten;
+        if (spill_written_ == spill_size_) {
+          close(spill_fd_);
+          spill_fd_ = -1;
+        }
+      }
+      if (written_ == buffer_.size() && buffer_.capacity() > memory_limit_) {
+        std::string().swap(buffer_);
+        written_ = 0;
+      }
+    } else if (nwritten < 0 && errno == EINTR) {
+      continue;
+    } else if (nwritten < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) &&
+               pollable_) {
+      if (!watching_) {
+        event_loop_->add_writable(write_fd_, [this]() {
+          flush();
+          if (empty()) {
+            // Copied, since the callback may well destroy this object.
+            std::function<void()> on_drained = on_drained_;
+            on_drained();
+          }
+        });
+        watching_ = true;
+      }
+      return;
+    } else {
+      // The client has gone away, but that is no reason not to finish the
+      // build.
+      drop();
+      return;
+    }
+  }
+
+  if (watching_) {
+    event_loop_->remove(write_fd_);
+    watching_ = false;
+  }
+}
+
+ssize_t ClientOutput::write_some(const char* data, size_t n) {
+  if (is_socket_) {
+    return send(fd_, data, n, MSG_DONTWAIT | MSG_NOSIGNAL);
+  }
+  return ::write(write_fd_, data, n);
+}
+
+} // namespace unixbuild
@@ -0,0 +1,87 @@
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "unixbuild/common.h"
+#include "unixbuild/jobserver.h"
+
+namespace unixbuild {
+
+namespace {
+
+// The byte that the daemon writes for each token. Jobserver clients write
+// back whatever byte they read, so any value would do.
+constexpr char TOKEN = '+';
+
+} // namespace
+
+JobServer::JobServer(size_t tokens) : capacity_(tokens) {
+  int fds[2];
+  // Deliberately not close-on-exec, so that jobs inherit the pipe.
+  if (pipe(fds) < 0) {
+    throw ExitException("pipe() returned an error status", 1);
+  }
+  read_fd_ = fds[0];
+  write_fd_ = fds[1];
+
+  // Setting O_NONBLOCK on `read_fd_` itself would affect the jobs as well,
+  // since they would share its open file description. Reopening the pipe
+  // through /proc gives us a description of our own.
+  std::string path = std::string("/proc/self/fd/")
+                         .append(std::to_string(read_fd_));
+  nonblocking_fd_ = open(path.c_str(), O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+  if (nonblocking_fd_ < 0) {
+    close(read_fd_);
+    close(write_fd_);
+    throw ExitException("could not reopen jobserver pipe", 1);
+  }
+
+  // A pipe buffer holds at least a page, far more tokens than any machine
+  // has cores, so this never blocks.
+  std::string initial(tokens, TOKEN);
+  if (write(write_fd_, initial.data(), initial.size()) !=
+      static_cast<ssize_t>(initial.size())) {
+    close(nonblocking_fd_);
+    close(read_fd_);
+    close(write_fd_);
+    throw ExitException("could not fill jobserver pipe", 1);
+  }
+}
+
+JobServer::~JobServer() {
+  close(nonblocking_fd_);
+  close(read_fd_);
+  close(write_fd_);
+}
+
+bool JobServer::acquire() {
+  char token;
+  ssize_t n;
+  while ((n = read(nonblocking_fd_, &token, 1)) < 0 && errno == EINTR) {
+  }
+  if (n == 1) {
+    held_++;
+    return true;
+  }
+  return false;
+}
+
+void JobServer::release() {
+  held_--;
+  while (write(write_fd_, &TOKEN, 1) < 0 && errno == EINTR) {
+  }
+}
+
+std::string JobServer::makeflags() const {
+  // --jobserver-auth is what make 4.2 and later, and GCC, look for; older
+  // versions of make look for --jobserver-fds.
+  std::string fds = std::to_string(read_fd_) + "," + std::to_string(write_fd_);
+  return std::string(" -j")
+      .append(std::to_string(capacity_))
+      .append(" --jobserver-auth=")
+      .append(fds)
+      .append(" --jobserver-fds=")
+      .append(fds);
+}
+
+} // namespace unixbuild
@@ -0,0 +1,107 @@
+#include <csignal>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "unixbuild/common.h"
+#include "unixbuild/launcher.h"
+
+extern char** environ;
+
+namespace unixbuild {
+
+namespace {
+
+// Closes the descriptors and frees the file actions of a launch when it goes
+// out of scope, whether or not the launch succeeded.
+struct LaunchResources {
+  posix_spawn_file_actions_t actions;
+  int pipe_fds[2] = {-1, -1};
+
+  LaunchResources() { posix_spawn_file_actions_init(&actions); }
+  ~LaunchResources() {
+    posix_spawn_file_actions_destroy(&actions);
+    for (int fd : pipe_fds) {
+      if (fd >= 0) {
+        close(fd);
+      }
+    }
+  }
+};
+
+} // namespace
+
+Launcher::Launcher() {
+  posix_spawnattr_init(&attr_);
+
+  sigset_t empty;
+  sigemptyset(&empty);
+  posix_spawnattr_setsigmask(&attr_, &empty);
+
+  sigset_t defaults;
+  sigemptyset(&defaults);
+  sigaddset(&defaults, SIGPIPE);
+  posix_spawnattr_setsigdefault(&attr_, &defaults);
+
+  posix_spawnattr_setflags(&attr_,
+                           POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+}
+
+Launcher::~Launcher() { posix_spawnattr_destroy(&attr_); }
+
+LaunchedProcess Launcher::launch(const std::vector<std::string>& args,
+                                 const LaunchOptions& options) {
+  LaunchResources resources;
+  posix_spawn_file_actions_t* actions = &resources.actions;
+
+  int stdout_fd = options.stdout_fd;
+  int stderr_fd = options.stderr_fd;
+  if (options.capture_output) {
+    if (pipe2(resources.pipe_fds, O_CLOEXEC) < 0) {
+      throw ExitException("pipe() returned an error status", 1);
+    }
+    stdout_fd = resources.pipe_fds[1];
+    stderr_fd = resources.pipe_fds[1];
+  }
+
+  // A descriptor that is already in place is simply inherited.
+  if (stdout_fd != STDOUT_FILENO) {
+    posix_spawn_file_actions_adddup2(actions, stdout_fd, STDOUT_FILENO);
+  }
+  if (stderr_fd != STDERR_FILENO) {
+    posix_spawn_file_actions_adddup2(actions, stderr_fd, STDERR_FILENO);
+  }
+  if (!options.dir.empty()) {
+    posix_spawn_file_actions_addchdir_np(actions, options.dir.c_str());
+  }
+
+  std::vector<char*> argv;
+  argv.reserve(args.size() + 1);
+  for (const std::string& arg : args) {
+    argv.push_back(const_cast<char*>(arg.c_str()));
+  }
+  argv.push_back(NULL);
+
+  mode_t old_umask = umask(options.umask);
+  pid_t pid;
+  int error =
+      posix_spawnp(&pid, argv[0], actions, &attr_, argv.data(), environ);
+  umask(old_umask);
+  if (error != 0) {
+    throw ExitException(std::string("could not run ")
+                            .append(args[0])
+                            .append(": ")
+                            .append(strerror(error)),
+                        1);
+  }
+
+  LaunchedProcess process;
+  process.pid = pid;
+  if (options.capture_output) {
+    process.output_fd = resources.pipe_fds[0];
+    resources.pipe_fds[0] = -1;
+  }
+  return process;
+}
+
+} // namespace unixbuild
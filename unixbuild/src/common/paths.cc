@@ -0,0 +1,79 @@
+#include <functional>
+
+#include "unixbuild/common.h"
+#include "unixbuild/paths.h"
+
+namespace unixbuild {
+
+namespace {
+
+constexpr size_t INITIAL_SLOTS = 1024;
+
+size_t hash_path(std::string_view path) {
+  return std::hash<std::string_view>()(path);
+}
+
+} // namespace
+
+size_t PathTable::find_slot(std::string_view path, size_t hash) const {
+  // Linear probing. The table is never more than half full, so this always
+  // terminates at an empty slot or a match.
+  size_t mask = slots_.size() - 1;
+  size_t i = hash & mask;
+  while (slots_[i].id != EMPTY_SLOT &&
+         (slots_[i].hash != (uint32_t)hash ||
+          this->path(slots_[i].id) != path)) {
+    i = (i + 1) & mask;
+  }
+  return i;
+}
+
+std::optional<uint32_t> PathTable::find(std::string_view path) const {
+  if (slots_.empty()) {
+    return {};
+  }
+
+  size_t slot = find_slot(path, hash_path(path));
+  if (slots_[slot].id == EMPTY_SLOT) {
+    return {};
+  }
+  return slots_[slot].id;
+}
+
+uint32_t PathTable::intern(std::string_view path) {
+  if ((size() + 1) * 2 > slots_.size()) {
+    grow();
+  }
+
+  size_t hash = hash_path(path);
+  size_t slot = find_slot(path, hash);
+  if (slots_[slot].id != EMPTY_SLOT) {
+    return slots_[slot].id;
+  }
+
+  if (size() >= EMPTY_SLOT - 1 || arena_.size() + path.size() > UINT32_MAX) {
+    throw ExitException("too many distinct paths in build file", 2);
+  }
+
+  uint32_t id = size();
+  arena_.append(path);
+  offsets_.push_back(arena_.size());
+  slots_[slot] = Slot{id, (uint32_t)hash};
+  return id;
+}
+
+void PathTable::grow() {
+  size_t capacity = slots_.empty() ? INITIAL_SLOTS : slots_.size() * 2;
+  slots_.assign(capacity, Slot{EMPTY_SLOT, 0});
+  for (uint32_t id = 0; id < size(); id++) {
+    size_t hash = hash_path(path(id));
+    slots_[find_slot(path(id), hash)] = Slot{id, (uint32_t)hash};
+  }
+}
+
+size_t PathTable::memory_usage() const {
+  return arena_.capacity() + offsets_.capacity() * sizeof(uint32_t) +
+         slots_.capacity() * sizeof(Slot);
+}
+
+} // namespace unixbuild
@@ -0,0 +1,412 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "unixbuild/protocol.h"
+
+namespace unixbuild {
+
+namespace {
+
+struct MessageHeader {
+  uint32_t length;
+  uint16_t type;
+  uint16_t version;
+};
+
+static_assert(sizeof(MessageHeader) == 8, "message header must be 8 bytes");
+
+void write_all(int fd, const char* buf, size_t n) {
+  while (n > 0) {
+    ssize_t nwritten = write(fd, buf, n);
+    if (nwritten < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      throw ProtocolException(std::string("write(): ").append(strerror(errno)));
+    }
+    buf += nwritten;
+    n -= nwritten;
+  }
+}
+
+// Fills in `un` for `path` and returns the length to pass to `bind` or
+// `connect`, as in examples/hello_server.c.
+socklen_t make_address(const std::string& path, struct sockaddr_un& un) {
+  memset(&un, 0, sizeof un);
+  un.sun_family = AF_UNIX;
+  if (path.size() >= sizeof un.sun_path) {
+    throw ExitException(std::string("socket path too long: ").append(path), 1);
+  }
+  strcpy(un.sun_path, path.c_str());
+  return offsetof(struct sockaddr_un, sun_path) + path.size();
+}
+
+// Binds `fd` to `un` with a socket file that only we can connect to. The
+// daemon runs with a umask of 0, and fixing the mode with `chmod` afterwards
+// would leave a moment in which any user could connect, so the umask is
+// tightened around the `bind` instead.
+int bind_private(int fd, const struct sockaddr_un& un, socklen_t size) {
+  mode_t old_umask = umask(S_IRWXG | S_IRWXO);
+  int r = bind(fd, (const struct sockaddr*)&un, size);
+  int saved_errno = errno;
+  umask(old_umask);
+  errno = saved_errno;
+  return r;
+}
+
+} // namespace
+
+void PayloadWriter::write_u32(uint32_t x) {
+  buffer_.append(reinterpret_cast<const char*>(&x), sizeof x);
+}
+
+void PayloadWriter::write_string(const std::string& s) {
+  write_u32(s.size());
+  buffer_.append(s);
+}
+
+uint32_t PayloadReader::read_u32() {
+  uint32_t x;
+  if (payload_.size() - pos_ < sizeof x) {
+    throw ProtocolException("payload truncated");
+  }
+  memcpy(&x, payload_.data() + pos_, sizeof x);
+  pos_ += sizeof x;
+  return x;
+}
+
+std::string PayloadReader::read_string() {
+  uint32_t n = read_u32();
+  if (payload_.size() - pos_ < n) {
+    throw ProtocolException("payload truncated");
+  }
+  std::string s = payload_.substr(pos_, n);
+  pos_ += n;
+  return s;
+}
+
+std::string encode_build_request(const BuildRequest& request) {
+  PayloadWriter writer;
+  writer.write_string(request.build_path);
+  writer.write_string(request.output_path);
+  writer.write_string(request.target);
+  writer.write_u32(request.jobs);
+  writer.write_u32(request.umask);
+  writer.write_u32(request.content_hash);
+  writer.write_string(request.cache_dir);
+  writer.write_u32(request.cache_size_mb);
+  writer.write_string(request.trace_path);
+  return writer.payload();
+}
+
+BuildRequest decode_build_request(const std::string& payload) {
+  PayloadReader reader(payload);
+  BuildRequest request;
+  request.build_path = reader.read_string();
+  request.output_path = reader.read_string();
+  request.target = reader.read_string();
+  request.jobs = reader.read_u32();
+  request.umask = reader.read_u32();
+  request.content_hash = reader.read_u32() != 0;
+  request.cache_dir = reader.read_string();
+  request.cache_size_mb = reader.read_u32();
+  request.trace_path = reader.read_string();
+  return request;
+}
+
+std::string encode_build_response(const BuildResponse& response) {
+  PayloadWriter writer;
+  writer.write_u32(response.returncode);
+  writer.write_string(response.message);
+  return writer.payload();
+}
+
+BuildResponse decode_build_response(const std::string& payload) {
+  PayloadReader reader(payload);
+  BuildResponse response;
+  response.returncode = reader.read_u32();
+  response.message = reader.read_string();
+  return response;
+}
+
+void send_message(int fd, MessageType type, const std::string& payload,
+                  const std::vector<int>& fds) {
+  if (fds.size() > MAX_MESSAGE_FDS) {
+    throw ProtocolException("too many file descriptors");
+  }
+
+  MessageHeader header;
+  header.length = payload.size();
+  header.type = static_cast<uint16_t>(type);
+  header.version = PROTOCOL_VERSION;
+
+  // The header and payload are sent as one buffer so that small messages go
+  // out in a single syscall.
+  std::string buf(reinterpret_cast<const char*>(&header), sizeof header);
+  buf.append(payload);
+  if (fds.empty()) {
+    write_all(fd, buf.data(), buf.size());
+    return;
+  }
+
+  // File descriptors can only be passed with `sendmsg`. The ancillary data is
+  // attached to the first byte sent, so as long as at least one byte goes out
+  // the rest of the buffer can be written normally.
+  struct iovec iov;
+  iov.iov_base = buf.data();
+  iov.iov_len = buf.size();
+
+  alignas(struct cmsghdr) char control[CMSG_SPACE(sizeof(int) *
+                                                  MAX_MESSAGE_FDS)];
+  memset(control, 0, sizeof control);
+  struct msghdr msg;
+  memset(&msg, 0, sizeof msg);
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = CMSG_SPACE(sizeof(int) * fds.size());
+
+  struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fds.size());
+  memcpy(CMSG_DATA(cmsg), fds.data(), sizeof(int) * fds.size());
+
+  ssize_t nsent;
+  while ((nsent = sendmsg(fd, &msg, 0)) < 0) {
+    if (errno != EINTR) {
+      throw ProtocolException(
+          std::string("sendmsg(): ").append(strerror(errno)));
+    }
+  }
+  write_all(fd, buf.data() + nsent, buf.size() - nsent);
+}
+
+std::optional<Message> recv_message(int fd) {
+  // On a blocking descriptor, one call reads the whole message.
+  MessageReader reader;
+  reader.read_some(fd);
+  return reader.take();
+}
+
+MessageReader::~MessageReader() {
+  for (int passed_fd : message_.fds) {
+    close(passed_fd);
+  }
+}
+
+bool MessageReader::read_some(int fd) {
+  while (buffer_.size() < sizeof(MessageHeader) ||
+         buffer_.size() < expected_) {
+    size_t have = buffer_.size();
+    size_t want = expected_ > 0 ? expected_ : sizeof(MessageHeader);
+    buffer_.resize(want);
+
+    // Every read uses `recvmsg`, since the sender attaches file descriptors
+    // to the first byte of the message, and we might get that byte alone.
+    struct iovec iov;
+    iov.iov_base = buffer_.data() + have;
+    iov.iov_len = want - have;
+
+    alignas(struct cmsghdr) char control[CMSG_SPACE(sizeof(int) *
+                                                    MAX_MESSAGE_FDS)];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof msg);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof control;
+
+    // MSG_CMSG_CLOEXEC keeps the received descriptors from leaking into the
+    // compiler processes that the daemon spawns.
+    ssize_t nread = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+    buffer_.resize(have + std::max<ssize_t>(nread, 0));
+    if (nread < 0) {
+      if (errno == EINTR) {
+        continue;
+      } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        return false;
+      }
+      throw ProtocolException(
+          std::string("recvmsg(): ").append(strerror(errno)));
+    }
+
+    for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+         cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+      if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+        size_t n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        const int* received = reinterpret_cast<const int*>(CMSG_DATA(cmsg));
+        message_.fds.insert(message_.fds.end(), received, received + n);
+      }
+    }
+    if ((msg.msg_flags & MSG_CTRUNC) || message_.fds.size() > MAX_MESSAGE_FDS) {
+      throw ProtocolException("too many file descriptors");
+    }
+
+    if (nread == 0) {
+      if (have == 0) {
+        closed_ = true;
+        return true;
+      }
+      throw ProtocolException(expected_ == 0
+                                  ? "connection closed in message header"
+                                  : "connection closed in message payload");
+    }
+
+    if (expected_ == 0 && buffer_.size() == sizeof(MessageHeader)) {
+      MessageHeader header;
+      memcpy(&header, buffer_.data(), sizeof header);
+      if (header.version != PROTOCOL_VERSION) {
+        throw ProtocolException(std::string("unsupported protocol version ")
+                                    .append(std::to_string(header.version)));
+      }
+      if (header.length > MAX_PAYLOAD_SIZE) {
+        throw ProtocolException("payload too large");
+      }
+      message_.type = static_cast<MessageType>(header.type);
+      expected_ = sizeof header + header.length;
+    }
+  }
+  return true;
+}
+
+std::optional<Message> MessageReader::take() {
+  if (closed_) {
+    return {};
+  }
+  Message message;
+  message.type = message_.type;
+  message.payload = buffer_.substr(sizeof(MessageHeader));
+  message.fds = std::move(message_.fds);
+  message_.fds.clear();
+  return message;
+}
+
+std::string runtime_directory() {
+  const char* xdg = getenv("XDG_RUNTIME_DIR");
+  std::string dir = xdg != NULL && xdg[0] == '/'
+                        ? std::string(xdg).append("/unixbuild")
+                        : std::string("/tmp/unixbuild-")
+                              .append(std::to_string(getuid()));
+  if (mkdir(dir.c_str(), S_IRWXU) < 0 && errno != EEXIST) {
+    throw ExitException(std::string("could not create directory: ").append(dir),
+                        1);
+  }
+
+  // `lstat`, so that a symlink to a directory of someone else's is refused
+  // rather than followed.
+  struct stat st;
+  if (lstat(dir.c_str(), &st) < 0 || !S_ISDIR(st.st_mode) ||
+      st.st_uid != getuid() || (st.st_mode & (S_IRWXG | S_IRWXO)) != 0) {
+    throw ExitException(
+        std::string("unsafe runtime directory: ").append(dir), 1);
+  }
+  return dir;
+}
+
+std::string socket_path() { return runtime_directory().append("/socket"); }
+
+std::string lock_path() { return runtime_directory().append("/lock"); }
+
+int acquire_lock(const std::string& path) {
+  int fd = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, S_IRUSR | S_IWUSR);
+  if (fd < 0) {
+    throw ExitException(std::string("could not open lock file: ").append(path),
+                        1);
+  }
+  // The file itself is never removed, since a daemon that removed it on exit
+  // could race with one that had just opened it, leaving the two of them
+  // holding locks on different files.
+  if (flock(fd, LOCK_EX | LOCK_NB) < 0) {
+    int saved_errno = errno;
+    close(fd);
+    if (saved_errno == EWOULDBLOCK) {
+      return -1;
+    }
+    throw ExitException(std::string("could not lock file: ").append(path), 1);
+  }
+  return fd;
+}
+
+uid_t peer_uid(int fd) {
+  struct ucred cred;
+  socklen_t size = sizeof cred;
+  if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &size) < 0) {
+    return (uid_t)-1;
+  }
+  return cred.uid;
+}
+
+int connect_to_server(const std::string& path) {
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) {
+    throw ExitException("socket() returned an error status", 1);
+  }
+
+  struct sockaddr_un un;
+  socklen_t size = make_address(path, un);
+  if (connect(fd, (struct sockaddr*)&un, size) < 0) {
+    close(fd);
+    return -1;
+  }
+  // The runtime directory should already keep other users out, but the
+  // descriptors that we are about to pass are worth checking for.
+  if (peer_uid(fd) != getuid()) {
+    close(fd);
+    throw ExitException(
+        std::string("daemon socket belongs to another user: ").append(path),
+        1);
+  }
+  return fd;
+}
+
+int listen_on(const std::string& path) {
+  // Non-blocking, so that the daemon's event loop can accept every pending
+  // connection until there are none left without getting stuck.
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    throw ExitException("socket() returned an error status", 1);
+  }
+
+  struct sockaddr_un un;
+  socklen_t size = make_address(path, un);
+  if (bind_private(fd, un, size) < 0) {
+    if (errno != EADDRINUSE) {
+      close(fd);
+      throw ExitException("bind() returned an error status", 1);
+    }
+
+    // The socket file already exists. If someone is listening on it then
+    // another daemon beat us to it; otherwise it was left behind by a daemon
+    // that crashed and it is safe to remove.
+    int other = connect_to_server(path);
+    if (other >= 0) {
+      close(other);
+      close(fd);
+      return -1;
+    }
+
+    unlink(path.c_str());
+    if (bind_private(fd, un, size) < 0) {
+      close(fd);
+      throw ExitException("bind() returned an error status", 1);
+    }
+  }
+
+  if (listen(fd, 128) < 0) {
+    close(fd);
+    throw ExitException("listen() returned an error status", 1);
+  }
+  return fd;
+}
+
+} // namespace unixbuild
@@ -0,0 +1,96 @@
+#include <algorithm>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#include "unixbuild/scan.h"
+
+namespace unixbuild {
+
+namespace {
+
+uint64_t scan_scalar(const char* p) {
+  uint64_t mask = 0;
+  for (size_t i = 0; i < SCAN_BLOCK_SIZE; i++) {
+    if (p[i] == '\n' || p[i] == ':' || p[i] == ' ') {
+      mask |= uint64_t(1) << i;
+    }
+  }
+  return mask;
+}
+
+#if defined(__x86_64__)
+
+// The vector versions compare every byte against each of the three characters
+// at once, and `movemask` packs the top bit of each resulting byte into an
+// integer. Loads are unaligned, since lines start wherever they like.
+//
+// They are compiled for their instruction sets with `target` attributes
+// rather than with compiler flags, so that the rest of the program still runs
+// on CPUs without AVX2, and only called once `detect_simd_level` has checked
+// that the CPU has it.
+
+__attribute__((target("sse2"))) uint64_t scan_sse2(const char* p) {
+  const __m128i newline = _mm_set1_epi8('\n');
+  const __m128i colon = _mm_set1_epi8(':');
+  const __m128i space = _mm_set1_epi8(' ');
+  uint64_t mask = 0;
+  for (size_t i = 0; i < SCAN_BLOCK_SIZE; i += 16) {
+    __m128i bytes =
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i));
+    __m128i matches =
+        _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(bytes, newline),
+                                  _mm_cmpeq_epi8(bytes, colon)),
+                     _mm_cmpeq_epi8(bytes, space));
+    mask |= uint64_t(static_cast<uint32_t>(_mm_movemask_epi8(matches))) << i;
+  }
+  return mask;
+}
+
+__attribute__((target("avx2"))) uint64_t scan_avx2(const char* p) {
+  const __m256i newline = _mm256_set1_epi8('\n');
+  const __m256i colon = _mm256_set1_epi8(':');
+  const __m256i space = _mm256_set1_epi8(' ');
+  uint64_t mask = 0;
+  for (size_t i = 0; i < SCAN_BLOCK_SIZE; i += 32) {
+    __m256i bytes =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + i));
+    __m256i matches =
+        _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(bytes, newline),
+                                        _mm256_cmpeq_epi8(bytes, colon)),
+                        _mm256_cmpeq_epi8(bytes, space));
+    mask |= uint64_t(static_cast<uint32_t>(_mm256_movemask_epi8(matches)))
+            << i;
+  }
+  return mask;
+}
+
+#endif
+
+} // namespace
+
+SimdLevel detect_simd_level() {
+#if defined(__x86_64__)
+  static const SimdLevel level =
+      __builtin_cpu_supports("avx2") ? SimdLevel::AVX2 : SimdLevel::SSE2;
+  return level;
+#else
+  return SimdLevel::SCALAR;
+#endif
+}
+
+ScanFunction scan_function(SimdLevel level) {
+  switch (std::min(level, detect_simd_level())) {
+#if defined(__x86_64__)
+  case SimdLevel::AVX2:
+    return scan_avx2;
+  case SimdLevel::SSE2:
+    return scan_sse2;
+#endif
+  default:
+    return scan_scalar;
+  }
+}
+
+} // namespace unixbuild
@@ -0,0 +1,364 @@
+#include <algorithm>
+#include <cstring>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "unixbuild/command.h"
+#include "unixbuild/common.h"
+#include "unixbuild/scheduler.h"
+#include "unixbuild/staleness.h"
+
+namespace unixbuild {
+
+Scheduler::Scheduler(const BuildGraph& graph, const std::vector<size_t>& nodes,
+                     BuildOptions options)
+    : graph_(graph), options_(std::move(options)), in_build_(graph.size()),
+      pending_deps_(graph.size()), dependents_(graph.size()),
+      priority_(graph.size()), started_at_(graph.size(), -1.0),
+      finished_at_(graph.size(), -1.0), job_durations_(graph.size(), -1.0),
+      ready_(ReadyOrder{&priority_}) {
+  for (size_t node : nodes) {
+    in_build_[node] = true;
+  }
+
+  for (size_t node : nodes) {
+    for (size_t dep : graph_.rule_deps(node)) {
+      if (in_build_[dep]) {
+        pending_deps_[node]++;
+        dependents_[dep].push_back(node);
+      }
+    }
+  }
+
+  // Nodes that have never been built are assumed to take as long as the
+  // average of those that have. With no estimates at all, every job counts
+  // the same, and a chain's length is just the number of jobs in it.
+  const std::vector<double>& durations = options_.durations;
+  double known = 0.0;
+  size_t known_count = 0;
+  for (size_t node : nodes) {
+    if (node < durations.size() && durations[node] > 0) {
+      known += durations[node];
+      known_count++;
+    }
+  }
+  double fallback = known_count > 0 ? known / known_count : 1.0;
+
+  // A node's priority is the length of the longest chain of jobs that cannot
+  // start until it finishes, itself included. Walking the nodes in reverse
+  // dependency order means every dependent has been assigned its priority
+  // before the nodes it depends on.
+  for (auto it = nodes.rbegin(); it != nodes.rend(); it++) {
+    double longest = 0.0;
+    for (size_t dependent : dependents_[*it]) {
+      longest = std::max(longest, priority_[dependent]);
+    }
+    double duration = *it < durations.size() && durations[*it] > 0
+                          ? durations[*it]
+                          : fallback;
+    priority_[*it] = duration + longest;
+  }
+
+  for (size_t node : nodes) {
+    if (pending_deps_[node] == 0) {
+      ready_.push(node);
+    }
+  }
+}
+
+Scheduler::~Scheduler() {
+  for (auto& [pid, job] : running_) {
+    if (job.output) {
+      options_.event_loop->remove(job.output->fd());
+    }
+  }
+}
+
+void Scheduler::start_jobs() {
+  while (can_start()) {
+    start_job();
+  }
+}
+
+bool Scheduler::can_start() const {
+  // After a failure we let the running jobs finish but do not start any more,
+  // like make without -k.
+  return !failed() && !ready_.empty() && running_.size() < options_.jobs;
+}
+
+pid_t Scheduler::start_job() {
+  if (start_time_ < 0) {
+    start_time_ = monotonic_seconds();
+  }
+
+  size_t node = ready_.top();
+  ready_.pop();
+  return spawn(node);
+}
+
+pid_t Scheduler::spawn(size_t node) {
+  double start = monotonic_seconds();
+  size_t slot = std::find(busy_slots_.begin(), busy_slots_.end(), false) -
+                busy_slots_.begin();
+  if (slot == busy_slots_.size()) {
+    busy_slots_.push_back(false);
+  }
+
+  std::string output = output_file(graph_, node, options_.output_dir);
+  create_directories(output.substr(0, output.rfind('/')),
+                     0777 & ~options_.umask);
+
+  std::vector<std::string> args =
+      deduce_command(graph_, node, options_.output_dir);
+
+  std::string cache_key;
+  if (options_.action_cache != nullptr) {
+    std::vector<std::string> inputs;
+    for (uint32_t dep : graph_.deps(node)) {
+      inputs.push_back(
+          resolve_dep(graph_, dep, options_.build_dir, options_.output_dir));
+    }
+    cache_key = options_.action_cache->key(args, inputs, options_.build_dir,
+                                           options_.output_dir);
+    std::vector<std::string> discovered;
+    if (options_.action_cache->restore(cache_key, output, discovered)) {
+      // The depfile is not in the cache, but it is needed to find out whether
+      // the output is stale the next time the daemon starts.
+      if (!discovered.empty()) {
+        write_depfile(depfile_path(output), output, discovered);
+        if (options_.discovered != nullptr) {
+          options_.discovered->set(output, discovered);
+        }
+      }
+      stats_.cache_hits++;
+      stats_.wall_seconds = monotonic_seconds() - start_time_;
+      std::string echo =
+          std::string("restored ").append(output).append(" from cache\n");
+      if (options_.client_output != nullptr) {
+        options_.client_output->write(std::move(echo));
+      } else if (write(options_.stdout_fd, echo.data(), echo.size()) < 0) {
+        // As below.
+      }
+      trace_job(node, slot, "cache", start, monotonic_seconds());
+      complete(node, start);
+      return 0;
+    }
+    stats_.cache_misses++;
+  }
+
+  // The old output may be a hard link into the action cache, which the
+  // compiler would overwrite in place if we left it there.
+  unlink(output.c_str());
+
+  std::string echo = format_command(args).append("\n");
+  if (options_.event_loop == nullptr) {
+    // A single `write` keeps the line from being split up by output from jobs
+    // that are already running.
+    if (write(options_.stdout_fd, echo.data(), echo.size()) < 0) {
+      // The client has gone away, but that is no reason not to finish the
+      // build.
+    }
+  }
+
+  LaunchOptions launch;
+  launch.dir = options_.build_dir;
+  launch.umask = options_.umask;
+  launch.stdout_fd = options_.stdout_fd;
+  launch.stderr_fd = options_.stderr_fd;
+  launch.capture_output = options_.event_loop != nullptr;
+  LaunchedProcess process = launcher_.launch(args, launch);
+
+  busy_slots_[slot] = true;
+  RunningJob job{node, monotonic_seconds(), slot, std::move(cache_key), "",
+                 nullptr};
+  if (process.output_fd >= 0) {
+    job.command = std::move(echo);
+    job.output = std::make_unique<JobOutput>(process.output_fd,
+                                             options_.output_memory_limit);
+    JobOutput* output = job.output.get();
+    EventLoop* event_loop = options_.event_loop;
+    event_loop->add(output->fd(), [output, event_loop]() {
+      // The pipe stays readable once it has been closed, so stop watching it
+      // then, even if the job has not been reaped yet.
+      if (!output->read_available()) {
+        event_loop->remove(output->fd());
+      }
+    });
+  }
+  running_.emplace(process.pid, std::move(job));
+  return process.pid;
+}
+
+bool Scheduler::finish_job(pid_t pid, int status) {
+  auto it = running_.find(pid);
+  if (it == running_.end()) {
+    return false;
+  }
+
+  RunningJob job = std::move(it->second);
+  running_.erase(it);
+
+  if (job.output) {
+    // Whatever the job printed just before it exited may still be in the
+    // pipe.
+    options_.event_loop->remove(job.output->fd());
+    job.output->read_available();
+    if (options_.client_output != nullptr) {
+      options_.client_output->write(std::move(job.command),
+                                    std::move(job.output));
+    } else {
+      job.output->write_to(options_.stdout_fd, job.command);
+    }
+  }
+
+  double now = monotonic_seconds();
+  busy_slots_[job.slot] = false;
+  bool succeeded = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+  trace_job(job.node, job.slot, succeeded ? "job" : "failed", job.start, now);
+  stats_.jobs_run++;
+  stats_.job_seconds += now - job.start;
+  stats_.wall_seconds = now - start_time_;
+
+  if (!succeeded) {
+    if (!failed()) {
+      failure_ = std::string("failed to build ")
+                     .append(graph_.output(job.node));
+      if (WIFEXITED(status)) {
+        failure_.append(" (exit status ")
+            .append(std::to_string(WEXITSTATUS(status)))
+            .append(")");
+      } else if (WIFSIGNALED(status)) {
+        failure_.append(" (killed by signal ")
+            .append(std::to_string(WTERMSIG(status)))
+            .append(")");
+      }
+    }
+    return true;
+  }
+
+  std::string output = output_file(graph_, job.node, options_.output_dir);
+  std::vector<std::string> discovered;
+  if (writes_depfile(graph_, job.node)) {
+    try {
+      discovered = read_depfile(depfile_path(output), options_.build_dir);
+    } catch (ExitException& e) {
+      // Then we know no more than the build file tells us.
+    }
+    if (options_.discovered != nullptr) {
+      options_.discovered->set(output, discovered);
+    }
+  }
+  if (!job.cache_key.empty()) {
+    options_.action_cache->store(job.cache_key, output, discovered);
+  }
+  job_durations_[job.node] = now - job.start;
+  complete(job.node, job.start);
+  return true;
+}
+
+void Scheduler::complete(size_t node, double start) {
+  started_at_[node] = start;
+  finished_at_[node] = monotonic_seconds();
+  for (size_t dependent : dependents_[node]) {
+    if (--pending_deps_[dependent] == 0) {
+      ready_.push(dependent);
+    }
+  }
+}
+
+void Scheduler::trace_job(size_t node, size_t slot, const char* category,
+                          double start, double end) {
+  if (options_.trace != nullptr) {
+    TraceEvent event;
+    event.category = category;
+    event.node = node;
+    event.lane = slot + 1;
+    event.start = start;
+    event.end = end;
+    options_.trace->record(event);
+  }
+}
+
+std::vector<CriticalPathStep> Scheduler::critical_path() const {
+  std::vector<CriticalPathStep> path;
+  size_t last = graph_.size();
+  for (size_t node = 0; node < graph_.size(); node++) {
+    if (finished_at_[node] >= 0 &&
+        (last == graph_.size() || finished_at_[node] > finished_at_[last])) {
+      last = node;
+    }
+  }
+
+  // Each node's dependencies all finished before it started, so the one that
+  // finished last is the one it was waiting for.
+  while (last != graph_.size()) {
+    path.push_back({last, finished_at_[last] - started_at_[last]});
+    size_t node = last;
+    last = graph_.size();
+    for (size_t dep : graph_.rule_deps(node)) {
+      if (finished_at_[dep] >= 0 &&
+          (last == graph_.size() || finished_at_[dep] > finished_at_[last])) {
+        last = dep;
+      }
+    }
+  }
+  std::reverse(path.begin(), path.end());
+  return path;
+}
+
+bool Scheduler::finished() const {
+  return running_.empty() && (failed() || ready_.empty());
+}
+
+namespace {
+
+void on_sigchld(__attribute__((unused)) int signum) {
+  // Nothing to do; the point of the handler is to interrupt `sigsuspend`.
+}
+
+} // namespace
+
+void Scheduler::run() {
+  // SIGCHLD is blocked everywhere except inside `sigsuspend`. Otherwise a job
+  // that exited after we last called `waitpid` but before we went to sleep
+  // would never wake us up.
+  sigset_t chld_mask, old_mask, wait_mask;
+  sigemptyset(&chld_mask);
+  sigaddset(&chld_mask, SIGCHLD);
+  sigprocmask(SIG_BLOCK, &chld_mask, &old_mask);
+  wait_mask = old_mask;
+  sigdelset(&wait_mask, SIGCHLD);
+
+  // SIGCHLD is ignored by default, and an ignored signal does not interrupt
+  // `sigsuspend`, so we need a handler even though it does nothing.
+  struct sigaction act, old_act;
+  memset(&act, 0, sizeof act);
+  act.sa_handler = on_sigchld;
+  sigaction(SIGCHLD, &act, &old_act);
+
+  try {
+    start_jobs();
+    while (!finished()) {
+      sigsuspend(&wait_mask);
+
+      // One SIGCHLD may stand for several exited children, since signals do
+      // not queue, so reap until there is nothing left.
+      pid_t pid;
+      int status;
+      while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        finish_job(pid, status);
+      }
+      start_jobs();
+    }
+  } catch (ExitException& e) {
+    sigaction(SIGCHLD, &old_act, NULL);
+    sigprocmask(SIG_SETMASK, &old_mask, NULL);
+    throw;
+  }
+
+  sigaction(SIGCHLD, &old_act, NULL);
+  sigprocmask(SIG_SETMASK, &old_mask, NULL);
+}
+
+} // namespace unixbuild
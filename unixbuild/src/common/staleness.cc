@@ -0,0 +1,482 @@
+#include <cerrno>
+#include <sys/stat.h>
+#include <unordered_set>
+
+#include "unixbuild/batch_io.h"
+#include "unixbuild/command.h"
+#include "unixbuild/staleness.h"
+
+namespace unixbuild {
+
+namespace {
+
+bool newer_than(const struct timespec& a, const struct timespec& b) {
+  return a.tv_sec > b.tv_sec || (a.tv_sec == b.tv_sec && a.tv_nsec > b.tv_nsec);
+}
+
+// Returns true if `path` is a symbolic link. Watching its directory would not
+// see changes to the file it points to, which is what `stat` describes.
+bool is_symlink(const std::string& path) {
+  struct stat st;
+  return lstat(path.c_str(), &st) == 0 && S_ISLNK(st.st_mode);
+}
+
+// Reads the depfiles of `nodes`, and stats every path that `find_stale` may
+// look up for them, on `pool`'s threads.
+void prefetch_stamps(const BuildGraph& graph, const std::vector<size_t>& nodes,
+                     const std::string& build_dir,
+                     const std::string& output_dir, StatCache& stat_cache,
+                     DiscoveredDeps* discovered, ThreadPool& pool) {
+  std::vector<std::string> outputs;
+  if (discovered != nullptr) {
+    for (size_t node : nodes) {
+      outputs.push_back(output_file(graph, node, output_dir));
+    }
+    discovered->prefetch(outputs, build_dir, pool);
+  }
+
+  // Each path is resolved once, however many rules mention it.
+  std::vector<std::string> paths;
+  std::vector<bool> seen(graph.paths().size());
+  auto add = [&](uint32_t id) {
+    if (!seen[id]) {
+      seen[id] = true;
+      paths.push_back(resolve_dep(graph, id, build_dir, output_dir));
+    }
+  };
+  std::vector<bool> seen_discovered;
+  for (size_t i = 0; i < nodes.size(); i++) {
+    add(graph.output_id(nodes[i]));
+    for (uint32_t dep : graph.deps(nodes[i])) {
+      add(dep);
+    }
+    if (discovered != nullptr) {
+      seen_discovered.resize(discovered->paths().size());
+      for (uint32_t id : discovered->get(outputs[i], build_dir)) {
+        if (!seen_discovered[id]) {
+          seen_discovered[id] = true;
+          paths.emplace_back(discovered->paths().path(id));
+        }
+      }
+    }
+  }
+  stat_cache.prefetch(paths, pool);
+}
+
+// Returns true if `existing`, the log entry for an output whose stamp is now
+// `stamp`, does not need replacing.
+bool is_recorded(const LogEntry* existing, const FileStamp& stamp,
+                 const StalenessChecks& checks) {
+  // An output that has not been rebuilt since its entry was written still
+  // has the same inputs as far as we are concerned: if they had changed, it
+  // would have been stale and been rebuilt.
+  return existing != nullptr && existing->output == stamp &&
+         (existing->has_inputs_hash || checks.hashes == nullptr);
+}
+
+// Stats the outputs of `nodes`, and hashes the inputs of those that
+// `record_builds` is going to write new entries for, on `checks.pool`'s
+// threads.
+void prefetch_records(const BuildGraph& graph,
+                      const std::vector<size_t>& nodes,
+                      const std::string& build_dir,
+                      const std::string& output_dir, StatCache& stat_cache,
+                      const StalenessChecks& checks) {
+  ThreadPool& pool = *checks.pool;
+  std::vector<std::string> outputs;
+  for (size_t node : nodes) {
+    outputs.push_back(output_file(graph, node, output_dir));
+  }
+  stat_cache.prefetch(outputs, pool);
+  if (checks.hashes == nullptr) {
+    return;
+  }
+
+  std::vector<std::string> inputs;
+  std::vector<bool> seen(graph.paths().size());
+  for (size_t i = 0; i < nodes.size(); i++) {
+    std::optional<FileStamp> stamp = stat_cache.stamp(outputs[i]);
+    if (!stamp.has_value() ||
+        is_recorded(checks.log->find(outputs[i]), *stamp, checks)) {
+      continue;
+    }
+    for (uint32_t dep : graph.deps(nodes[i])) {
+      if (!seen[dep]) {
+        seen[dep] = true;
+        inputs.push_back(resolve_dep(graph, dep, build_dir, output_dir));
+      }
+    }
+    if (checks.discovered != nullptr) {
+      const PathTable& paths = checks.discovered->paths();
+      for (uint32_t id : checks.discovered->get(outputs[i], build_dir)) {
+        inputs.emplace_back(paths.path(id));
+      }
+    }
+  }
+  stat_cache.prefetch(inputs, pool);
+
+  // Inputs that are missing are left for `hash_inputs` to report.
+  std::vector<std::pair<std::string, FileStamp>> files;
+  for (std::string& input : inputs) {
+    std::optional<FileStamp> stamp = stat_cache.stamp(input);
+    if (stamp.has_value()) {
+      files.emplace_back(std::move(input), *stamp);
+    }
+  }
+  checks.hashes->prefetch(files, pool);
+}
+
+} // namespace
+
+void StatCache::process_events() {
+  if (watcher_ != nullptr) {
+    watcher_->read_events([this](const std::string& path) { invalidate(path); },
+                          [this]() { invalidate_all(); });
+  }
+}
+
+std::optional<FileStamp> StatCache::stamp(const std::string& path) {
+  auto it = entries_.find(path);
+  if (it != entries_.end() &&
+      (it->second.watched || it->second.generation == generation_)) {
+    return it->second.stamp;
+  }
+
+  Entry entry;
+  entry.generation = generation_;
+  // The watch has to be in place before we stat the file; otherwise a change
+  // in between would be missed and the stale stamp trusted forever. A symlink
+  // is stat'd afresh for every build instead, since the watch only sees the
+  // link itself change.
+  entry.watched = watcher_ != nullptr &&
+                  watcher_->watch_directory(path.substr(0, path.rfind('/'))) &&
+                  !is_symlink(path);
+  stat_calls_++;
+  struct stat st;
+  if (stat(path.c_str(), &st) == 0) {
+    entry.stamp = FileStamp{st.st_dev, st.st_ino, st.st_mtim, st.st_size};
+  } else if (errno != ENOENT && errno != ENOTDIR) {
+    throw ExitException(std::string("could not stat file: ").append(path), 2);
+  }
+
+  entries_[path] = entry;
+  return entry.stamp;
+}
+
+void StatCache::prefetch(const std::vector<std::string>& paths,
+                         ThreadPool& pool) {
+  std::vector<const std::string*> missing;
+  std::unordered_set<std::string_view> seen;
+  for (const std::string& path : paths) {
+    auto it = entries_.find(path);
+    if ((it == entries_.end() ||
+         !(it->second.watched || it->second.generation == generation_)) &&
+        seen.insert(path).second) {
+      missing.push_back(&path);
+    }
+  }
+
+  // As in `stamp`, each watch goes in before the stat, and the watcher is not
+  // thread-safe, so they are all added up front.
+  std::vector<Entry> fetched(missing.size());
+  for (size_t i = 0; i < missing.size(); i++) {
+    const std::string& path = *missing[i];
+    fetched[i].generation = generation_;
+    fetched[i].watched =
+        watcher_ != nullptr &&
+        watcher_->watch_directory(path.substr(0, path.rfind('/')));
+  }
+
+  std::vector<char> fetched_ok(missing.size());
+  for_each_batch(pool, missing.size(), [&](size_t begin, size_t end) {
+    std::vector<const char*> batch;
+    for (size_t i = begin; i < end; i++) {
+      batch.push_back(missing[i]->c_str());
+      if (fetched[i].watched && is_symlink(*missing[i])) {
+        fetched[i].watched = false;
+      }
+    }
+    std::vector<StatResult> results = stat_files(batch);
+    for (size_t i = begin; i < end; i++) {
+      const StatResult& result = results[i - begin];
+      if (result.error == 0) {
+        fetched[i].stamp = result.stamp;
+      }
+      fetched_ok[i] = result.error == 0 || result.error == ENOENT ||
+                      result.error == ENOTDIR;
+    }
+  });
+
+  stat_calls_ += missing.size();
+  for (size_t i = 0; i < missing.size(); i++) {
+    if (fetched_ok[i]) {
+      entries_[*missing[i]] = fetched[i];
+    }
+  }
+}
+
+void StatCache::invalidate(const std::string& path) { entries_.erase(path); }
+
+std::string resolve_dep(const BuildGraph& graph, uint32_t dep,
+                        const std::string& build_dir,
+                        const std::string& output_dir) {
+  std::string path = dep_file(graph, dep, output_dir);
+  if (!path.empty() && path[0] == '/') {
+    return path;
+  }
+  return std::string(build_dir).append("/").append(path);
+}
+
+uint64_t command_hash(const BuildGraph& graph, size_t node,
+                      const std::string& output_dir) {
+  std::string buffer;
+  for (const std::string& arg : deduce_command(graph, node, output_dir)) {
+    buffer.append(arg).push_back('\0');
+  }
+  return hash_bytes(buffer);
+}
+
+uint64_t hash_inputs(const BuildGraph& graph, size_t node,
+                     const std::string& build_dir,
+                     const std::string& output_dir, StatCache& stat_cache,
+                     ContentHashCache& hashes, DiscoveredDeps* discovered) {
+  // The paths are included as well as the contents, so that renaming a
+  // dependency, or adding or removing one, also changes the hash.
+  std::string buffer;
+  auto add = [&](const std::string& path) {
+    std::optional<FileStamp> stamp = stat_cache.stamp(path);
+    if (!stamp.has_value()) {
+      throw ExitException(std::string("missing dependency: ").append(path), 2);
+    }
+
+    uint64_t hash = hashes.hash(path, *stamp);
+    buffer.append(path).push_back('\0');
+    buffer.append(reinterpret_cast<const char*>(&hash), sizeof hash);
+  };
+
+  for (uint32_t dep : graph.deps(node)) {
+    add(resolve_dep(graph, dep, build_dir, output_dir));
+  }
+  if (discovered != nullptr) {
+    for (uint32_t id :
+         discovered->get(output_file(graph, node, output_dir), build_dir)) {
+      add(std::string(discovered->paths().path(id)));
+    }
+  }
+  return hash_bytes(buffer);
+}
+
+std::vector<size_t> find_stale(const BuildGraph& graph,
+                               const std::vector<size_t>& nodes,
+                               const std::string& build_dir,
+                               const std::string& output_dir,
+                               StatCache& stat_cache,
+                               const StalenessChecks& checks) {
+  DiscoveredDeps* discovered = checks.discovered;
+  if (checks.pool != nullptr) {
+    prefetch_stamps(graph, nodes, build_dir, output_dir, stat_cache,
+                    discovered, *checks.pool);
+  }
+
+  // What we know about each path during this pass, indexed by path ID. A
+  // shared header is resolved to an absolute path and looked up in the stat
+  // cache the first time it is seen; every later rule that depends on it just
+  // indexes this array.
+  enum class Status : uint8_t { UNKNOWN, MISSING, PRESENT };
+  struct PathState {
+    Status status = Status::UNKNOWN;
+    FileStamp stamp;
+  };
+  std::vector<PathState> states(graph.paths().size());
+  auto lookup = [&](uint32_t id) -> const PathState& {
+    PathState& state = states[id];
+    if (state.status == Status::UNKNOWN) {
+      std::optional<FileStamp> stamp =
+          stat_cache.stamp(resolve_dep(graph, id, build_dir, output_dir));
+      if (stamp.has_value()) {
+        state.status = Status::PRESENT;
+        state.stamp = *stamp;
+      } else {
+        state.status = Status::MISSING;
+      }
+    }
+    return state;
+  };
+
+  // The same, for paths that only appear in depfiles. Depfiles are read
+  // lazily, so this grows as new paths are discovered.
+  std::vector<PathState> discovered_states;
+  auto lookup_discovered = [&](uint32_t id) -> const PathState& {
+    if (id >= discovered_states.size()) {
+      discovered_states.resize(discovered->paths().size());
+    }
+    PathState& state = discovered_states[id];
+    if (state.status == Status::UNKNOWN) {
+      std::optional<FileStamp> stamp =
+          stat_cache.stamp(std::string(discovered->paths().path(id)));
+      if (stamp.has_value()) {
+        state.status = Status::PRESENT;
+        state.stamp = *stamp;
+      } else {
+        state.status = Status::MISSING;
+      }
+    }
+    return state;
+  };
+
+  std::vector<bool> stale(graph.size());
+  std::vector<size_t> result;
+
+  for (size_t node : nodes) {
+    // If a node this one depends on is going to be rebuilt, then so is this
+    // one, regardless of timestamps.
+    bool is_stale = false;
+    for (uint32_t dep : graph.rule_deps(node)) {
+      if (stale[dep]) {
+        is_stale = true;
+        break;
+      }
+    }
+
+    const PathState* output = nullptr;
+    bool newer = false;
+    if (!is_stale) {
+      output = &lookup(graph.output_id(node));
+      is_stale = output->status == Status::MISSING;
+    }
+
+    // Dependencies are checked even if we already know the node is stale, so
+    // that a missing source file is reported up front rather than as a
+    // compiler error halfway through the build. The outputs of other rules
+    // were already looked up when their own nodes were visited, so this costs
+    // nothing extra for them.
+    for (uint32_t dep : graph.deps(node)) {
+      bool produced = graph.producer(dep).has_value();
+      if (produced && is_stale) {
+        continue;
+      }
+
+      const PathState& state = lookup(dep);
+      if (state.status == Status::MISSING) {
+        throw ExitException(
+            std::string("missing dependency with no rule to build it: ")
+                .append(resolve_dep(graph, dep, build_dir, output_dir)),
+            2);
+      }
+      if (!is_stale && newer_than(state.stamp.mtime, output->stamp.mtime)) {
+        newer = true;
+      }
+    }
+
+    std::string output_path;
+    if (!is_stale && (discovered != nullptr || checks.log != nullptr)) {
+      output_path = output_file(graph, node, output_dir);
+    }
+
+    if (!is_stale && discovered != nullptr) {
+      for (uint32_t id : discovered->get(output_path, build_dir)) {
+        const PathState& state = lookup_discovered(id);
+        if (state.status == Status::MISSING) {
+          is_stale = true;
+          break;
+        } else if (newer_than(state.stamp.mtime, output->stamp.mtime)) {
+          newer = true;
+        }
+      }
+    }
+
+    // A log entry only describes the output if nothing else has written to it
+    // since.
+    const LogEntry* entry = nullptr;
+    if (!is_stale && checks.log != nullptr) {
+      entry = checks.log->find(output_path);
+      if (entry != nullptr && entry->output != output->stamp) {
+        entry = nullptr;
+      }
+    }
+
+    if (!is_stale && entry != nullptr &&
+        (checks.commands_checked == nullptr ||
+         checks.commands_checked->count(output_path) == 0) &&
+        entry->command_hash != command_hash(graph, node, output_dir)) {
+      is_stale = true;
+    }
+
+    if (!is_stale && entry != nullptr && checks.hashes != nullptr &&
+        entry->has_inputs_hash) {
+      // Only bother reading the inputs if their timestamps suggest that
+      // something changed; otherwise the mtime check is just as good.
+      is_stale = newer && hash_inputs(graph, node, build_dir, output_dir,
+                                      stat_cache, *checks.hashes,
+                                      discovered) != entry->inputs_hash;
+    } else if (!is_stale) {
+      is_stale = newer;
+    }
+
+    if (is_stale) {
+      stale[node] = true;
+      result.push_back(node);
+    }
+  }
+
+  return result;
+}
+
+void record_builds(const BuildGraph& graph, const std::vector<size_t>& nodes,
+                   const std::string& build_dir, const std::string& output_dir,
+                   StatCache& stat_cache, const StalenessChecks& checks,
+                   const std::vector<double>& durations) {
+  if (checks.pool != nullptr) {
+    prefetch_records(graph, nodes, build_dir, output_dir, stat_cache, checks);
+  }
+
+  for (size_t node : nodes) {
+    std::string output = output_file(graph, node, output_dir);
+    std::optional<FileStamp> stamp = stat_cache.stamp(output);
+    if (!stamp.has_value()) {
+      continue;
+    }
+    const LogEntry* existing = checks.log->find(output);
+    if (is_recorded(existing, *stamp, checks)) {
+      continue;
+    }
+
+    LogEntry entry;
+    entry.output = *stamp;
+    entry.command_hash = command_hash(graph, node, output_dir);
+    if (node < durations.size() && durations[node] >= 0) {
+      entry.duration_us = static_cast<uint64_t>(durations[node] * 1e6);
+    } else if (existing != nullptr) {
+      entry.duration_us = existing->duration_us;
+    }
+    if (checks.hashes != nullptr) {
+      entry.has_inputs_hash = true;
+      entry.inputs_hash =
+          hash_inputs(graph, node, build_dir, output_dir, stat_cache,
+                      *checks.hashes, checks.discovered);
+    }
+    if (checks.discovered != nullptr) {
+      const PathTable& paths = checks.discovered->paths();
+      for (uint32_t id : checks.discovered->get(output, build_dir)) {
+        entry.discovered.emplace_back(paths.path(id));
+      }
+    }
+    checks.log->record(output, std::move(entry));
+  }
+}
+
+std::vector<double> logged_durations(const BuildGraph& graph,
+                                     const std::vector<size_t>& nodes,
+                                     const std::string& output_dir,
+                                     const BuildLog& log) {
+  std::vector<double> durations(graph.size());
+  for (size_t node : nodes) {
+    const LogEntry* entry = log.find(output_file(graph, node, output_dir));
+    if (entry != nullptr) {
+      durations[node] = entry->duration_us / 1e6;
+    }
+  }
+  return durations;
+}
+
+} // namespace unixbuild
@@ -0,0 +1,170 @@
+#include <algorithm>
+#include <csignal>
+#include <cstdint>
+#include <pthread.h>
+
+#include "unixbuild/thread_pool.h"
+
+namespace unixbuild {
+
+namespace {
+
+// Which pool, if any, the current thread belongs to, and its deque there.
+thread_local const ThreadPool* current_pool = nullptr;
+thread_local size_t current_index = 0;
+
+} // namespace
+
+struct ThreadPool::Job {
+  const std::function<void(size_t)>& f;
+  size_t grain;
+  // The number of indices that have not been run yet.
+  std::atomic<size_t> remaining;
+
+  std::mutex error_mutex;
+  size_t error_index = SIZE_MAX;
+  std::exception_ptr error;
+};
+
+ThreadPool::ThreadPool(size_t threads) {
+  if (threads == 0) {
+    threads = std::max(1u, std::thread::hardware_concurrency());
+  }
+  for (size_t i = 0; i < threads; i++) {
+    deques_.push_back(std::make_unique<Deque>());
+  }
+
+  // New threads inherit the signal mask of the thread that starts them, so
+  // blocking everything here, rather than in each thread, leaves no moment
+  // when a signal could land on one of them.
+  sigset_t all, old;
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+  // The last deque belongs to the callers of `parallel_for`.
+  for (size_t i = 0; i + 1 < threads; i++) {
+    threads_.emplace_back([this, i]() { work(i); });
+  }
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::lock_guard<std::mutex> lock(sleep_mutex_);
+    stopping_ = true;
+  }
+  wake_.notify_all();
+  for (std::thread& thread : threads_) {
+    thread.join();
+  }
+}
+
+void ThreadPool::parallel_for(size_t n, const std::function<void(size_t)>& f,
+                              size_t grain) {
+  if (n == 0) {
+    return;
+  }
+
+  Job job{f, std::max<size_t>(grain, 1), {n}, {}, SIZE_MAX, nullptr};
+  if (threads_.empty()) {
+    run_range(job, 0, n);
+  } else {
+    size_t self = current_deque();
+    run_range(job, 0, n);
+    // Help with whatever is left, ours or not, until the last of our indices
+    // is done. The tasks for them refer to `job`, so we cannot leave before.
+    while (job.remaining.load(std::memory_order_acquire) > 0) {
+      if (!run_one(self)) {
+        std::this_thread::yield();
+      }
+    }
+  }
+
+  if (job.error) {
+    std::rethrow_exception(job.error);
+  }
+}
+
+void ThreadPool::run_range(Job& job, size_t begin, size_t end) {
+  if (!threads_.empty()) {
+    size_t self = current_deque();
+    while (end - begin > job.grain) {
+      size_t middle = begin + (end - begin) / 2;
+      push(self, [this, &job, middle, end]() { run_range(job, middle, end); });
+      end = middle;
+    }
+  }
+
+  for (size_t i = begin; i < end; i++) {
+    try {
+      job.f(i);
+    } catch (...) {
+      std::lock_guard<std::mutex> lock(job.error_mutex);
+      if (i < job.error_index) {
+        job.error_index = i;
+        job.error = std::current_exception();
+      }
+    }
+  }
+  job.remaining.fetch_sub(end - begin, std::memory_order_acq_rel);
+}
+
+bool ThreadPool::run_one(size_t self) {
+  Task task;
+  for (size_t k = 0; k < deques_.size() && !task; k++) {
+    Deque& deque = *deques_[(self + k) % deques_.size()];
+    std::lock_guard<std::mutex> lock(deque.mutex);
+    if (deque.tasks.empty()) {
+      continue;
+    }
+    // Our own newest task is the one whose data is most likely still in the
+    // cache; someone else's oldest is the biggest piece of work they have.
+    if (k == 0) {
+      task = std::move(deque.tasks.back());
+      deque.tasks.pop_back();
+    } else {
+      task = std::move(deque.tasks.front());
+      deque.tasks.pop_front();
+    }
+    queued_--;
+  }
+
+  if (!task) {
+    return false;
+  }
+  task();
+  return true;
+}
+
+void ThreadPool::push(size_t self, Task task) {
+  {
+    std::lock_guard<std::mutex> lock(deques_[self]->mutex);
+    deques_[self]->tasks.push_back(std::move(task));
+    queued_++;
+  }
+  // Taking the lock, even briefly, means a thread that has just found nothing
+  // to do is either still checking `queued_`, and will see the new task, or
+  // already waiting, and will be woken.
+  { std::lock_guard<std::mutex> lock(sleep_mutex_); }
+  wake_.notify_one();
+}
+
+void ThreadPool::work(size_t self) {
+  current_pool = this;
+  current_index = self;
+  while (true) {
+    if (run_one(self)) {
+      continue;
+    }
+    std::unique_lock<std::mutex> lock(sleep_mutex_);
+    wake_.wait(lock, [this]() { return stopping_ || queued_ > 0; });
+    if (stopping_) {
+      return;
+    }
+  }
+}
+
+size_t ThreadPool::current_deque() const {
+  return current_pool == this ? current_index : deques_.size() - 1;
+}
+
+} // namespace unixbuild
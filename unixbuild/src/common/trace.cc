@@ -0,0 +1,111 @@
+#include <algorithm>
+#include <cstdio>
+#include <string_view>
+
+#include "unixbuild/trace.h"
+
+namespace unixbuild {
+
+namespace {
+
+// Appends `s` to `out` as a JSON string literal.
+void append_json_string(std::string& out, std::string_view s) {
+  out.push_back('"');
+  for (char c : s) {
+    if (c == '"' || c == '\\') {
+      out.push_back('\\');
+      out.push_back(c);
+    } else if (static_cast<unsigned char>(c) < 0x20) {
+      char escaped[8];
+      snprintf(escaped, sizeof escaped, "\\u%04x", c);
+      out.append(escaped);
+    } else {
+      out.push_back(c);
+    }
+  }
+  out.push_back('"');
+}
+
+// Appends a metadata event that names `lane`, after a separator from the
+// event before it.
+void append_lane_name(std::string& out, uint32_t lane,
+                      const std::string& name) {
+  out.append(",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":")
+      .append(std::to_string(lane))
+      .append(",\"args\":{\"name\":");
+  append_json_string(out, name);
+  out.append("}}");
+}
+
+} // namespace
+
+TraceRecorder::TraceRecorder(size_t capacity)
+    : events_(std::max<size_t>(capacity, 1)) {}
+
+void TraceRecorder::record(const TraceEvent& event) {
+  events_[next_] = event;
+  next_ = (next_ + 1) % events_.size();
+  if (size_ < events_.size()) {
+    size_++;
+  } else {
+    dropped_++;
+  }
+}
+
+void TraceRecorder::record_phase(const char* name, double start, double end) {
+  TraceEvent event;
+  event.name = name;
+  event.category = "daemon";
+  event.start = start;
+  event.end = end;
+  record(event);
+}
+
+std::string TraceRecorder::to_json(const BuildGraph& graph) const {
+  // The oldest event is the one that will be overwritten next.
+  size_t first = size_ < events_.size() ? 0 : next_;
+  auto event_at = [&](size_t i) -> const TraceEvent& {
+    return events_[(first + i) % events_.size()];
+  };
+
+  // Timestamps are relative to the start of the trace, in microseconds.
+  double origin = size_ > 0 ? event_at(0).start : 0.0;
+  uint32_t lanes = 1;
+  for (size_t i = 0; i < size_; i++) {
+    origin = std::min(origin, event_at(i).start);
+    lanes = std::max(lanes, event_at(i).lane + 1);
+  }
+
+  std::string out = "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+  out.append("{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,"
+             "\"args\":{\"name\":\"unixbuild\"}}");
+  append_lane_name(out, 0, "daemon");
+  for (uint32_t lane = 1; lane < lanes; lane++) {
+    append_lane_name(out, lane, "job slot " + std::to_string(lane - 1));
+  }
+
+  char times[96];
+  for (size_t i = 0; i < size_; i++) {
+    const TraceEvent& event = event_at(i);
+    out.append(",\n{\"name\":");
+    if (event.name != nullptr) {
+      append_json_string(out, event.name);
+    } else {
+      append_json_string(out, graph.output(event.node));
+    }
+    out.append(",\"cat\":");
+    append_json_string(out, event.category);
+    snprintf(times, sizeof times,
+             ",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":%u}",
+             (event.start - origin) * 1e6, (event.end - event.start) * 1e6,
+             event.lane);
+    out.append(times);
+  }
+
+  out.append("\n],\"otherData\":{\"dropped_events\":")
+      .append(std::to_string(dropped_))
+      .append("}}\n");
+  return out;
+}
+
+} // namespace unixbuild
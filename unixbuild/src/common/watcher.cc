@@ -0,0 +1,110 @@
+#include <cerrno>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+#include "unixbuild/common.h"
+#include "unixbuild/watcher.h"
+
+namespace unixbuild {
+
+namespace {
+
+// IN_ATTRIB is included because `touch` only changes a file's timestamps,
+// which does not count as a modification.
+constexpr uint32_t WATCH_MASK = IN_ATTRIB | IN_MODIFY | IN_CLOSE_WRITE |
+                                IN_CREATE | IN_DELETE | IN_MOVED_FROM |
+                                IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF |
+                                IN_ONLYDIR;
+
+constexpr size_t EVENT_BUFFER_SIZE = 4096;
+
+} // namespace
+
+FileWatcher::FileWatcher() {
+  fd_ = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (fd_ < 0) {
+    throw ExitException("inotify_init1() returned an error status", 1);
+  }
+}
+
+FileWatcher::~FileWatcher() { close(fd_); }
+
+bool FileWatcher::watch_directory(const std::string& dir) {
+  if (is_watched(dir)) {
+    return true;
+  }
+
+  int wd = inotify_add_watch(fd_, dir.c_str(), WATCH_MASK);
+  if (wd < 0) {
+    return false;
+  }
+  wds_[dir] = wd;
+  dirs_[wd].push_back(dir);
+  return true;
+}
+
+bool FileWatcher::is_watched(const std::string& dir) const {
+  return wds_.find(dir) != wds_.end();
+}
+
+void FileWatcher::read_events(
+    const std::function<void(const std::string&)>& changed,
+    const std::function<void()>& lost) {
+  // The buffer must be suitably aligned for `struct inotify_event`, since
+  // that's what the kernel writes into it.
+  alignas(struct inotify_event) char buffer[EVENT_BUFFER_SIZE];
+  bool lost_events = false;
+
+  while (true) {
+    ssize_t nread = read(fd_, buffer, sizeof buffer);
+    if (nread < 0) {
+      if (errno == EINTR) {
+        continue;
+      } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        break;
+      }
+      throw ExitException("could not read inotify events", 1);
+    }
+
+    for (char* p = buffer; p < buffer + nread;) {
+      struct inotify_event* event = (struct inotify_event*)p;
+      p += sizeof(struct inotify_event) + event->len;
+      events_processed_++;
+
+      if (event->mask & IN_Q_OVERFLOW) {
+        lost_events = true;
+        continue;
+      }
+
+      auto it = dirs_.find(event->wd);
+      if (it == dirs_.end()) {
+        continue;
+      }
+
+      if (event->mask & (IN_IGNORED | IN_DELETE_SELF | IN_MOVE_SELF)) {
+        // The directory itself was deleted or moved, so every path we knew
+        // under it is now suspect. The kernel removes the watch for a deleted
+        // directory on its own (that is what IN_IGNORED means), but a moved
+        // one would keep reporting events under its old name.
+        if (!(event->mask & IN_IGNORED)) {
+          inotify_rm_watch(fd_, event->wd);
+        }
+        for (const std::string& dir : it->second) {
+          wds_.erase(dir);
+        }
+        dirs_.erase(it);
+        lost_events = true;
+      } else if (event->len > 0) {
+        for (const std::string& dir : it->second) {
+          changed(std::string(dir).append("/").append(event->name));
+        }
+      }
+    }
+  }
+
+  if (lost_events) {
+    lost();
+  }
+}
+
+} // namespace unixbuild
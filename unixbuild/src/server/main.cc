@@ -1,19 +1,313 @@
+#include <algorithm>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
 #include <fcntl.h>
+#include <memory>
+#include <optional>
+#include <unordered_map>
+#include <unordered_set>
 #include <sys/resource.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
 #include <syslog.h>
 #include <unistd.h>
 
+#include "unixbuild/action_cache.h"
+#include "unixbuild/batch_io.h"
+#include "unixbuild/build_log.h"
+#include "unixbuild/cache.h"
+#include "unixbuild/command.h"
 #include "unixbuild/common.h"
+#include "unixbuild/depfile.h"
+#include "unixbuild/event_loop.h"
+#include "unixbuild/hashing.h"
+#include "unixbuild/histogram.h"
+#include "unixbuild/jobserver.h"
+#include "unixbuild/protocol.h"
+#include "unixbuild/scheduler.h"
+#include "unixbuild/staleness.h"
+#include "unixbuild/trace.h"
+#include "unixbuild/watcher.h"
+
+struct Build;
+struct OutputDir;
 
 void daemon_startup(void);
+void install_signal_handlers(void);
+long env_number(const char* name, long max, long fallback);
+void serve(void);
+bool is_idle(void);
+void accept_connections(void);
+void read_request(int fd);
+void handle_request(int fd, unixbuild::Message message);
+void handle_signals(void);
+bool resolve_build(Build& build);
+const std::vector<std::string>& build_outputs(Build& build);
+void start_ready_builds(void);
+bool start_build(Build& build);
+void advance_builds(void);
+void dispatch_jobs(void);
+bool finish_builds(void);
+void answer_builds(void);
+int drop_stalled_clients(void);
+void fail_build(Build& build, const unixbuild::ExitException& e);
+unixbuild::BuildResponse finish_build(Build& build);
+void append_critical_path(std::string& out, const unixbuild::BuildGraph& graph,
+                          const unixbuild::Scheduler& scheduler);
+void respond(Build& build, unixbuild::BuildResponse response);
+void send_response(Build& build);
+void trace_phase(Build& build, const char* name, double start);
+std::string format_stats(void);
+OutputDir& output_dir_for(const std::string& path);
+unixbuild::ActionCache& action_cache_for(const std::string& cache_dir);
+void save_state(unixbuild::BuildLog& log, bool hashes);
+void mark_commands_checked(OutputDir& dir, const Build& build);
+void invalidate_outputs(const unixbuild::BuildGraph& graph,
+                        const std::vector<size_t>& nodes,
+                        const std::string& output_dir);
+
+void cleanup(void);
+
+// The daemon exits once it has had no clients for this long, unless overridden
+// by the UNIXBUILD_IDLE_TIMEOUT environment variable, in seconds, where 0 means
+// never to exit.
+constexpr int DEFAULT_IDLE_TIMEOUT_MS = 30 * 1000;
+
+// The most tokens the job pool can have. Each token is a byte in a pipe, which
+// must hold them all without blocking.
+constexpr long MAX_JOB_TOKENS = 4096;
+// The most threads that the daemon will use for its own work.
+constexpr long MAX_THREADS = 256;
+
+// A client that takes none of its build's output for this long, e.g. because
+// it has been suspended, has the rest dropped so that it can be answered.
+constexpr double CLIENT_STALL_TIMEOUT_SECONDS = 60.0;
+
+// The name of the file, in each output directory, that holds its build log.
+constexpr const char* BUILD_LOG_FILE = ".unixbuild_log";
+
+// A trace has room for an event per job, plus this many for the daemon's
+// phases, but no more than `MAX_TRACE_EVENTS` in all.
+constexpr size_t TRACE_PHASE_EVENTS = 16;
+constexpr size_t MAX_TRACE_EVENTS = 1 << 20;
+
+// Global variables so that the atexit handler can close and remove them.
+int listenfd = -1;
+std::string listen_path;
+int lockfd = -1;
+
+// Everything the daemon waits on goes through this loop. SIGCHLD, SIGINT, and
+// SIGTERM are blocked and read from `signalfd` instead, so that a child
+// exiting is just another event rather than an interruption.
+std::unique_ptr<unixbuild::EventLoop> event_loop;
+int signalfd_ = -1;
+
+// File timestamps are kept here for the lifetime of the daemon. Without a
+// watcher they are only trusted within a single build; with one, they are
+// trusted until inotify tells us that the file has changed.
+unixbuild::StatCache stat_cache;
+std::unique_ptr<unixbuild::FileWatcher> watcher;
+
+// Threads for the daemon's own work, like stat'ing and hashing files, which
+// the event loop hands off and waits for.
+std::unique_ptr<unixbuild::ThreadPool> thread_pool;
+
+// Parsed build files are kept here so that repeated requests for the same
+// unchanged build file are not re-parsed.
+unixbuild::BuildFileCache build_file_cache(stat_cache);
+
+// Dependencies that GCC reported in depfiles, by output. These are merged with
+// the build file's own dependencies when checking staleness, so that editing
+// a header that the build file does not mention still triggers a rebuild.
+unixbuild::DiscoveredDeps discovered_deps;
+
+// Content hashes for builds with `--hash`, shared by every build and persisted
+// in the user's cache directory.
+unixbuild::ContentHashCache content_hashes;
+std::string content_hashes_path;
+
+// What we know about each output directory that has been built into.
+struct OutputDir {
+  // Loaded the first time a build uses the directory, and flushed after every
+  // build.
+  std::unique_ptr<unixbuild::BuildLog> log;
+  // The outputs, by absolute path, whose commands have been checked against
+  // the log, and the build file and generation of the build file cache that
+  // they were checked against. Every graph of one generation has the same
+  // rules, so whichever targets are built, each command is checked once.
+  std::string build_path;
+  uint64_t generation = 0;
+  std::unordered_set<std::string> commands_checked;
+};
+std::unordered_map<std::string, OutputDir> output_dirs;
+
+// Action caches, by directory. Each is scanned the first time a build uses it
+// and kept up to date in memory after that.
+std::unordered_map<std::string, std::unique_ptr<unixbuild::ActionCache>>
+    action_caches;
+
+// A build request, from when it is read until it is answered.
+struct Build {
+  // The client's connection, and the standard output and standard error that
+  // it passed us. All three are closed when the build is destroyed.
+  int fd;
+  std::vector<int> fds;
+  unixbuild::BuildRequest request;
+
+  // The graph as it was when the request arrived. If the build file changes
+  // while the build is waiting or running, the cache swaps in a new graph for
+  // later requests, and this one lives on until the build is done with it.
+  std::shared_ptr<const unixbuild::BuildGraph> graph;
+  // The generation of the build file cache that `graph` came from.
+  uint64_t generation = 0;
+  size_t target = 0;
+  unixbuild::BuildOptions options;
+  std::vector<size_t> closure;
+  // The absolute paths of the outputs in `closure`, computed only when they
+  // are needed to check for overlap with other builds.
+  std::vector<std::string> outputs;
+
+  OutputDir* dir = nullptr;
+  unixbuild::StalenessChecks checks;
+  std::vector<size_t> stale;
+  // Everything for the client's standard output goes through here, and the
+  // client is only answered once it has all been written, or dropped.
+  std::unique_ptr<unixbuild::ClientOutput> output;
+  std::unique_ptr<unixbuild::Scheduler> scheduler;
+  // Set once the build has failed. No more of its jobs are started, and the
+  // client is told about the error once the ones it has running are done.
+  std::optional<unixbuild::ExitException> error;
+  // Set once the build is over and its results are recorded. The response
+  // is kept until the client has read the build's output.
+  bool done = false;
+  std::optional<unixbuild::BuildResponse> response;
+
+  // When the request arrived.
+  double received_at = 0.0;
+  // Only set if the client asked for a trace.
+  std::unique_ptr<unixbuild::TraceRecorder> trace;
+  // When the build joined the queue, and when its first job was started.
+  double queued_at = 0.0;
+  double scheduled_at = 0.0;
+
+  Build(int fd, std::vector<int> fds) : fd(fd), fds(std::move(fds)) {}
+  ~Build() {
+    for (int passed_fd : fds) {
+      close(passed_fd);
+    }
+    close(fd);
+  }
+  Build(const Build&) = delete;
+  Build& operator=(const Build&) = delete;
+};
+
+// Builds run concurrently, interleaved by the event loop, unless they overlap:
+// a build that would read or write an output that a running build may be
+// writing waits in `queued_builds` until that build is done. Builds are
+// started in the order they were requested, and a build never overtakes an
+// earlier one that it overlaps with, so nothing waits forever.
+std::vector<std::unique_ptr<Build>> active_builds;
+std::deque<std::unique_ptr<Build>> queued_builds;
+// The outputs of every active build.
+std::unordered_set<std::string> claimed_outputs;
+// Builds that are over, with outputs no longer claimed, whose clients have
+// yet to read all of their output before they can be answered.
+std::vector<std::unique_ptr<Build>> answering_builds;
+
+// Every job of every build runs on a token from this pool, which has one token
+// per CPU unless overridden by the UNIXBUILD_MAX_JOBS environment variable.
+std::unique_ptr<unixbuild::JobServer> job_server;
+// The jobs that hold tokens, which are returned when they are reaped.
+std::unordered_set<pid_t> token_pids;
+// Whether the event loop is waiting for the pool to have a free token.
+bool watching_tokens = false;
+// Where `dispatch_jobs` starts handing out tokens next time.
+size_t next_build = 0;
+
+// What the daemon has done since it started, for `unixbuild --stats`. Times
+// are in microseconds.
+struct DaemonStats {
+  double started_at = 0.0;
+  uint64_t builds = 0;
+  uint64_t failed_builds = 0;
+  uint64_t jobs_run = 0;
+  uint64_t action_cache_hits = 0;
+  uint64_t action_cache_misses = 0;
+  // From a build request arriving to its response being sent.
+  unixbuild::Histogram request_latency;
+  // Parsing build files that were not already cached.
+  unixbuild::Histogram parse_time;
+  // Builds waiting for overlapping builds to finish.
+  unixbuild::Histogram wait_time;
+  // Working out what is stale.
+  unixbuild::Histogram stat_time;
+};
+DaemonStats daemon_stats;
+
+// Connections that have been accepted but whose request has not been read in
+// full, with what has arrived of it so far.
+std::unordered_map<int, unixbuild::MessageReader> connections;
+// When the daemon last had anything to do, for the idle timeout.
+double last_activity = 0.0;
+// Set by a shutdown request, after which the daemon exits as soon as it has
+// answered every request it has already received.
+bool shutting_down = false;
+// Set by SIGINT or SIGTERM, after which the daemon exits immediately.
+bool terminating = false;
 
 int main() {
   try {
     daemon_startup();
 
+    // The lock, rather than the socket, decides which daemon runs, since
+    // checking for a live socket and then replacing a stale one is racy: two
+    // daemons started at once could both decide the socket was stale.
+    lockfd = unixbuild::acquire_lock(unixbuild::lock_path());
+    if (lockfd < 0) {
+      // Two clients raced to start a daemon and the other one won.
+      syslog(LOG_INFO, "another server is already running");
+      return 0;
+    }
+    install_signal_handlers();
+
+    listen_path = unixbuild::socket_path();
+    listenfd = unixbuild::listen_on(listen_path);
+    if (listenfd < 0) {
+      // A daemon from before the lock file existed is still running.
+      syslog(LOG_INFO, "another server is already listening");
+      return 0;
+    }
+
+    // This must happen after `daemon_startup`, which closes every open file
+    // descriptor.
+    try {
+      watcher = std::make_unique<unixbuild::FileWatcher>();
+      stat_cache.set_watcher(watcher.get());
+    } catch (unixbuild::ExitException& e) {
+      syslog(LOG_WARNING, "%s; falling back to stat", e.message_.c_str());
+    }
+
+    std::string cache_dir = unixbuild::cache_directory();
+    if (!cache_dir.empty()) {
+      try {
+        unixbuild::create_directories(cache_dir, 0700);
+        content_hashes_path = cache_dir + "/hashes";
+        content_hashes.load(content_hashes_path);
+      } catch (unixbuild::ExitException& e) {
+        // The hashes can always be recomputed, so this is not fatal.
+        syslog(LOG_WARNING, "%s", e.message_.c_str());
+        content_hashes_path.clear();
+      }
+    }
+
     syslog(LOG_INFO, "server started");
-    sleep(30);
+    serve();
+    syslog(LOG_INFO, "server shutting down");
   } catch (unixbuild::ExitException& e) {
     syslog(LOG_ERR, "%s", e.message_.c_str());
     return e.returncode_;
@@ -21,6 +315,875 @@ int main() {
   return 0;
 }
 
+// Reads a non-negative number, at most `max`, from the environment variable
+// `name`, or returns `fallback` if it is not set or not valid.
+long env_number(const char* name, long max, long fallback) {
+  const char* value = getenv(name);
+  if (value == NULL || *value == '\0') {
+    return fallback;
+  }
+
+  char* end;
+  long n = strtol(value, &end, 10);
+  if (*end != '\0' || n < 0 || n > max) {
+    syslog(LOG_WARNING, "invalid %s: %s", name, value);
+    return fallback;
+  }
+  return n;
+}
+
+void serve() {
+  int timeout_ms = env_number("UNIXBUILD_IDLE_TIMEOUT", INT32_MAX / 1000,
+                              DEFAULT_IDLE_TIMEOUT_MS / 1000) *
+                   1000;
+
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  size_t max_jobs = env_number("UNIXBUILD_MAX_JOBS", MAX_JOB_TOKENS,
+                               std::max(cpus, 1L));
+  job_server = std::make_unique<unixbuild::JobServer>(std::max<size_t>(
+      max_jobs, 1));
+  // Jobs inherit our environment, so this is how they find the pool.
+  setenv("MAKEFLAGS", job_server->makeflags().c_str(), 1);
+
+  // Unlike the job pool, this is for our own work, which the event loop waits
+  // for rather than interleaving, so it is sized to the machine.
+  thread_pool = std::make_unique<unixbuild::ThreadPool>(std::max(
+      env_number("UNIXBUILD_THREADS", MAX_THREADS, std::max(cpus, 1L)), 1L));
+  build_file_cache.set_pool(thread_pool.get());
+  if (env_number("UNIXBUILD_IO_URING", 1, 1) == 0) {
+    unixbuild::set_io_uring_enabled(false);
+  }
+
+  event_loop = std::make_unique<unixbuild::EventLoop>();
+  event_loop->add(listenfd, accept_connections);
+  event_loop->add(signalfd_, handle_signals);
+  if (watcher) {
+    // We keep draining inotify events while idle so that the kernel's queue
+    // does not overflow and force a full rescan.
+    event_loop->add(watcher->fd(), []() { stat_cache.process_events(); });
+  }
+
+  last_activity = unixbuild::monotonic_seconds();
+  daemon_stats.started_at = last_activity;
+  while (!terminating && !(shutting_down && is_idle())) {
+    int wait_ms = drop_stalled_clients();
+    if (timeout_ms > 0 && is_idle()) {
+      double idle_ms = (unixbuild::monotonic_seconds() - last_activity) * 1000;
+      if (idle_ms >= timeout_ms) {
+        syslog(LOG_INFO, "idle timeout expired");
+        return;
+      }
+      wait_ms = timeout_ms - static_cast<int>(idle_ms);
+    }
+    event_loop->run_once(wait_ms);
+    if (!is_idle()) {
+      last_activity = unixbuild::monotonic_seconds();
+    }
+  }
+}
+
+// Returns true if the daemon has no clients to serve.
+bool is_idle() {
+  return connections.empty() && active_builds.empty() &&
+         queued_builds.empty() && answering_builds.empty();
+}
+
+void accept_connections() {
+  while (true) {
+    int connfd = accept4(listenfd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+    if (connfd < 0) {
+      if (errno == EINTR) {
+        continue;
+      } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        syslog(LOG_WARNING, "accept(): %s", strerror(errno));
+      }
+      return;
+    }
+
+    // The socket's mode should already keep other users out, but a build runs
+    // commands as us, so make sure.
+    if (unixbuild::peer_uid(connfd) != getuid()) {
+      syslog(LOG_WARNING, "rejected a connection from another user");
+      close(connfd);
+      continue;
+    }
+
+    connections.try_emplace(connfd);
+    event_loop->add(connfd, [connfd]() { read_request(connfd); });
+  }
+}
+
+// Reads whatever has arrived of the request on `fd`, and once all of it has,
+// hands it and `fd` to `handle_request`.
+void read_request(int fd) {
+  auto it = connections.find(fd);
+  std::optional<unixbuild::Message> message;
+  try {
+    if (!it->second.read_some(fd)) {
+      return;
+    }
+    message = it->second.take();
+  } catch (unixbuild::ProtocolException& e) {
+    syslog(LOG_WARNING, "%s", e.message_.c_str());
+  }
+
+  event_loop->remove(fd);
+  connections.erase(it);
+  if (!message.has_value()) {
+    close(fd);
+    return;
+  }
+  // Responses are small, and are sent with the usual blocking writes.
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+  handle_request(fd, std::move(*message));
+}
+
+// Services the single request `message`, sent over `fd`, and takes ownership
+// of `fd` and of the descriptors passed with the request.
+void handle_request(int fd, unixbuild::Message message) {
+  try {
+    switch (message.type) {
+    case unixbuild::MessageType::BUILD_REQUEST: {
+      if (message.fds.size() != 2) {
+        throw unixbuild::ProtocolException(
+            "build request must pass standard output and standard error");
+      }
+      unixbuild::BuildRequest request =
+          unixbuild::decode_build_request(message.payload);
+      // From here on, the build is responsible for the descriptors.
+      auto build = std::make_unique<Build>(fd, std::move(message.fds));
+      build->request = std::move(request);
+      build->received_at = unixbuild::monotonic_seconds();
+      if (resolve_build(*build)) {
+        queued_builds.push_back(std::move(build));
+        advance_builds();
+      }
+      return;
+    }
+    case unixbuild::MessageType::SHUTDOWN_REQUEST:
+      unixbuild::send_message(fd, unixbuild::MessageType::SHUTDOWN_RESPONSE,
+                              "");
+      shutting_down = true;
+      break;
+    case unixbuild::MessageType::STATS_REQUEST:
+      unixbuild::send_message(fd, unixbuild::MessageType::STATS_RESPONSE,
+                              format_stats());
+      break;
+    default:
+      throw unixbuild::ProtocolException(
+          std::string("unexpected message type ")
+              .append(std::to_string(static_cast<int>(message.type))));
+    }
+  } catch (unixbuild::ProtocolException& e) {
+    // A misbehaving client should not bring down the daemon.
+    syslog(LOG_WARNING, "%s", e.message_.c_str());
+  }
+
+  for (int passed_fd : message.fds) {
+    close(passed_fd);
+  }
+  close(fd);
+}
+
+void handle_signals() {
+  struct signalfd_siginfo info;
+  bool child_exited = false;
+  while (read(signalfd_, &info, sizeof info) == sizeof info) {
+    if (info.ssi_signo == SIGCHLD) {
+      child_exited = true;
+    } else {
+      syslog(LOG_INFO, "received signal %u", info.ssi_signo);
+      terminating = true;
+    }
+  }
+  if (!child_exited) {
+    return;
+  }
+
+  // One SIGCHLD may stand for several exited children, since signals do not
+  // queue, so reap until there is nothing left. A build that has failed is
+  // still active until its last job has been reaped here.
+  pid_t pid;
+  int status;
+  while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+    if (token_pids.erase(pid) > 0) {
+      job_server->release();
+    }
+    for (std::unique_ptr<Build>& build : active_builds) {
+      if (build->done) {
+        continue;
+      }
+      try {
+        if (build->scheduler->finish_job(pid, status)) {
+          break;
+        }
+      } catch (unixbuild::ExitException& e) {
+        fail_build(*build, e);
+        break;
+      }
+    }
+  }
+
+  advance_builds();
+}
+
+// Starts queued builds, hands out job tokens, and answers finished builds,
+// until nothing more can happen without waiting.
+void advance_builds() {
+  do {
+    start_ready_builds();
+    dispatch_jobs();
+  } while (finish_builds());
+  answer_builds();
+
+  // If a build is only waiting for a token, then every token is in use, so
+  // wait for one to come back. Tokens held by our own jobs come back when
+  // they exit, but a recursive make may also return some. The pipe is only
+  // watched while we need it, since it is readable whenever tokens are free.
+  bool starved = false;
+  for (std::unique_ptr<Build>& build : active_builds) {
+    starved = starved || (!build->error && build->scheduler->can_start());
+  }
+  if (starved && !watching_tokens) {
+    event_loop->add(job_server->fd(), advance_builds);
+  } else if (!starved && watching_tokens) {
+    event_loop->remove(job_server->fd());
+  }
+  watching_tokens = starved;
+}
+
+// Starts jobs for the active builds for as long as there are tokens.
+void dispatch_jobs() {
+  if (active_builds.empty()) {
+    return;
+  }
+
+  // Tokens are handed out one build at a time, round robin, so that when
+  // there are not enough to go around each build gets an equal share
+  // regardless of its -j, rather than whichever build asked first getting
+  // all of them. The build that goes first rotates too.
+  size_t first = next_build++ % active_builds.size();
+  bool started = true;
+  while (started) {
+    started = false;
+    for (size_t i = 0; i < active_builds.size(); i++) {
+      Build& build = *active_builds[(first + i) % active_builds.size()];
+      if (build.done || build.error || !build.scheduler->can_start()) {
+        continue;
+      }
+      if (!job_server->acquire()) {
+        return;
+      }
+
+      pid_t pid = 0;
+      try {
+        pid = build.scheduler->start_job();
+      } catch (unixbuild::ExitException& e) {
+        fail_build(build, e);
+      }
+      if (pid > 0) {
+        token_pids.insert(pid);
+      } else {
+        // The output came from the action cache, or the job could not be
+        // started at all.
+        job_server->release();
+      }
+      started = true;
+    }
+  }
+}
+
+// Answers every active build that has nothing left to run, and frees their
+// outputs. Returns true if there were any.
+bool finish_builds() {
+  bool any = false;
+  for (std::unique_ptr<Build>& build : active_builds) {
+    if (!build->done && !build->error && build->scheduler->finished()) {
+      try {
+        respond(*build, finish_build(*build));
+      } catch (unixbuild::ExitException& e) {
+        fail_build(*build, e);
+      }
+    }
+    // A failed build keeps its outputs until its last job has exited, since
+    // until then a job may still be writing one of them.
+    if (!build->done && build->error &&
+        build->scheduler->running_jobs() == 0) {
+      invalidate_outputs(*build->graph, build->stale,
+                         build->options.output_dir);
+      unixbuild::BuildResponse response;
+      response.returncode = build->error->returncode_;
+      response.message = build->error->message_;
+      respond(*build, response);
+    }
+    // The outputs are released as soon as the jobs are done, even if the
+    // client has yet to read everything they printed, so that a paused
+    // client does not hold up anyone else's builds.
+    if (build->done) {
+      for (const std::string& output : build_outputs(*build)) {
+        claimed_outputs.erase(output);
+      }
+      if (build->response) {
+        answering_builds.push_back(std::move(build));
+      }
+      any = true;
+    }
+  }
+
+  active_builds.erase(std::remove_if(active_builds.begin(),
+                                     active_builds.end(),
+                                     [](const std::unique_ptr<Build>& build) {
+                                       return !build || build->done;
+                                     }),
+                      active_builds.end());
+  return any;
+}
+
+// Answers the builds whose clients have read all of their output.
+void answer_builds() {
+  answering_builds.erase(
+      std::remove_if(answering_builds.begin(), answering_builds.end(),
+                     [](const std::unique_ptr<Build>& build) {
+                       if (!build->output->empty()) {
+                         return false;
+                       }
+                       send_response(*build);
+                       return true;
+                     }),
+      answering_builds.end());
+}
+
+// Drops the output of every client that has stopped reading it, and answers
+// any that this was holding up. Returns how long the event loop may wait
+// before a client that is still behind could time out, or -1 if none is.
+int drop_stalled_clients() {
+  double now = unixbuild::monotonic_seconds();
+  double next = -1.0;
+  bool dropped = false;
+  for (auto* builds : {&active_builds, &answering_builds}) {
+    for (const std::unique_ptr<Build>& build : *builds) {
+      if (build->output == nullptr || build->output->empty()) {
+        continue;
+      }
+      double left =
+          build->output->last_progress() + CLIENT_STALL_TIMEOUT_SECONDS - now;
+      if (left <= 0) {
+        syslog(LOG_WARNING, "client stopped reading; dropping its output");
+        build->output->drop();
+        dropped = true;
+      } else if (next < 0 || left < next) {
+        next = left;
+      }
+    }
+  }
+  if (dropped) {
+    answer_builds();
+  }
+  return next < 0 ? -1 : static_cast<int>(next * 1000) + 1;
+}
+
+// Abandons `build` after an error. It starts no more jobs, and once the ones
+// it has running have finished, `finish_builds` reports the first error to
+// the client.
+void fail_build(Build& build, const unixbuild::ExitException& e) {
+  if (!build.error) {
+    build.error = e;
+  }
+}
+
+// Takes a snapshot of the graph that `build` needs and works out which nodes
+// it covers. Returns false, after answering the client, if the request is
+// invalid.
+bool resolve_build(Build& build) {
+  const unixbuild::BuildRequest& request = build.request;
+  try {
+    // Anything that changed before the client sent its request has been queued
+    // by the kernel by now, so draining the queue here is enough to make the
+    // cached stamps up to date.
+    stat_cache.begin_build();
+    stat_cache.process_events();
+
+    double parse_start = unixbuild::monotonic_seconds();
+    size_t misses = build_file_cache.misses();
+    // Only the rules that the target needs are in the graph.
+    build.graph = build_file_cache.get(request.build_path, request.target);
+    build.generation = build_file_cache.generation();
+    double parse_end = unixbuild::monotonic_seconds();
+    if (build_file_cache.misses() > misses) {
+      daemon_stats.parse_time.record((parse_end - parse_start) * 1e6);
+    }
+    const unixbuild::BuildGraph& graph = *build.graph;
+    syslog(LOG_INFO, "build file cache: %zu hits, %zu misses, %zu targets",
+           build_file_cache.hits(), build_file_cache.misses(),
+           build_file_cache.graphs());
+
+    // With no target, the graph is of the file's first rule, which comes
+    // first in it as well.
+    if (!request.target.empty()) {
+      build.target = graph.find(request.target).value();
+    }
+    build.closure = graph.closure(build.target);
+
+    unixbuild::BuildOptions& options = build.options;
+    options.build_dir =
+        request.build_path.substr(0, request.build_path.rfind('/'));
+    options.output_dir = request.output_path;
+    options.jobs = std::max<uint32_t>(request.jobs, 1);
+    options.umask = request.umask;
+    options.stdout_fd = build.fds[0];
+    options.stderr_fd = build.fds[1];
+    // Jobs from several builds may be running at once, so their output is
+    // collected and passed on as each one finishes.
+    options.event_loop = event_loop.get();
+    build.output = std::make_unique<unixbuild::ClientOutput>(
+        build.fds[0], event_loop.get(), advance_builds);
+    options.client_output = build.output.get();
+    options.discovered = &discovered_deps;
+
+    if (!request.trace_path.empty()) {
+      build.trace = std::make_unique<unixbuild::TraceRecorder>(std::min(
+          build.closure.size() + TRACE_PHASE_EVENTS, MAX_TRACE_EVENTS));
+      build.trace->record_phase(build_file_cache.misses() > misses
+                                    ? "parse"
+                                    : "parse (cached)",
+                                parse_start, parse_end);
+      options.trace = build.trace.get();
+    }
+    build.queued_at = unixbuild::monotonic_seconds();
+    return true;
+  } catch (unixbuild::ExitException& e) {
+    unixbuild::BuildResponse response;
+    response.returncode = e.returncode_;
+    response.message = e.message_;
+    respond(build, response);
+    return false;
+  }
+}
+
+const std::vector<std::string>& build_outputs(Build& build) {
+  if (build.outputs.empty()) {
+    for (size_t node : build.closure) {
+      build.outputs.push_back(unixbuild::output_file(
+          *build.graph, node, build.options.output_dir));
+    }
+  }
+  return build.outputs;
+}
+
+// Starts every queued build that does not overlap with an active build or an
+// earlier queued one.
+void start_ready_builds() {
+  // Outputs of queued builds that have to keep waiting, which later builds
+  // may not overtake.
+  std::unordered_set<std::string> waiting;
+  auto overlaps = [&](Build& build) {
+    if (claimed_outputs.empty() && waiting.empty()) {
+      return false;
+    }
+    for (const std::string& output : build_outputs(build)) {
+      if (claimed_outputs.count(output) > 0 || waiting.count(output) > 0) {
+        return true;
+      }
+    }
+    return false;
+  };
+
+  auto it = queued_builds.begin();
+  while (it != queued_builds.end()) {
+    if (overlaps(**it)) {
+      for (const std::string& output : build_outputs(**it)) {
+        waiting.insert(output);
+      }
+      it++;
+      continue;
+    }
+
+    std::unique_ptr<Build> build = std::move(*it);
+    it = queued_builds.erase(it);
+    last_activity = unixbuild::monotonic_seconds();
+    if (start_build(*build)) {
+      for (const std::string& output : build_outputs(*build)) {
+        claimed_outputs.insert(output);
+      }
+      active_builds.push_back(std::move(build));
+    }
+  }
+}
+
+// Works out what `build` needs to do. Returns true if it has jobs to run;
+// otherwise answers the client.
+bool start_build(Build& build) {
+  unixbuild::BuildResponse response;
+  response.returncode = 0;
+  const unixbuild::BuildRequest& request = build.request;
+  const unixbuild::BuildGraph& graph = *build.graph;
+  unixbuild::BuildOptions& options = build.options;
+
+  trace_phase(build, "wait", build.queued_at);
+  daemon_stats.wait_time.record(
+      (unixbuild::monotonic_seconds() - build.queued_at) * 1e6);
+  try {
+    // Another build may have changed files since this one was resolved.
+    double stat_start = unixbuild::monotonic_seconds();
+    stat_cache.begin_build();
+    stat_cache.process_events();
+    size_t stat_calls = stat_cache.stat_calls();
+
+    if (!request.cache_dir.empty()) {
+      options.action_cache = &action_cache_for(request.cache_dir);
+      options.action_cache->set_max_size((uint64_t)request.cache_size_mb
+                                         << 20);
+    }
+    unixbuild::create_directories(options.output_dir, 0777 & ~options.umask);
+
+    OutputDir& dir = output_dir_for(options.output_dir);
+    if (dir.build_path != request.build_path ||
+        dir.generation != build.generation) {
+      dir.build_path = request.build_path;
+      dir.generation = build.generation;
+      dir.commands_checked.clear();
+    }
+    build.dir = &dir;
+    unixbuild::StalenessChecks& checks = build.checks;
+    checks.discovered = &discovered_deps;
+    checks.log = dir.log.get();
+    checks.commands_checked = &dir.commands_checked;
+    if (request.content_hash) {
+      checks.hashes = &content_hashes;
+    }
+    checks.pool = thread_pool.get();
+    size_t files_hashed = content_hashes.files_hashed();
+
+    build.stale =
+        unixbuild::find_stale(graph, build.closure, options.build_dir,
+                              options.output_dir, stat_cache, checks);
+    syslog(LOG_INFO, "%zu stale targets, %zu stat calls, %zu files hashed",
+           build.stale.size(), stat_cache.stat_calls() - stat_calls,
+           content_hashes.files_hashed() - files_hashed);
+    trace_phase(build, "stat", stat_start);
+    daemon_stats.stat_time.record(
+        (unixbuild::monotonic_seconds() - stat_start) * 1e6);
+    if (!build.stale.empty()) {
+      options.durations = unixbuild::logged_durations(
+          graph, build.stale, options.output_dir, *dir.log);
+      build.scheduler =
+          std::make_unique<unixbuild::Scheduler>(graph, build.stale, options);
+      build.scheduled_at = unixbuild::monotonic_seconds();
+      return true;
+    }
+
+    double record_start = unixbuild::monotonic_seconds();
+    unixbuild::record_builds(graph, build.closure, options.build_dir,
+                             options.output_dir, stat_cache, checks);
+    save_state(*dir.log, request.content_hash);
+    mark_commands_checked(dir, build);
+    trace_phase(build, "record", record_start);
+    response.message =
+        std::string(graph.output(build.target)).append(" is up to date");
+  } catch (unixbuild::ExitException& e) {
+    response.returncode = e.returncode_;
+    response.message = e.message_;
+  }
+
+  respond(build, response);
+  return false;
+}
+
+// Records the results of `build`, whose jobs have all finished, and returns
+// the response for the client.
+//
+// Throws an `ExitException` if the build failed.
+unixbuild::BuildResponse finish_build(Build& build) {
+  const unixbuild::BuildGraph& graph = *build.graph;
+  const unixbuild::BuildOptions& options = build.options;
+  const unixbuild::Scheduler& scheduler = *build.scheduler;
+  trace_phase(build, "schedule", build.scheduled_at);
+  invalidate_outputs(graph, build.stale, options.output_dir);
+
+  const unixbuild::BuildStats& stats = scheduler.stats();
+  daemon_stats.jobs_run += stats.jobs_run;
+  daemon_stats.action_cache_hits += stats.cache_hits;
+  daemon_stats.action_cache_misses += stats.cache_misses;
+  if (scheduler.failed()) {
+    throw unixbuild::ExitException(scheduler.failure(), 1);
+  }
+  double record_start = unixbuild::monotonic_seconds();
+  unixbuild::record_builds(graph, build.closure, options.build_dir,
+                           options.output_dir, stat_cache, build.checks,
+                           scheduler.job_durations());
+  save_state(*build.dir->log,
+             build.request.content_hash || options.action_cache != nullptr);
+  mark_commands_checked(*build.dir, build);
+  trace_phase(build, "record", record_start);
+
+  unixbuild::BuildResponse response;
+  response.returncode = 0;
+  char summary[256];
+  snprintf(summary, sizeof summary,
+           "ran %zu jobs in %.2fs (%.2fs of work, %.1fx parallelism)",
+           stats.jobs_run, stats.wall_seconds, stats.job_seconds,
+           stats.wall_seconds > 0 ? stats.job_seconds / stats.wall_seconds
+                                  : 0.0);
+  response.message = summary;
+  if (options.action_cache != nullptr) {
+    size_t lookups = stats.cache_hits + stats.cache_misses;
+    snprintf(summary, sizeof summary,
+             "\naction cache: %zu hits, %zu misses (%.0f%% hit rate), "
+             "%.1f MB in %zu entries",
+             stats.cache_hits, stats.cache_misses,
+             lookups > 0 ? 100.0 * stats.cache_hits / lookups : 0.0,
+             options.action_cache->total_bytes() / 1e6,
+             options.action_cache->entries());
+    response.message.append(summary);
+  }
+  append_critical_path(response.message, graph, scheduler);
+  return response;
+}
+
+// Appends the critical path of `scheduler`'s build to `out`, one node per
+// line, so that users can see which targets are holding the build up.
+void append_critical_path(std::string& out, const unixbuild::BuildGraph& graph,
+                          const unixbuild::Scheduler& scheduler) {
+  std::vector<unixbuild::CriticalPathStep> path = scheduler.critical_path();
+  double total = 0.0;
+  for (const unixbuild::CriticalPathStep& step : path) {
+    total += step.seconds;
+  }
+  char line[256];
+  snprintf(line, sizeof line, "\ncritical path: %zu %s, %.2fs", path.size(),
+           path.size() == 1 ? "target" : "targets", total);
+  out.append(line);
+  for (const unixbuild::CriticalPathStep& step : path) {
+    snprintf(line, sizeof line, "\n  %7.2fs  ", step.seconds);
+    out.append(line).append(graph.output(step.node));
+  }
+}
+
+// Finishes `build` with `response`, after writing the trace if the client
+// asked for one, and sends it to the client once it has read all of the
+// build's output.
+void respond(Build& build, unixbuild::BuildResponse response) {
+  if (build.trace) {
+    try {
+      unixbuild::write_file_atomically(build.request.trace_path,
+                                       build.trace->to_json(*build.graph));
+    } catch (unixbuild::ExitException& e) {
+      if (response.returncode == 0) {
+        response.returncode = e.returncode_;
+        response.message = e.message_;
+      }
+    }
+  }
+
+  build.done = true;
+  last_activity = unixbuild::monotonic_seconds();
+
+  daemon_stats.builds++;
+  if (response.returncode != 0) {
+    daemon_stats.failed_builds++;
+  }
+  daemon_stats.request_latency.record((last_activity - build.received_at) *
+                                      1e6);
+
+  // The client prints the response as soon as it arrives, so it waits until
+  // the client has read all of the build's output; see `answer_builds`.
+  build.response = std::move(response);
+  if (build.output == nullptr || build.output->empty()) {
+    send_response(build);
+  }
+}
+
+void send_response(Build& build) {
+  try {
+    unixbuild::send_message(build.fd, unixbuild::MessageType::BUILD_RESPONSE,
+                            unixbuild::encode_build_response(*build.response));
+  } catch (unixbuild::ProtocolException& e) {
+    // The client went away before the build finished.
+    syslog(LOG_WARNING, "%s", e.message_.c_str());
+  }
+  build.response.reset();
+}
+
+// Records a phase of `build` that started at `start` and has just ended, if
+// the client asked for a trace. `name` must be a string literal.
+void trace_phase(Build& build, const char* name, double start) {
+  if (build.trace) {
+    build.trace->record_phase(name, start, unixbuild::monotonic_seconds());
+  }
+}
+
+// Appends a metric to `out`, in the Prometheus text format.
+void append_metric(std::string& out, const char* name, double value,
+                   const char* labels = "") {
+  char line[256];
+  snprintf(line, sizeof line, "unixbuild_%s%s %.15g\n", name, labels, value);
+  out.append(line);
+}
+
+// Appends `histogram` to `out` as a Prometheus summary.
+void append_histogram(std::string& out, const char* name,
+                      const unixbuild::Histogram& histogram) {
+  append_metric(out, name, histogram.percentile(50), "{quantile=\"0.5\"}");
+  append_metric(out, name, histogram.percentile(90), "{quantile=\"0.9\"}");
+  append_metric(out, name, histogram.percentile(99), "{quantile=\"0.99\"}");
+  append_metric(out, name, histogram.percentile(99.9),
+                "{quantile=\"0.999\"}");
+  append_metric(out, name, histogram.max(), "{quantile=\"1\"}");
+  append_metric(out, (std::string(name) + "_sum").c_str(), histogram.sum());
+  append_metric(out, (std::string(name) + "_count").c_str(),
+                histogram.count());
+}
+
+// Returns the daemon's statistics for `unixbuild --stats`, in the Prometheus
+// text format so that they can be scraped as they are.
+std::string format_stats() {
+  std::string out;
+  append_metric(out, "uptime_seconds",
+                unixbuild::monotonic_seconds() - daemon_stats.started_at);
+
+  append_metric(out, "builds_total", daemon_stats.builds);
+  append_metric(out, "failed_builds_total", daemon_stats.failed_builds);
+  append_histogram(out, "request_latency_microseconds",
+                   daemon_stats.request_latency);
+  append_histogram(out, "build_wait_microseconds", daemon_stats.wait_time);
+
+  append_metric(out, "build_file_cache_hits_total", build_file_cache.hits());
+  append_metric(out, "build_file_cache_misses_total",
+                build_file_cache.misses());
+  append_metric(out, "build_file_cache_targets", build_file_cache.graphs());
+  append_histogram(out, "parse_microseconds", daemon_stats.parse_time);
+
+  append_metric(out, "stat_calls_total", stat_cache.stat_calls());
+  append_metric(out, "stat_cache_entries", stat_cache.size());
+  append_histogram(out, "stale_check_microseconds", daemon_stats.stat_time);
+  if (watcher) {
+    append_metric(out, "inotify_events_total", watcher->events_processed());
+    append_metric(out, "inotify_watches", watcher->watch_count());
+  }
+
+  append_metric(out, "jobs_run_total", daemon_stats.jobs_run);
+  uint64_t lookups =
+      daemon_stats.action_cache_hits + daemon_stats.action_cache_misses;
+  append_metric(out, "action_cache_hits_total", daemon_stats.action_cache_hits);
+  append_metric(out, "action_cache_misses_total",
+                daemon_stats.action_cache_misses);
+  append_metric(out, "action_cache_hit_ratio",
+                lookups > 0 ? static_cast<double>(
+                                  daemon_stats.action_cache_hits) /
+                                  lookups
+                            : 0.0);
+
+  size_t ready_jobs = 0;
+  for (const std::unique_ptr<Build>& build : active_builds) {
+    if (build->scheduler) {
+      ready_jobs += build->scheduler->ready_jobs();
+    }
+  }
+  append_metric(out, "active_builds", active_builds.size());
+  append_metric(out, "queued_builds", queued_builds.size());
+  append_metric(out, "answering_builds", answering_builds.size());
+  append_metric(out, "ready_jobs", ready_jobs);
+  append_metric(out, "running_jobs", job_server->held());
+  append_metric(out, "job_tokens", job_server->capacity());
+
+  // The second field of statm is the resident set size, in pages.
+  FILE* statm = fopen("/proc/self/statm", "r");
+  long pages, resident_pages;
+  if (statm != NULL) {
+    if (fscanf(statm, "%ld %ld", &pages, &resident_pages) == 2) {
+      append_metric(out, "resident_memory_bytes",
+                    static_cast<double>(resident_pages) *
+                        sysconf(_SC_PAGESIZE));
+    }
+    fclose(statm);
+  }
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) == 0) {
+    append_metric(out, "peak_resident_memory_bytes", usage.ru_maxrss * 1024.0);
+  }
+  return out;
+}
+
+// Returns the state of the output directory at `path`, loading its build log if
+// this is the first build to use it.
+OutputDir& output_dir_for(const std::string& path) {
+  OutputDir& dir = output_dirs[path];
+  if (dir.log == nullptr) {
+    dir.log = std::make_unique<unixbuild::BuildLog>(path + "/" +
+                                                    BUILD_LOG_FILE);
+    // The log already knows what the depfiles say, so there is no need to
+    // read them again, unless the output has been rebuilt since the entry
+    // was written, by something else or by a daemon that died before it
+    // could log it, in which case its depfile is newer. The stamps are
+    // cached for the build that is about to check them anyway.
+    dir.log->for_each(
+        [](const std::string& output, const unixbuild::LogEntry& entry) {
+          if (!entry.discovered.empty() &&
+              stat_cache.stamp(output) == entry.output) {
+            discovered_deps.set(output, entry.discovered);
+          }
+        });
+    syslog(LOG_INFO, "loaded %zu build log entries from %s", dir.log->size(),
+           dir.log->path().c_str());
+  }
+  return dir;
+}
+
+// Returns the action cache in `cache_dir`, opening it if this is the first
+// build to use it.
+unixbuild::ActionCache& action_cache_for(const std::string& cache_dir) {
+  auto it = action_caches.find(cache_dir);
+  if (it == action_caches.end()) {
+    auto cache =
+        std::make_unique<unixbuild::ActionCache>(cache_dir, content_hashes);
+    it = action_caches.emplace(cache_dir, std::move(cache)).first;
+  }
+  return *it->second;
+}
+
+// Records that every output of `build` was built, or found to be up to date,
+// with the current command, so that later builds from the same build file can
+// skip deducing it, whatever their target. Until a build succeeds, the
+// commands of a changed build file have to keep being checked.
+void mark_commands_checked(OutputDir& dir, const Build& build) {
+  // A build from another build file, or from a newer version of this one, may
+  // have used the directory since this one started, in which case the marks
+  // belong to that.
+  if (dir.build_path != build.request.build_path ||
+      dir.generation != build.generation) {
+    return;
+  }
+  for (size_t node : build.closure) {
+    dir.commands_checked.insert(unixbuild::output_file(
+        *build.graph, node, build.options.output_dir));
+  }
+}
+
+// Writes new build log entries, and content hashes if `hashes` is set, to disk
+// so that they survive the daemon exiting.
+void save_state(unixbuild::BuildLog& log, bool hashes) {
+  // Failing to save only costs us some rebuilding or rehashing later, so it
+  // should not fail a build that has otherwise succeeded.
+  try {
+    log.flush();
+    if (hashes && !content_hashes_path.empty()) {
+      content_hashes.save(content_hashes_path);
+    }
+  } catch (unixbuild::ExitException& e) {
+    syslog(LOG_WARNING, "%s", e.message_.c_str());
+  }
+}
+
+// Drops the cached stamps of the outputs of `nodes`, which have just been
+// rebuilt (or at least may have been).
+void invalidate_outputs(const unixbuild::BuildGraph& graph,
+                        const std::vector<size_t>& nodes,
+                        const std::string& output_dir) {
+  for (size_t node : nodes) {
+    stat_cache.invalidate(unixbuild::output_file(graph, node, output_dir));
+  }
+}
+
 void daemon_startup() {
   // Daemon start-up steps, adapted from chapter 13 of Advanced Programming in
   // the UNIX Environment.
@@ -56,3 +1219,47 @@ void daemon_startup() {
   // Initialize syslog.
   openlog("unixbuild-server", LOG_CONS, LOG_DAEMON);
 }
+
+void install_signal_handlers() {
+  // SIGCHLD, SIGINT, and SIGTERM are blocked so that they can be read from a
+  // signalfd by the event loop. Blocked signals are still queued, even
+  // SIGCHLD, whose default action is to be discarded. Jobs unblock them again
+  // before running the compiler.
+  sigset_t mask;
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGCHLD);
+  sigaddset(&mask, SIGINT);
+  sigaddset(&mask, SIGTERM);
+  if (sigprocmask(SIG_BLOCK, &mask, NULL) < 0) {
+    throw unixbuild::ExitException("sigprocmask() returned an error status", 1);
+  }
+  signalfd_ = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+  if (signalfd_ < 0) {
+    throw unixbuild::ExitException("signalfd() returned an error status", 1);
+  }
+
+  // A client that disconnects before reading its response should cause
+  // `write` to fail with EPIPE, not kill the daemon.
+  struct sigaction act;
+  memset(&act, 0, sizeof act);
+  act.sa_handler = SIG_IGN;
+  if (sigaction(SIGPIPE, &act, NULL) < 0) {
+    throw unixbuild::ExitException("sigaction() returned an error status", 1);
+  }
+
+  // Remove the socket file however we exit, as in examples/hello_server.c.
+  if (atexit(cleanup) != 0) {
+    throw unixbuild::ExitException("atexit() returned an error status", 1);
+  }
+}
+
+void cleanup() {
+  if (listenfd != -1) {
+    close(listenfd);
+    unlink(listen_path.c_str());
+  }
+  // Only now that the socket is gone may another daemon take over.
+  if (lockfd != -1) {
+    close(lockfd);
+  }
+}
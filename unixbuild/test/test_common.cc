@@ -1,8 +1,49 @@
+#include <algorithm>
 #include <cassert>
 #include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
 #include <iostream>
+#include <map>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
+#include "unixbuild/action_cache.h"
+#include "unixbuild/batch_io.h"
+#include "unixbuild/build_log.h"
+#include "unixbuild/buildfile.h"
+#include "unixbuild/cache.h"
+#include "unixbuild/command.h"
 #include "unixbuild/common.h"
+#include "unixbuild/depfile.h"
+#include "unixbuild/event_loop.h"
+#include "unixbuild/graph.h"
+#include "unixbuild/hashing.h"
+#include "unixbuild/job_output.h"
+#include "unixbuild/histogram.h"
+#include "unixbuild/jobserver.h"
+#include "unixbuild/launcher.h"
+#include "unixbuild/protocol.h"
+#include "unixbuild/scan.h"
+#include "unixbuild/scheduler.h"
+#include "unixbuild/staleness.h"
+#include "unixbuild/thread_pool.h"
+#include "unixbuild/trace.h"
+#include "unixbuild/watcher.h"
+
+// Creates a temporary file with the given contents and returns its path. The
+// caller is responsible for unlinking it.
+std::string make_temp_file(const char* contents) {
+  char path[] = "/tmp/unixbuild_test_XXXXXX";
+  int fd = mkstemp(path);
+  assert(fd >= 0);
+  ssize_t n = strlen(contents);
+  assert(write(fd, contents, n) == n);
+  close(fd);
+  return path;
+}
 
 void test_trim_whitespace() {
   std::string s = " abc ";
@@ -29,6 +70,14 @@ void test_split_string() {
   assert(vec.size() == 0);
 }
 
+void test_normalize_path() {
+  assert(unixbuild::normalize_path("lib/./x//y.c") == "lib/x/y.c");
+  assert(unixbuild::normalize_path("lib/x/../../y.c") == "y.c");
+  assert(unixbuild::normalize_path("lib/../../y.c") == "../y.c");
+  assert(unixbuild::normalize_path("/../usr/./include/") == "/usr/include");
+  assert(unixbuild::normalize_path("lib/..") == ".");
+}
+
 void test_read_lines() {
   std::vector<std::string> lines =
       unixbuild::read_lines("test/resources/bigfile.txt");
@@ -47,6 +96,1899 @@ void test_read_lines() {
   assert(lines[0] == std::string(10000, 'a').append("\n"));
 }
 
+// Writes `contents` to the file at `path`, replacing it if it exists.
+void write_file(const std::string& path, const char* contents) {
+  FILE* f = fopen(path.c_str(), "w");
+  assert(f != NULL);
+  fputs(contents, f);
+  fclose(f);
+}
+
+unixbuild::BuildFile make_build_file(
+    std::vector<std::pair<std::string, std::vector<std::string>>> rules) {
+  unixbuild::BuildFile build_file;
+  for (auto& [output, deps] : rules) {
+    build_file.rules.push_back(unixbuild::Rule{output, deps});
+  }
+  return build_file;
+}
+
+void test_parse_build_file() {
+  std::string path = make_temp_file("# comment\n"
+                                    "hello: hello.c  mylib.o\n"
+                                    "\n"
+                                    "mylib.o : mylib.c\n");
+  unixbuild::BuildFile build_file = unixbuild::parse_build_file(path);
+  assert(build_file.rules.size() == 2);
+  assert(build_file.rules[0].output == "hello");
+  assert(build_file.rules[0].deps.size() == 2);
+  assert(build_file.rules[0].deps[1] == "mylib.o");
+  assert(build_file.rules[1].output == "mylib.o");
+  unlink(path.c_str());
+
+  std::string line = "hello hello.c";
+  bool threw = false;
+  try {
+    unixbuild::parse_line(line, 1);
+  } catch (unixbuild::ParseException& e) {
+    threw = true;
+  }
+  assert(threw);
+
+  path = make_temp_file("");
+  assert(unixbuild::parse_build_file(path).rules.empty());
+  unlink(path.c_str());
+}
+
+void test_parse_rules() {
+  std::vector<std::string> outputs;
+  size_t ndeps = 0;
+  unixbuild::parse_rules("a: a.c\r\n\n  # comment\nb:b.c  a\t",
+                         [&](const unixbuild::RuleView& rule) {
+                           outputs.emplace_back(rule.output);
+                           ndeps += rule.deps.size();
+                         });
+  assert(outputs.size() == 2);
+  assert(outputs[0] == "a" && outputs[1] == "b");
+  assert(ndeps == 3);
+
+  // Line numbers in errors count blank lines and comments too.
+  std::string message;
+  try {
+    unixbuild::parse_rules("a: a.c\n\n# comment\nb\n",
+                           [](const unixbuild::RuleView&) {});
+  } catch (unixbuild::ParseException& e) {
+    message = e.message_;
+  }
+  assert(message == "could not parse line 4: no colon");
+
+  // `subdir` lines are only allowed if someone is listening for them.
+  std::vector<std::string> subdirs;
+  unixbuild::parse_rules(
+      "subdir lib\na: a.c\n  subdir\ttools/x \nsubdirs: a\n",
+      [](const unixbuild::RuleView&) {}, {},
+      [&subdirs](std::string_view dir) { subdirs.emplace_back(dir); });
+  assert(subdirs == std::vector<std::string>({"lib", "tools/x"}));
+  for (auto [text, expected] :
+       std::vector<std::pair<const char*, const char*>>{
+           {"a: a.c\nsubdir lib\n",
+            "could not parse line 2: unexpected subdir"},
+           {"subdir\n", "could not parse line 1: no directory"},
+           {"subdir a b\n", "could not parse line 1: more than one directory"},
+           {"subdirectory\n", "could not parse line 1: no colon"},
+           {"a: a.c\n \t: b.c\n", "could not parse line 2: no output"}}) {
+    message.clear();
+    try {
+      unixbuild::parse_rules(text, [](const unixbuild::RuleView&) {});
+    } catch (unixbuild::ParseException& e) {
+      message = e.message_;
+    }
+    assert(message == expected);
+  }
+  message.clear();
+  try {
+    std::string line = " : b.c";
+    unixbuild::parse_line(line, 3);
+  } catch (unixbuild::ParseException& e) {
+    message = e.message_;
+  }
+  assert(message == "could not parse line 3: no output");
+
+  // However the file is split between threads, every directory is passed
+  // on in order, among the rules around it.
+  std::string with_subdirs;
+  std::vector<std::string> expected_subdirs;
+  for (int i = 0; i < 100; i++) {
+    std::string n = std::to_string(i);
+    with_subdirs.append("subdir dir" + n + "\nout" + n + ": " +
+                        std::string(i, 'x') + ".c\n");
+    expected_subdirs.push_back("subdir dir" + n);
+    expected_subdirs.push_back("out" + n);
+    if (i % 3 == 0) {
+      with_subdirs.append("subdir extra" + n + "\n");
+      expected_subdirs.push_back("subdir extra" + n);
+    }
+  }
+  for (size_t threads = 1; threads <= 5; threads++) {
+    subdirs.clear();
+    unixbuild::parse_rules(
+        with_subdirs,
+        [&subdirs](const unixbuild::RuleView& rule) {
+          subdirs.emplace_back(rule.output);
+        },
+        unixbuild::ParseOptions{threads, unixbuild::SimdLevel::AVX2},
+        [&subdirs](std::string_view dir) {
+          subdirs.push_back("subdir " + std::string(dir));
+        });
+    assert(subdirs == expected_subdirs);
+  }
+
+  // Every way of parsing gives the same rules as parsing each line on its
+  // own, however the file is split up. The lines are long enough to span
+  // several scan blocks.
+  std::string contents;
+  for (int i = 0; i < 200; i++) {
+    std::string n = std::to_string(i);
+    contents.append(i % 7 == 0   ? "# a comment: with a colon\n"
+                    : i % 7 == 1 ? "\t \r\n"
+                    : i % 7 == 2 ? " out" + n + " :  a:b  c\t \r\n"
+                                 : "out" + n + ": " + std::string(i, 'x') +
+                                       ".c   dep" + n + ".h\tx last\n");
+  }
+  contents.append("final: no-newline\t");
+  std::vector<std::string> expected;
+  std::vector<std::string> lines;
+  unixbuild::split_string(contents, lines, '\n');
+  for (std::string& line : lines) {
+    std::optional<unixbuild::Rule> rule = unixbuild::parse_line(line, 1);
+    if (rule.has_value()) {
+      expected.push_back(rule->output);
+      expected.insert(expected.end(), rule->deps.begin(), rule->deps.end());
+      expected.push_back("|");
+    }
+  }
+  for (unixbuild::SimdLevel simd :
+       {unixbuild::SimdLevel::SCALAR, unixbuild::SimdLevel::SSE2,
+        unixbuild::SimdLevel::AVX2}) {
+    for (size_t threads = 1; threads <= 5; threads++) {
+      std::vector<std::string> fields;
+      unixbuild::parse_rules(
+          contents,
+          [&](const unixbuild::RuleView& rule) {
+            fields.emplace_back(rule.output);
+            fields.insert(fields.end(), rule.deps.begin(), rule.deps.end());
+            fields.push_back("|");
+          },
+          unixbuild::ParseOptions{threads, simd});
+      assert(fields == expected);
+    }
+  }
+
+  // Errors report the line number within the whole file, whichever thread
+  // found them, and the rules before them are all passed on first.
+  for (size_t threads = 1; threads <= 5; threads++) {
+    size_t rules = 0;
+    message.clear();
+    try {
+      unixbuild::parse_rules(
+          contents + "\nbad: \n",
+          [&rules](const unixbuild::RuleView&) { rules++; },
+          unixbuild::ParseOptions{threads, unixbuild::SimdLevel::AVX2});
+    } catch (unixbuild::ParseException& e) {
+      message = e.message_;
+    }
+    assert(message == "could not parse line 202: no deps");
+    assert(rules == static_cast<size_t>(std::count(
+                        expected.begin(), expected.end(), "|")));
+  }
+}
+
+void test_scan() {
+  // Every byte value, in every position, so that each vector version agrees
+  // with the scalar one bit for bit.
+  char block[unixbuild::SCAN_BLOCK_SIZE];
+  unixbuild::ScanFunction scalar =
+      unixbuild::scan_function(unixbuild::SimdLevel::SCALAR);
+  for (int offset = 0; offset < 256; offset++) {
+    for (size_t i = 0; i < sizeof block; i++) {
+      block[i] = static_cast<char>((i * 7 + offset) % 256);
+    }
+    uint64_t expected = scalar(block);
+    assert(unixbuild::scan_function(unixbuild::SimdLevel::SSE2)(block) ==
+           expected);
+    assert(unixbuild::scan_function(unixbuild::SimdLevel::AVX2)(block) ==
+           expected);
+  }
+  memcpy(block, "a: b c\n", 7);
+  assert((scalar(block) & 0x7f) == 0x56);
+}
+
+void test_build_file_cache() {
+  std::string path = make_temp_file("a: a.c\n");
+  unixbuild::StatCache stat_cache;
+  unixbuild::BuildFileCache cache(stat_cache);
+
+  auto first = cache.get(path);
+  assert(cache.hits() == 0 && cache.misses() == 1);
+  auto second = cache.get(path);
+  assert(cache.hits() == 1 && cache.misses() == 1);
+  assert(first == second);
+  // The first rule is the default target, and the same graph by its name.
+  assert(cache.get(path, "a") == first && cache.graphs() == 1);
+  assert(cache.generation() == 0);
+
+  // Changing the size of the file is enough to invalidate the entry even if
+  // the modification time happens to fall in the same clock tick.
+  FILE* f = fopen(path.c_str(), "a");
+  fputs("b: b.c a\nc: c.c\n", f);
+  fclose(f);
+
+  // Stamps are only re-checked at the start of a build.
+  stat_cache.begin_build();
+  auto third = cache.get(path, "b");
+  assert(cache.hits() == 2 && cache.misses() == 2);
+  // Only the rules that the target needs are in its graph.
+  assert(third->size() == 2 && !third->find("c").has_value());
+  assert(first->size() == 1);
+  assert(cache.size() == 1 && cache.graphs() == 1);
+  assert(cache.generation() == 1);
+
+  std::string message;
+  try {
+    cache.get(path, "d");
+  } catch (unixbuild::ExitException& e) {
+    message = e.message_;
+  }
+  assert(message == "unknown target: d");
+  std::string empty = make_temp_file("# empty\n");
+  try {
+    cache.get(empty);
+  } catch (unixbuild::ExitException& e) {
+    message = e.message_;
+  }
+  assert(message == "build file has no rules");
+  unlink(empty.c_str());
+
+  unlink(path.c_str());
+
+  // Only the most recently used graphs of each file are kept.
+  const size_t max_graphs = unixbuild::BuildFileCache::MAX_GRAPHS;
+  std::string many_rules;
+  for (size_t i = 0; i <= max_graphs; i++) {
+    many_rules += "t" + std::to_string(i) + ": t.c\n";
+  }
+  std::string many = make_temp_file(many_rules.c_str());
+  unixbuild::BuildFileCache bounded(stat_cache);
+  auto oldest = bounded.get(many, "t0");
+  auto recent = bounded.get(many, "t1");
+  for (size_t i = 2; i < max_graphs; i++) {
+    bounded.get(many, "t" + std::to_string(i));
+  }
+  assert(bounded.get(many, "t0") == oldest);
+  bounded.get(many, "t" + std::to_string(max_graphs));
+  assert(bounded.graphs() == max_graphs);
+  // Using t0 again saved it, so t1 was the one evicted. A build that still
+  // holds its old graph is unaffected.
+  assert(bounded.get(many, "t0") == oldest);
+  assert(bounded.get(many, "t1") != recent && recent->size() == 1);
+  unlink(many.c_str());
+
+  // Each subdirectory's build file has an entry of its own, which is only
+  // loaded when a target needs it, and parsed again when it changes.
+  char dir[] = "/tmp/unixbuild_test_XXXXXX";
+  assert(mkdtemp(dir) != NULL);
+  std::string root(dir);
+  unixbuild::create_directories(root + "/lib");
+  unixbuild::create_directories(root + "/tools");
+  write_file(root + "/BUILD.uxb",
+             "app: main.c lib/lib.o\nsubdir lib\nsubdir tools\n");
+  write_file(root + "/lib/BUILD.uxb", "lib.o: lib.c\n");
+  write_file(root + "/tools/BUILD.uxb", "tool: tool.c\n");
+  unixbuild::BuildFileCache tree_cache(stat_cache);
+  stat_cache.begin_build();
+  auto app = tree_cache.get(root + "/BUILD.uxb");
+  assert(app->size() == 2 && app->find("lib/lib.o").has_value());
+  assert(tree_cache.misses() == 2 && tree_cache.size() == 2);
+  assert(tree_cache.get(root + "/BUILD.uxb") == app);
+  assert(tree_cache.hits() == 2 && tree_cache.misses() == 2);
+
+  write_file(root + "/lib/BUILD.uxb", "lib.o: lib.c lib.h\n");
+  stat_cache.begin_build();
+  auto edited = tree_cache.get(root + "/BUILD.uxb");
+  assert(edited != app && tree_cache.misses() == 3);
+  assert(edited->deps(edited->find("lib/lib.o").value()).size() == 2);
+  assert(tree_cache.size() == 2);
+  assert(tree_cache.get(root + "/BUILD.uxb", "tools/tool")->size() == 1);
+  assert(tree_cache.misses() == 4 && tree_cache.size() == 3);
+
+  write_file(root + "/tools/BUILD.uxb", "tool tool.c\n");
+  write_file(root + "/other.uxb", "x: none/y.o\nsubdir none\n");
+  stat_cache.begin_build();
+  for (auto [target, expected] :
+       std::vector<std::pair<std::string, std::string>>{
+           {"tools/tool", root + "/tools/BUILD.uxb: could not parse line 1: "
+                                 "no colon"},
+           {"x", "no build file in subdir: none"}}) {
+    message.clear();
+    try {
+      tree_cache.get(root + (target == "x" ? "/other.uxb" : "/BUILD.uxb"),
+                     target);
+    } catch (unixbuild::ExitException& e) {
+      message = e.message_;
+    }
+    assert(message == expected);
+  }
+
+  std::string cmd = std::string("rm -rf ").append(root);
+  assert(system(cmd.c_str()) == 0);
+}
+
+void test_protocol() {
+  int fds[2];
+  assert(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+
+  unixbuild::BuildRequest request;
+  request.build_path = "/src/BUILD.uxb";
+  request.output_path = "/src/out";
+  request.target = "";
+  request.jobs = 4;
+  request.umask = 022;
+  request.content_hash = true;
+  request.trace_path = "/tmp/trace.json";
+  unixbuild::send_message(fds[0], unixbuild::MessageType::BUILD_REQUEST,
+                          unixbuild::encode_build_request(request));
+  close(fds[0]);
+
+  std::optional<unixbuild::Message> message = unixbuild::recv_message(fds[1]);
+  assert(message.has_value());
+  assert(message->type == unixbuild::MessageType::BUILD_REQUEST);
+  unixbuild::BuildRequest decoded =
+      unixbuild::decode_build_request(message->payload);
+  assert(decoded.build_path == request.build_path);
+  assert(decoded.output_path == request.output_path);
+  assert(decoded.target.empty());
+  assert(decoded.jobs == 4);
+  assert(decoded.content_hash);
+  assert(decoded.trace_path == request.trace_path);
+
+  // The peer has hung up, so the next read should see a clean EOF.
+  assert(!unixbuild::recv_message(fds[1]).has_value());
+  close(fds[1]);
+
+  // A message that arrives in pieces is read as far as it has got, without
+  // blocking, along with the descriptors passed with its first byte.
+  assert(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+  int raw[2];
+  assert(socketpair(AF_UNIX, SOCK_STREAM, 0, raw) == 0);
+  unixbuild::send_message(raw[0], unixbuild::MessageType::STATS_REQUEST,
+                          "payload");
+  char bytes[64];
+  ssize_t n = read(raw[1], bytes, sizeof bytes);
+  assert(n == 8 + 7);
+  close(raw[0]);
+  close(raw[1]);
+
+  assert(fcntl(fds[1], F_SETFL, O_NONBLOCK) == 0);
+  unixbuild::MessageReader reader;
+  assert(!reader.read_some(fds[1]));
+  int passed = dup(2);
+  struct iovec iov = {bytes, 5};
+  alignas(struct cmsghdr) char control[CMSG_SPACE(sizeof(int))];
+  struct msghdr msg;
+  memset(&msg, 0, sizeof msg);
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof control;
+  struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(cmsg), &passed, sizeof(int));
+  assert(sendmsg(fds[0], &msg, 0) == 5);
+  close(passed);
+  assert(!reader.read_some(fds[1]));
+  assert(write(fds[0], bytes + 5, 5) == 5);
+  assert(!reader.read_some(fds[1]));
+  assert(write(fds[0], bytes + 10, n - 10) == n - 10);
+  assert(reader.read_some(fds[1]));
+  message = reader.take();
+  assert(message.has_value());
+  assert(message->type == unixbuild::MessageType::STATS_REQUEST);
+  assert(message->payload == "payload");
+  assert(message->fds.size() == 1);
+  close(message->fds[0]);
+
+  // A peer that hangs up partway through a message is an error.
+  unixbuild::MessageReader truncated;
+  assert(write(fds[0], bytes, 10) == 10);
+  close(fds[0]);
+  bool closed_early = false;
+  try {
+    truncated.read_some(fds[1]);
+  } catch (unixbuild::ProtocolException& e) {
+    closed_early = e.message_.find("payload") != std::string::npos;
+  }
+  assert(closed_early);
+  close(fds[1]);
+
+  bool threw = false;
+  try {
+    unixbuild::decode_build_response(std::string(2, '\0'));
+  } catch (unixbuild::ProtocolException& e) {
+    threw = true;
+  }
+  assert(threw);
+}
+
+void test_acquire_lock() {
+  std::string path = make_temp_file("");
+  int fd = unixbuild::acquire_lock(path);
+  assert(fd >= 0);
+  // A second daemon cannot take the lock while the first holds it...
+  assert(unixbuild::acquire_lock(path) == -1);
+  // ...but can as soon as it lets go.
+  close(fd);
+  fd = unixbuild::acquire_lock(path);
+  assert(fd >= 0);
+  close(fd);
+  unlink(path.c_str());
+}
+
+void test_runtime_directory() {
+  char dir[] = "/tmp/unixbuild_test_XXXXXX";
+  assert(mkdtemp(dir) != NULL);
+  std::string root(dir);
+  const char* saved = getenv("XDG_RUNTIME_DIR");
+  std::string saved_value = saved != NULL ? saved : "";
+  setenv("XDG_RUNTIME_DIR", root.c_str(), 1);
+
+  // The directory is created for us, and only we can get into it.
+  std::string runtime = unixbuild::runtime_directory();
+  assert(runtime == root + "/unixbuild");
+  struct stat st;
+  assert(lstat(runtime.c_str(), &st) == 0 && (st.st_mode & 0777) == 0700);
+  assert(unixbuild::socket_path() == runtime + "/socket");
+  assert(unixbuild::lock_path() == runtime + "/lock");
+
+  // The socket is never connectable by other users, even with a umask of 0.
+  mode_t old_umask = umask(0);
+  int listening = unixbuild::listen_on(unixbuild::socket_path());
+  umask(old_umask);
+  assert(listening >= 0);
+  assert(lstat(unixbuild::socket_path().c_str(), &st) == 0 &&
+         (st.st_mode & 077) == 0);
+  close(listening);
+  unlink(unixbuild::socket_path().c_str());
+
+  // One that others can write to, or a symlink, is refused.
+  for (int unsafe = 0; unsafe < 2; unsafe++) {
+    if (unsafe == 0) {
+      assert(chmod(runtime.c_str(), 0777) == 0);
+    } else {
+      assert(rmdir(runtime.c_str()) == 0);
+      assert(mkdir((root + "/elsewhere").c_str(), 0700) == 0);
+      assert(symlink("elsewhere", runtime.c_str()) == 0);
+    }
+    bool threw = false;
+    try {
+      unixbuild::runtime_directory();
+    } catch (unixbuild::ExitException& e) {
+      threw = true;
+    }
+    assert(threw);
+  }
+
+  // Whoever is at the other end of a socket can be asked for their user ID.
+  int fds[2];
+  assert(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+  assert(unixbuild::peer_uid(fds[0]) == getuid());
+  close(fds[0]);
+  close(fds[1]);
+
+  if (saved != NULL) {
+    setenv("XDG_RUNTIME_DIR", saved_value.c_str(), 1);
+  } else {
+    unsetenv("XDG_RUNTIME_DIR");
+  }
+  std::string cmd = std::string("rm -rf ").append(root);
+  assert(system(cmd.c_str()) == 0);
+}
+
+void test_event_loop() {
+  unixbuild::EventLoop loop;
+  int a[2], b[2];
+  assert(pipe(a) == 0 && pipe(b) == 0);
+
+  int a_calls = 0, b_calls = 0;
+  loop.add(a[0], [&]() {
+    char c;
+    assert(read(a[0], &c, 1) == 1);
+    a_calls++;
+  });
+  // A callback can remove itself.
+  loop.add(b[0], [&]() {
+    b_calls++;
+    loop.remove(b[0]);
+  });
+  assert(loop.size() == 2);
+
+  // Nothing is readable yet, so the timeout expires.
+  assert(loop.run_once(0) == 0);
+
+  assert(write(a[1], "x", 1) == 1);
+  assert(write(b[1], "x", 1) == 1);
+  assert(loop.run_once(-1) == 2);
+  assert(a_calls == 1 && b_calls == 1);
+  assert(loop.size() == 1);
+
+  // b is still readable, but no longer watched.
+  assert(loop.run_once(0) == 0);
+  assert(b_calls == 1);
+
+  for (int fd : {a[0], a[1], b[0], b[1]}) {
+    close(fd);
+  }
+}
+
+void test_job_server() {
+  unixbuild::JobServer pool(2);
+  assert(pool.capacity() == 2);
+  assert(pool.acquire());
+  assert(pool.acquire());
+  assert(pool.held() == 2);
+  // The pool is empty, and acquiring does not block.
+  assert(!pool.acquire());
+  pool.release();
+  assert(pool.held() == 1);
+  assert(pool.acquire());
+  pool.release();
+  pool.release();
+
+  std::string flags = pool.makeflags();
+  assert(flags.find(" -j2 ") != std::string::npos);
+  assert(flags.find(" --jobserver-auth=") != std::string::npos);
+
+  // Jobs see the pipe through the inherited descriptors named in MAKEFLAGS.
+  size_t auth = flags.find("--jobserver-auth=") + strlen("--jobserver-auth=");
+  int read_fd = atoi(flags.c_str() + auth);
+  int write_fd = atoi(flags.c_str() + flags.find(',', auth) + 1);
+  char tokens[2];
+  assert(read(read_fd, tokens, 2) == 2);
+  // A job that takes tokens for itself takes them from the same pool.
+  assert(!pool.acquire());
+  assert(write(write_fd, tokens, 2) == 2);
+  assert(pool.acquire());
+  pool.release();
+}
+
+void test_launcher() {
+  unixbuild::Launcher launcher;
+  unixbuild::LaunchOptions options;
+  options.dir = "/tmp";
+  options.umask = 027;
+  options.capture_output = true;
+  unixbuild::LaunchedProcess process = launcher.launch(
+      {"sh", "-c", "echo out; echo err >&2; pwd; umask"}, options);
+  assert(process.pid > 0 && process.output_fd >= 0);
+
+  std::string output;
+  char buffer[256];
+  ssize_t n;
+  while ((n = read(process.output_fd, buffer, sizeof buffer)) > 0) {
+    output.append(buffer, n);
+  }
+  close(process.output_fd);
+  int status;
+  assert(waitpid(process.pid, &status, 0) == process.pid);
+  assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+  assert(output == "out\nerr\n/tmp\n0027\n");
+
+  bool threw = false;
+  try {
+    launcher.launch({"unixbuild-no-such-program"}, options);
+  } catch (unixbuild::ExitException& e) {
+    threw = true;
+  }
+  assert(threw);
+}
+
+// Returns everything that `output` writes after `header`.
+std::string collected_output(unixbuild::JobOutput& output) {
+  std::string path = make_temp_file("");
+  int fd = open(path.c_str(), O_RDWR);
+  output.write_to(fd, "$ header\n");
+  std::string contents;
+  char buffer[4096];
+  ssize_t n;
+  lseek(fd, 0, SEEK_SET);
+  while ((n = read(fd, buffer, sizeof buffer)) > 0) {
+    contents.append(buffer, n);
+  }
+  close(fd);
+  unlink(path.c_str());
+  assert(contents.rfind("$ header\n", 0) == 0);
+  return contents.substr(strlen("$ header\n"));
+}
+
+void test_job_output() {
+  int fds[2];
+  assert(pipe(fds) == 0);
+  unixbuild::JobOutput small(fds[0], 100);
+  assert(write(fds[1], "warning\n", 8) == 8);
+  assert(small.read_available());
+  // Nothing more to read, but the pipe is still open.
+  assert(small.read_available());
+  close(fds[1]);
+  assert(!small.read_available());
+  assert(small.size() == 8 && !small.spilled());
+  assert(collected_output(small) == "warning\n");
+
+  // Output past the limit goes to a file, in order.
+  assert(pipe(fds) == 0);
+  unixbuild::JobOutput large(fds[0], 100);
+  std::string expected;
+  for (int i = 0; i < 1000; i++) {
+    std::string line = "line " + std::to_string(i) + "\n";
+    assert(write(fds[1], line.data(), line.size()) ==
+           static_cast<ssize_t>(line.size()));
+    expected.append(line);
+    if (i % 100 == 0) {
+      large.read_available();
+    }
+  }
+  close(fds[1]);
+  while (large.read_available()) {
+  }
+  assert(large.spilled());
+  assert(large.size() == expected.size());
+  assert(collected_output(large) == expected);
+}
+
+void test_client_output() {
+  // A pipe that holds less than the output, with no one reading it yet.
+  int fds[2];
+  assert(pipe(fds) == 0);
+  assert(fcntl(fds[1], F_SETPIPE_SZ, 4096) >= 0);
+  int job[2];
+  assert(pipe(job) == 0);
+  auto spilled = std::make_unique<unixbuild::JobOutput>(job[0], 100);
+  std::string expected = "$ job\n";
+  for (int i = 0; i < 10000; i++) {
+    std::string line = "line " + std::to_string(i) + "\n";
+    expected.append(line);
+    assert(write(job[1], line.data(), line.size()) ==
+           static_cast<ssize_t>(line.size()));
+    spilled->read_available();
+  }
+  close(job[1]);
+  spilled->read_available();
+  assert(spilled->spilled());
+
+  unixbuild::EventLoop loop;
+  int drained = 0;
+  unixbuild::ClientOutput output(fds[1], &loop, [&drained]() { drained++; });
+  output.write("first\n");
+  assert(output.empty());
+  // This does not block, but waits for the client to read it.
+  output.write("$ job\n", std::move(spilled));
+  output.write("last\n");
+  assert(!output.empty() && loop.size() == 1);
+  // The client's own descriptor is left as it was.
+  assert((fcntl(fds[1], F_GETFL) & O_NONBLOCK) == 0);
+
+  std::string contents;
+  char buffer[4096];
+  while (!output.empty()) {
+    ssize_t n = read(fds[0], buffer, sizeof buffer);
+    assert(n > 0);
+    contents.append(buffer, n);
+    loop.run_once(0);
+  }
+  ssize_t n;
+  fcntl(fds[0], F_SETFL, O_NONBLOCK);
+  while ((n = read(fds[0], buffer, sizeof buffer)) > 0) {
+    contents.append(buffer, n);
+  }
+  assert(contents == "first\n" + expected + "last\n");
+  assert(drained == 1 && loop.size() == 0);
+
+  // Only a little of the queue is kept in memory, however many jobs print
+  // to a client that is not reading, and the rest still arrives in order.
+  unixbuild::ClientOutput small(fds[1], &loop, []() {}, 1000);
+  expected.clear();
+  for (int i = 0; i < 2000; i++) {
+    int job[2];
+    assert(pipe(job) == 0);
+    std::string line = "job " + std::to_string(i) + "\n";
+    assert(write(job[1], line.data(), line.size()) ==
+           static_cast<ssize_t>(line.size()));
+    close(job[1]);
+    auto collected = std::make_unique<unixbuild::JobOutput>(job[0]);
+    collected->read_available();
+    small.write("$ " + std::to_string(i) + "\n", std::move(collected));
+    expected += "$ " + std::to_string(i) + "\n" + line;
+  }
+  assert(!small.empty());
+  contents.clear();
+  while (!small.empty()) {
+    ssize_t n = read(fds[0], buffer, sizeof buffer);
+    if (n > 0) {
+      contents.append(buffer, n);
+    }
+    loop.run_once(0);
+  }
+  while ((n = read(fds[0], buffer, sizeof buffer)) > 0) {
+    contents.append(buffer, n);
+  }
+  assert(contents == expected);
+
+  // A client that stops reading can be dropped, after which nothing more is
+  // queued for it.
+  unixbuild::ClientOutput stalled(fds[1], &loop, []() {}, 1000);
+  stalled.write(std::string(100000, 'x'));
+  assert(!stalled.empty() && loop.size() == 1);
+  assert(stalled.last_progress() > 0);
+  stalled.drop();
+  assert(stalled.empty() && loop.size() == 0);
+  stalled.write("more\n");
+  assert(stalled.empty());
+  close(fds[0]);
+  close(fds[1]);
+}
+
+void test_thread_pool() {
+  for (size_t threads : {1, 4}) {
+    unixbuild::ThreadPool pool(threads);
+    assert(pool.size() == threads);
+
+    std::vector<int> calls(10000);
+    pool.parallel_for(calls.size(), [&](size_t i) { calls[i]++; }, 7);
+    assert(std::count(calls.begin(), calls.end(), 1) == 10000);
+
+    std::atomic<size_t> total{0};
+    pool.parallel_for(10, [&](size_t) {
+      pool.parallel_for(100, [&](size_t j) { total += j; });
+    });
+    assert(total == 10 * 4950);
+
+    // Every call still runs, and the error from the lowest index wins.
+    std::atomic<size_t> ran{0};
+    std::string message;
+    try {
+      pool.parallel_for(1000, [&](size_t i) {
+        ran++;
+        if (i % 100 == 37) {
+          throw unixbuild::ExitException("index " + std::to_string(i), 1);
+        }
+      });
+    } catch (unixbuild::ExitException& e) {
+      message = e.message_;
+    }
+    assert(ran == 1000);
+    assert(message == "index 37");
+  }
+
+  // A pool of one runs everything on the caller, in order.
+  unixbuild::ThreadPool single(1);
+  std::vector<size_t> order;
+  single.parallel_for(100, [&](size_t i) { order.push_back(i); }, 3);
+  assert(order.size() == 100 && std::is_sorted(order.begin(), order.end()));
+}
+
+void test_batch_io() {
+  char dir[] = "/tmp/unixbuild_test_XXXXXX";
+  assert(mkdtemp(dir) != NULL);
+  std::string root(dir);
+
+  // More files than fit in one batch, of sizes either side of the size of
+  // the first read, and paths that cannot be read.
+  std::vector<std::string> paths;
+  for (size_t i = 0; i < unixbuild::IO_BATCH_SIZE + 10; i++) {
+    std::string path = root + "/f" + std::to_string(i);
+    write_file(path, std::string(i * 7, 'a' + i % 26).c_str());
+    paths.push_back(path);
+  }
+  paths.push_back(root + "/missing");
+  paths.push_back(root + "/f0/not_a_directory");
+  paths.push_back(root);
+  std::vector<const char*> batch;
+  for (const std::string& path : paths) {
+    batch.push_back(path.c_str());
+  }
+
+  for (bool io_uring : {false, true}) {
+    unixbuild::set_io_uring_enabled(io_uring);
+    std::vector<unixbuild::StatResult> stats =
+        unixbuild::stat_files(batch, io_uring);
+    std::vector<unixbuild::ReadResult> reads =
+        unixbuild::read_files(batch, 100);
+    assert(stats.size() == paths.size() && reads.size() == paths.size());
+    for (size_t i = 0; i + 3 < paths.size(); i++) {
+      assert(stats[i].error == 0);
+      assert(stats[i].stamp == unixbuild::stat_file(batch[i]));
+      assert(reads[i].error == 0);
+      assert(reads[i].contents == std::string(i * 7, 'a' + i % 26));
+    }
+    size_t n = paths.size();
+    assert(stats[n - 3].error == ENOENT && reads[n - 3].error == ENOENT);
+    assert(stats[n - 2].error == ENOTDIR && reads[n - 2].error == ENOTDIR);
+    assert(stats[n - 1].error == 0 && reads[n - 1].error == EISDIR);
+    assert(reads[n - 1].contents.empty());
+  }
+  unixbuild::set_io_uring_enabled(true);
+
+  std::string cmd = std::string("rm -rf ").append(root);
+  assert(system(cmd.c_str()) == 0);
+}
+
+void test_path_table() {
+  unixbuild::PathTable paths;
+  assert(paths.size() == 0);
+  assert(!paths.find("a.c").has_value());
+
+  uint32_t a = paths.intern("a.c");
+  uint32_t b = paths.intern("include/b.h");
+  assert(a == 0 && b == 1);
+  assert(paths.intern("a.c") == a);
+  assert(paths.path(b) == "include/b.h");
+  assert(paths.find("include/b.h").value() == b);
+
+  // Enough paths to force the hash table to grow several times.
+  for (int i = 0; i < 10000; i++) {
+    std::string path = std::string("src/file").append(std::to_string(i));
+    assert(paths.intern(path) == (uint32_t)i + 2);
+  }
+  assert(paths.size() == 10002);
+  assert(paths.find("src/file5000").value() == 5002);
+  assert(paths.path(a) == "a.c");
+}
+
+void test_build_graph() {
+  unixbuild::BuildGraph graph(make_build_file({
+      {"hello", {"hello.c", "mylib.o", "util.o"}},
+      {"mylib.o", {"mylib.c", "util.o"}},
+      {"util.o", {"util.c"}},
+      {"unrelated", {"unrelated.c"}},
+  }));
+
+  assert(graph.rule_deps(0).size() == 2);
+  assert(graph.find("util.o").value() == 2);
+  assert(!graph.find("hello.c").has_value());
+  assert(graph.output(1) == "mylib.o");
+  assert(graph.deps(0).size() == 3);
+  // util.o is listed twice but interned once.
+  assert(graph.deps(0)[2] == graph.deps(1)[1]);
+  assert(graph.deps(0)[2] == graph.output_id(2));
+  assert(graph.producer(graph.deps(0)[0]) == std::nullopt);
+
+  // Parsing text directly should give the same graph.
+  unixbuild::BuildGraph parsed = unixbuild::BuildGraph::parse(
+      "hello: hello.c mylib.o util.o\n"
+      "mylib.o: mylib.c util.o\n"
+      "util.o: util.c\n");
+  assert(parsed.size() == 3);
+  assert(parsed.rule_deps(0).size() == 2);
+  assert(parsed.closure(0) == graph.closure(0));
+
+  // Every node must come after the nodes it depends on.
+  std::vector<size_t> order = graph.closure(0);
+  assert(order.size() == 3);
+  assert(order[0] == 2 && order[1] == 1 && order[2] == 0);
+
+  unixbuild::BuildGraph cyclic(make_build_file({
+      {"a", {"b"}},
+      {"b", {"c"}},
+      {"c", {"a"}},
+  }));
+  bool threw = false;
+  try {
+    cyclic.closure(0);
+  } catch (unixbuild::ExitException& e) {
+    threw = true;
+  }
+  assert(threw);
+
+  threw = false;
+  try {
+    unixbuild::BuildGraph duplicate(make_build_file({
+        {"a", {"a.c"}},
+        {"a", {"b.c"}},
+    }));
+  } catch (unixbuild::ExitException& e) {
+    threw = true;
+  }
+  assert(threw);
+}
+
+void test_build_file_index() {
+  const char* text = "app: main.o lib.a\n"
+                     "# The library.\n"
+                     "lib.a: x.o y.o\n"
+                     "  x.o:   x.c  config.h \n"
+                     "y.o: y.c config.h\n"
+                     "tool: tool.o lib.a\n"
+                     "tool.o: tool.c\n"
+                     "main.o: main.c config.h";
+  unixbuild::BuildFileIndex index(text);
+  unixbuild::BuildGraph full = unixbuild::BuildGraph::parse(text);
+  assert(index.size() == 7);
+  assert(index.find("x.o").value() == 2 && !index.find("x.c").has_value());
+
+  // A target's graph has the rules of its closure, in file order, with the
+  // same dependencies as in the graph of the whole file.
+  auto check = [&](const char* target, std::vector<std::string> expected) {
+    unixbuild::BuildGraph graph =
+        index.subgraph(index.find(target).value());
+    assert(graph.size() == expected.size());
+    for (size_t node = 0; node < graph.size(); node++) {
+      assert(graph.output(node) == expected[node]);
+      size_t original = full.find(graph.output(node)).value();
+      assert(graph.deps(node).size() == full.deps(original).size());
+      for (size_t i = 0; i < graph.deps(node).size(); i++) {
+        assert(graph.paths().path(graph.deps(node)[i]) ==
+               full.paths().path(full.deps(original)[i]));
+      }
+    }
+    return graph;
+  };
+  unixbuild::BuildGraph app =
+      check("app", {"app", "lib.a", "x.o", "y.o", "main.o"});
+  assert(app.closure(0).back() == 0);
+  check("tool", {"lib.a", "x.o", "y.o", "tool", "tool.o"});
+  check("x.o", {"x.o"});
+
+  // The whole file is checked, with the same errors as a full parse.
+  for (const char* bad : {"a: a.c\nb: b.c\na: c.c\n", "a: a.c\nb b.c\n",
+                          "a: a.c\na: b.c\nb\n"}) {
+    std::string expected, actual;
+    try {
+      unixbuild::BuildGraph::parse(bad);
+    } catch (unixbuild::ExitException& e) {
+      expected = e.message_;
+    }
+    try {
+      unixbuild::BuildFileIndex bad_index(bad);
+    } catch (unixbuild::ExitException& e) {
+      actual = e.message_;
+    }
+    assert(!expected.empty() && actual == expected);
+  }
+
+  // Subdirectories' build files are only loaded once a path in them is
+  // needed, and their paths are made relative to the top-level file.
+  unixbuild::BuildFileIndex top("app: main.o lib/lib.a\n"
+                                "subdir lib\n"
+                                "subdir tools\n"
+                                "main.o: main.c lib/include/lib.h\n");
+  std::map<std::string, std::shared_ptr<const unixbuild::BuildFileIndex>>
+      subdir_files = {
+          {"lib", std::make_shared<const unixbuild::BuildFileIndex>(
+                      "subdir sub\n"
+                      "lib.a: x.o sub/y.o\n"
+                      "x.o: ./x.c include/lib.h ../config.h /usr/include/z.h\n"
+                      "unused.o: unused.c\n")},
+          {"lib/sub", std::make_shared<const unixbuild::BuildFileIndex>(
+                          "y.o: y.c ../../tools/gen.h\n")},
+          {"tools", std::make_shared<const unixbuild::BuildFileIndex>(
+                        "gen.h: gen.txt\n")},
+      };
+  std::vector<std::string> loaded;
+  auto load = [&](const std::string& dir) {
+    loaded.push_back(dir);
+    return subdir_files.at(dir);
+  };
+  assert(top.subdir_of("lib/sub/y.o").value() == "lib");
+  assert(!top.subdir_of("libx/y.o").has_value());
+
+  // A header in a subdirectory could be generated, so its file is needed.
+  unixbuild::BuildGraph tree = top.target_graph("main.o", load);
+  assert(tree.size() == 1 && loaded == std::vector<std::string>{"lib"});
+  loaded.clear();
+  tree = top.target_graph("", load);
+  assert((loaded == std::vector<std::string>{"lib", "lib/sub", "tools"}));
+  std::vector<std::string> outputs;
+  for (size_t node = 0; node < tree.size(); node++) {
+    outputs.emplace_back(tree.output(node));
+  }
+  assert((outputs == std::vector<std::string>{"app", "main.o", "lib/lib.a",
+                                              "lib/x.o", "lib/sub/y.o",
+                                              "tools/gen.h"}));
+  std::vector<std::string> deps;
+  for (uint32_t dep : tree.deps(tree.find("lib/x.o").value())) {
+    deps.emplace_back(tree.paths().path(dep));
+  }
+  assert((deps == std::vector<std::string>{"lib/x.c", "lib/include/lib.h",
+                                           "config.h", "/usr/include/z.h"}));
+  // Each rule depends on the ones that produce its inputs, across files.
+  assert(tree.closure(0).size() == 6);
+
+  loaded.clear();
+  assert(top.target_graph("lib/sub/y.o", load).size() == 2);
+  assert((loaded == std::vector<std::string>{"lib", "lib/sub", "tools"}));
+  for (const char* target : {"lib/unknown.o", "tools/gen.txt"}) {
+    std::string message;
+    try {
+      top.target_graph(target, load);
+    } catch (unixbuild::ExitException& e) {
+      message = e.message_;
+    }
+    assert(message == std::string("unknown target: ").append(target));
+  }
+
+  for (auto [bad, expected] : std::vector<std::pair<const char*, const char*>>{
+           {"subdir ../x\n", "subdir is not below the build file: ../x"},
+           {"subdir a/..\n", "subdir is not below the build file: a/.."},
+           {"subdir a\na/b.o: b.c\n",
+            "output a/b.o belongs in the build file of a"}}) {
+    std::string message;
+    try {
+      unixbuild::BuildFileIndex bad_index(bad);
+    } catch (unixbuild::ExitException& e) {
+      message = e.message_;
+    }
+    assert(message == expected);
+  }
+}
+
+void test_deduce_command() {
+  unixbuild::BuildGraph graph(make_build_file({
+      {"hello", {"hello.c", "include/mylib.h", "mylib.o"}},
+      {"mylib.o", {"src/mylib.cc", "include/mylib.h", "config.h"}},
+      {"two", {"one.c", "two.c"}},
+  }));
+
+  std::vector<std::string> argv =
+      unixbuild::deduce_command(graph, 0, "/build");
+  assert(unixbuild::format_command(argv) ==
+         "gcc -o /build/hello -MMD -MF /build/hello.d hello.c /build/mylib.o "
+         "-Iinclude");
+
+  argv = unixbuild::deduce_command(graph, 1, "/build");
+  assert(unixbuild::format_command(argv) ==
+         "g++ -c -o /build/mylib.o -MMD -MF /build/mylib.o.d src/mylib.cc "
+         "-Iinclude -I.");
+
+  // No depfile when compiling more than one source at once.
+  assert(!unixbuild::writes_depfile(graph, 2));
+  argv = unixbuild::deduce_command(graph, 2, "/build");
+  assert(unixbuild::format_command(argv) == "gcc -o /build/two one.c two.c");
+}
+
+void test_scheduler() {
+  char dir[] = "/tmp/unixbuild_test_XXXXXX";
+  assert(mkdtemp(dir) != NULL);
+  std::string root(dir);
+  write_file(root + "/a.c", "int a(void) { return 1; }\n");
+  write_file(root + "/b.c", "int b(void) { return 2; }\n");
+  write_file(root + "/main.c", "int a(void);\n"
+                               "int b(void);\n"
+                               "int main(void) { return a() + b() - 3; }\n");
+
+  unixbuild::BuildGraph graph(make_build_file({
+      {"prog", {"main.c", "a.o", "b.o"}},
+      {"a.o", {"a.c"}},
+      {"b.o", {"b.c"}},
+  }));
+
+  int devnull = open("/dev/null", O_WRONLY);
+  unixbuild::BuildOptions options;
+  options.build_dir = root;
+  options.output_dir = root + "/out";
+  options.jobs = 2;
+  options.stdout_fd = devnull;
+  options.stderr_fd = devnull;
+
+  unixbuild::Scheduler scheduler(graph, graph.closure(0), options);
+  scheduler.run();
+  assert(!scheduler.failed());
+  assert(scheduler.stats().jobs_run == 3);
+  assert(access((root + "/out/prog").c_str(), X_OK) == 0);
+  assert(scheduler.job_durations()[0] > 0);
+  // The link waited on one of the objects.
+  std::vector<unixbuild::CriticalPathStep> path = scheduler.critical_path();
+  assert(path.size() == 2);
+  assert(path[0].node == 1 || path[0].node == 2);
+  assert(path[1].node == 0 && path[1].seconds > 0);
+
+  // With one job slot, the object that is expected to take longer goes first,
+  // even though it comes later in the build file.
+  std::string clean = std::string("rm -rf ").append(root).append("/out");
+  assert(system(clean.c_str()) == 0);
+  unixbuild::TraceRecorder trace(3);
+  unixbuild::BuildOptions weighted = options;
+  weighted.jobs = 1;
+  weighted.trace = &trace;
+  weighted.durations = {0.0, 1.0, 10.0};
+  unixbuild::Scheduler ordered(graph, graph.closure(0), weighted);
+  ordered.run();
+  std::string json = trace.to_json(graph);
+  assert(json.find("\"b.o\"") < json.find("\"a.o\""));
+
+  // A failing job stops the build before anything that depends on it runs.
+  write_file(root + "/b.c", "this is not C\n");
+  unixbuild::Scheduler failing(graph, graph.closure(0), options);
+  failing.run();
+  assert(failing.failed());
+  assert(failing.failure().find("b.o") != std::string::npos);
+  assert(failing.stats().jobs_run == 2);
+
+  // With an action cache, a clean rebuild does not need to run anything.
+  write_file(root + "/b.c", "int b(void) { return 2; }\n");
+  unixbuild::ContentHashCache hashes;
+  unixbuild::ActionCache cache(root + "/cache", hashes);
+  options.action_cache = &cache;
+  unixbuild::Scheduler populating(graph, graph.closure(0), options);
+  populating.run();
+  assert(populating.stats().jobs_run == 3);
+  assert(populating.stats().cache_misses == 3);
+  // An entry for each output, and a manifest for each depfile.
+  assert(cache.entries() == 6);
+
+  assert(system(clean.c_str()) == 0);
+  unixbuild::Scheduler cached(graph, graph.closure(0), options);
+  cached.run();
+  assert(!cached.failed());
+  assert(cached.stats().jobs_run == 0);
+  assert(cached.stats().cache_hits == 3);
+  assert(access((root + "/out/prog").c_str(), X_OK) == 0);
+  // The depfiles are restored along with the outputs.
+  assert(access((root + "/out/a.o.d").c_str(), R_OK) == 0);
+
+  // So does a build into a different output directory.
+  unixbuild::BuildOptions elsewhere = options;
+  elsewhere.output_dir = root + "/out2";
+  unixbuild::Scheduler moved(graph, graph.closure(0), elsewhere);
+  moved.run();
+  assert(!moved.failed());
+  assert(moved.stats().jobs_run == 0);
+  assert(moved.stats().cache_hits == 3);
+  assert(access((root + "/out2/prog").c_str(), X_OK) == 0);
+  assert(unixbuild::read_lines((root + "/out2/a.o.d").c_str())[0].find(
+             root + "/out2/a.o:") == 0);
+
+  close(devnull);
+  std::string cmd = std::string("rm -rf ").append(root);
+  assert(system(cmd.c_str()) == 0);
+}
+
+// Sets the modification time of `path` to `seconds` past the epoch.
+void set_mtime(const std::string& path, time_t seconds) {
+  struct timespec times[2];
+  times[0].tv_sec = seconds;
+  times[0].tv_nsec = 0;
+  times[1] = times[0];
+  assert(utimensat(AT_FDCWD, path.c_str(), times, 0) == 0);
+}
+
+void test_action_cache() {
+  char dir[] = "/tmp/unixbuild_test_XXXXXX";
+  assert(mkdtemp(dir) != NULL);
+  std::string root(dir);
+  std::string input = root + "/a.c";
+  std::string output = root + "/a.o";
+  std::string out = root + "/out";
+  write_file(input, "int a;");
+
+  unixbuild::ContentHashCache hashes;
+  unixbuild::ActionCache cache(root + "/cache", hashes);
+  std::vector<std::string> argv = {"gcc", "-c", "-o", output, "a.c"};
+  std::string key = cache.key(argv, {input}, root, out);
+  assert(key.size() == 32);
+  std::vector<std::string> discovered;
+  assert(!cache.restore(key, output, discovered));
+
+  write_file(output, "object code");
+  cache.store(key, output, {});
+  assert(cache.entries() == 1);
+  assert(cache.total_bytes() == strlen("object code"));
+
+  // The same command and inputs restore the output, even once it is gone.
+  unlink(output.c_str());
+  assert(
+      cache.restore(cache.key(argv, {input}, root, out), output, discovered));
+  assert(unixbuild::read_lines(output.c_str())[0] == "object code");
+  assert(cache.hits() == 1 && cache.misses() == 1);
+
+  // Different contents or a different command line are different actions.
+  write_file(input, "int a = 1;");
+  assert(cache.key(argv, {input}, root, out) != key);
+  argv.push_back("-O2");
+  write_file(input, "int a;");
+  assert(cache.key(argv, {input}, root, out) != key);
+
+  // A reopened cache finds the existing entry on disk.
+  unixbuild::ActionCache reopened(root + "/cache", hashes);
+  assert(reopened.entries() == 1);
+
+  // Storing an entry over the size limit evicts the least recently used one.
+  std::string other = root + "/b.o";
+  write_file(other, "more object code");
+  reopened.set_max_size(20);
+  reopened.store(std::string(32, '0'), other, {});
+  assert(reopened.entries() == 1);
+  assert(!reopened.restore(key, output, discovered));
+  assert(reopened.restore(std::string(32, '0'), output, discovered));
+  reopened.set_max_size(UINT64_MAX);
+
+  // An entry for a command that discovered a header is only restored if the
+  // header is unchanged too.
+  std::string header = root + "/a.h";
+  write_file(header, "#define A 1");
+  write_file(output, "object code");
+  reopened.store(key, output, {header});
+  assert(reopened.restore(key, output, discovered));
+  assert(discovered.size() == 1 && discovered[0] == header);
+  write_file(header, "#define A 2");
+  set_mtime(header, 1000);
+  assert(!reopened.restore(key, output, discovered));
+
+  std::string cmd = std::string("rm -rf ").append(root);
+  assert(system(cmd.c_str()) == 0);
+}
+
+void test_histogram() {
+  unixbuild::Histogram empty;
+  assert(empty.count() == 0 && empty.percentile(50) == 0 && empty.min() == 0);
+
+  // Small values are exact.
+  unixbuild::Histogram small;
+  for (uint64_t i = 1; i <= 50; i++) {
+    small.record(i);
+  }
+  assert(small.count() == 50 && small.sum() == 1275);
+  assert(small.min() == 1 && small.max() == 50);
+  assert(small.percentile(50) == 25);
+  assert(small.percentile(100) == 50);
+
+  // Large values are within about 3%, and never above the maximum.
+  unixbuild::Histogram large;
+  for (uint64_t i = 1; i <= 100000; i++) {
+    large.record(i * 10);
+  }
+  uint64_t p50 = large.percentile(50);
+  assert(p50 >= 500000 && p50 <= 500000 * 1.035);
+  uint64_t p99 = large.percentile(99);
+  assert(p99 >= 990000 && p99 <= 990000 * 1.035);
+  assert(large.percentile(100) == 1000000);
+
+  unixbuild::Histogram extreme;
+  extreme.record(UINT64_MAX);
+  assert(extreme.percentile(50) == UINT64_MAX);
+}
+
+void test_trace_recorder() {
+  unixbuild::BuildGraph graph = unixbuild::BuildGraph::parse(
+      "prog: main.o\n"
+      "main.o: main.c\n");
+  unixbuild::TraceRecorder trace(3);
+  trace.record_phase("parse", 10.0, 10.5);
+  trace.record_phase("stat", 10.5, 11.0);
+  unixbuild::TraceEvent job;
+  job.category = "job";
+  job.node = 1;
+  job.lane = 2;
+  job.start = 11.0;
+  job.end = 12.0;
+  trace.record(job);
+  assert(trace.size() == 3 && trace.dropped() == 0);
+
+  // The ring is full, so this overwrites "parse".
+  trace.record_phase("record", 12.0, 12.25);
+  assert(trace.size() == 3 && trace.dropped() == 1);
+
+  std::string json = trace.to_json(graph);
+  assert(json.find("\"parse\"") == std::string::npos);
+  // Times are in microseconds since the oldest event that is left.
+  assert(json.find("{\"name\":\"stat\",\"cat\":\"daemon\",\"ph\":\"X\","
+                   "\"ts\":0.000,\"dur\":500000.000,\"pid\":1,\"tid\":0}") !=
+         std::string::npos);
+  // Jobs are named after their outputs.
+  assert(json.find("{\"name\":\"main.o\",\"cat\":\"job\",\"ph\":\"X\","
+                   "\"ts\":500000.000,\"dur\":1000000.000,\"pid\":1,"
+                   "\"tid\":2}") != std::string::npos);
+  assert(json.find("\"job slot 1\"") != std::string::npos);
+  assert(json.find("\"dropped_events\":1") != std::string::npos);
+}
+
+void test_find_stale() {
+  char dir[] = "/tmp/unixbuild_test_XXXXXX";
+  assert(mkdtemp(dir) != NULL);
+  std::string root(dir);
+  unixbuild::create_directories(root + "/out");
+
+  unixbuild::BuildGraph graph(make_build_file({
+      {"prog", {"main.c", "common.h", "a.o", "b.o"}},
+      {"a.o", {"a.c", "common.h"}},
+      {"b.o", {"b.c", "common.h"}},
+  }));
+  std::vector<size_t> nodes = graph.closure(0);
+
+  for (const char* name : {"main.c", "common.h", "a.c", "b.c"}) {
+    write_file(root + "/" + name, "");
+    set_mtime(root + "/" + name, 1000);
+  }
+  for (const char* name : {"prog", "a.o", "b.o"}) {
+    write_file(root + "/out/" + name, "");
+    set_mtime(root + "/out/" + name, 2000);
+  }
+
+  unixbuild::StatCache stat_cache;
+  stat_cache.begin_build();
+  std::vector<size_t> stale =
+      unixbuild::find_stale(graph, nodes, root, root + "/out", stat_cache);
+  assert(stale.empty());
+  // Seven distinct files, each stat'd exactly once even though common.h is a
+  // dependency of every rule.
+  assert(stat_cache.stat_calls() == 7);
+
+  // Within a build, results are memoized.
+  unixbuild::find_stale(graph, nodes, root, root + "/out", stat_cache);
+  assert(stat_cache.stat_calls() == 7);
+
+  // Touching a source makes its object and everything downstream stale.
+  set_mtime(root + "/b.c", 3000);
+  stat_cache.begin_build();
+  stale = unixbuild::find_stale(graph, nodes, root, root + "/out", stat_cache);
+  assert(stale.size() == 2);
+  assert(stale[0] == 2 && stale[1] == 0);
+
+  // So does a missing output.
+  unlink((root + "/out/a.o").c_str());
+  set_mtime(root + "/b.c", 1000);
+  stat_cache.begin_build();
+  stale = unixbuild::find_stale(graph, nodes, root, root + "/out", stat_cache);
+  assert(stale.size() == 2);
+  assert(stale[0] == 1 && stale[1] == 0);
+
+  unlink((root + "/main.c").c_str());
+  stat_cache.begin_build();
+  bool threw = false;
+  try {
+    unixbuild::find_stale(graph, nodes, root, root + "/out", stat_cache);
+  } catch (unixbuild::ExitException& e) {
+    threw = true;
+  }
+  assert(threw);
+
+  std::string cmd = std::string("rm -rf ").append(root);
+  assert(system(cmd.c_str()) == 0);
+}
+
+void test_parse_depfile() {
+  std::vector<std::string> deps;
+  auto collect = [&deps](std::string_view dep) { deps.emplace_back(dep); };
+  unixbuild::parse_depfile("out/a.o: a.c include/a.h \\\n"
+                           "  include/my\\ file.h \\\n"
+                           " cost$$.h\n",
+                           collect);
+  assert(deps.size() == 4);
+  assert(deps[0] == "a.c");
+  assert(deps[1] == "include/a.h");
+  assert(deps[2] == "include/my file.h");
+  assert(deps[3] == "cost$.h");
+
+  // Writing and reading back a depfile gives the same paths, made absolute.
+  std::string path = make_temp_file("");
+  unixbuild::write_depfile(path, "/out/b.o", {"/src/b.c", "/src/my file.h"});
+  deps = unixbuild::read_depfile(path, "/src");
+  assert(deps.size() == 2);
+  assert(deps[1] == "/src/my file.h");
+  unixbuild::write_file_atomically(path, "b.o: b.c\n");
+  deps = unixbuild::read_depfile(path, "/src");
+  assert(deps.size() == 1 && deps[0] == "/src/b.c");
+  unlink(path.c_str());
+
+  assert(unixbuild::read_depfile(path, "/src").empty());
+
+  bool threw = false;
+  try {
+    unixbuild::parse_depfile("no target here", collect);
+  } catch (unixbuild::ExitException& e) {
+    threw = true;
+  }
+  assert(threw);
+}
+
+void test_find_stale_with_depfiles() {
+  char dir[] = "/tmp/unixbuild_test_XXXXXX";
+  assert(mkdtemp(dir) != NULL);
+  std::string root(dir);
+  std::string out = root + "/out";
+  unixbuild::create_directories(out);
+
+  // The build file only mentions the source, but the depfile says it also
+  // includes a header.
+  unixbuild::BuildGraph graph(make_build_file({{"a.o", {"a.c"}}}));
+  std::vector<size_t> nodes = graph.closure(0);
+  write_file(root + "/a.c", "");
+  write_file(root + "/a.h", "");
+  set_mtime(root + "/a.c", 1000);
+  set_mtime(root + "/a.h", 1000);
+  write_file(out + "/a.o", "");
+  set_mtime(out + "/a.o", 2000);
+  unixbuild::write_depfile(out + "/a.o.d", out + "/a.o",
+                           {root + "/a.c", root + "/a.h"});
+
+  unixbuild::StatCache stat_cache;
+  unixbuild::DiscoveredDeps discovered;
+  unixbuild::StalenessChecks checks;
+  checks.discovered = &discovered;
+  stat_cache.begin_build();
+  assert(unixbuild::find_stale(graph, nodes, root, out, stat_cache, checks)
+             .empty());
+  assert(discovered.depfiles_read() == 1);
+
+  set_mtime(root + "/a.h", 3000);
+  stat_cache.begin_build();
+  assert(unixbuild::find_stale(graph, nodes, root, out, stat_cache, checks)
+             .size() == 1);
+  // Without the depfile we would not have known.
+  assert(unixbuild::find_stale(graph, nodes, root, out, stat_cache).empty());
+  // The depfile was only read once.
+  assert(discovered.depfiles_read() == 1);
+
+  // A discovered header that has gone away is not an error, but does mean
+  // that the output needs to be rebuilt.
+  unlink((root + "/a.h").c_str());
+  stat_cache.begin_build();
+  assert(unixbuild::find_stale(graph, nodes, root, out, stat_cache, checks)
+             .size() == 1);
+
+  std::string cmd = std::string("rm -rf ").append(root);
+  assert(system(cmd.c_str()) == 0);
+}
+
+void test_staleness_with_thread_pool() {
+  char dir[] = "/tmp/unixbuild_test_XXXXXX";
+  assert(mkdtemp(dir) != NULL);
+  std::string root(dir);
+  std::string out = root + "/out";
+  unixbuild::create_directories(out);
+
+  // A program linked from objects that share some headers. Some sources, and
+  // a header that only depfiles mention, have changed since the objects were
+  // built, and some objects are missing.
+  std::string text = "prog:";
+  for (int i = 0; i < 300; i++) {
+    std::string n = std::to_string(i);
+    text.append(" o" + n + ".o");
+  }
+  text.append("\n");
+  for (int i = 0; i < 300; i++) {
+    std::string n = std::to_string(i);
+    std::string header = "h" + std::to_string(i % 10) + ".h";
+    text.append("o" + n + ".o: s" + n + ".c " + header + "\n");
+    write_file(root + "/s" + n + ".c", ("int s" + n + ";").c_str());
+    set_mtime(root + "/s" + n + ".c", i % 7 == 0 ? 3000 : 1000);
+    if (i % 50 != 0) {
+      write_file(out + "/o" + n + ".o", "");
+      set_mtime(out + "/o" + n + ".o", 2000);
+    }
+    if (i % 2 == 0) {
+      std::string extra = root + "/extra" + std::to_string(i % 5) + ".h";
+      unixbuild::write_depfile(
+          out + "/o" + n + ".o.d", out + "/o" + n + ".o",
+          {root + "/s" + n + ".c", root + "/" + header, extra});
+    } else if (i % 10 == 1) {
+      // Left empty by a compiler that was killed, which lists nothing.
+      write_file(out + "/o" + n + ".o.d", "");
+    }
+  }
+  for (int i = 0; i < 10; i++) {
+    std::string header = root + "/h" + std::to_string(i) + ".h";
+    write_file(header, ("int h" + std::to_string(i) + ";").c_str());
+    set_mtime(header, 1000);
+  }
+  for (int i = 0; i < 5; i++) {
+    std::string header = root + "/extra" + std::to_string(i) + ".h";
+    write_file(header, "");
+    set_mtime(header, i == 4 ? 3000 : 1000);
+  }
+  write_file(out + "/prog", "");
+  set_mtime(out + "/prog", 2500);
+
+  unixbuild::BuildGraph graph = unixbuild::BuildGraph::parse(text);
+  std::vector<size_t> nodes = graph.closure(0);
+
+  // Runs the same checks, with fresh caches, on one thread or with `pool`,
+  // and returns what was found stale, followed by the inputs hash of each
+  // output that exists.
+  auto analyze = [&](unixbuild::ThreadPool* pool) {
+    unixbuild::StatCache stat_cache;
+    unixbuild::DiscoveredDeps discovered;
+    unixbuild::ContentHashCache hashes;
+    unixbuild::BuildLog log(root + "/log");
+    unixbuild::StalenessChecks checks;
+    checks.discovered = &discovered;
+    checks.log = &log;
+    checks.hashes = &hashes;
+    checks.pool = pool;
+    stat_cache.begin_build();
+    std::vector<uint64_t> results;
+    for (size_t node :
+         unixbuild::find_stale(graph, nodes, root, out, stat_cache, checks)) {
+      results.push_back(node);
+    }
+    // The program cannot be recorded while some of its objects are missing.
+    std::vector<size_t> objects;
+    for (size_t node : nodes) {
+      if (graph.output(node) != "prog") {
+        objects.push_back(node);
+      }
+    }
+    unixbuild::record_builds(graph, objects, root, out, stat_cache, checks);
+    for (size_t node : objects) {
+      const unixbuild::LogEntry* entry =
+          log.find(unixbuild::output_file(graph, node, out));
+      if (entry != nullptr) {
+        results.push_back(entry->inputs_hash);
+        results.push_back(entry->discovered.size());
+      }
+    }
+    return results;
+  };
+  unixbuild::ThreadPool pool(4);
+  std::vector<uint64_t> expected = analyze(nullptr);
+  // Some targets are stale, and every object that exists was recorded.
+  assert(expected.size() > 2 * 294);
+  assert(analyze(&pool) == expected);
+  unixbuild::set_io_uring_enabled(false);
+  assert(analyze(&pool) == expected);
+  unixbuild::set_io_uring_enabled(true);
+
+  // Errors are the same too.
+  unlink((root + "/s3.c").c_str());
+  unlink((root + "/s5.c").c_str());
+  std::string messages[2];
+  for (unixbuild::ThreadPool* p : {(unixbuild::ThreadPool*)nullptr, &pool}) {
+    try {
+      analyze(p);
+    } catch (unixbuild::ExitException& e) {
+      messages[p != nullptr] = e.message_;
+    }
+  }
+  assert(messages[0].find("/s3.c") != std::string::npos);
+  assert(messages[0] == messages[1]);
+
+  // As are the graph's indices, which a pool builds in blocks of nodes.
+  text.clear();
+  for (int i = 0; i < 10000; i++) {
+    text.append("n" + std::to_string(i) + ": n" +
+                std::to_string((i * 7 + 1) % 10000) + " src n" +
+                std::to_string((i + 5000) % 10000) + "\n");
+  }
+  unixbuild::BuildGraph single = unixbuild::BuildGraph::parse(text);
+  unixbuild::BuildGraph pooled = unixbuild::BuildGraph::parse(text, &pool);
+  for (size_t node = 0; node < single.size(); node++) {
+    unixbuild::IdRange a = single.rule_deps(node);
+    unixbuild::IdRange b = pooled.rule_deps(node);
+    assert(std::equal(a.begin(), a.end(), b.begin(), b.end()));
+    a = single.deps(node);
+    b = pooled.deps(node);
+    assert(std::equal(a.begin(), a.end(), b.begin(), b.end()));
+  }
+
+  std::string cmd = std::string("rm -rf ").append(root);
+  assert(system(cmd.c_str()) == 0);
+}
+
+void test_hash_bytes() {
+  // Reference values from the XXH64 specification's implementation.
+  assert(unixbuild::hash_bytes("") == 0xEF46DB3751D8E999ULL);
+  assert(unixbuild::hash_bytes("abc") == 0x44BC2CF5AD770999ULL);
+
+  // Inputs long enough to use the four-lane loop, differing in one byte.
+  std::string a(100, 'x');
+  std::string b = a;
+  b[77] = 'y';
+  assert(unixbuild::hash_bytes(a) == unixbuild::hash_bytes(a));
+  assert(unixbuild::hash_bytes(a) != unixbuild::hash_bytes(b));
+}
+
+void test_content_hash_cache() {
+  std::string path = make_temp_file("int x;");
+  std::string saved = path + ".hashes";
+
+  unixbuild::ContentHashCache hashes;
+  uint64_t h = hashes.hash(path, unixbuild::stat_file(path.c_str()));
+  assert(h == unixbuild::hash_bytes("int x;"));
+  assert(hashes.hash(path, unixbuild::stat_file(path.c_str())) == h);
+  assert(hashes.files_hashed() == 1);
+
+  // A reloaded cache still knows the file, so does not need to read it.
+  hashes.save(saved);
+  unixbuild::ContentHashCache reloaded;
+  reloaded.load(saved);
+  assert(reloaded.size() == 1);
+  assert(reloaded.hash(path, unixbuild::stat_file(path.c_str())) == h);
+  assert(reloaded.files_hashed() == 0);
+
+  // A different modification time means the file has to be read again, and
+  // replaces the old entry.
+  set_mtime(path, 1000);
+  assert(reloaded.hash(path, unixbuild::stat_file(path.c_str())) == h);
+  assert(reloaded.files_hashed() == 1);
+  assert(reloaded.size() == 1);
+
+  unlink(path.c_str());
+  unlink(saved.c_str());
+}
+
+void test_find_stale_with_hashes() {
+  char dir[] = "/tmp/unixbuild_test_XXXXXX";
+  assert(mkdtemp(dir) != NULL);
+  std::string root(dir);
+  std::string out = root + "/out";
+  unixbuild::create_directories(out);
+
+  unixbuild::BuildGraph graph(make_build_file({
+      {"prog", {"main.c", "a.o"}},
+      {"a.o", {"a.c", "common.h"}},
+  }));
+  std::vector<size_t> nodes = graph.closure(0);
+
+  write_file(root + "/main.c", "int main() {}");
+  write_file(root + "/a.c", "int a;");
+  write_file(root + "/common.h", "");
+  for (const char* name : {"main.c", "a.c", "common.h"}) {
+    set_mtime(root + "/" + name, 1000);
+  }
+  for (const char* name : {"prog", "a.o"}) {
+    write_file(out + "/" + name, "");
+    set_mtime(out + "/" + name, 2000);
+  }
+
+  unixbuild::StatCache stat_cache;
+  unixbuild::ContentHashCache hashes;
+  unixbuild::BuildLog log(root + "/log");
+  unixbuild::StalenessChecks checks;
+  checks.log = &log;
+  checks.hashes = &hashes;
+
+  // Without any log entries, staleness is decided by timestamps.
+  stat_cache.begin_build();
+  assert(unixbuild::find_stale(graph, nodes, root, out, stat_cache, checks)
+             .empty());
+  unixbuild::record_builds(graph, nodes, root, out, stat_cache, checks);
+  assert(log.size() == 2);
+  size_t files_hashed = hashes.files_hashed();
+
+  // Touching a file without changing it is not enough to rebuild anything,
+  // and the files that were not touched are not read again.
+  set_mtime(root + "/a.c", 3000);
+  stat_cache.begin_build();
+  assert(unixbuild::find_stale(graph, nodes, root, out, stat_cache, checks)
+             .empty());
+  assert(hashes.files_hashed() == files_hashed + 1);
+
+  // Plain timestamp mode still rebuilds.
+  assert(unixbuild::find_stale(graph, nodes, root, out, stat_cache).size() ==
+         2);
+
+  // Changing its contents does, though.
+  write_file(root + "/a.c", "int a = 1;");
+  set_mtime(root + "/a.c", 3000);
+  stat_cache.begin_build();
+  std::vector<size_t> stale =
+      unixbuild::find_stale(graph, nodes, root, out, stat_cache, checks);
+  assert(stale.size() == 2);
+
+  std::string cmd = std::string("rm -rf ").append(root);
+  assert(system(cmd.c_str()) == 0);
+}
+
+void test_build_log() {
+  char dir[] = "/tmp/unixbuild_test_XXXXXX";
+  assert(mkdtemp(dir) != NULL);
+  std::string root(dir);
+  std::string path = root + "/log";
+
+  unixbuild::LogEntry entry;
+  entry.output = unixbuild::FileStamp{1, 2, {3, 4}, 5};
+  entry.command_hash = 6;
+  entry.has_inputs_hash = true;
+  entry.inputs_hash = 7;
+  entry.duration_us = 1500;
+  entry.discovered = {"/src/a.c", "/src/a.h"};
+
+  {
+    unixbuild::BuildLog log(path);
+    assert(log.size() == 0);
+    log.record("/out/a.o", entry);
+    log.flush();
+  }
+
+  // Entries survive a round trip through the file system.
+  {
+    unixbuild::BuildLog log(path);
+    assert(log.size() == 1);
+    const unixbuild::LogEntry* found = log.find("/out/a.o");
+    assert(found != nullptr);
+    assert(found->output == entry.output);
+    assert(found->command_hash == 6);
+    assert(found->has_inputs_hash);
+    assert(found->inputs_hash == 7);
+    assert(found->duration_us == 1500);
+    assert(found->discovered == entry.discovered);
+    assert(log.find("/out/b.o") == nullptr);
+
+    // New entries are appended, and later ones win.
+    entry.command_hash = 8;
+    log.record("/out/a.o", entry);
+    log.record("/out/b.o", unixbuild::LogEntry());
+    log.flush();
+    assert(log.records() == 3);
+  }
+  {
+    unixbuild::BuildLog log(path);
+    assert(log.size() == 2);
+    assert(log.records() == 3);
+    assert(log.find("/out/a.o")->command_hash == 8);
+    assert(!log.find("/out/b.o")->has_inputs_hash);
+  }
+
+  // A record cut short by a crash is ignored, and the log is rewritten
+  // without it.
+  size_t size = unixbuild::stat_file(path.c_str()).size;
+  assert(truncate(path.c_str(), size - 3) == 0);
+  {
+    unixbuild::BuildLog log(path);
+    assert(log.size() == 2);
+    assert(log.find("/out/a.o")->command_hash == 6);
+    log.flush();
+    assert(log.records() == 2);
+  }
+  {
+    unixbuild::BuildLog log(path);
+    assert(log.size() == 2);
+    assert(log.records() == 2);
+  }
+
+  // Once most records are dead, the log is compacted.
+  {
+    unixbuild::BuildLog log(path);
+    for (int i = 0; i < 2000; i++) {
+      entry.command_hash = i;
+      log.record("/out/a.o", entry);
+      log.flush();
+    }
+    assert(log.records() < 2000);
+  }
+  {
+    unixbuild::BuildLog log(path);
+    assert(log.size() == 2);
+    assert(log.find("/out/a.o")->command_hash == 1999);
+  }
+
+  // A file in some other format is ignored.
+  write_file(path, "unixbuild records 1\n");
+  {
+    unixbuild::BuildLog log(path);
+    assert(log.size() == 0);
+  }
+
+  std::string cmd = std::string("rm -rf ").append(root);
+  assert(system(cmd.c_str()) == 0);
+}
+
+void test_find_stale_with_commands() {
+  char dir[] = "/tmp/unixbuild_test_XXXXXX";
+  assert(mkdtemp(dir) != NULL);
+  std::string root(dir);
+  std::string out = root + "/out";
+  unixbuild::create_directories(out);
+
+  write_file(root + "/a.c", "");
+  write_file(root + "/a.h", "");
+  set_mtime(root + "/a.c", 1000);
+  set_mtime(root + "/a.h", 1000);
+  write_file(out + "/a.o", "");
+  set_mtime(out + "/a.o", 2000);
+
+  unixbuild::BuildGraph graph(make_build_file({{"a.o", {"a.c"}}}));
+  std::vector<size_t> nodes = graph.closure(0);
+  unixbuild::StatCache stat_cache;
+  unixbuild::BuildLog log(root + "/log");
+  unixbuild::StalenessChecks checks;
+  checks.log = &log;
+  stat_cache.begin_build();
+  assert(unixbuild::find_stale(graph, nodes, root, out, stat_cache, checks)
+             .empty());
+  unixbuild::record_builds(graph, nodes, root, out, stat_cache, checks);
+
+  // Adding a header to the rule changes the command line, so the output is
+  // rebuilt even though it is newer than everything it depends on.
+  unixbuild::BuildGraph changed(make_build_file({{"a.o", {"a.c", "a.h"}}}));
+  assert(unixbuild::find_stale(changed, nodes, root, out, stat_cache, checks)
+             .size() == 1);
+  // Unless we already know that the command matches.
+  std::unordered_set<std::string> commands_checked = {out + "/a.o"};
+  checks.commands_checked = &commands_checked;
+  assert(unixbuild::find_stale(changed, nodes, root, out, stat_cache, checks)
+             .empty());
+
+  std::string cmd = std::string("rm -rf ").append(root);
+  assert(system(cmd.c_str()) == 0);
+}
+
+void test_watched_stat_cache() {
+  char dir[] = "/tmp/unixbuild_test_XXXXXX";
+  assert(mkdtemp(dir) != NULL);
+  std::string root(dir);
+  std::string path = root + "/a.c";
+  std::string missing = root + "/b.c";
+  write_file(path, "");
+  set_mtime(path, 1000);
+
+  unixbuild::FileWatcher watcher;
+  unixbuild::StatCache stat_cache;
+  stat_cache.set_watcher(&watcher);
+
+  stat_cache.begin_build();
+  assert(stat_cache.stamp(path)->mtime.tv_sec == 1000);
+  assert(!stat_cache.stamp(missing).has_value());
+  assert(stat_cache.stat_calls() == 2);
+  assert(watcher.watch_count() == 1);
+
+  // Nothing has changed, so a new build should not need to stat anything.
+  stat_cache.begin_build();
+  stat_cache.process_events();
+  assert(stat_cache.stamp(path)->mtime.tv_sec == 1000);
+  assert(!stat_cache.stamp(missing).has_value());
+  assert(stat_cache.stat_calls() == 2);
+
+  // Touching one file and creating the other invalidates both.
+  set_mtime(path, 2000);
+  write_file(missing, "");
+  stat_cache.begin_build();
+  stat_cache.process_events();
+  assert(stat_cache.stamp(path)->mtime.tv_sec == 2000);
+  assert(stat_cache.stamp(missing).has_value());
+  assert(stat_cache.stat_calls() == 4);
+  assert(watcher.events_processed() > 0);
+
+  // A symlink to a file in a directory that is not watched is stat'd again
+  // for each build, so that changes to the file it points to are seen.
+  char target_dir[] = "/tmp/unixbuild_test_XXXXXX";
+  assert(mkdtemp(target_dir) != NULL);
+  std::string target = std::string(target_dir) + "/c.c";
+  std::string link = root + "/c.c";
+  write_file(target, "");
+  set_mtime(target, 1000);
+  assert(symlink(target.c_str(), link.c_str()) == 0);
+  stat_cache.begin_build();
+  stat_cache.process_events();
+  assert(stat_cache.stamp(link)->mtime.tv_sec == 1000);
+  set_mtime(target, 2000);
+  stat_cache.begin_build();
+  stat_cache.process_events();
+  assert(stat_cache.stamp(link)->mtime.tv_sec == 2000);
+
+  // The same goes for paths that are prefetched.
+  set_mtime(target, 3000);
+  stat_cache.begin_build();
+  stat_cache.process_events();
+  unixbuild::ThreadPool pool(2);
+  stat_cache.prefetch({link}, pool);
+  assert(stat_cache.stamp(link)->mtime.tv_sec == 3000);
+  set_mtime(target, 4000);
+  stat_cache.begin_build();
+  stat_cache.process_events();
+  stat_cache.prefetch({link}, pool);
+  assert(stat_cache.stamp(link)->mtime.tv_sec == 4000);
+
+  std::string cmd = std::string("rm -rf ").append(target_dir);
+  assert(system(cmd.c_str()) == 0);
+  cmd = std::string("rm -rf ").append(root);
+  assert(system(cmd.c_str()) == 0);
+
+  // Deleting the directory itself means we can no longer trust anything.
+  stat_cache.process_events();
+  assert(stat_cache.size() == 0);
+  assert(watcher.watch_count() == 0);
+}
+
 int main(int argc, char* argv[]) {
   if (argc > 1) {
     std::cerr << argv[0] << ": error: test binary takes no arguments"
@@ -57,7 +1999,40 @@ int main(int argc, char* argv[]) {
   try {
     test_trim_whitespace();
     test_split_string();
+    test_normalize_path();
     test_read_lines();
+    test_parse_build_file();
+    test_parse_rules();
+    test_scan();
+    test_build_file_cache();
+    test_protocol();
+    test_acquire_lock();
+    test_runtime_directory();
+    test_event_loop();
+    test_job_server();
+    test_launcher();
+    test_job_output();
+    test_client_output();
+    test_thread_pool();
+    test_batch_io();
+    test_path_table();
+    test_build_graph();
+    test_build_file_index();
+    test_deduce_command();
+    test_scheduler();
+    test_action_cache();
+    test_histogram();
+    test_trace_recorder();
+    test_find_stale();
+    test_hash_bytes();
+    test_content_hash_cache();
+    test_find_stale_with_hashes();
+    test_parse_depfile();
+    test_find_stale_with_depfiles();
+    test_staleness_with_thread_pool();
+    test_build_log();
+    test_find_stale_with_commands();
+    test_watched_stat_cache();
   } catch (unixbuild::ExitException& e) {
     std::cerr << "Exception caught while running tests: " << e.message_
               << std::endl;